@@ -23,13 +23,12 @@ misrepresented as being the original software.
 */
 
 #include "BufferManager.h"
+#include "C9.h"
 #include "CDevice9.h"
 #include "CTexture9.h"
 
 #include "Utilities.h"
 
-#define CACHE_SECONDS 1
-
 typedef boost::container::flat_map<UINT, StreamSource> map_type;
 
 BufferManager::BufferManager()
@@ -58,6 +57,23 @@ BufferManager::BufferManager(CDevice9* device)
 	//	0, 0, 1, 0,
 	//	0, 0, 0, 1;
 
+	/**********************************************
+	* Fixed function draws index one big texture table when the device has descriptor indexing so a 2D texture change doesn't need a new descriptor set.
+	* Shader draws still get per draw descriptor sets because the converter doesn't sample textures yet.
+	* The stage slots ride along with the transformations so the push constant range has to fit both.
+	**********************************************/
+	mUseFixedFunctionBindlessTextures = mDevice->mIsDescriptorIndexingSupported
+		&& mDevice->mDeviceProperties.limits.maxPushConstantsSize >= UBO_SIZE * 2 + sizeof(uint32_t) * BINDLESS_STAGES;
+	if (mDevice->mInstance->mOptions.count("FixedFunctionBindlessTextures"))
+	{
+		mUseFixedFunctionBindlessTextures = mUseFixedFunctionBindlessTextures && mDevice->mInstance->mOptions["FixedFunctionBindlessTextures"].as<bool>();
+	}
+
+	if (mUseFixedFunctionBindlessTextures)
+	{
+		CreateBindlessTable();
+	}
+
 	mVertShaderModule_XYZ_DIFFUSE = LoadShaderFromFile(mDevice->mDevice, "VertexBuffer_XYZ_DIFFUSE.vert.spv");
 	mFragShaderModule_XYZ_DIFFUSE = LoadShaderFromFile(mDevice->mDevice, "VertexBuffer_XYZ_DIFFUSE.frag.spv");
 
@@ -85,8 +101,97 @@ BufferManager::BufferManager(CDevice9* device)
 	mVertShaderModule_XYZ_NORMAL_DIFFUSE_TEX2 = LoadShaderFromFile(mDevice->mDevice, "VertexBuffer_XYZ_NORMAL_DIFFUSE_TEX2.vert.spv");
 	mFragShaderModule_XYZ_NORMAL_DIFFUSE_TEX2 = LoadShaderFromFile(mDevice->mDevice, "VertexBuffer_XYZ_NORMAL_DIFFUSE_TEX2.frag.spv");
 
+	mVertShaderModule_XYZ_DIFFUSE_Generic = LoadShaderFromFile(mDevice->mDevice, "VertexBuffer_XYZ_DIFFUSE_Generic.vert.spv");
+	mFragShaderModule_XYZ_DIFFUSE_Generic = LoadShaderFromFile(mDevice->mDevice, "VertexBuffer_XYZ_DIFFUSE_Generic.frag.spv");
+
+	mVertShaderModule_XYZ_TEX1_Generic = LoadShaderFromFile(mDevice->mDevice, "VertexBuffer_XYZ_TEX1_Generic.vert.spv");
+	mFragShaderModule_XYZ_TEX1_Generic = LoadShaderFromFile(mDevice->mDevice, "VertexBuffer_XYZ_TEX1_Generic.frag.spv");
+
+	mVertShaderModule_XYZ_TEX2_Generic = LoadShaderFromFile(mDevice->mDevice, "VertexBuffer_XYZ_TEX2_Generic.vert.spv");
+	mFragShaderModule_XYZ_TEX2_Generic = LoadShaderFromFile(mDevice->mDevice, "VertexBuffer_XYZ_TEX2_Generic.frag.spv");
+
+	mVertShaderModule_XYZ_DIFFUSE_TEX1_Generic = LoadShaderFromFile(mDevice->mDevice, "VertexBuffer_XYZ_DIFFUSE_TEX1_Generic.vert.spv");
+	mFragShaderModule_XYZ_DIFFUSE_TEX1_Generic = LoadShaderFromFile(mDevice->mDevice, "VertexBuffer_XYZ_DIFFUSE_TEX1_Generic.frag.spv");
+
+	mVertShaderModule_XYZ_DIFFUSE_TEX2_Generic = LoadShaderFromFile(mDevice->mDevice, "VertexBuffer_XYZ_DIFFUSE_TEX2_Generic.vert.spv");
+	mFragShaderModule_XYZ_DIFFUSE_TEX2_Generic = LoadShaderFromFile(mDevice->mDevice, "VertexBuffer_XYZ_DIFFUSE_TEX2_Generic.frag.spv");
+
+	mVertShaderModule_XYZ_NORMAL_Generic = LoadShaderFromFile(mDevice->mDevice, "VertexBuffer_XYZ_NORMAL_Generic.vert.spv");
+	mFragShaderModule_XYZ_NORMAL_Generic = LoadShaderFromFile(mDevice->mDevice, "VertexBuffer_XYZ_NORMAL_Generic.frag.spv");
+
+	mVertShaderModule_XYZ_NORMAL_TEX1_Generic = LoadShaderFromFile(mDevice->mDevice, "VertexBuffer_XYZ_NORMAL_TEX1_Generic.vert.spv");
+	mFragShaderModule_XYZ_NORMAL_TEX1_Generic = LoadShaderFromFile(mDevice->mDevice, "VertexBuffer_XYZ_NORMAL_TEX1_Generic.frag.spv");
+
+	mVertShaderModule_XYZ_NORMAL_DIFFUSE_Generic = LoadShaderFromFile(mDevice->mDevice, "VertexBuffer_XYZ_NORMAL_DIFFUSE_Generic.vert.spv");
+	mFragShaderModule_XYZ_NORMAL_DIFFUSE_Generic = LoadShaderFromFile(mDevice->mDevice, "VertexBuffer_XYZ_NORMAL_DIFFUSE_Generic.frag.spv");
+
+	mVertShaderModule_XYZ_NORMAL_DIFFUSE_TEX2_Generic = LoadShaderFromFile(mDevice->mDevice, "VertexBuffer_XYZ_NORMAL_DIFFUSE_TEX2_Generic.vert.spv");
+	mFragShaderModule_XYZ_NORMAL_DIFFUSE_TEX2_Generic = LoadShaderFromFile(mDevice->mDevice, "VertexBuffer_XYZ_NORMAL_DIFFUSE_TEX2_Generic.frag.spv");
+
+	/**********************************************
+	* The textured fragment shaders have variants that sample through the bindless table. If any of them is missing the regular ones are kept.
+	**********************************************/
+	if (mUseFixedFunctionBindlessTextures)
+	{
+		VkShaderModule bindlessModules[12] =
+		{
+			LoadShaderFromFile(mDevice->mDevice, "VertexBuffer_XYZ_TEX1_Bindless.frag.spv"),
+			LoadShaderFromFile(mDevice->mDevice, "VertexBuffer_XYZ_TEX2_Bindless.frag.spv"),
+			LoadShaderFromFile(mDevice->mDevice, "VertexBuffer_XYZ_DIFFUSE_TEX1_Bindless.frag.spv"),
+			LoadShaderFromFile(mDevice->mDevice, "VertexBuffer_XYZ_DIFFUSE_TEX2_Bindless.frag.spv"),
+			LoadShaderFromFile(mDevice->mDevice, "VertexBuffer_XYZ_NORMAL_TEX1_Bindless.frag.spv"),
+			LoadShaderFromFile(mDevice->mDevice, "VertexBuffer_XYZ_NORMAL_DIFFUSE_TEX2_Bindless.frag.spv"),
+			LoadShaderFromFile(mDevice->mDevice, "VertexBuffer_XYZ_TEX1_Generic_Bindless.frag.spv"),
+			LoadShaderFromFile(mDevice->mDevice, "VertexBuffer_XYZ_TEX2_Generic_Bindless.frag.spv"),
+			LoadShaderFromFile(mDevice->mDevice, "VertexBuffer_XYZ_DIFFUSE_TEX1_Generic_Bindless.frag.spv"),
+			LoadShaderFromFile(mDevice->mDevice, "VertexBuffer_XYZ_DIFFUSE_TEX2_Generic_Bindless.frag.spv"),
+			LoadShaderFromFile(mDevice->mDevice, "VertexBuffer_XYZ_NORMAL_TEX1_Generic_Bindless.frag.spv"),
+			LoadShaderFromFile(mDevice->mDevice, "VertexBuffer_XYZ_NORMAL_DIFFUSE_TEX2_Generic_Bindless.frag.spv")
+		};
+
+		BOOL hasBindlessModules = true;
+		for (size_t i = 0; i < 12; i++)
+		{
+			hasBindlessModules = hasBindlessModules && bindlessModules[i] != VK_NULL_HANDLE;
+		}
+
+		if (hasBindlessModules)
+		{
+			//The regular modules end up in the array and are destroyed below.
+			std::swap(mFragShaderModule_XYZ_TEX1, bindlessModules[0]);
+			std::swap(mFragShaderModule_XYZ_TEX2, bindlessModules[1]);
+			std::swap(mFragShaderModule_XYZ_DIFFUSE_TEX1, bindlessModules[2]);
+			std::swap(mFragShaderModule_XYZ_DIFFUSE_TEX2, bindlessModules[3]);
+			std::swap(mFragShaderModule_XYZ_NORMAL_TEX1, bindlessModules[4]);
+			std::swap(mFragShaderModule_XYZ_NORMAL_DIFFUSE_TEX2, bindlessModules[5]);
+			std::swap(mFragShaderModule_XYZ_TEX1_Generic, bindlessModules[6]);
+			std::swap(mFragShaderModule_XYZ_TEX2_Generic, bindlessModules[7]);
+			std::swap(mFragShaderModule_XYZ_DIFFUSE_TEX1_Generic, bindlessModules[8]);
+			std::swap(mFragShaderModule_XYZ_DIFFUSE_TEX2_Generic, bindlessModules[9]);
+			std::swap(mFragShaderModule_XYZ_NORMAL_TEX1_Generic, bindlessModules[10]);
+			std::swap(mFragShaderModule_XYZ_NORMAL_DIFFUSE_TEX2_Generic, bindlessModules[11]);
+		}
+		else
+		{
+			BOOST_LOG_TRIVIAL(warning) << "BufferManager::BufferManager bindless shader variants are missing so textures are bound per draw.";
+			mUseFixedFunctionBindlessTextures = false;
+		}
+
+		for (size_t i = 0; i < 12; i++)
+		{
+			if (bindlessModules[i] != VK_NULL_HANDLE)
+			{
+				vkDestroyShaderModule(mDevice->mDevice, bindlessModules[i], NULL);
+			}
+		}
+	}
+
 	mPushConstantRanges[0].offset = 0;
 	mPushConstantRanges[0].size = UBO_SIZE*2; //There are 2 matrices one for world transform and one for all transforms.
+	if (mUseFixedFunctionBindlessTextures)
+	{
+		mPushConstantRanges[0].size += sizeof(uint32_t) * BINDLESS_STAGES; //Followed by the table slots of each stage.
+	}
 	mPushConstantRanges[0].stageFlags = VK_SHADER_STAGE_ALL_GRAPHICS; //VK_SHADER_STAGE_VERTEX_BIT
 
 	mSpecializationInfo.pData = &mDevice->mDeviceState.mSpecializationConstants;
@@ -144,6 +249,10 @@ BufferManager::BufferManager(CDevice9* device)
 	mDynamicStateEnables[mPipelineDynamicStateCreateInfo.dynamicStateCount++] = VK_DYNAMIC_STATE_VIEWPORT;
 	mDynamicStateEnables[mPipelineDynamicStateCreateInfo.dynamicStateCount++] = VK_DYNAMIC_STATE_SCISSOR;
 	mDynamicStateEnables[mPipelineDynamicStateCreateInfo.dynamicStateCount++] = VK_DYNAMIC_STATE_DEPTH_BIAS;
+	mDynamicStateEnables[mPipelineDynamicStateCreateInfo.dynamicStateCount++] = VK_DYNAMIC_STATE_BLEND_CONSTANTS;
+	mDynamicStateEnables[mPipelineDynamicStateCreateInfo.dynamicStateCount++] = VK_DYNAMIC_STATE_STENCIL_COMPARE_MASK;
+	mDynamicStateEnables[mPipelineDynamicStateCreateInfo.dynamicStateCount++] = VK_DYNAMIC_STATE_STENCIL_WRITE_MASK;
+	mDynamicStateEnables[mPipelineDynamicStateCreateInfo.dynamicStateCount++] = VK_DYNAMIC_STATE_STENCIL_REFERENCE;
 
 	mPipelineDepthStencilStateCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_DEPTH_STENCIL_STATE_CREATE_INFO;
 	mPipelineDepthStencilStateCreateInfo.depthTestEnable = VK_TRUE;
@@ -171,6 +280,8 @@ BufferManager::BufferManager(CDevice9* device)
 	mDescriptorSetAllocateInfo.pNext = NULL;
 	mDescriptorSetAllocateInfo.descriptorPool = mDevice->mDescriptorPool;
 	mDescriptorSetAllocateInfo.descriptorSetCount = 1;
+	mDescriptorPools.push_back(mDevice->mDescriptorPool);
+	mDevice->mStatistics.DescriptorPools = mDescriptorPools.size();
 	//mDescriptorSetAllocateInfo.pSetLayouts = &mDescriptorSetLayout;
 
 	mPipelineLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_LAYOUT_CREATE_INFO;
@@ -205,7 +316,57 @@ BufferManager::BufferManager(CDevice9* device)
 
 	mPipelineCacheCreateInfo.sType = VK_STRUCTURE_TYPE_PIPELINE_CACHE_CREATE_INFO;
 
+	/**********************************************
+	* Seed the pipeline cache with what the last run of this application compiled.
+	**********************************************/
+	char modulePath[MAX_PATH] = {};
+	GetModuleFileNameA(NULL, modulePath, MAX_PATH);
+
+	std::string moduleName = modulePath;
+	moduleName = moduleName.substr(moduleName.find_last_of("\\/") + 1);
+	moduleName = moduleName.substr(0, moduleName.find_last_of('.'));
+
+	if (mDevice->mInstance->mOptions.count("PipelineCacheFile"))
+	{
+		mPipelineCacheFile = mDevice->mInstance->mOptions["PipelineCacheFile"].as<std::string>();
+	}
+	else
+	{
+		mPipelineCacheFile = moduleName + ".vk9cache";
+	}
+
+	if (mDevice->mInstance->mOptions.count("PipelineManifestFile"))
+	{
+		mPipelineManifestFile = mDevice->mInstance->mOptions["PipelineManifestFile"].as<std::string>();
+	}
+	else
+	{
+		mPipelineManifestFile = moduleName + ".vk9manifest";
+	}
+
+	std::vector<char> pipelineCacheData;
+	LoadPipelineCache(pipelineCacheData);
+
+	if (pipelineCacheData.size())
+	{
+		mPipelineCacheCreateInfo.initialDataSize = pipelineCacheData.size();
+		mPipelineCacheCreateInfo.pInitialData = pipelineCacheData.data();
+	}
+
 	mResult = vkCreatePipelineCache(mDevice->mDevice, &mPipelineCacheCreateInfo, nullptr, &mPipelineCache);
+	if (mResult != VK_SUCCESS && mPipelineCacheCreateInfo.initialDataSize)
+	{
+		BOOST_LOG_TRIVIAL(warning) << "BufferManager::BufferManager vkCreatePipelineCache rejected " << mPipelineCacheFile << " with return code of " << mResult;
+
+		mPipelineCacheCreateInfo.initialDataSize = 0;
+		mPipelineCacheCreateInfo.pInitialData = nullptr;
+
+		mResult = vkCreatePipelineCache(mDevice->mDevice, &mPipelineCacheCreateInfo, nullptr, &mPipelineCache);
+	}
+
+	mPipelineCacheCreateInfo.initialDataSize = 0;
+	mPipelineCacheCreateInfo.pInitialData = nullptr;
+
 	if (mResult != VK_SUCCESS)
 	{
 		BOOST_LOG_TRIVIAL(fatal) << "BufferManager::BufferManager vkCreatePipelineCache failed with return code of " << mResult;
@@ -352,6 +513,13 @@ BufferManager::BufferManager(CDevice9* device)
 		return;
 	}
 
+	if (mUseFixedFunctionBindlessTextures)
+	{
+		//Stages without a texture and anything that didn't get a slot read these.
+		UpdateTextureSlot(0, mImageView);
+		UpdateSamplerSlot(0, mSampler);
+	}
+
 	mDevice->mDeviceState.mDescriptorImageInfo[0].sampler = mSampler;
 	mDevice->mDeviceState.mDescriptorImageInfo[0].imageView = mImageView;
 	mDevice->mDeviceState.mDescriptorImageInfo[0].imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
@@ -434,63 +602,258 @@ BufferManager::BufferManager(CDevice9* device)
 
 	mWriteDescriptorSet[2].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
 	//mWriteDescriptorSet[2].dstSet = descriptorSet;
-	mWriteDescriptorSet[2].dstBinding = 2;
+	mWriteDescriptorSet[2].dstBinding = 3;
 	mWriteDescriptorSet[2].dstArrayElement = 0;
-	mWriteDescriptorSet[2].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	mWriteDescriptorSet[2].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
 	mWriteDescriptorSet[2].descriptorCount = 1;
-	mWriteDescriptorSet[2].pImageInfo = mDevice->mDeviceState.mDescriptorImageInfo;
+	mWriteDescriptorSet[2].pBufferInfo = &mDescriptorBufferInfo[2];
+
+	mWriteDescriptorSet[3].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+	//mWriteDescriptorSet[3].dstSet = descriptorSet;
+	mWriteDescriptorSet[3].dstBinding = 4;
+	mWriteDescriptorSet[3].dstArrayElement = 0;
+	mWriteDescriptorSet[3].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	mWriteDescriptorSet[3].descriptorCount = 1;
+	mWriteDescriptorSet[3].pBufferInfo = &mDescriptorBufferInfo[3];
+
+	mWriteDescriptorSet[4].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+	//mWriteDescriptorSet[4].dstSet = descriptorSet;
+	mWriteDescriptorSet[4].dstBinding = 2;
+	mWriteDescriptorSet[4].dstArrayElement = 0;
+	mWriteDescriptorSet[4].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	mWriteDescriptorSet[4].descriptorCount = 1;
+	mWriteDescriptorSet[4].pImageInfo = mDevice->mDeviceState.mDescriptorImageInfo;
+
+	//UpdateFixedFunctionBuffers points these at the constant ring.
+	mDescriptorBufferInfo[FIXED_FUNCTION_LIGHTS].range = sizeof(Light) * MAX_LIGHTS; //The generic shaders always declare MAX_LIGHTS.
+	mDescriptorBufferInfo[FIXED_FUNCTION_MATERIAL].range = sizeof(D3DMATERIAL9);
+	mDescriptorBufferInfo[FIXED_FUNCTION_RENDER_STATE].range = sizeof(RenderState);
+	mDescriptorBufferInfo[FIXED_FUNCTION_SPECIALIZATION].range = sizeof(SpecializationConstants);
+
+	/**********************************************
+	* Generic pipelines read the fixed function state from a buffer so they can be used without compiling for every state combination.
+	**********************************************/
+	if (mDevice->mInstance->mOptions.count("FixedFunctionShaders"))
+	{
+		const std::string shaders = mDevice->mInstance->mOptions["FixedFunctionShaders"].as<std::string>();
 
-	//Command Buffer Setup
-	mCommandBufferAllocateInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-	mCommandBufferAllocateInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-	mCommandBufferAllocateInfo.commandPool = mDevice->mCommandPool;
-	mCommandBufferAllocateInfo.commandBufferCount = 1;
+		if (shaders == "Generic")
+		{
+			mUseGenericPipelines = true;
+		}
+		else if (shaders == "Specialized")
+		{
+			mUseGenericPipelines = false;
+		}
+		else
+		{
+			BOOST_LOG_TRIVIAL(warning) << "BufferManager::BufferManager unknown FixedFunctionShaders " << shaders;
+		}
+	}
 
-	vkAllocateCommandBuffers(mDevice->mDevice, &mCommandBufferAllocateInfo, &mCommandBuffer);
+	/**********************************************
+	* Use the extended dynamic state extensions when the device has them. Without them every state is still compiled into the pipeline.
+	**********************************************/
+	BOOL useDynamicPipelineState = true;
+	if (mDevice->mInstance->mOptions.count("DynamicPipelineState"))
+	{
+		useDynamicPipelineState = mDevice->mInstance->mOptions["DynamicPipelineState"].as<bool>();
+	}
 
-	mBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-	mBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+	if (mDevice->mInstance->mOptions.count("DynamicPipelineStateComparison"))
+	{
+		mIsDynamicStateComparisonEnabled = mDevice->mInstance->mOptions["DynamicPipelineStateComparison"].as<bool>();
+	}
 
-	mSubmitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-	mSubmitInfo.commandBufferCount = 1;
-	mSubmitInfo.pCommandBuffers = &mCommandBuffer;
+	if (mDevice->mInstance->mOptions.count("DescriptorSetMaxFrames"))
+	{
+		mMaximumDescriptorSetAge = mDevice->mInstance->mOptions["DescriptorSetMaxFrames"].as<uint32_t>();
+	}
+	mMaximumDescriptorSetAge = max(mMaximumDescriptorSetAge, mDevice->mMaximumFramesInFlight); //A set can't be rewritten while a frame in flight may still read it.
 
-	//revisit - light should be sized dynamically. Really more that 4 lights is stupid but this limit isn't correct behavior.
-	CreateBuffer(sizeof(Light)*4, VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, mLightBuffer, mLightBufferMemory);
-	CreateBuffer(sizeof(D3DMATERIAL9), VK_BUFFER_USAGE_TRANSFER_DST_BIT | VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_DEVICE_LOCAL_BIT, mMaterialBuffer, mMaterialBufferMemory);
-}
+	if (mDevice->mInstance->mOptions.count("DescriptorAllocator"))
+	{
+		const std::string allocator = mDevice->mInstance->mOptions["DescriptorAllocator"].as<std::string>();
 
-BufferManager::~BufferManager()
-{
-	if (mCommandBuffer != VK_NULL_HANDLE)
+		if (allocator == "Cached")
+		{
+			mDescriptorAllocator = DESCRIPTOR_ALLOCATOR_CACHED;
+		}
+		else if (allocator == "Linear")
+		{
+			mDescriptorAllocator = DESCRIPTOR_ALLOCATOR_LINEAR;
+		}
+		else
+		{
+			BOOST_LOG_TRIVIAL(warning) << "BufferManager::BufferManager unknown DescriptorAllocator " << allocator;
+		}
+	}
+
+	/**********************************************
+	* Push the fixed function descriptors straight into the command buffer when the device can. Shader draws still bind sets.
+	**********************************************/
+	mUsePushDescriptors = mDevice->mIsPushDescriptorSupported;
+	if (mDevice->mInstance->mOptions.count("PushDescriptors"))
+	{
+		mUsePushDescriptors = mUsePushDescriptors && mDevice->mInstance->mOptions["PushDescriptors"].as<bool>();
+	}
+
+	if (mUsePushDescriptors)
+	{
+		mFixedFunctionBufferType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	}
+
+	for (size_t i = 0; i < FIXED_FUNCTION_BLOCK_COUNT; i++)
+	{
+		mWriteDescriptorSet[i].descriptorType = mFixedFunctionBufferType;
+	}
+
+	/**********************************************
+	* Write fixed function sets with an update template made once per layout. Turning it off makes it easy to compare the write times in the log.
+	**********************************************/
+	mUseDescriptorUpdateTemplates = mDevice->mIsDescriptorUpdateTemplateSupported;
+	if (mDevice->mInstance->mOptions.count("DescriptorUpdateTemplates"))
+	{
+		mUseDescriptorUpdateTemplates = mUseDescriptorUpdateTemplates && mDevice->mInstance->mOptions["DescriptorUpdateTemplates"].as<bool>();
+	}
+
+	if (mDescriptorAllocator == DESCRIPTOR_ALLOCATOR_LINEAR)
+	{
+		//One set of pools for each frame in flight. The device waits for a frame's fence before its pools are reset.
+		mFrameDescriptorPools.resize(mDevice->mMaximumFramesInFlight);
+	}
+
+	mRetiredTextureSlots.resize(mDevice->mMaximumFramesInFlight);
+
+	/**********************************************
+	* Shader constants and the fixed function buffers get one ring per frame the same way. The buffers are created on the first draw and grow from mConstantRingSize.
+	**********************************************/
+	if (mDevice->mInstance->mOptions.count("ShaderConstantRingSize"))
+	{
+		mConstantRingSize = (VkDeviceSize)mDevice->mInstance->mOptions["ShaderConstantRingSize"].as<uint32_t>() * 1024;
+	}
+	mConstantRingSize = max(mConstantRingSize, (VkDeviceSize)sizeof(ShaderConstants) * 4); //Room for every block at the worst alignment.
+	mConstantRings.resize(mDevice->mMaximumFramesInFlight);
+
+	mUseExtendedDynamicState = useDynamicPipelineState && mDevice->mIsExtendedDynamicStateSupported;
+	mUseExtendedDynamicState2 = mUseExtendedDynamicState && mDevice->mIsExtendedDynamicState2Supported;
+	mUseExtendedDynamicState3 = mUseExtendedDynamicState && mDevice->mIsExtendedDynamicState3Supported;
+
+	if (mUseExtendedDynamicState)
+	{
+		mDynamicStateEnables[mPipelineDynamicStateCreateInfo.dynamicStateCount++] = VK_DYNAMIC_STATE_CULL_MODE_EXT;
+		mDynamicStateEnables[mPipelineDynamicStateCreateInfo.dynamicStateCount++] = VK_DYNAMIC_STATE_FRONT_FACE_EXT;
+		mDynamicStateEnables[mPipelineDynamicStateCreateInfo.dynamicStateCount++] = VK_DYNAMIC_STATE_PRIMITIVE_TOPOLOGY_EXT;
+		mDynamicStateEnables[mPipelineDynamicStateCreateInfo.dynamicStateCount++] = VK_DYNAMIC_STATE_VERTEX_INPUT_BINDING_STRIDE_EXT;
+		mDynamicStateEnables[mPipelineDynamicStateCreateInfo.dynamicStateCount++] = VK_DYNAMIC_STATE_DEPTH_TEST_ENABLE_EXT;
+		mDynamicStateEnables[mPipelineDynamicStateCreateInfo.dynamicStateCount++] = VK_DYNAMIC_STATE_DEPTH_WRITE_ENABLE_EXT;
+		mDynamicStateEnables[mPipelineDynamicStateCreateInfo.dynamicStateCount++] = VK_DYNAMIC_STATE_DEPTH_COMPARE_OP_EXT;
+		mDynamicStateEnables[mPipelineDynamicStateCreateInfo.dynamicStateCount++] = VK_DYNAMIC_STATE_STENCIL_TEST_ENABLE_EXT;
+		mDynamicStateEnables[mPipelineDynamicStateCreateInfo.dynamicStateCount++] = VK_DYNAMIC_STATE_STENCIL_OP_EXT;
+	}
+
+	if (mUseExtendedDynamicState2)
+	{
+		mDynamicStateEnables[mPipelineDynamicStateCreateInfo.dynamicStateCount++] = VK_DYNAMIC_STATE_DEPTH_BIAS_ENABLE_EXT;
+	}
+
+	if (mUseExtendedDynamicState3)
+	{
+		mDynamicStateEnables[mPipelineDynamicStateCreateInfo.dynamicStateCount++] = VK_DYNAMIC_STATE_POLYGON_MODE_EXT;
+		mDynamicStateEnables[mPipelineDynamicStateCreateInfo.dynamicStateCount++] = VK_DYNAMIC_STATE_COLOR_BLEND_ENABLE_EXT;
+		mDynamicStateEnables[mPipelineDynamicStateCreateInfo.dynamicStateCount++] = VK_DYNAMIC_STATE_COLOR_BLEND_EQUATION_EXT;
+		mDynamicStateEnables[mPipelineDynamicStateCreateInfo.dynamicStateCount++] = VK_DYNAMIC_STATE_COLOR_WRITE_MASK_EXT;
+	}
+
+	mCommandBufferState.mDevice = mDevice;
+	mCommandBufferState.UseExtendedDynamicState = mUseExtendedDynamicState;
+	mCommandBufferState.UseExtendedDynamicState2 = mUseExtendedDynamicState2;
+	mCommandBufferState.UseExtendedDynamicState3 = mUseExtendedDynamicState3;
+
+	/**********************************************
+	* Start pipeline compile threads. With none pipelines are compiled on the draw thread.
+	**********************************************/
+	if (mDevice->mInstance->mOptions.count("PipelineFallback"))
+	{
+		const std::string fallback = mDevice->mInstance->mOptions["PipelineFallback"].as<std::string>();
+
+		if (fallback == "Skip")
+		{
+			mPipelineFallback = PIPELINE_FALLBACK_SKIP;
+		}
+		else if (fallback == "Wait")
+		{
+			mPipelineFallback = PIPELINE_FALLBACK_WAIT;
+		}
+		else if (fallback == "Generic")
+		{
+			mPipelineFallback = PIPELINE_FALLBACK_GENERIC;
+		}
+		else
+		{
+			BOOST_LOG_TRIVIAL(warning) << "BufferManager::BufferManager unknown PipelineFallback " << fallback;
+		}
+	}
+
+	int32_t threadCount = 0;
+	if (mDevice->mInstance->mOptions.count("PipelineCompileThreads"))
+	{
+		threadCount = mDevice->mInstance->mOptions["PipelineCompileThreads"].as<int32_t>();
+	}
+
+	for (int32_t i = 0; i < threadCount; i++)
+	{
+		mPipelineThreads.push_back(std::thread(&BufferManager::CompilePipelines, this));
+	}
+
+	/**********************************************
+	* Pipeline cache limits. Pipelines are evicted least recently used first once the cache is full.
+	**********************************************/
+	if (mDevice->mInstance->mOptions.count("PipelineCacheMaxEntries"))
 	{
-		vkFreeCommandBuffers(mDevice->mDevice, mDevice->mCommandPool, 1, &mCommandBuffer);
-		mCommandBuffer = VK_NULL_HANDLE;
+		mMaximumPipelines = mDevice->mInstance->mOptions["PipelineCacheMaxEntries"].as<uint32_t>();
 	}
 
-	if (mLightBuffer != VK_NULL_HANDLE)
+	if (mDevice->mInstance->mOptions.count("PipelineCacheMaxMemory"))
 	{
-		vkDestroyBuffer(mDevice->mDevice, mLightBuffer, NULL);
-		mLightBuffer = VK_NULL_HANDLE;
+		mMaximumPipelineMemory = (size_t)mDevice->mInstance->mOptions["PipelineCacheMaxMemory"].as<uint32_t>() * 1024 * 1024;
 	}
 
-	if (mLightBufferMemory != VK_NULL_HANDLE)
+	if (mDevice->mInstance->mOptions.count("PipelineCacheMaxFrames"))
 	{
-		vkFreeMemory(mDevice->mDevice, mLightBufferMemory, NULL);
-		mLightBufferMemory = VK_NULL_HANDLE;
+		mMaximumPipelineAge = mDevice->mInstance->mOptions["PipelineCacheMaxFrames"].as<uint32_t>();
 	}
 
-	if (mMaterialBuffer != VK_NULL_HANDLE)
+	if (mMaximumPipelineAge)
 	{
-		vkDestroyBuffer(mDevice->mDevice, mMaterialBuffer, NULL);
-		mMaterialBuffer = VK_NULL_HANDLE;
+		mMaximumPipelineAge = max(mMaximumPipelineAge, mDevice->mMaximumFramesInFlight); //Pipelines can't be destroyed while a frame in flight may still use them.
 	}
 
-	if (mMaterialBufferMemory != VK_NULL_HANDLE)
+	mMaximumSamplers = min((uint32_t)MAX_SAMPLERS, mDevice->mDeviceProperties.limits.maxSamplerAllocationCount / 4);
+
+	/**********************************************
+	* Queue the pipelines the last run of this application used so they are ready or in flight before the first draw.
+	**********************************************/
+	PrewarmPipelines();
+}
+
+BufferManager::~BufferManager()
+{
+	/**********************************************
+	* Stop the compile threads before anything they use goes away.
+	**********************************************/
+	{
+		std::lock_guard<std::mutex> lock(mPipelineMutex);
+		mIsStopping = true;
+		mPipelineRequests.clear();
+	}
+	mPipelineRequestCondition.notify_all();
+
+	BOOST_FOREACH(std::thread& thread, mPipelineThreads)
 	{
-		vkFreeMemory(mDevice->mDevice, mMaterialBufferMemory, NULL);
-		mMaterialBufferMemory = VK_NULL_HANDLE;
+		thread.join();
 	}
+	mPipelineThreads.clear();
 
 	if (mImageView != VK_NULL_HANDLE)
 	{
@@ -624,513 +987,575 @@ BufferManager::~BufferManager()
 		mFragShaderModule_XYZ_NORMAL_DIFFUSE_TEX2 = VK_NULL_HANDLE;
 	}
 
-	if (mPipelineCache != VK_NULL_HANDLE)
+	if (mVertShaderModule_XYZ_DIFFUSE_Generic != VK_NULL_HANDLE)
 	{
-		vkDestroyPipelineCache(mDevice->mDevice, mPipelineCache, nullptr);
-		mPipelineCache = VK_NULL_HANDLE;
+		vkDestroyShaderModule(mDevice->mDevice, mVertShaderModule_XYZ_DIFFUSE_Generic, NULL);
+		mVertShaderModule_XYZ_DIFFUSE_Generic = VK_NULL_HANDLE;
 	}
 
-	//Empty cached objects. (a destructor should take care of their resources.)
+	if (mFragShaderModule_XYZ_DIFFUSE_Generic != VK_NULL_HANDLE)
+	{
+		vkDestroyShaderModule(mDevice->mDevice, mFragShaderModule_XYZ_DIFFUSE_Generic, NULL);
+		mFragShaderModule_XYZ_DIFFUSE_Generic = VK_NULL_HANDLE;
+	}
 
-	mDrawBuffer.clear();
-	mSamplerRequests.clear();
+	if (mVertShaderModule_XYZ_TEX1_Generic != VK_NULL_HANDLE)
+	{
+		vkDestroyShaderModule(mDevice->mDevice, mVertShaderModule_XYZ_TEX1_Generic, NULL);
+		mVertShaderModule_XYZ_TEX1_Generic = VK_NULL_HANDLE;
+	}
 
-	mUsedResourceBuffer.clear();
-	mUnusedResourceBuffer.clear();
-}
+	if (mFragShaderModule_XYZ_TEX1_Generic != VK_NULL_HANDLE)
+	{
+		vkDestroyShaderModule(mDevice->mDevice, mFragShaderModule_XYZ_TEX1_Generic, NULL);
+		mFragShaderModule_XYZ_TEX1_Generic = VK_NULL_HANDLE;
+	}
 
-void BufferManager::BeginDraw(std::shared_ptr<DrawContext> context, std::shared_ptr<ResourceContext> resourceContext, D3DPRIMITIVETYPE type)
-{
-	VkResult result = VK_SUCCESS;
-	boost::container::flat_map<D3DRENDERSTATETYPE, DWORD>::const_iterator searchResult;
-	
-	/**********************************************
-	* Update the stuff that need to be done outside of a render pass.
-	**********************************************/
-	if (mDevice->mDeviceState.mAreLightsDirty || mDevice->mDeviceState.mIsMaterialDirty)
+	if (mVertShaderModule_XYZ_TEX2_Generic != VK_NULL_HANDLE)
 	{
-		vkCmdEndRenderPass(mDevice->mSwapchainBuffers[mDevice->mCurrentBuffer]);
-		UpdateBuffer();
-		vkCmdBeginRenderPass(mDevice->mSwapchainBuffers[mDevice->mCurrentBuffer], &mDevice->mRenderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
+		vkDestroyShaderModule(mDevice->mDevice, mVertShaderModule_XYZ_TEX2_Generic, NULL);
+		mVertShaderModule_XYZ_TEX2_Generic = VK_NULL_HANDLE;
 	}
 
-	/**********************************************
-	* Update the textures that are currently mapped.
-	**********************************************/
-	BOOST_FOREACH(const auto& pair1, mDevice->mDeviceState.mTextures)
+	if (mFragShaderModule_XYZ_TEX2_Generic != VK_NULL_HANDLE)
 	{
-		VkDescriptorImageInfo& targetSampler = mDevice->mDeviceState.mDescriptorImageInfo[pair1.first];
+		vkDestroyShaderModule(mDevice->mDevice, mFragShaderModule_XYZ_TEX2_Generic, NULL);
+		mFragShaderModule_XYZ_TEX2_Generic = VK_NULL_HANDLE;
+	}
 
-		if (pair1.second != nullptr)
-		{
-			std::shared_ptr<SamplerRequest> request = std::make_shared<SamplerRequest>(mDevice);
+	if (mVertShaderModule_XYZ_DIFFUSE_TEX1_Generic != VK_NULL_HANDLE)
+	{
+		vkDestroyShaderModule(mDevice->mDevice, mVertShaderModule_XYZ_DIFFUSE_TEX1_Generic, NULL);
+		mVertShaderModule_XYZ_DIFFUSE_TEX1_Generic = VK_NULL_HANDLE;
+	}
 
-			request->MagFilter = (D3DTEXTUREFILTERTYPE)mDevice->mDeviceState.mSamplerStates[request->SamplerIndex][D3DSAMP_MAGFILTER];
-			request->MinFilter = (D3DTEXTUREFILTERTYPE)mDevice->mDeviceState.mSamplerStates[request->SamplerIndex][D3DSAMP_MINFILTER];
-			request->AddressModeU = (D3DTEXTUREADDRESS)mDevice->mDeviceState.mSamplerStates[request->SamplerIndex][D3DSAMP_ADDRESSU];
-			request->AddressModeV = (D3DTEXTUREADDRESS)mDevice->mDeviceState.mSamplerStates[request->SamplerIndex][D3DSAMP_ADDRESSV];
-			request->AddressModeW = (D3DTEXTUREADDRESS)mDevice->mDeviceState.mSamplerStates[request->SamplerIndex][D3DSAMP_ADDRESSW];
-			request->MaxAnisotropy = mDevice->mDeviceState.mSamplerStates[request->SamplerIndex][D3DSAMP_MAXANISOTROPY];
-			request->MipmapMode = (D3DTEXTUREFILTERTYPE)mDevice->mDeviceState.mSamplerStates[request->SamplerIndex][D3DSAMP_MIPFILTER];
-			request->MipLodBias = *(float*)&mDevice->mDeviceState.mSamplerStates[request->SamplerIndex][D3DSAMP_MIPMAPLODBIAS];
-			request->MaxLod = pair1.second->mLevels;
+	if (mFragShaderModule_XYZ_DIFFUSE_TEX1_Generic != VK_NULL_HANDLE)
+	{
+		vkDestroyShaderModule(mDevice->mDevice, mFragShaderModule_XYZ_DIFFUSE_TEX1_Generic, NULL);
+		mFragShaderModule_XYZ_DIFFUSE_TEX1_Generic = VK_NULL_HANDLE;
+	}
 
-			for (size_t i = 0; i < mSamplerRequests.size(); i++)
-			{
-				auto& storedRequest = mSamplerRequests[i];
-				if (request->MagFilter == storedRequest->MagFilter
-					&& request->MinFilter == storedRequest->MinFilter
-					&& request->AddressModeU == storedRequest->AddressModeU
-					&& request->AddressModeV == storedRequest->AddressModeV
-					&& request->AddressModeW == storedRequest->AddressModeW
-					&& request->MaxAnisotropy == storedRequest->MaxAnisotropy
-					&& request->MipmapMode == storedRequest->MipmapMode
-					&& request->MipLodBias == storedRequest->MipLodBias
-					&& request->MaxLod == storedRequest->MaxLod)
-				{
-					request->Sampler = storedRequest->Sampler;
-					request->mDevice = nullptr; //Not owner.
-					storedRequest->LastUsed = std::chrono::steady_clock::now();
-				}
-			}
+	if (mVertShaderModule_XYZ_DIFFUSE_TEX2_Generic != VK_NULL_HANDLE)
+	{
+		vkDestroyShaderModule(mDevice->mDevice, mVertShaderModule_XYZ_DIFFUSE_TEX2_Generic, NULL);
+		mVertShaderModule_XYZ_DIFFUSE_TEX2_Generic = VK_NULL_HANDLE;
+	}
 
-			if (request->Sampler == VK_NULL_HANDLE)
-			{
-				CreateSampler(request);
-			}
+	if (mFragShaderModule_XYZ_DIFFUSE_TEX2_Generic != VK_NULL_HANDLE)
+	{
+		vkDestroyShaderModule(mDevice->mDevice, mFragShaderModule_XYZ_DIFFUSE_TEX2_Generic, NULL);
+		mFragShaderModule_XYZ_DIFFUSE_TEX2_Generic = VK_NULL_HANDLE;
+	}
 
-			targetSampler.sampler = request->Sampler;
-			targetSampler.imageView = pair1.second->mImageView;
-			targetSampler.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-		}
-		else
-		{
-			targetSampler.sampler = this->mSampler;
-			targetSampler.imageView = this->mImageView;
-			targetSampler.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
-		}
+	if (mVertShaderModule_XYZ_NORMAL_Generic != VK_NULL_HANDLE)
+	{
+		vkDestroyShaderModule(mDevice->mDevice, mVertShaderModule_XYZ_NORMAL_Generic, NULL);
+		mVertShaderModule_XYZ_NORMAL_Generic = VK_NULL_HANDLE;
 	}
 
-	/**********************************************
-	* Setup context.
-	**********************************************/
-	context->PrimitiveType = type;
+	if (mFragShaderModule_XYZ_NORMAL_Generic != VK_NULL_HANDLE)
+	{
+		vkDestroyShaderModule(mDevice->mDevice, mFragShaderModule_XYZ_NORMAL_Generic, NULL);
+		mFragShaderModule_XYZ_NORMAL_Generic = VK_NULL_HANDLE;
+	}
 
-	if (mDevice->mDeviceState.mHasVertexDeclaration)
+	if (mVertShaderModule_XYZ_NORMAL_TEX1_Generic != VK_NULL_HANDLE)
 	{
-		context->VertexDeclaration = mDevice->mDeviceState.mVertexDeclaration;
+		vkDestroyShaderModule(mDevice->mDevice, mVertShaderModule_XYZ_NORMAL_TEX1_Generic, NULL);
+		mVertShaderModule_XYZ_NORMAL_TEX1_Generic = VK_NULL_HANDLE;
 	}
-	else if (mDevice->mDeviceState.mHasFVF)
+
+	if (mFragShaderModule_XYZ_NORMAL_TEX1_Generic != VK_NULL_HANDLE)
 	{
-		context->FVF = mDevice->mDeviceState.mFVF;
+		vkDestroyShaderModule(mDevice->mDevice, mFragShaderModule_XYZ_NORMAL_TEX1_Generic, NULL);
+		mFragShaderModule_XYZ_NORMAL_TEX1_Generic = VK_NULL_HANDLE;
 	}
 
-	//TODO: revisit if it's valid to have declaration or FVF with either shader type.
+	if (mVertShaderModule_XYZ_NORMAL_DIFFUSE_Generic != VK_NULL_HANDLE)
+	{
+		vkDestroyShaderModule(mDevice->mDevice, mVertShaderModule_XYZ_NORMAL_DIFFUSE_Generic, NULL);
+		mVertShaderModule_XYZ_NORMAL_DIFFUSE_Generic = VK_NULL_HANDLE;
+	}
 
-	if (mDevice->mDeviceState.mHasVertexShader)
+	if (mFragShaderModule_XYZ_NORMAL_DIFFUSE_Generic != VK_NULL_HANDLE)
 	{
-		context->VertexShader = mDevice->mDeviceState.mVertexShader; //vert
+		vkDestroyShaderModule(mDevice->mDevice, mFragShaderModule_XYZ_NORMAL_DIFFUSE_Generic, NULL);
+		mFragShaderModule_XYZ_NORMAL_DIFFUSE_Generic = VK_NULL_HANDLE;
 	}
 
-	if (mDevice->mDeviceState.mHasPixelShader)
+	if (mVertShaderModule_XYZ_NORMAL_DIFFUSE_TEX2_Generic != VK_NULL_HANDLE)
 	{
-		context->PixelShader = mDevice->mDeviceState.mPixelShader; //pixel
+		vkDestroyShaderModule(mDevice->mDevice, mVertShaderModule_XYZ_NORMAL_DIFFUSE_TEX2_Generic, NULL);
+		mVertShaderModule_XYZ_NORMAL_DIFFUSE_TEX2_Generic = VK_NULL_HANDLE;
 	}
 
-	context->StreamCount = mDevice->mDeviceState.mStreamSources.size();
+	if (mFragShaderModule_XYZ_NORMAL_DIFFUSE_TEX2_Generic != VK_NULL_HANDLE)
+	{
+		vkDestroyShaderModule(mDevice->mDevice, mFragShaderModule_XYZ_NORMAL_DIFFUSE_TEX2_Generic, NULL);
+		mFragShaderModule_XYZ_NORMAL_DIFFUSE_TEX2_Generic = VK_NULL_HANDLE;
+	}
 
-	context->mSpecializationConstants = mDevice->mDeviceState.mSpecializationConstants;
+	SavePipelineManifest();
 
-	SpecializationConstants& constants = context->mSpecializationConstants;
-	constants.lightCount = mDevice->mDeviceState.mLights.size();
-	constants.textureCount = mDevice->mDeviceState.mTextures.size();
+	if (mPipelineCache != VK_NULL_HANDLE)
+	{
+		SavePipelineCache();
+		vkDestroyPipelineCache(mDevice->mDevice, mPipelineCache, nullptr);
+		mPipelineCache = VK_NULL_HANDLE;
+	}
 
-	mDevice->mDeviceState.mSpecializationConstants.lightCount = constants.lightCount;
-	mDevice->mDeviceState.mSpecializationConstants.textureCount = constants.textureCount;
+	//Empty cached objects. (a destructor should take care of their resources.)
 
-	int i = 0;
-	BOOST_FOREACH(map_type::value_type& source, mDevice->mDeviceState.mStreamSources)
+	mDrawContext.reset();
+	mGenericContext.reset();
+	mResourceContext.reset();
+	mLastDrawContext.reset();
+	mDrawBuffer.clear();
+	for (size_t i = 0; i < 16; i++)
 	{
-		mVertexInputBindingDescription[i].binding = source.first;
-		mVertexInputBindingDescription[i].stride = source.second.Stride;
-		mVertexInputBindingDescription[i].inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+		mStageSamplers[i].reset();
+	}
+	mSamplers.clear();
 
-		context->Bindings[source.first] = source.second.Stride;
+	mUsedResourceBuffer.clear();
+	mUnusedResourceBuffer.clear();
+	mFrameResourceBuffer.clear();
+	mLayouts.clear();
 
-		i++;
+	//The first pool belongs to the device.
+	for (size_t i = 1; i < mDescriptorPools.size(); i++)
+	{
+		vkDestroyDescriptorPool(mDevice->mDevice, mDescriptorPools[i], nullptr);
 	}
+	mDescriptorPools.clear();
 
-	/**********************************************
-	* Check for existing pipeline. Create one if there isn't a matching one.
-	**********************************************/	 
-
-	for (size_t i = 0; i < mDrawBuffer.size(); i++)
-	{
-		auto& drawBuffer = (*mDrawBuffer[i]);
-
-		if (drawBuffer.PrimitiveType == context->PrimitiveType
-			&& drawBuffer.FVF == context->FVF
-			&& drawBuffer.VertexDeclaration == context->VertexDeclaration
-			&& drawBuffer.VertexShader == context->VertexShader
-			&& drawBuffer.PixelShader == context->PixelShader
-			&& drawBuffer.StreamCount == context->StreamCount
-			&& drawBuffer.mSpecializationConstants.lightCount == constants.lightCount
-			   
-			&& drawBuffer.mSpecializationConstants.textureCount == constants.textureCount
-			   
-			&& drawBuffer.mSpecializationConstants.texureCoordinateIndex_0 == constants.texureCoordinateIndex_0
-			&& drawBuffer.mSpecializationConstants.texureCoordinateIndex_1 == constants.texureCoordinateIndex_1
-			&& drawBuffer.mSpecializationConstants.texureCoordinateIndex_2 == constants.texureCoordinateIndex_2
-			&& drawBuffer.mSpecializationConstants.texureCoordinateIndex_3 == constants.texureCoordinateIndex_3
-			&& drawBuffer.mSpecializationConstants.texureCoordinateIndex_4 == constants.texureCoordinateIndex_4
-			&& drawBuffer.mSpecializationConstants.texureCoordinateIndex_5 == constants.texureCoordinateIndex_5
-			&& drawBuffer.mSpecializationConstants.texureCoordinateIndex_6 == constants.texureCoordinateIndex_6
-			&& drawBuffer.mSpecializationConstants.texureCoordinateIndex_7 == constants.texureCoordinateIndex_7
-			   
-			&& drawBuffer.mSpecializationConstants.textureTransformationFlags_0 == constants.textureTransformationFlags_0
-			&& drawBuffer.mSpecializationConstants.textureTransformationFlags_1 == constants.textureTransformationFlags_1
-			&& drawBuffer.mSpecializationConstants.textureTransformationFlags_2 == constants.textureTransformationFlags_2
-			&& drawBuffer.mSpecializationConstants.textureTransformationFlags_3 == constants.textureTransformationFlags_3
-			&& drawBuffer.mSpecializationConstants.textureTransformationFlags_4 == constants.textureTransformationFlags_4
-			&& drawBuffer.mSpecializationConstants.textureTransformationFlags_5 == constants.textureTransformationFlags_5
-			&& drawBuffer.mSpecializationConstants.textureTransformationFlags_6 == constants.textureTransformationFlags_6
-			&& drawBuffer.mSpecializationConstants.textureTransformationFlags_7 == constants.textureTransformationFlags_7
-			   
-			&& drawBuffer.mSpecializationConstants.colorOperation_0 == constants.colorOperation_0
-			&& drawBuffer.mSpecializationConstants.colorOperation_1 == constants.colorOperation_1
-			&& drawBuffer.mSpecializationConstants.colorOperation_2 == constants.colorOperation_2
-			&& drawBuffer.mSpecializationConstants.colorOperation_3 == constants.colorOperation_3
-			&& drawBuffer.mSpecializationConstants.colorOperation_4 == constants.colorOperation_4
-			&& drawBuffer.mSpecializationConstants.colorOperation_5 == constants.colorOperation_5
-			&& drawBuffer.mSpecializationConstants.colorOperation_6 == constants.colorOperation_6
-			&& drawBuffer.mSpecializationConstants.colorOperation_7 == constants.colorOperation_7
-			   
-			&& drawBuffer.mSpecializationConstants.colorArgument1_0 == constants.colorArgument1_0
-			&& drawBuffer.mSpecializationConstants.colorArgument1_1 == constants.colorArgument1_1
-			&& drawBuffer.mSpecializationConstants.colorArgument1_2 == constants.colorArgument1_2
-			&& drawBuffer.mSpecializationConstants.colorArgument1_3 == constants.colorArgument1_3
-			&& drawBuffer.mSpecializationConstants.colorArgument1_4 == constants.colorArgument1_4
-			&& drawBuffer.mSpecializationConstants.colorArgument1_5 == constants.colorArgument1_5
-			&& drawBuffer.mSpecializationConstants.colorArgument1_6 == constants.colorArgument1_6
-			&& drawBuffer.mSpecializationConstants.colorArgument1_7 == constants.colorArgument1_7
-			  
-			&& drawBuffer.mSpecializationConstants.colorArgument2_0 == constants.colorArgument2_0
-			&& drawBuffer.mSpecializationConstants.colorArgument2_1 == constants.colorArgument2_1
-			&& drawBuffer.mSpecializationConstants.colorArgument2_2 == constants.colorArgument2_2
-			&& drawBuffer.mSpecializationConstants.colorArgument2_3 == constants.colorArgument2_3
-			&& drawBuffer.mSpecializationConstants.colorArgument2_4 == constants.colorArgument2_4
-			&& drawBuffer.mSpecializationConstants.colorArgument2_5 == constants.colorArgument2_5
-			&& drawBuffer.mSpecializationConstants.colorArgument2_6 == constants.colorArgument2_6
-			&& drawBuffer.mSpecializationConstants.colorArgument2_7 == constants.colorArgument2_7
-			   
-			&& drawBuffer.mSpecializationConstants.alphaOperation_0 == constants.alphaOperation_0
-			&& drawBuffer.mSpecializationConstants.alphaOperation_1 == constants.alphaOperation_1
-			&& drawBuffer.mSpecializationConstants.alphaOperation_2 == constants.alphaOperation_2
-			&& drawBuffer.mSpecializationConstants.alphaOperation_3 == constants.alphaOperation_3
-			&& drawBuffer.mSpecializationConstants.alphaOperation_4 == constants.alphaOperation_4
-			&& drawBuffer.mSpecializationConstants.alphaOperation_5 == constants.alphaOperation_5
-			&& drawBuffer.mSpecializationConstants.alphaOperation_6 == constants.alphaOperation_6
-			&& drawBuffer.mSpecializationConstants.alphaOperation_7 == constants.alphaOperation_7
-			   
-			&& drawBuffer.mSpecializationConstants.alphaArgument1_0 == constants.alphaArgument1_0
-			&& drawBuffer.mSpecializationConstants.alphaArgument1_1 == constants.alphaArgument1_1
-			&& drawBuffer.mSpecializationConstants.alphaArgument1_2 == constants.alphaArgument1_2
-			&& drawBuffer.mSpecializationConstants.alphaArgument1_3 == constants.alphaArgument1_3
-			&& drawBuffer.mSpecializationConstants.alphaArgument1_4 == constants.alphaArgument1_4
-			&& drawBuffer.mSpecializationConstants.alphaArgument1_5 == constants.alphaArgument1_5
-			&& drawBuffer.mSpecializationConstants.alphaArgument1_6 == constants.alphaArgument1_6
-			&& drawBuffer.mSpecializationConstants.alphaArgument1_7 == constants.alphaArgument1_7
-			   
-			&& drawBuffer.mSpecializationConstants.alphaArgument2_0 == constants.alphaArgument2_0
-			&& drawBuffer.mSpecializationConstants.alphaArgument2_1 == constants.alphaArgument2_1
-			&& drawBuffer.mSpecializationConstants.alphaArgument2_2 == constants.alphaArgument2_2
-			&& drawBuffer.mSpecializationConstants.alphaArgument2_3 == constants.alphaArgument2_3
-			&& drawBuffer.mSpecializationConstants.alphaArgument2_4 == constants.alphaArgument2_4
-			&& drawBuffer.mSpecializationConstants.alphaArgument2_5 == constants.alphaArgument2_5
-			&& drawBuffer.mSpecializationConstants.alphaArgument2_6 == constants.alphaArgument2_6
-			&& drawBuffer.mSpecializationConstants.alphaArgument2_7 == constants.alphaArgument2_7
-			   
-			&& drawBuffer.mSpecializationConstants.bumpMapMatrix00_0 == constants.bumpMapMatrix00_0
-			&& drawBuffer.mSpecializationConstants.bumpMapMatrix00_1 == constants.bumpMapMatrix00_1
-			&& drawBuffer.mSpecializationConstants.bumpMapMatrix00_2 == constants.bumpMapMatrix00_2
-			&& drawBuffer.mSpecializationConstants.bumpMapMatrix00_3 == constants.bumpMapMatrix00_3
-			&& drawBuffer.mSpecializationConstants.bumpMapMatrix00_4 == constants.bumpMapMatrix00_4
-			&& drawBuffer.mSpecializationConstants.bumpMapMatrix00_5 == constants.bumpMapMatrix00_5
-			&& drawBuffer.mSpecializationConstants.bumpMapMatrix00_6 == constants.bumpMapMatrix00_6
-			&& drawBuffer.mSpecializationConstants.bumpMapMatrix00_7 == constants.bumpMapMatrix00_7
-			   
-			&& drawBuffer.mSpecializationConstants.bumpMapMatrix01_0 == constants.bumpMapMatrix01_0
-			&& drawBuffer.mSpecializationConstants.bumpMapMatrix01_1 == constants.bumpMapMatrix01_1
-			&& drawBuffer.mSpecializationConstants.bumpMapMatrix01_2 == constants.bumpMapMatrix01_2
-			&& drawBuffer.mSpecializationConstants.bumpMapMatrix01_3 == constants.bumpMapMatrix01_3
-			&& drawBuffer.mSpecializationConstants.bumpMapMatrix01_4 == constants.bumpMapMatrix01_4
-			&& drawBuffer.mSpecializationConstants.bumpMapMatrix01_5 == constants.bumpMapMatrix01_5
-			&& drawBuffer.mSpecializationConstants.bumpMapMatrix01_6 == constants.bumpMapMatrix01_6
-			&& drawBuffer.mSpecializationConstants.bumpMapMatrix01_7 == constants.bumpMapMatrix01_7
-			   
-			&& drawBuffer.mSpecializationConstants.bumpMapMatrix10_0 == constants.bumpMapMatrix10_0
-			&& drawBuffer.mSpecializationConstants.bumpMapMatrix10_1 == constants.bumpMapMatrix10_1
-			&& drawBuffer.mSpecializationConstants.bumpMapMatrix10_2 == constants.bumpMapMatrix10_2
-			&& drawBuffer.mSpecializationConstants.bumpMapMatrix10_3 == constants.bumpMapMatrix10_3
-			&& drawBuffer.mSpecializationConstants.bumpMapMatrix10_4 == constants.bumpMapMatrix10_4
-			&& drawBuffer.mSpecializationConstants.bumpMapMatrix10_5 == constants.bumpMapMatrix10_5
-			&& drawBuffer.mSpecializationConstants.bumpMapMatrix10_6 == constants.bumpMapMatrix10_6
-			&& drawBuffer.mSpecializationConstants.bumpMapMatrix10_7 == constants.bumpMapMatrix10_7
-			   
-			&& drawBuffer.mSpecializationConstants.bumpMapMatrix11_0 == constants.bumpMapMatrix11_0
-			&& drawBuffer.mSpecializationConstants.bumpMapMatrix11_1 == constants.bumpMapMatrix11_1
-			&& drawBuffer.mSpecializationConstants.bumpMapMatrix11_2 == constants.bumpMapMatrix11_2
-			&& drawBuffer.mSpecializationConstants.bumpMapMatrix11_3 == constants.bumpMapMatrix11_3
-			&& drawBuffer.mSpecializationConstants.bumpMapMatrix11_4 == constants.bumpMapMatrix11_4
-			&& drawBuffer.mSpecializationConstants.bumpMapMatrix11_5 == constants.bumpMapMatrix11_5
-			&& drawBuffer.mSpecializationConstants.bumpMapMatrix11_6 == constants.bumpMapMatrix11_6
-			&& drawBuffer.mSpecializationConstants.bumpMapMatrix11_7 == constants.bumpMapMatrix11_7
-			   
-			&& drawBuffer.mSpecializationConstants.bumpMapScale_0 == constants.bumpMapScale_0
-			&& drawBuffer.mSpecializationConstants.bumpMapScale_1 == constants.bumpMapScale_1
-			&& drawBuffer.mSpecializationConstants.bumpMapScale_2 == constants.bumpMapScale_2
-			&& drawBuffer.mSpecializationConstants.bumpMapScale_3 == constants.bumpMapScale_3
-			&& drawBuffer.mSpecializationConstants.bumpMapScale_4 == constants.bumpMapScale_4
-			&& drawBuffer.mSpecializationConstants.bumpMapScale_5 == constants.bumpMapScale_5
-			&& drawBuffer.mSpecializationConstants.bumpMapScale_6 == constants.bumpMapScale_6
-			&& drawBuffer.mSpecializationConstants.bumpMapScale_7 == constants.bumpMapScale_7
-			   
-			&& drawBuffer.mSpecializationConstants.bumpMapOffset_0 == constants.bumpMapOffset_0
-			&& drawBuffer.mSpecializationConstants.bumpMapOffset_1 == constants.bumpMapOffset_1
-			&& drawBuffer.mSpecializationConstants.bumpMapOffset_2 == constants.bumpMapOffset_2
-			&& drawBuffer.mSpecializationConstants.bumpMapOffset_3 == constants.bumpMapOffset_3
-			&& drawBuffer.mSpecializationConstants.bumpMapOffset_4 == constants.bumpMapOffset_4
-			&& drawBuffer.mSpecializationConstants.bumpMapOffset_5 == constants.bumpMapOffset_5
-			&& drawBuffer.mSpecializationConstants.bumpMapOffset_6 == constants.bumpMapOffset_6
-			&& drawBuffer.mSpecializationConstants.bumpMapOffset_7 == constants.bumpMapOffset_7
-			   
-			&& drawBuffer.mSpecializationConstants.colorArgument0_0 == constants.colorArgument0_0
-			&& drawBuffer.mSpecializationConstants.colorArgument0_1 == constants.colorArgument0_1
-			&& drawBuffer.mSpecializationConstants.colorArgument0_2 == constants.colorArgument0_2
-			&& drawBuffer.mSpecializationConstants.colorArgument0_3 == constants.colorArgument0_3
-			&& drawBuffer.mSpecializationConstants.colorArgument0_4 == constants.colorArgument0_4
-			&& drawBuffer.mSpecializationConstants.colorArgument0_5 == constants.colorArgument0_5
-			&& drawBuffer.mSpecializationConstants.colorArgument0_6 == constants.colorArgument0_6
-			&& drawBuffer.mSpecializationConstants.colorArgument0_7 == constants.colorArgument0_7
-			   
-			&& drawBuffer.mSpecializationConstants.alphaArgument0_0 == constants.alphaArgument0_0
-			&& drawBuffer.mSpecializationConstants.alphaArgument0_1 == constants.alphaArgument0_1
-			&& drawBuffer.mSpecializationConstants.alphaArgument0_2 == constants.alphaArgument0_2
-			&& drawBuffer.mSpecializationConstants.alphaArgument0_3 == constants.alphaArgument0_3
-			&& drawBuffer.mSpecializationConstants.alphaArgument0_4 == constants.alphaArgument0_4
-			&& drawBuffer.mSpecializationConstants.alphaArgument0_5 == constants.alphaArgument0_5
-			&& drawBuffer.mSpecializationConstants.alphaArgument0_6 == constants.alphaArgument0_6
-			&& drawBuffer.mSpecializationConstants.alphaArgument0_7 == constants.alphaArgument0_7
-			   
-			&& drawBuffer.mSpecializationConstants.Result_0 == constants.Result_0
-			&& drawBuffer.mSpecializationConstants.Result_1 == constants.Result_1
-			&& drawBuffer.mSpecializationConstants.Result_2 == constants.Result_2
-			&& drawBuffer.mSpecializationConstants.Result_3 == constants.Result_3
-			&& drawBuffer.mSpecializationConstants.Result_4 == constants.Result_4
-			&& drawBuffer.mSpecializationConstants.Result_5 == constants.Result_5
-			&& drawBuffer.mSpecializationConstants.Result_6 == constants.Result_6
-			&& drawBuffer.mSpecializationConstants.Result_7 == constants.Result_7
-
-			&& drawBuffer.mSpecializationConstants.zEnable == constants.zEnable
-			&& drawBuffer.mSpecializationConstants.fillMode == constants.fillMode
-			&& drawBuffer.mSpecializationConstants.shadeMode == constants.shadeMode
-			&& drawBuffer.mSpecializationConstants.zWriteEnable == constants.zWriteEnable
-			&& drawBuffer.mSpecializationConstants.alphaTestEnable == constants.alphaTestEnable
-			&& drawBuffer.mSpecializationConstants.lastPixel == constants.lastPixel
-			&& drawBuffer.mSpecializationConstants.sourceBlend == constants.sourceBlend
-			&& drawBuffer.mSpecializationConstants.destinationBlend == constants.destinationBlend
-			&& drawBuffer.mSpecializationConstants.cullMode == constants.cullMode
-			&& drawBuffer.mSpecializationConstants.zFunction == constants.zFunction
-			&& drawBuffer.mSpecializationConstants.alphaReference == constants.alphaReference
-			&& drawBuffer.mSpecializationConstants.alphaFunction == constants.alphaFunction
-			&& drawBuffer.mSpecializationConstants.ditherEnable == constants.ditherEnable
-			&& drawBuffer.mSpecializationConstants.alphaBlendEnable == constants.alphaBlendEnable
-			&& drawBuffer.mSpecializationConstants.fogEnable == constants.fogEnable
-			&& drawBuffer.mSpecializationConstants.specularEnable == constants.specularEnable
-			&& drawBuffer.mSpecializationConstants.fogColor == constants.fogColor
-			&& drawBuffer.mSpecializationConstants.fogTableMode == constants.fogTableMode
-			&& drawBuffer.mSpecializationConstants.fogStart == constants.fogStart
-			&& drawBuffer.mSpecializationConstants.fogEnd == constants.fogEnd
-			&& drawBuffer.mSpecializationConstants.fogDensity == constants.fogDensity
-			&& drawBuffer.mSpecializationConstants.rangeFogEnable == constants.rangeFogEnable
-			&& drawBuffer.mSpecializationConstants.stencilEnable == constants.stencilEnable
-			&& drawBuffer.mSpecializationConstants.stencilFail == constants.stencilFail
-			&& drawBuffer.mSpecializationConstants.stencilZFail == constants.stencilZFail
-			&& drawBuffer.mSpecializationConstants.stencilPass == constants.stencilPass
-			&& drawBuffer.mSpecializationConstants.stencilFunction == constants.stencilFunction
-			&& drawBuffer.mSpecializationConstants.stencilReference == constants.stencilReference
-			&& drawBuffer.mSpecializationConstants.stencilMask == constants.stencilMask
-			&& drawBuffer.mSpecializationConstants.stencilWriteMask == constants.stencilWriteMask
-			&& drawBuffer.mSpecializationConstants.textureFactor == constants.textureFactor
-			&& drawBuffer.mSpecializationConstants.wrap0 == constants.wrap0
-			&& drawBuffer.mSpecializationConstants.wrap1 == constants.wrap1
-			&& drawBuffer.mSpecializationConstants.wrap2 == constants.wrap2
-			&& drawBuffer.mSpecializationConstants.wrap3 == constants.wrap3
-			&& drawBuffer.mSpecializationConstants.wrap4 == constants.wrap4
-			&& drawBuffer.mSpecializationConstants.wrap5 == constants.wrap5
-			&& drawBuffer.mSpecializationConstants.wrap6 == constants.wrap6
-			&& drawBuffer.mSpecializationConstants.wrap7 == constants.wrap7
-			&& drawBuffer.mSpecializationConstants.clipping == constants.clipping
-			&& drawBuffer.mSpecializationConstants.lighting == constants.lighting
-			&& drawBuffer.mSpecializationConstants.ambient == constants.ambient
-			&& drawBuffer.mSpecializationConstants.fogVertexMode == constants.fogVertexMode
-			&& drawBuffer.mSpecializationConstants.colorVertex == constants.colorVertex
-			&& drawBuffer.mSpecializationConstants.localViewer == constants.localViewer
-			&& drawBuffer.mSpecializationConstants.normalizeNormals == constants.normalizeNormals
-			&& drawBuffer.mSpecializationConstants.diffuseMaterialSource == constants.diffuseMaterialSource
-			&& drawBuffer.mSpecializationConstants.specularMaterialSource == constants.specularMaterialSource
-			&& drawBuffer.mSpecializationConstants.ambientMaterialSource == constants.ambientMaterialSource
-			&& drawBuffer.mSpecializationConstants.emissiveMaterialSource == constants.emissiveMaterialSource
-			&& drawBuffer.mSpecializationConstants.vertexBlend == constants.vertexBlend
-			&& drawBuffer.mSpecializationConstants.clipPlaneEnable == constants.clipPlaneEnable
-			&& drawBuffer.mSpecializationConstants.pointSize == constants.pointSize
-			&& drawBuffer.mSpecializationConstants.pointSizeMinimum == constants.pointSizeMinimum
-			&& drawBuffer.mSpecializationConstants.pointSpriteEnable == constants.pointSpriteEnable
-			&& drawBuffer.mSpecializationConstants.pointScaleEnable == constants.pointScaleEnable
-			&& drawBuffer.mSpecializationConstants.pointScaleA == constants.pointScaleA
-			&& drawBuffer.mSpecializationConstants.pointScaleB == constants.pointScaleB
-			&& drawBuffer.mSpecializationConstants.pointScaleC == constants.pointScaleC
-			&& drawBuffer.mSpecializationConstants.multisampleAntiAlias == constants.multisampleAntiAlias
-			&& drawBuffer.mSpecializationConstants.multisampleMask == constants.multisampleMask
-			&& drawBuffer.mSpecializationConstants.patchEdgeStyle == constants.patchEdgeStyle
-			&& drawBuffer.mSpecializationConstants.debugMonitorToken == constants.debugMonitorToken
-			&& drawBuffer.mSpecializationConstants.pointSizeMaximum == constants.pointSizeMaximum
-			&& drawBuffer.mSpecializationConstants.indexedVertexBlendEnable == constants.indexedVertexBlendEnable
-			&& drawBuffer.mSpecializationConstants.colorWriteEnable == constants.colorWriteEnable
-			&& drawBuffer.mSpecializationConstants.tweenFactor == constants.tweenFactor
-			&& drawBuffer.mSpecializationConstants.blendOperation == constants.blendOperation
-			&& drawBuffer.mSpecializationConstants.positionDegree == constants.positionDegree
-			&& drawBuffer.mSpecializationConstants.normalDegree == constants.normalDegree
-			&& drawBuffer.mSpecializationConstants.scissorTestEnable == constants.scissorTestEnable
-			&& drawBuffer.mSpecializationConstants.slopeScaleDepthBias == constants.slopeScaleDepthBias
-			&& drawBuffer.mSpecializationConstants.antiAliasedLineEnable == constants.antiAliasedLineEnable
-			&& drawBuffer.mSpecializationConstants.minimumTessellationLevel == constants.minimumTessellationLevel
-			&& drawBuffer.mSpecializationConstants.maximumTessellationLevel == constants.maximumTessellationLevel
-			&& drawBuffer.mSpecializationConstants.adaptivetessX == constants.adaptivetessX
-			&& drawBuffer.mSpecializationConstants.adaptivetessY == constants.adaptivetessY
-			&& drawBuffer.mSpecializationConstants.adaptivetessZ == constants.adaptivetessZ
-			&& drawBuffer.mSpecializationConstants.adaptivetessW == constants.adaptivetessW
-			&& drawBuffer.mSpecializationConstants.enableAdaptiveTessellation == constants.enableAdaptiveTessellation
-			&& drawBuffer.mSpecializationConstants.twoSidedStencilMode == constants.twoSidedStencilMode
-			&& drawBuffer.mSpecializationConstants.ccwStencilFail == constants.ccwStencilFail
-			&& drawBuffer.mSpecializationConstants.ccwStencilZFail == constants.ccwStencilZFail
-			&& drawBuffer.mSpecializationConstants.ccwStencilPass == constants.ccwStencilPass
-			&& drawBuffer.mSpecializationConstants.ccwStencilFunction == constants.ccwStencilFunction
-			&& drawBuffer.mSpecializationConstants.colorWriteEnable1 == constants.colorWriteEnable1
-			&& drawBuffer.mSpecializationConstants.colorWriteEnable2 == constants.colorWriteEnable2
-			&& drawBuffer.mSpecializationConstants.colorWriteEnable3 == constants.colorWriteEnable3
-			&& drawBuffer.mSpecializationConstants.blendFactor == constants.blendFactor
-			&& drawBuffer.mSpecializationConstants.srgbWriteEnable == constants.srgbWriteEnable
-			&& drawBuffer.mSpecializationConstants.depthBias == constants.depthBias
-			&& drawBuffer.mSpecializationConstants.wrap8 == constants.wrap8
-			&& drawBuffer.mSpecializationConstants.wrap9 == constants.wrap9
-			&& drawBuffer.mSpecializationConstants.wrap10 == constants.wrap10
-			&& drawBuffer.mSpecializationConstants.wrap11 == constants.wrap11
-			&& drawBuffer.mSpecializationConstants.wrap12 == constants.wrap12
-			&& drawBuffer.mSpecializationConstants.wrap13 == constants.wrap13
-			&& drawBuffer.mSpecializationConstants.wrap14 == constants.wrap14
-			&& drawBuffer.mSpecializationConstants.wrap15 == constants.wrap15
-			&& drawBuffer.mSpecializationConstants.separateAlphaBlendEnable == constants.separateAlphaBlendEnable
-			&& drawBuffer.mSpecializationConstants.sourceBlendAlpha == constants.sourceBlendAlpha
-			&& drawBuffer.mSpecializationConstants.destinationBlendAlpha == constants.destinationBlendAlpha
-			&& drawBuffer.mSpecializationConstants.blendOperationAlpha == constants.blendOperationAlpha
-			)
-		{
-			BOOL isMatch = true;
-			BOOST_FOREACH(const auto& pair, context->Bindings)
-			{
-				if (mDrawBuffer[i]->Bindings.count(pair.first) == 0 || pair.second != mDrawBuffer[i]->Bindings[pair.first])
-				{
-					isMatch = false;
-					break;
-				}
-			}
-			if (isMatch)
-			{
-				context->Pipeline = mDrawBuffer[i]->Pipeline;
-				context->PipelineLayout = mDrawBuffer[i]->PipelineLayout;
-				context->DescriptorSetLayout = mDrawBuffer[i]->DescriptorSetLayout;
-				context->mDevice = nullptr; //Not owner.
-				mDrawBuffer[i]->LastUsed = std::chrono::steady_clock::now();
-			}
+	BOOST_FOREACH(FrameDescriptorPool& framePool, mFrameDescriptorPools)
+	{
+		BOOST_FOREACH(VkDescriptorPool pool, framePool.Pools)
+		{
+			vkDestroyDescriptorPool(mDevice->mDevice, pool, nullptr);
 		}
 	}
+	mFrameDescriptorPools.clear();
 
-	if (context->Pipeline == VK_NULL_HANDLE)
+	//Destroying the pool frees the table.
+	if (mBindlessDescriptorPool != VK_NULL_HANDLE)
 	{
-		CreatePipe(context); //If we didn't find a matching pipeline then create a new one.	
+		vkDestroyDescriptorPool(mDevice->mDevice, mBindlessDescriptorPool, nullptr);
+		mBindlessDescriptorPool = VK_NULL_HANDLE;
+		mBindlessDescriptorSet = VK_NULL_HANDLE;
 	}
 
-	/*
-	https://msdn.microsoft.com/en-us/library/windows/desktop/bb205599(v=vs.85).aspx
-	The units for the D3DRS_DEPTHBIAS and D3DRS_SLOPESCALEDEPTHBIAS render states depend on whether z-buffering or w-buffering is enabled.
-	The bias is not applied to any line and point primitive.
-	*/
-	if (constants.zEnable != D3DZB_FALSE && type > 3)
-	{
-		vkCmdSetDepthBias(mDevice->mSwapchainBuffers[mDevice->mCurrentBuffer], constants.depthBias, 0.0f, constants.slopeScaleDepthBias);
-	}
-	else
+	if (mBindlessDescriptorSetLayout != VK_NULL_HANDLE)
 	{
-		vkCmdSetDepthBias(mDevice->mSwapchainBuffers[mDevice->mCurrentBuffer], 0.0f, 0.0f, 0.0f);
+		vkDestroyDescriptorSetLayout(mDevice->mDevice, mBindlessDescriptorSetLayout, nullptr);
+		mBindlessDescriptorSetLayout = VK_NULL_HANDLE;
 	}
 
+	BOOST_FOREACH(FrameConstantRing& ring, mConstantRings)
+	{
+		ring.RetiredBuffers.push_back(std::make_pair(ring.Buffer, ring.Memory));
+		for (size_t i = 0; i < ring.RetiredBuffers.size(); i++)
+		{
+			vkDestroyBuffer(mDevice->mDevice, ring.RetiredBuffers[i].first, nullptr);
+			vkFreeMemory(mDevice->mDevice, ring.RetiredBuffers[i].second, nullptr); //Freeing the memory unmaps it.
+		}
+	}
+	mConstantRings.clear();
+}
+
+bool BufferManager::BeginDraw(D3DPRIMITIVETYPE type)
+{
+	VkResult result = VK_SUCCESS;
+	boost::container::flat_map<D3DRENDERSTATETYPE, DWORD>::const_iterator searchResult;
+
 	/**********************************************
-	* Update transformation structure.
+	* Reuse the contexts from the last draw unless something kept them. Steady state draws don't touch the heap.
 	**********************************************/
-	if (context->VertexShader==nullptr)
+	if (mDrawContext == nullptr || mDrawContext.use_count() > 1)
+	{
+		mDrawContext = std::make_shared<DrawContext>(mDevice);
+		mDevice->mStatistics.DrawContextAllocations++;
+	}
+	else
+	{
+		mDrawContext->Reset(mDevice);
+	}
+
+	if (mResourceContext == nullptr || mResourceContext.use_count() > 1)
 	{
-		UpdatePushConstants(context);
+		mResourceContext = std::make_shared<ResourceContext>(mDevice);
+		mDevice->mStatistics.ResourceContextAllocations++;
 	}
 	else
 	{
-		vkCmdPushConstants(mDevice->mSwapchainBuffers[mDevice->mCurrentBuffer], context->PipelineLayout, VK_SHADER_STAGE_ALL_GRAPHICS, 0, UBO_SIZE * 2, &mPushConstants);
+		mResourceContext->Reset(mDevice);
 	}
 
+	const std::shared_ptr<DrawContext>& context = mDrawContext;
+	const std::shared_ptr<ResourceContext>& resourceContext = mResourceContext;
+	mDevice->mStatistics.DrawCount++;
+	
 	/**********************************************
-	* Check for existing DescriptorSet. Create one if there isn't a matching one.
+	* Compare the state generations with the last draw. Anything that hasn't changed doesn't need to be resolved again.
+	**********************************************/
+	const StateGenerations& generations = mDevice->mDeviceState.mGenerations;
+
+	const BOOL isTextureStateCurrent = mLastDrawContext != nullptr
+		&& generations.Texture == mLastGenerations.Texture
+		&& generations.SamplerState == mLastGenerations.SamplerState;
+
+	const BOOL isPipelineStateCurrent = mLastDrawContext != nullptr
+		&& type == mLastPrimitiveType
+		&& generations.RenderState == mLastGenerations.RenderState
+		&& generations.TextureStageState == mLastGenerations.TextureStageState
+		&& generations.Shader == mLastGenerations.Shader
+		&& generations.VertexInput == mLastGenerations.VertexInput
+		&& mDevice->mDeviceState.mLights.size() == mLastLightCount
+		&& mDevice->mDeviceState.mTextures.size() == mLastTextureCount;
+
+	/**********************************************
+	* Update the textures that are currently mapped.
+	* The first draw of each frame also goes through them so textures that stay bound are stamped with every frame that uses them.
 	**********************************************/
+	if (!isTextureStateCurrent || mTextureFrameNumber != mDevice->mFrameNumber)
+	{
+		mTextureFrameNumber = mDevice->mFrameNumber;
+
+		BOOST_FOREACH(const auto& pair1, mDevice->mDeviceState.mTextures)
+		{
+			VkDescriptorImageInfo& targetSampler = mDevice->mDeviceState.mDescriptorImageInfo[pair1.first];
+
+			if (pair1.second != nullptr)
+			{
+				pair1.second->mLastFrameUsed = mDevice->mFrameNumber; //Lets uploads tell whether the GPU may still sample it.
+
+				//A stage only looks its sampler up again when its own sampler state or texture has changed.
+				if (mStageSamplers[pair1.first] == nullptr || mStageSamplerGenerations[pair1.first] != generations.Sampler[pair1.first])
+				{
+					UpdateStageSampler(pair1.first, pair1.second);
+				}
+
+				targetSampler.sampler = mStageSamplers[pair1.first]->Sampler;
+				targetSampler.imageView = pair1.second->mImageView;
+				targetSampler.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+				mStageSlots[pair1.first] = (mStageSamplers[pair1.first]->Slot << 16) | pair1.second->mTextureSlot;
+			}
+			else
+			{
+				targetSampler.sampler = this->mSampler;
+				targetSampler.imageView = this->mImageView;
+				targetSampler.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+				mStageSlots[pair1.first] = 0;
+			}
+		}
+	}
+
+	std::chrono::steady_clock::time_point stallStart = std::chrono::steady_clock::now();
+	std::shared_ptr<DrawContext> pipelineContext = context; //The context that owns the pipeline this draw is recorded with.
+	BOOL isFallback = false;
 
-	if (context->DescriptorSetLayout != VK_NULL_HANDLE)
+	if (isPipelineStateCurrent)
+	{
+		pipelineContext = mLastDrawContext;
+		context->mDevice = nullptr; //Not owner.
+		pipelineContext->LastUsedFrame = mFrameIndex;
+		mDevice->mStatistics.PipelineCacheHits++;
+	}
+	else
 	{
-		std::copy(std::begin(mDevice->mDeviceState.mDescriptorImageInfo), std::end(mDevice->mDeviceState.mDescriptorImageInfo), std::begin(resourceContext->DescriptorImageInfo));
+		/**********************************************
+		* Setup context.
+		**********************************************/
+		context->PrimitiveType = type;
+
+		if (mDevice->mDeviceState.mHasVertexDeclaration)
+		{
+			context->VertexDeclaration = mDevice->mDeviceState.mVertexDeclaration;
+		}
+		else if (mDevice->mDeviceState.mHasFVF)
+		{
+			context->FVF = mDevice->mDeviceState.mFVF;
+		}
+
+		//TODO: revisit if it's valid to have declaration or FVF with either shader type.
+
+		if (mDevice->mDeviceState.mHasVertexShader)
+		{
+			context->VertexShader = mDevice->mDeviceState.mVertexShader; //vert
+		}
+
+		if (mDevice->mDeviceState.mHasPixelShader)
+		{
+			context->PixelShader = mDevice->mDeviceState.mPixelShader; //pixel
+		}
+
+		context->StreamCount = mDevice->mDeviceState.mStreamSources.size();
+
+		context->mSpecializationConstants = mDevice->mDeviceState.mSpecializationConstants;
+
+		SpecializationConstants& constants = context->mSpecializationConstants;
+		constants.lightCount = mDevice->mDeviceState.mLights.size();
+		constants.textureCount = mDevice->mDeviceState.mTextures.size();
+
+		mDevice->mDeviceState.mSpecializationConstants.lightCount = constants.lightCount;
+		mDevice->mDeviceState.mSpecializationConstants.textureCount = constants.textureCount;
+
+		/*
+		These are fed through dynamic state or the render state buffer so they are cleared from the key to keep them from creating new pipelines.
+		The values themselves are read from the device state below.
+		*/
+		constants.stencilReference = 0;
+		constants.stencilMask = 0;
+		constants.stencilWriteMask = 0;
+		constants.textureFactor = 0;
+		constants.ambient = 0;
+		constants.pointSize = 0;
+		constants.blendFactor = 0;
+		constants.depthBias = 0;
+		constants.slopeScaleDepthBias = 0;
+
+		int i = 0;
+		BOOST_FOREACH(map_type::value_type& source, mDevice->mDeviceState.mStreamSources)
+		{
+			mVertexInputBindingDescription[i].binding = source.first;
+			mVertexInputBindingDescription[i].stride = source.second.Stride;
+			mVertexInputBindingDescription[i].inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+
+			context->Bindings[i][0] = source.first;
+			context->Bindings[i][1] = source.second.Stride;
+
+			i++;
+		}
+
+		/**********************************************
+		* Leave the dynamic states out of the key. The comparison mode also hashes the key as it would be with and without them.
+		**********************************************/
+		if (mIsDynamicStateComparisonEnabled)
+		{
+			const SpecializationConstants staticConstants = constants;
+			UINT staticBindings[16][2];
+			memcpy(staticBindings, context->Bindings, sizeof(staticBindings));
+
+			context->UpdateHash();
+			mStaticPipelineKeys.insert(context->Hash);
+
+			StripDynamicPipelineState(context, true, true);
+			context->UpdateHash();
+			mDynamicPipelineKeys.insert(context->Hash);
+			mDevice->mStatistics.StaticPipelineKeys = mStaticPipelineKeys.size();
+			mDevice->mStatistics.DynamicPipelineKeys = mDynamicPipelineKeys.size();
+
+			constants = staticConstants;
+			memcpy(context->Bindings, staticBindings, sizeof(staticBindings));
+			context->PrimitiveType = type;
+		}
+
+		StripDynamicPipelineState(context, mUseExtendedDynamicState, mUseExtendedDynamicState3);
 
-		//Loop over cached descriptor information.
-		for (size_t i = 0; i < mUsedResourceBuffer.size(); i++)
+		/**********************************************
+		* Check for existing pipeline. Create one if there isn't a matching one.
+		**********************************************/	 
+
+		if (mUseGenericPipelines && context->VertexShader == nullptr)
+		{
+			pipelineContext = FindGenericContext(context);
+			if (pipelineContext == nullptr)
+			{
+				return false;
+			}
+		}
+		else
 		{
-			auto& resourceBuffer = mUsedResourceBuffer[i];
-			BOOL imageMatches = true;
+			context->UpdateHash();
 
-			//The image info array is currently always 16.
-			for (int32_t j = 0; j < 16; j++)
+			auto drawBuffer = mDrawBuffer.find(context);
+			if (drawBuffer != mDrawBuffer.end())
 			{
-				auto& imageData1 = resourceBuffer->DescriptorImageInfo[j];
-				auto& imageData2 = resourceContext->DescriptorImageInfo[j];
+				pipelineContext = (*drawBuffer);
+				context->mDevice = nullptr; //Not owner.
+				pipelineContext->LastUsedFrame = mFrameIndex;
+				pipelineContext->IsPrewarmed = false;
+				mDevice->mStatistics.PipelineCacheHits++;
+			}
+			else
+			{
+				mDevice->mStatistics.PipelineCacheMisses++;
+				if (!CreatePipe(context)) //If we didn't find a matching pipeline then create a new one.
+				{
+					return false;
+				}
+			}
 
-				if (imageData1.imageLayout == imageData2.imageLayout
-					&& imageData1.imageView == imageData2.imageView
-					&& imageData1.sampler == imageData2.sampler)
+			//Pending pipelines stay in the draw buffer so a second draw with the same state waits on the same request instead of compiling again.
+			if (pipelineContext->IsPending)
+			{
+				if (mPipelineFallback == PIPELINE_FALLBACK_GENERIC && context->VertexShader == nullptr)
+				{
+					pipelineContext = FindGenericContext(context);
+					isFallback = true;
+					if (pipelineContext == nullptr)
+					{
+						return false;
+					}
+				}
+				else if (mPipelineFallback == PIPELINE_FALLBACK_SKIP)
 				{
-					//nothing?
+					return false;
 				}
 				else
 				{
-					imageMatches = false;
-					break;
+					WaitForPipeline(pipelineContext);
 				}
 			}
-			if (imageMatches)
+
+			//A worker failed to compile it. It is dropped so a later draw can try again but this one has nothing to record with.
+			if (pipelineContext->Pipeline == VK_NULL_HANDLE)
 			{
-				resourceContext->DescriptorSet = resourceBuffer->DescriptorSet;
-				resourceContext->mDevice = nullptr; //Not owner.
-				resourceBuffer->LastUsed = std::chrono::steady_clock::now();
-				break;
+				mPipelineMemory -= pipelineContext->EstimatedSize;
+				mDrawBuffer.erase(pipelineContext);
+				return false;
+			}
+		}
+
+		if (pipelineContext->IsGeneric)
+		{
+			UpdateSpecializationBuffer(constants);
+		}
+	}
+
+	long long stall = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - stallStart).count();
+	if (stall > mDevice->mStatistics.MaximumPipelineStall)
+	{
+		mDevice->mStatistics.MaximumPipelineStall = stall;
+	}
+
+	/*
+	https://msdn.microsoft.com/en-us/library/windows/desktop/bb205599(v=vs.85).aspx
+	The units for the D3DRS_DEPTHBIAS and D3DRS_SLOPESCALEDEPTHBIAS render states depend on whether z-buffering or w-buffering is enabled.
+	The bias is not applied to any line and point primitive.
+	*/
+	const SpecializationConstants& dynamicConstants = mDevice->mDeviceState.mSpecializationConstants;
+
+	if (dynamicConstants.zEnable != D3DZB_FALSE && type > 3)
+	{
+		mCommandBufferState.SetDepthBias(dynamicConstants.depthBias, 0.0f, dynamicConstants.slopeScaleDepthBias);
+	}
+	else
+	{
+		mCommandBufferState.SetDepthBias(0.0f, 0.0f, 0.0f);
+	}
+
+	/**********************************************
+	* Update dynamic render states.
+	**********************************************/
+	const float blendConstants[4] =
+	{
+		(float)((dynamicConstants.blendFactor >> 16) & 0xFF) / 255.0f,
+		(float)((dynamicConstants.blendFactor >> 8) & 0xFF) / 255.0f,
+		(float)(dynamicConstants.blendFactor & 0xFF) / 255.0f,
+		(float)((dynamicConstants.blendFactor >> 24) & 0xFF) / 255.0f
+	};
+
+	mCommandBufferState.SetBlendConstants(blendConstants);
+	mCommandBufferState.SetStencil(dynamicConstants.stencilMask, dynamicConstants.stencilWriteMask, dynamicConstants.stencilReference);
+
+	//SetViewport and SetScissorRect can be called mid scene so these are picked up here rather than in StartScene.
+	mCommandBufferState.SetViewport(mDevice->mDeviceState.mViewport);
+	mCommandBufferState.SetScissor(mDevice->mDeviceState.mScissor);
+
+	if (mUseExtendedDynamicState)
+	{
+		DynamicPipelineState pipelineState;
+		GetDynamicPipelineState(dynamicConstants, type, pipelineState);
+		mCommandBufferState.SetPipelineState(pipelineState);
+	}
+
+	/**********************************************
+	* Update transformation structure.
+	**********************************************/
+	if (pipelineContext->VertexShader==nullptr)
+	{
+		UpdatePushConstants(pipelineContext);
+		UpdateFixedFunctionBuffers();
+
+		//Unlit draws don't read the lights so later changes can still go into the same slot.
+		if (mDevice->mDeviceState.mSpecializationConstants.lighting)
+		{
+			mIsLightSlotRead = true;
+		}
+	}
+	else
+	{
+		UpdateShaderConstants();
+	}
+
+	/**********************************************
+	* Check for existing DescriptorSet. Create one if there isn't a matching one.
+	* With push descriptors only the bindings that changed since the last draw are pushed and no set is needed.
+	* With bindless textures set 0 only holds buffers so texture changes don't need a new set.
+	* Layouts are shared so the last set carries over to any pipeline with the same layout.
+	**********************************************/
+	const BOOL isBindless = mUseFixedFunctionBindlessTextures && pipelineContext->VertexShader == nullptr;
+
+	if (mUsePushDescriptors && pipelineContext->VertexShader == nullptr)
+	{
+		uint32_t descriptorCount = mCommandBufferState.PushDescriptorSet(pipelineContext->PipelineLayout, mWriteDescriptorSet, mDescriptorBufferInfo, mDevice->mDeviceState.mDescriptorImageInfo, isBindless ? 0 : mDevice->mDeviceState.mTextures.size());
+		if (descriptorCount)
+		{
+			mDevice->mStatistics.PushDescriptorCount++;
+			mDevice->mStatistics.PushDescriptorWrites += descriptorCount;
+		}
+	}
+	else if (pipelineContext->DescriptorSetLayout != VK_NULL_HANDLE && (isTextureStateCurrent || isBindless) && mLastDrawContext != nullptr && pipelineContext->DescriptorSetLayout == mLastDrawContext->DescriptorSetLayout && mLastDescriptorSet != VK_NULL_HANDLE)
+	{
+		resourceContext->DescriptorSet = mLastDescriptorSet;
+		resourceContext->mDevice = nullptr; //Not owner.
+	}
+	else if (pipelineContext->DescriptorSetLayout != VK_NULL_HANDLE)
+	{
+		resourceContext->DescriptorSetLayout = pipelineContext->DescriptorSetLayout;
+		if (!isBindless)
+		{
+			std::copy(std::begin(mDevice->mDeviceState.mDescriptorImageInfo), std::end(mDevice->mDeviceState.mDescriptorImageInfo), std::begin(resourceContext->DescriptorImageInfo));
+		}
+
+		if (pipelineContext->VertexShader == nullptr)
+		{
+			//Like the shader constants the offsets are dynamic so the set only changes when the ring does.
+			std::copy(std::begin(mDescriptorBufferInfo), std::end(mDescriptorBufferInfo), std::begin(resourceContext->DescriptorBufferInfo));
+		}
+		else
+		{
+			//The offsets into the ring are dynamic so the set only changes when the ring does.
+			resourceContext->DescriptorBufferInfo[SHADER_CONSTANT_VERTEX_FLOAT].range = sizeof(mShaderConstants.VertexFloats);
+			resourceContext->DescriptorBufferInfo[SHADER_CONSTANT_VERTEX_INTEGER].range = sizeof(mShaderConstants.VertexIntegers);
+			resourceContext->DescriptorBufferInfo[SHADER_CONSTANT_PIXEL_FLOAT].range = sizeof(mShaderConstants.PixelFloats);
+			resourceContext->DescriptorBufferInfo[SHADER_CONSTANT_PIXEL_INTEGER].range = sizeof(mShaderConstants.PixelIntegers);
+			for (size_t i = 0; i < SHADER_CONSTANT_BLOCK_COUNT; i++)
+			{
+				resourceContext->DescriptorBufferInfo[i].buffer = mConstantBuffer;
+				resourceContext->DescriptorBufferInfo[i].offset = 0;
 			}
 		}
 
-		if (resourceContext->DescriptorSet == VK_NULL_HANDLE)
+		resourceContext->UpdateHash();
+
+		auto& resourceBuffers = (mDescriptorAllocator == DESCRIPTOR_ALLOCATOR_LINEAR) ? mFrameResourceBuffer : mUsedResourceBuffer;
+		auto resourceBuffer = resourceBuffers.find(resourceContext);
+		if (resourceBuffer != resourceBuffers.end())
+		{
+			resourceContext->DescriptorSet = (*resourceBuffer)->DescriptorSet;
+			resourceContext->mDevice = nullptr; //Not owner.
+			(*resourceBuffer)->LastUsedFrame = mFrameIndex;
+			mDevice->mStatistics.DescriptorSetHits++;
+		}
+		else
 		{
-			CreateDescriptorSet(context, resourceContext);
+			mDevice->mStatistics.DescriptorSetMisses++;
+			CreateDescriptorSet(pipelineContext, resourceContext);
 		}
 	}
 
@@ -1138,37 +1563,57 @@ void BufferManager::BeginDraw(std::shared_ptr<DrawContext> context, std::shared_
 	* Setup bindings
 	**********************************************/
 
-	//TODO: I need to find a way to prevent binding on every draw call.
+	//The command buffer state only emits the binds that differ from what is already on the command buffer.
+
+	if (resourceContext->DescriptorSet != VK_NULL_HANDLE && pipelineContext->VertexShader != nullptr)
+	{
+		mCommandBufferState.BindDescriptorSet(pipelineContext->PipelineLayout, resourceContext->DescriptorSet, SHADER_CONSTANT_BLOCK_COUNT, mConstantOffsets);
+	}
+	else if (resourceContext->DescriptorSet != VK_NULL_HANDLE)
+	{
+		mCommandBufferState.BindDescriptorSet(pipelineContext->PipelineLayout, resourceContext->DescriptorSet, FIXED_FUNCTION_BLOCK_COUNT, mFixedFunctionOffsets);
+	}
 
-	if (resourceContext->DescriptorSet != VK_NULL_HANDLE)
+	if (isBindless)
 	{
-		vkCmdBindDescriptorSets(mDevice->mSwapchainBuffers[mDevice->mCurrentBuffer], VK_PIPELINE_BIND_POINT_GRAPHICS, context->PipelineLayout, 0, 1, &resourceContext->DescriptorSet, 0, nullptr);
-		//mLastDescriptorSet = resourceContext->DescriptorSet;
+		mCommandBufferState.PushConstantData(pipelineContext->PipelineLayout, mStageSlots, sizeof(mStageSlots), UBO_SIZE * 2);
+		mCommandBufferState.BindTextureTable(pipelineContext->PipelineLayout, mBindlessDescriptorSet);
 	}
 
-	//if (!mIsDirty || mLastVkPipeline != context->Pipeline)
-	//{
-	vkCmdBindPipeline(mDevice->mSwapchainBuffers[mDevice->mCurrentBuffer], VK_PIPELINE_BIND_POINT_GRAPHICS, context->Pipeline);
-	//	mLastVkPipeline = context->Pipeline;
-	//}
+	mCommandBufferState.BindPipeline(pipelineContext->Pipeline);
 
 	mVertexCount = 0;
 
 	if (mDevice->mDeviceState.mIndexBuffer != nullptr)
 	{
-		vkCmdBindIndexBuffer(mDevice->mSwapchainBuffers[mDevice->mCurrentBuffer], mDevice->mDeviceState.mIndexBuffer->mBuffer, 0, mDevice->mDeviceState.mIndexBuffer->mIndexType);
+		mCommandBufferState.BindIndexBuffer(mDevice->mDeviceState.mIndexBuffer->mBuffer, 0, mDevice->mDeviceState.mIndexBuffer->mIndexType);
+		mDevice->mDeviceState.mIndexBuffer->mLastFrameUsed = mDevice->mFrameNumber; //Lets Lock tell whether the GPU may still read it.
 	}
 
 	BOOST_FOREACH(map_type::value_type& source, mDevice->mDeviceState.mStreamSources)
 	{
-		vkCmdBindVertexBuffers(mDevice->mSwapchainBuffers[mDevice->mCurrentBuffer], source.first, 1, &source.second.StreamData->mBuffer, &source.second.OffsetInBytes);
+		mCommandBufferState.BindVertexBuffer(source.first, source.second.StreamData->mBuffer, source.second.OffsetInBytes, source.second.Stride);
+		source.second.StreamData->mLastFrameUsed = mDevice->mFrameNumber;
 		mVertexCount += source.second.StreamData->mSize;
 	}
+	mCommandBufferState.FlushVertexBuffers();
+
+	/**********************************************
+	* Remember what this draw was resolved from. A fallback pipeline is not kept so the next draw picks up the real one once it is ready.
+	**********************************************/
+	mLastDrawContext = isFallback ? nullptr : pipelineContext;
+	mLastDescriptorSet = resourceContext->DescriptorSet;
+	mLastGenerations = generations;
+	mLastPrimitiveType = type;
+	mLastLightCount = mDevice->mDeviceState.mLights.size();
+	mLastTextureCount = mDevice->mDeviceState.mTextures.size();
 
 	mIsDirty = false;
+
+	return true;
 }
 
-void BufferManager::CreatePipe(std::shared_ptr<DrawContext> context)
+BOOL BufferManager::CreatePipe(const std::shared_ptr<DrawContext>& context)
 {
 	VkResult result = VK_SUCCESS;
 
@@ -1262,10 +1707,12 @@ void BufferManager::CreatePipe(std::shared_ptr<DrawContext> context)
 
 	mPipelineDepthStencilStateCreateInfo.back.failOp = ConvertStencilOperation(constants.stencilFail);
 	mPipelineDepthStencilStateCreateInfo.back.passOp = ConvertStencilOperation(constants.stencilPass);
+	mPipelineDepthStencilStateCreateInfo.back.depthFailOp = ConvertStencilOperation(constants.stencilZFail);
 	mPipelineDepthStencilStateCreateInfo.back.compareOp = ConvertCompareOperation(constants.stencilFunction);
 	
 	mPipelineDepthStencilStateCreateInfo.front.failOp = ConvertStencilOperation(constants.ccwStencilFail);
 	mPipelineDepthStencilStateCreateInfo.front.passOp = ConvertStencilOperation(constants.ccwStencilPass);
+	mPipelineDepthStencilStateCreateInfo.front.depthFailOp = ConvertStencilOperation(constants.ccwStencilZFail);
 	mPipelineDepthStencilStateCreateInfo.front.compareOp = ConvertCompareOperation(constants.ccwStencilFunction);
 
 	//mPipelineDepthStencilStateCreateInfo.minDepthBounds = 0.0f;
@@ -1289,12 +1736,12 @@ void BufferManager::CreatePipe(std::shared_ptr<DrawContext> context)
 				//No textures. 
 				break;
 			case 1:
-				mPipelineShaderStageCreateInfo[0].module = mVertShaderModule_XYZ_TEX1;
-				mPipelineShaderStageCreateInfo[1].module = mFragShaderModule_XYZ_TEX1;
+				mPipelineShaderStageCreateInfo[0].module = context->IsGeneric ? mVertShaderModule_XYZ_TEX1_Generic : mVertShaderModule_XYZ_TEX1;
+				mPipelineShaderStageCreateInfo[1].module = context->IsGeneric ? mFragShaderModule_XYZ_TEX1_Generic : mFragShaderModule_XYZ_TEX1;
 				break;
 			case 2:
-				mPipelineShaderStageCreateInfo[0].module = mVertShaderModule_XYZ_TEX2;
-				mPipelineShaderStageCreateInfo[1].module = mFragShaderModule_XYZ_TEX2;
+				mPipelineShaderStageCreateInfo[0].module = context->IsGeneric ? mVertShaderModule_XYZ_TEX2_Generic : mVertShaderModule_XYZ_TEX2;
+				mPipelineShaderStageCreateInfo[1].module = context->IsGeneric ? mFragShaderModule_XYZ_TEX2_Generic : mFragShaderModule_XYZ_TEX2;
 				break;
 			default:
 				BOOST_LOG_TRIVIAL(fatal) << "BufferManager::CreatePipe unsupported texture count " << textureCount;
@@ -1306,16 +1753,16 @@ void BufferManager::CreatePipe(std::shared_ptr<DrawContext> context)
 			switch (textureCount)
 			{
 			case 0:
-				mPipelineShaderStageCreateInfo[0].module = mVertShaderModule_XYZ_DIFFUSE;
-				mPipelineShaderStageCreateInfo[1].module = mFragShaderModule_XYZ_DIFFUSE;
+				mPipelineShaderStageCreateInfo[0].module = context->IsGeneric ? mVertShaderModule_XYZ_DIFFUSE_Generic : mVertShaderModule_XYZ_DIFFUSE;
+				mPipelineShaderStageCreateInfo[1].module = context->IsGeneric ? mFragShaderModule_XYZ_DIFFUSE_Generic : mFragShaderModule_XYZ_DIFFUSE;
 				break;
 			case 1:
-				mPipelineShaderStageCreateInfo[0].module = mVertShaderModule_XYZ_DIFFUSE_TEX1;
-				mPipelineShaderStageCreateInfo[1].module = mFragShaderModule_XYZ_DIFFUSE_TEX1;
+				mPipelineShaderStageCreateInfo[0].module = context->IsGeneric ? mVertShaderModule_XYZ_DIFFUSE_TEX1_Generic : mVertShaderModule_XYZ_DIFFUSE_TEX1;
+				mPipelineShaderStageCreateInfo[1].module = context->IsGeneric ? mFragShaderModule_XYZ_DIFFUSE_TEX1_Generic : mFragShaderModule_XYZ_DIFFUSE_TEX1;
 				break;
 			case 2:
-				mPipelineShaderStageCreateInfo[0].module = mVertShaderModule_XYZ_DIFFUSE_TEX2;
-				mPipelineShaderStageCreateInfo[1].module = mFragShaderModule_XYZ_DIFFUSE_TEX2;
+				mPipelineShaderStageCreateInfo[0].module = context->IsGeneric ? mVertShaderModule_XYZ_DIFFUSE_TEX2_Generic : mVertShaderModule_XYZ_DIFFUSE_TEX2;
+				mPipelineShaderStageCreateInfo[1].module = context->IsGeneric ? mFragShaderModule_XYZ_DIFFUSE_TEX2_Generic : mFragShaderModule_XYZ_DIFFUSE_TEX2;
 				break;
 			default:
 				BOOST_LOG_TRIVIAL(fatal) << "BufferManager::CreatePipe unsupported texture count " << textureCount;
@@ -1327,12 +1774,12 @@ void BufferManager::CreatePipe(std::shared_ptr<DrawContext> context)
 			switch (textureCount)
 			{
 			case 2:
-				mPipelineShaderStageCreateInfo[0].module = mVertShaderModule_XYZ_NORMAL_DIFFUSE_TEX2;
-				mPipelineShaderStageCreateInfo[1].module = mFragShaderModule_XYZ_NORMAL_DIFFUSE_TEX2;
+				mPipelineShaderStageCreateInfo[0].module = context->IsGeneric ? mVertShaderModule_XYZ_NORMAL_DIFFUSE_TEX2_Generic : mVertShaderModule_XYZ_NORMAL_DIFFUSE_TEX2;
+				mPipelineShaderStageCreateInfo[1].module = context->IsGeneric ? mFragShaderModule_XYZ_NORMAL_DIFFUSE_TEX2_Generic : mFragShaderModule_XYZ_NORMAL_DIFFUSE_TEX2;
 				break;
 			case 0:
-				mPipelineShaderStageCreateInfo[0].module = mVertShaderModule_XYZ_NORMAL_DIFFUSE;
-				mPipelineShaderStageCreateInfo[1].module = mFragShaderModule_XYZ_NORMAL_DIFFUSE;
+				mPipelineShaderStageCreateInfo[0].module = context->IsGeneric ? mVertShaderModule_XYZ_NORMAL_DIFFUSE_Generic : mVertShaderModule_XYZ_NORMAL_DIFFUSE;
+				mPipelineShaderStageCreateInfo[1].module = context->IsGeneric ? mFragShaderModule_XYZ_NORMAL_DIFFUSE_Generic : mFragShaderModule_XYZ_NORMAL_DIFFUSE;
 				break;
 			default:
 				BOOST_LOG_TRIVIAL(fatal) << "BufferManager::CreatePipe unsupported texture count " << textureCount;
@@ -1344,12 +1791,12 @@ void BufferManager::CreatePipe(std::shared_ptr<DrawContext> context)
 			switch (textureCount)
 			{
 			case 0:
-				mPipelineShaderStageCreateInfo[0].module = mVertShaderModule_XYZ_NORMAL;
-				mPipelineShaderStageCreateInfo[1].module = mFragShaderModule_XYZ_NORMAL;
+				mPipelineShaderStageCreateInfo[0].module = context->IsGeneric ? mVertShaderModule_XYZ_NORMAL_Generic : mVertShaderModule_XYZ_NORMAL;
+				mPipelineShaderStageCreateInfo[1].module = context->IsGeneric ? mFragShaderModule_XYZ_NORMAL_Generic : mFragShaderModule_XYZ_NORMAL;
 				break;
 			case 1:
-				mPipelineShaderStageCreateInfo[0].module = mVertShaderModule_XYZ_NORMAL_TEX1;
-				mPipelineShaderStageCreateInfo[1].module = mFragShaderModule_XYZ_NORMAL_TEX1;
+				mPipelineShaderStageCreateInfo[0].module = context->IsGeneric ? mVertShaderModule_XYZ_NORMAL_TEX1_Generic : mVertShaderModule_XYZ_NORMAL_TEX1;
+				mPipelineShaderStageCreateInfo[1].module = context->IsGeneric ? mFragShaderModule_XYZ_NORMAL_TEX1_Generic : mFragShaderModule_XYZ_NORMAL_TEX1;
 				break;
 			default:
 				BOOST_LOG_TRIVIAL(fatal) << "BufferManager::CreatePipe unsupported texture count " << textureCount;
@@ -1504,16 +1951,32 @@ void BufferManager::CreatePipe(std::shared_ptr<DrawContext> context)
 	{
 		auto& convertedShader = context->VertexShader->mConvertedShader;
 
+		//Converted shaders read every register from the constant blocks so nothing is pushed.
+		mPipelineLayoutCreateInfo.pushConstantRangeCount = 0;
+
 		mPipelineVertexInputStateCreateInfo.vertexAttributeDescriptionCount = convertedShader.mVertexInputAttributeDescriptionCount;
 
-		memcpy(&mDescriptorSetLayoutBinding, &convertedShader.mDescriptorSetLayoutBinding, sizeof(mDescriptorSetLayoutBinding));
+		memcpy(&mDescriptorSetLayoutBinding, &convertedShader.mDescriptorSetLayoutBinding, sizeof(convertedShader.mDescriptorSetLayoutBinding));
+
+		//The constant blocks follow the shader's own bindings.
+		uint32_t bindingCount = convertedShader.mDescriptorSetLayoutBindingCount;
+		for (uint32_t i = 0; i < SHADER_CONSTANT_BLOCK_COUNT; i++)
+		{
+			mDescriptorSetLayoutBinding[bindingCount].binding = SHADER_CONSTANT_BINDING + i;
+			mDescriptorSetLayoutBinding[bindingCount].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+			mDescriptorSetLayoutBinding[bindingCount].descriptorCount = 1;
+			mDescriptorSetLayoutBinding[bindingCount].stageFlags = (i < SHADER_CONSTANT_PIXEL_FLOAT) ? VK_SHADER_STAGE_VERTEX_BIT : VK_SHADER_STAGE_FRAGMENT_BIT;
+			mDescriptorSetLayoutBinding[bindingCount].pImmutableSamplers = NULL;
+			bindingCount++;
+		}
 
 		mDescriptorSetLayoutCreateInfo.pBindings = mDescriptorSetLayoutBinding;
+		mDescriptorSetLayoutCreateInfo.flags = 0;
 
 		mPipelineVertexInputStateCreateInfo.vertexBindingDescriptionCount = context->StreamCount;
 		mPipelineLayoutCreateInfo.pSetLayouts = &context->DescriptorSetLayout;
 
-		mDescriptorSetLayoutCreateInfo.bindingCount = convertedShader.mDescriptorSetLayoutBindingCount;
+		mDescriptorSetLayoutCreateInfo.bindingCount = bindingCount;
 		mPipelineLayoutCreateInfo.setLayoutCount = 1;
 	}
 	else
@@ -1523,155 +1986,855 @@ void BufferManager::CreatePipe(std::shared_ptr<DrawContext> context)
 		mPipelineVertexInputStateCreateInfo.vertexAttributeDescriptionCount = attributeCount;
 
 		mDescriptorSetLayoutBinding[0].binding = 0;
-		mDescriptorSetLayoutBinding[0].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+		mDescriptorSetLayoutBinding[0].descriptorType = mFixedFunctionBufferType;
 		mDescriptorSetLayoutBinding[0].descriptorCount = 1;
 		mDescriptorSetLayoutBinding[0].stageFlags = VK_SHADER_STAGE_ALL_GRAPHICS;
 		mDescriptorSetLayoutBinding[0].pImmutableSamplers = NULL;
 
 		mDescriptorSetLayoutBinding[1].binding = 1;
-		mDescriptorSetLayoutBinding[1].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+		mDescriptorSetLayoutBinding[1].descriptorType = mFixedFunctionBufferType;
 		mDescriptorSetLayoutBinding[1].descriptorCount = 1;
 		mDescriptorSetLayoutBinding[1].stageFlags = VK_SHADER_STAGE_ALL_GRAPHICS;
 		mDescriptorSetLayoutBinding[1].pImmutableSamplers = NULL;
 
-		mDescriptorSetLayoutBinding[2].binding = 2;
-		mDescriptorSetLayoutBinding[2].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER; //VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER'
-		mDescriptorSetLayoutBinding[2].descriptorCount = textureCount; //Update to use mapped texture.
-		mDescriptorSetLayoutBinding[2].stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+		mDescriptorSetLayoutBinding[2].binding = 3;
+		mDescriptorSetLayoutBinding[2].descriptorType = mFixedFunctionBufferType;
+		mDescriptorSetLayoutBinding[2].descriptorCount = 1;
+		mDescriptorSetLayoutBinding[2].stageFlags = VK_SHADER_STAGE_ALL_GRAPHICS;
 		mDescriptorSetLayoutBinding[2].pImmutableSamplers = NULL;
 
+		//Only the generic shaders read this but it is always in the layout so specialized and generic pipelines can share descriptor sets.
+		mDescriptorSetLayoutBinding[3].binding = 4;
+		mDescriptorSetLayoutBinding[3].descriptorType = mFixedFunctionBufferType;
+		mDescriptorSetLayoutBinding[3].descriptorCount = 1;
+		mDescriptorSetLayoutBinding[3].stageFlags = VK_SHADER_STAGE_ALL_GRAPHICS;
+		mDescriptorSetLayoutBinding[3].pImmutableSamplers = NULL;
+
+		mDescriptorSetLayoutBinding[4].binding = 2;
+		mDescriptorSetLayoutBinding[4].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER; //VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER'
+		mDescriptorSetLayoutBinding[4].descriptorCount = textureCount; //Update to use mapped texture.
+		mDescriptorSetLayoutBinding[4].stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+		mDescriptorSetLayoutBinding[4].pImmutableSamplers = NULL;
+
 		mDescriptorSetLayoutCreateInfo.pBindings = mDescriptorSetLayoutBinding;
+		mDescriptorSetLayoutCreateInfo.flags = mUsePushDescriptors ? VK_DESCRIPTOR_SET_LAYOUT_CREATE_PUSH_DESCRIPTOR_BIT_KHR : 0;
 
 		mPipelineVertexInputStateCreateInfo.vertexBindingDescriptionCount = context->StreamCount;
 		mPipelineLayoutCreateInfo.pSetLayouts = &context->DescriptorSetLayout;
 
-		if (textureCount)
+		if (mUseFixedFunctionBindlessTextures)
+		{
+			//Textures come from the bindless table in set 1 so set 0 only has the buffers.
+			mDescriptorSetLayoutCreateInfo.bindingCount = 4;
+			mPipelineLayoutCreateInfo.setLayoutCount = 2;
+		}
+		else if (textureCount)
 		{
-			mDescriptorSetLayoutCreateInfo.bindingCount = 3; //The number of elements in pBindings.	
+			mDescriptorSetLayoutCreateInfo.bindingCount = 5; //The number of elements in pBindings.	
 			mPipelineLayoutCreateInfo.setLayoutCount = 1;
 		}
 		else
 		{
-			mDescriptorSetLayoutCreateInfo.bindingCount = 2; //The number of elements in pBindings.	
+			mDescriptorSetLayoutCreateInfo.bindingCount = 4; //The number of elements in pBindings.	
 			mPipelineLayoutCreateInfo.setLayoutCount = 1;
 		}
 	}
 
-	result = vkCreateDescriptorSetLayout(mDevice->mDevice, &mDescriptorSetLayoutCreateInfo, nullptr, &context->DescriptorSetLayout);
-	if (result != VK_SUCCESS)
-	{
-		BOOST_LOG_TRIVIAL(fatal) << "BufferManager::CreateDescriptorSet vkCreateDescriptorSetLayout failed with return code of " << result;
-		return;
-	}
-
 	/**********************************************
-	* Create pipeline & descriptor set layout.
+	* Find or create the descriptor set & pipeline layout.
 	**********************************************/
-
-	result = vkCreatePipelineLayout(mDevice->mDevice, &mPipelineLayoutCreateInfo, nullptr, &context->PipelineLayout);
-	if (result != VK_SUCCESS)
+	//Without a layout there is nothing to build the pipeline on so the draw can't be recorded.
+	if (!FindLayout(context))
 	{
-		BOOST_LOG_TRIVIAL(fatal) << "BufferManager::BeginDraw vkCreatePipelineLayout failed with return code of " << result;
-		return;
+		return false;
 	}
 
 	mGraphicsPipelineCreateInfo.layout = context->PipelineLayout;
+	mSpecializationInfo.pData = &context->mSpecializationConstants;
+
+	mDevice->mStatistics.PipelineCount++;
+
+	context->LastUsedFrame = mFrameIndex;
+	context->EstimatedSize = sizeof(DrawContext) + PIPELINE_ESTIMATED_SIZE;
+	mPipelineMemory += context->EstimatedSize;
+
+	this->mDrawBuffer.insert(context);
+	RecordPipeline(context);
+
+	//Generic pipelines are the fallback for pending ones so they are always compiled right away.
+	if (mPipelineThreads.size() && !context->IsGeneric)
+	{
+		std::shared_ptr<PipelineRequest> request = std::make_shared<PipelineRequest>(*this, context);
+
+		context->IsPending = true;
+
+		{
+			std::lock_guard<std::mutex> lock(mPipelineMutex);
+			mPipelineRequests.push_back(request);
+		}
+		mPipelineRequestCondition.notify_one();
+
+		return true;
+	}
 
 	result = vkCreateGraphicsPipelines(mDevice->mDevice, mPipelineCache, 1, &mGraphicsPipelineCreateInfo, nullptr, &context->Pipeline);
 	//result = vkCreateGraphicsPipelines(mDevice->mDevice, VK_NULL_HANDLE, 1, &mGraphicsPipelineCreateInfo, nullptr, &context.Pipeline);
 	if (result != VK_SUCCESS)
 	{
-		BOOST_LOG_TRIVIAL(fatal) << "BufferManager::BeginDraw vkCreateGraphicsPipelines failed with return code of " << result;
+		BOOST_LOG_TRIVIAL(fatal) << "BufferManager::CreatePipe vkCreateGraphicsPipelines failed with return code of " << result;
+
+		//Left in the cache every later draw with this state would bind a null pipeline.
+		context->Pipeline = VK_NULL_HANDLE;
+		mPipelineMemory -= context->EstimatedSize;
+		mDrawBuffer.erase(context);
+		return false;
 	}
 
-	this->mDrawBuffer.push_back(context);
+	return true;
 }
 
-void BufferManager::CreateDescriptorSet(std::shared_ptr<DrawContext> context, std::shared_ptr<ResourceContext> resourceContext)
+void BufferManager::CompilePipelines()
 {
 	VkResult result = VK_SUCCESS;
+	std::shared_ptr<PipelineRequest> request;
 
-	if (context->DescriptorSetLayout == VK_NULL_HANDLE)
+	while (true)
 	{
-		resourceContext->DescriptorSet = VK_NULL_HANDLE;
-		return;
-	}
+		{
+			std::unique_lock<std::mutex> lock(mPipelineMutex);
+			mPipelineRequestCondition.wait(lock, [this]() { return mIsStopping || mPipelineRequests.size(); });
 
-	mDescriptorSetAllocateInfo.pSetLayouts = &context->DescriptorSetLayout;
-	mDescriptorSetAllocateInfo.descriptorSetCount = 1;
+			if (mIsStopping)
+			{
+				return;
+			}
 
-	/**********************************************
-	* Create descriptor set if there are none left over, otherwise reuse an existing descriptor set.
-	**********************************************/
+			request = mPipelineRequests.front();
+			mPipelineRequests.pop_front();
+		}
 
-	if (mUnusedResourceBuffer.size())
-	{
-		auto& buffer = mUnusedResourceBuffer.back();
-		buffer->mDevice = nullptr;
+		VkPipeline pipeline = VK_NULL_HANDLE;
 
-		resourceContext->DescriptorSet = buffer->DescriptorSet;
+		result = vkCreateGraphicsPipelines(mDevice->mDevice, mPipelineCache, 1, &request->GraphicsPipelineCreateInfo, nullptr, &pipeline);
+		if (result != VK_SUCCESS)
+		{
+			BOOST_LOG_TRIVIAL(fatal) << "BufferManager::CompilePipelines vkCreateGraphicsPipelines failed with return code of " << result;
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(mPipelineMutex);
+			request->Context->Pipeline = pipeline;
+			request->Context->IsPending = false;
+		}
+		mPipelineCompleteCondition.notify_all();
 
-		mUnusedResourceBuffer.pop_back();
+		request.reset();
+	}
+}
+
+void BufferManager::WaitForPipeline(const std::shared_ptr<DrawContext>& context)
+{
+	std::unique_lock<std::mutex> lock(mPipelineMutex);
+	mPipelineCompleteCondition.wait(lock, [&context]() { return !context->IsPending; });
+}
+
+std::shared_ptr<DrawContext> BufferManager::FindGenericContext(const std::shared_ptr<DrawContext>& context)
+{
+	if (mGenericContext == nullptr || mGenericContext.use_count() > 1)
+	{
+		mGenericContext = std::make_shared<DrawContext>(mDevice);
+		mDevice->mStatistics.DrawContextAllocations++;
 	}
 	else
 	{
-		result = vkAllocateDescriptorSets(mDevice->mDevice, &mDescriptorSetAllocateInfo, &resourceContext->DescriptorSet);
-		if (result != VK_SUCCESS)
-		{
-			BOOST_LOG_TRIVIAL(fatal) << "BufferManager::CreateDescriptorSet vkAllocateDescriptorSets failed with return code of " << result;
-			return;
-		}
+		mGenericContext->Reset(mDevice);
 	}
 
-	mUsedResourceBuffer.push_back(resourceContext);
-  
-	if (context->VertexShader == nullptr)
+	const std::shared_ptr<DrawContext>& genericContext = mGenericContext;
+
+	genericContext->IsGeneric = true;
+	genericContext->PrimitiveType = context->PrimitiveType;
+	genericContext->FVF = context->FVF;
+	genericContext->VertexDeclaration = context->VertexDeclaration;
+	genericContext->StreamCount = context->StreamCount;
+	memcpy(genericContext->Bindings, context->Bindings, sizeof(context->Bindings));
+
+	/**********************************************
+	* Only the states CreatePipe turns into pipeline state are part of the key. The shaders read the rest from the specialization block.
+	**********************************************/
+	const SpecializationConstants& source = context->mSpecializationConstants;
+	SpecializationConstants& target = genericContext->mSpecializationConstants;
+
+	target.zEnable = source.zEnable;
+	target.fillMode = source.fillMode;
+	target.zWriteEnable = source.zWriteEnable;
+	target.sourceBlend = source.sourceBlend;
+	target.destinationBlend = source.destinationBlend;
+	target.cullMode = source.cullMode;
+	target.zFunction = source.zFunction;
+	target.alphaBlendEnable = source.alphaBlendEnable;
+	target.stencilEnable = source.stencilEnable;
+	target.stencilFail = source.stencilFail;
+	target.stencilZFail = source.stencilZFail;
+	target.stencilPass = source.stencilPass;
+	target.stencilFunction = source.stencilFunction;
+	target.colorWriteEnable = source.colorWriteEnable;
+	target.blendOperation = source.blendOperation;
+	target.twoSidedStencilMode = source.twoSidedStencilMode;
+	target.ccwStencilFail = source.ccwStencilFail;
+	target.ccwStencilZFail = source.ccwStencilZFail;
+	target.ccwStencilPass = source.ccwStencilPass;
+	target.ccwStencilFunction = source.ccwStencilFunction;
+	target.separateAlphaBlendEnable = source.separateAlphaBlendEnable;
+	target.sourceBlendAlpha = source.sourceBlendAlpha;
+	target.destinationBlendAlpha = source.destinationBlendAlpha;
+	target.blendOperationAlpha = source.blendOperationAlpha;
+
+	genericContext->UpdateHash();
+
+	auto drawBuffer = mDrawBuffer.find(genericContext);
+	if (drawBuffer != mDrawBuffer.end())
 	{
-		mDescriptorBufferInfo[0].buffer = mLightBuffer;
-		mDescriptorBufferInfo[0].offset = 0;
-		mDescriptorBufferInfo[0].range = sizeof(Light) * mDevice->mDeviceState.mLights.size(); //4; 
+		genericContext->mDevice = nullptr; //Not owner.
+		(*drawBuffer)->LastUsedFrame = mFrameIndex;
+		(*drawBuffer)->IsPrewarmed = false;
+		mDevice->mStatistics.PipelineCacheHits++;
+		return (*drawBuffer);
+	}
 
-		mDescriptorBufferInfo[1].buffer = mMaterialBuffer;
-		mDescriptorBufferInfo[1].offset = 0;
-		mDescriptorBufferInfo[1].range = sizeof(D3DMATERIAL9);
+	mDevice->mStatistics.PipelineCacheMisses++;
+	if (!CreatePipe(genericContext))
+	{
+		return nullptr;
+	}
 
-		mWriteDescriptorSet[0].dstSet = resourceContext->DescriptorSet;
-		mWriteDescriptorSet[0].descriptorCount = 1;
-		mWriteDescriptorSet[0].pBufferInfo = &mDescriptorBufferInfo[0];
+	return genericContext;
+}
 
-		mWriteDescriptorSet[1].dstSet = resourceContext->DescriptorSet;
-		mWriteDescriptorSet[1].descriptorCount = 1;
-		mWriteDescriptorSet[1].pBufferInfo = &mDescriptorBufferInfo[1];
+void BufferManager::StripDynamicPipelineState(const std::shared_ptr<DrawContext>& context, BOOL extendedDynamicState, BOOL extendedDynamicState3)
+{
+	SpecializationConstants& constants = context->mSpecializationConstants;
 
-		mWriteDescriptorSet[2].dstSet = resourceContext->DescriptorSet;
-		mWriteDescriptorSet[2].descriptorCount = mDevice->mDeviceState.mTextures.size();
-		mWriteDescriptorSet[2].pImageInfo = resourceContext->DescriptorImageInfo;
+	if (extendedDynamicState)
+	{
+		context->PrimitiveType = ConvertPrimitiveTypeToClass(context->PrimitiveType);
 
-		if (mDevice->mDeviceState.mTextures.size())
-		{
-			vkUpdateDescriptorSets(mDevice->mDevice, 3, mWriteDescriptorSet, 0, nullptr);
-		}
-		else
+		//The binding slots are still part of the pipeline but the strides come from vkCmdBindVertexBuffers2EXT.
+		for (int32_t i = 0; i < context->StreamCount; i++)
 		{
-			vkUpdateDescriptorSets(mDevice->mDevice, 2, mWriteDescriptorSet, 0, nullptr);
+			context->Bindings[i][1] = 0;
 		}
+
+		constants.cullMode = 0;
+		constants.zEnable = 0;
+		constants.zWriteEnable = 0;
+		constants.zFunction = 0;
+		constants.stencilEnable = 0;
+		constants.stencilFail = 0;
+		constants.stencilZFail = 0;
+		constants.stencilPass = 0;
+		constants.stencilFunction = 0;
+		constants.twoSidedStencilMode = 0;
+		constants.ccwStencilFail = 0;
+		constants.ccwStencilZFail = 0;
+		constants.ccwStencilPass = 0;
+		constants.ccwStencilFunction = 0;
 	}
-	else
-	{
 
+	if (extendedDynamicState3)
+	{
+		constants.fillMode = 0;
+		constants.alphaBlendEnable = 0;
+		constants.sourceBlend = 0;
+		constants.destinationBlend = 0;
+		constants.blendOperation = 0;
+		constants.separateAlphaBlendEnable = 0;
+		constants.sourceBlendAlpha = 0;
+		constants.destinationBlendAlpha = 0;
+		constants.blendOperationAlpha = 0;
+		constants.colorWriteEnable = 0;
 	}
 }
 
-void BufferManager::CreateSampler(std::shared_ptr<SamplerRequest> request)
+void BufferManager::GetDynamicPipelineState(const SpecializationConstants& constants, D3DPRIMITIVETYPE type, DynamicPipelineState& state)
 {
-	//https://msdn.microsoft.com/en-us/library/windows/desktop/bb172602(v=vs.85).aspx
-	//Mipmap filter to use during minification. See D3DTEXTUREFILTERTYPE. The default value is D3DTEXF_NONE.
-
-	VkSamplerCreateInfo samplerCreateInfo = {};
-	samplerCreateInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
-	samplerCreateInfo.pNext = NULL;
+	VkPipelineRasterizationStateCreateInfo rasterizationState = {};
+	SetCulling(rasterizationState, (D3DCULL)constants.cullMode);
+
+	state.CullMode = rasterizationState.cullMode;
+	state.FrontFace = rasterizationState.frontFace;
+	state.PrimitiveTopology = ConvertPrimitiveType(type);
+	state.DepthTestEnable = (constants.zEnable != D3DZB_FALSE);
+	state.DepthWriteEnable = constants.zWriteEnable;
+	state.DepthCompareOp = ConvertCompareOperation(constants.zFunction);
+	state.StencilTestEnable = constants.stencilEnable;
+
+	state.Back.failOp = ConvertStencilOperation(constants.stencilFail);
+	state.Back.passOp = ConvertStencilOperation(constants.stencilPass);
+	state.Back.depthFailOp = ConvertStencilOperation(constants.stencilZFail);
+	state.Back.compareOp = ConvertCompareOperation(constants.stencilFunction);
+
+	state.Front.failOp = ConvertStencilOperation(constants.ccwStencilFail);
+	state.Front.passOp = ConvertStencilOperation(constants.ccwStencilPass);
+	state.Front.depthFailOp = ConvertStencilOperation(constants.ccwStencilZFail);
+	state.Front.compareOp = ConvertCompareOperation(constants.ccwStencilFunction);
+
+	//Same rule as the depth bias values in BeginDraw.
+	state.DepthBiasEnable = (constants.zEnable != D3DZB_FALSE && type > 3);
+
+	state.PolygonMode = ConvertFillMode((D3DFILLMODE)constants.fillMode);
+	state.ColorBlendEnable = constants.alphaBlendEnable;
+	state.ColorBlendEquation.srcColorBlendFactor = ConvertColorFactor(constants.sourceBlend);
+	state.ColorBlendEquation.dstColorBlendFactor = ConvertColorFactor(constants.destinationBlend);
+	state.ColorBlendEquation.colorBlendOp = ConvertColorOperation(constants.blendOperation);
+	state.ColorBlendEquation.srcAlphaBlendFactor = ConvertColorFactor(constants.sourceBlendAlpha);
+	state.ColorBlendEquation.dstAlphaBlendFactor = ConvertColorFactor(constants.destinationBlendAlpha);
+	state.ColorBlendEquation.alphaBlendOp = ConvertColorOperation(constants.blendOperationAlpha);
+	state.ColorWriteMask = constants.colorWriteEnable;
+}
 
-	samplerCreateInfo.magFilter = ConvertFilter(request->MagFilter);
+void BufferManager::UpdateSpecializationBuffer(const SpecializationConstants& constants)
+{
+	if (!mIsSpecializationBufferDirty && memcmp(&mSpecializationBufferContents, &constants, sizeof(SpecializationConstants)) == 0)
+	{
+		return;
+	}
+
+	//Goes up with the other fixed function buffers once the draw knows its pipeline.
+	mSpecializationBufferContents = constants;
+	mIsSpecializationBufferDirty = false;
+	mDirtyFixedFunctionBlocks |= (1 << FIXED_FUNCTION_SPECIALIZATION);
+}
+
+void BufferManager::CreateDescriptorSet(const std::shared_ptr<DrawContext>& context, const std::shared_ptr<ResourceContext>& resourceContext)
+{
+	VkResult result = VK_SUCCESS;
+
+	if (context->DescriptorSetLayout == VK_NULL_HANDLE)
+	{
+		resourceContext->DescriptorSet = VK_NULL_HANDLE;
+		return;
+	}
+
+	mDescriptorSetAllocateInfo.pSetLayouts = &context->DescriptorSetLayout;
+	mDescriptorSetAllocateInfo.descriptorSetCount = 1;
+
+	/**********************************************
+	* Reuse an expired descriptor set with the same layout if there is one, otherwise allocate from the newest pool in the chain.
+	* The linear allocator skips all of that and takes the next set from this frame's pools.
+	**********************************************/
+
+	auto unusedResourceBuffer = mUnusedResourceBuffer.find(context->DescriptorSetLayout);
+	if (mDescriptorAllocator == DESCRIPTOR_ALLOCATOR_LINEAR)
+	{
+		resourceContext->mDevice = nullptr; //Not owner. The pool is reset as a whole.
+
+		result = AllocateFrameDescriptorSet(context->DescriptorSetLayout, resourceContext->DescriptorSet);
+		if (result != VK_SUCCESS)
+		{
+			resourceContext->DescriptorSet = VK_NULL_HANDLE;
+			return;
+		}
+	}
+	else if (unusedResourceBuffer != mUnusedResourceBuffer.end() && unusedResourceBuffer->second.size())
+	{
+		auto& buffer = unusedResourceBuffer->second.back();
+		buffer->mDevice = nullptr;
+
+		resourceContext->DescriptorSet = buffer->DescriptorSet;
+		resourceContext->DescriptorPool = buffer->DescriptorPool;
+
+		unusedResourceBuffer->second.pop_back();
+	}
+	else
+	{
+		mDescriptorSetAllocateInfo.descriptorPool = mDescriptorPools.back();
+		result = vkAllocateDescriptorSets(mDevice->mDevice, &mDescriptorSetAllocateInfo, &resourceContext->DescriptorSet);
+
+		if (result == VK_ERROR_OUT_OF_POOL_MEMORY || result == VK_ERROR_FRAGMENTED_POOL)
+		{
+			//Hand the expired sets of other layouts back to their pools first and only chain on a new pool if that wasn't enough.
+			mUnusedResourceBuffer.clear();
+			result = vkAllocateDescriptorSets(mDevice->mDevice, &mDescriptorSetAllocateInfo, &resourceContext->DescriptorSet);
+
+			if (result == VK_ERROR_OUT_OF_POOL_MEMORY || result == VK_ERROR_FRAGMENTED_POOL)
+			{
+				VkDescriptorPool descriptorPool = VK_NULL_HANDLE;
+				result = mDevice->CreateDescriptorPool(descriptorPool);
+				if (result != VK_SUCCESS)
+				{
+					BOOST_LOG_TRIVIAL(fatal) << "BufferManager::CreateDescriptorSet CreateDescriptorPool failed with return code of " << result;
+					resourceContext->DescriptorSet = VK_NULL_HANDLE;
+					return;
+				}
+				mDescriptorPools.push_back(descriptorPool);
+				mDevice->mStatistics.DescriptorPools = mDescriptorPools.size();
+
+				BOOST_LOG_TRIVIAL(info) << "BufferManager::CreateDescriptorSet chained descriptor pool " << mDescriptorPools.size() << ".";
+
+				mDescriptorSetAllocateInfo.descriptorPool = descriptorPool;
+				result = vkAllocateDescriptorSets(mDevice->mDevice, &mDescriptorSetAllocateInfo, &resourceContext->DescriptorSet);
+			}
+		}
+
+		if (result != VK_SUCCESS)
+		{
+			BOOST_LOG_TRIVIAL(fatal) << "BufferManager::CreateDescriptorSet vkAllocateDescriptorSets failed with return code of " << result;
+			resourceContext->DescriptorSet = VK_NULL_HANDLE;
+			return;
+		}
+
+		resourceContext->DescriptorPool = mDescriptorSetAllocateInfo.descriptorPool;
+		mDescriptorSetAllocateInfo.descriptorPool = mDescriptorPools.front();
+		mDevice->mStatistics.DescriptorSetAllocations++;
+	}
+
+	resourceContext->LastUsedFrame = mFrameIndex;
+	if (mDescriptorAllocator == DESCRIPTOR_ALLOCATOR_LINEAR)
+	{
+		mFrameResourceBuffer.insert(resourceContext);
+	}
+	else
+	{
+		mUsedResourceBuffer.insert(resourceContext);
+	}
+  
+	std::chrono::steady_clock::time_point writeStart = std::chrono::steady_clock::now();
+
+	if (context->DescriptorUpdateTemplate != VK_NULL_HANDLE)
+	{
+		mDevice->vkUpdateDescriptorSetWithTemplateKHR(mDevice->mDevice, resourceContext->DescriptorSet, context->DescriptorUpdateTemplate, resourceContext.get());
+	}
+	else if (context->VertexShader == nullptr)
+	{
+		mWriteDescriptorSet[0].dstSet = resourceContext->DescriptorSet;
+		mWriteDescriptorSet[0].descriptorCount = 1;
+		mWriteDescriptorSet[0].pBufferInfo = &resourceContext->DescriptorBufferInfo[0];
+
+		mWriteDescriptorSet[1].dstSet = resourceContext->DescriptorSet;
+		mWriteDescriptorSet[1].descriptorCount = 1;
+		mWriteDescriptorSet[1].pBufferInfo = &resourceContext->DescriptorBufferInfo[1];
+
+		mWriteDescriptorSet[2].dstSet = resourceContext->DescriptorSet;
+		mWriteDescriptorSet[2].descriptorCount = 1;
+		mWriteDescriptorSet[2].pBufferInfo = &resourceContext->DescriptorBufferInfo[2];
+
+		mWriteDescriptorSet[3].dstSet = resourceContext->DescriptorSet;
+		mWriteDescriptorSet[3].descriptorCount = 1;
+		mWriteDescriptorSet[3].pBufferInfo = &resourceContext->DescriptorBufferInfo[3];
+
+		mWriteDescriptorSet[4].dstSet = resourceContext->DescriptorSet;
+		mWriteDescriptorSet[4].descriptorCount = mDevice->mDeviceState.mTextures.size();
+		mWriteDescriptorSet[4].pImageInfo = resourceContext->DescriptorImageInfo;
+
+		if (mDevice->mDeviceState.mTextures.size() && !mUseFixedFunctionBindlessTextures)
+		{
+			vkUpdateDescriptorSets(mDevice->mDevice, 5, mWriteDescriptorSet, 0, nullptr);
+		}
+		else
+		{
+			vkUpdateDescriptorSets(mDevice->mDevice, 4, mWriteDescriptorSet, 0, nullptr);
+		}
+	}
+	else
+	{
+		VkWriteDescriptorSet writeDescriptorSet[SHADER_CONSTANT_BLOCK_COUNT] = {};
+		for (uint32_t i = 0; i < SHADER_CONSTANT_BLOCK_COUNT; i++)
+		{
+			writeDescriptorSet[i].sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+			writeDescriptorSet[i].dstSet = resourceContext->DescriptorSet;
+			writeDescriptorSet[i].dstBinding = SHADER_CONSTANT_BINDING + i;
+			writeDescriptorSet[i].dstArrayElement = 0;
+			writeDescriptorSet[i].descriptorCount = 1;
+			writeDescriptorSet[i].descriptorType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+			writeDescriptorSet[i].pBufferInfo = &resourceContext->DescriptorBufferInfo[i];
+		}
+
+		vkUpdateDescriptorSets(mDevice->mDevice, SHADER_CONSTANT_BLOCK_COUNT, writeDescriptorSet, 0, nullptr);
+	}
+
+	mDevice->mStatistics.DescriptorSetWrites++;
+	mDevice->mStatistics.DescriptorSetWriteTime += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - writeStart).count();
+}
+
+BOOL BufferManager::FindLayout(const std::shared_ptr<DrawContext>& context)
+{
+	VkResult result = VK_SUCCESS;
+
+	/**********************************************
+	* The key is what CreatePipe put in the create infos. It is built on the stack so a cache hit doesn't allocate.
+	**********************************************/
+	LayoutContext key(nullptr);
+
+	key.BindingCount = mDescriptorSetLayoutCreateInfo.bindingCount;
+	memcpy(key.Bindings, mDescriptorSetLayoutCreateInfo.pBindings, sizeof(VkDescriptorSetLayoutBinding) * key.BindingCount);
+	key.Flags = mDescriptorSetLayoutCreateInfo.flags;
+	key.SetLayoutCount = mPipelineLayoutCreateInfo.setLayoutCount;
+	key.PushConstantRangeCount = mPipelineLayoutCreateInfo.pushConstantRangeCount;
+	key.PushConstantSize = mPushConstantRanges[0].size;
+	key.IsFixedFunction = (context->VertexShader == nullptr);
+	key.UpdateHash();
+
+	std::shared_ptr<LayoutContext> layout;
+
+	auto existingLayout = mLayouts.find(key, LayoutContextHash(), LayoutContextEqual());
+	if (existingLayout != mLayouts.end())
+	{
+		layout = (*existingLayout);
+		mDevice->mStatistics.LayoutCacheHits++;
+	}
+	else
+	{
+		mDevice->mStatistics.LayoutCacheMisses++;
+
+		//The key has no handles yet so the copy is the new entry. Only it owns what is created below.
+		layout = std::make_shared<LayoutContext>(key);
+		layout->mDevice = mDevice;
+
+		mDescriptorSetLayoutCreateInfo.pBindings = layout->Bindings;
+		result = vkCreateDescriptorSetLayout(mDevice->mDevice, &mDescriptorSetLayoutCreateInfo, nullptr, &layout->DescriptorSetLayout);
+		mDescriptorSetLayoutCreateInfo.pBindings = mDescriptorSetLayoutBinding;
+		if (result != VK_SUCCESS)
+		{
+			BOOST_LOG_TRIVIAL(fatal) << "BufferManager::FindLayout vkCreateDescriptorSetLayout failed with return code of " << result;
+			return false;
+		}
+
+		VkDescriptorSetLayout setLayouts[2] = { layout->DescriptorSetLayout, mBindlessDescriptorSetLayout };
+		mPipelineLayoutCreateInfo.pSetLayouts = setLayouts;
+
+		result = vkCreatePipelineLayout(mDevice->mDevice, &mPipelineLayoutCreateInfo, nullptr, &layout->PipelineLayout);
+		mPipelineLayoutCreateInfo.pSetLayouts = nullptr;
+		if (result != VK_SUCCESS)
+		{
+			BOOST_LOG_TRIVIAL(fatal) << "BufferManager::FindLayout vkCreatePipelineLayout failed with return code of " << result;
+			return false;
+		}
+
+		//Pushed layouts never get sets so they don't need a template.
+		if (mUseDescriptorUpdateTemplates && layout->IsFixedFunction && !mUsePushDescriptors)
+		{
+			CreateDescriptorUpdateTemplate(layout);
+		}
+
+		mLayouts.insert(layout);
+	}
+
+	context->DescriptorSetLayout = layout->DescriptorSetLayout;
+	context->PipelineLayout = layout->PipelineLayout;
+	context->DescriptorUpdateTemplate = layout->DescriptorUpdateTemplate;
+
+	return true;
+}
+
+void BufferManager::CreateDescriptorUpdateTemplate(const std::shared_ptr<LayoutContext>& layout)
+{
+	VkResult result = VK_SUCCESS;
+
+	/**********************************************
+	* One entry per binding of the fixed function layout. The offsets point into ResourceContext so a set is written straight from its context.
+	* The first four bindings are the uniform buffers and the fifth, if there is one, is the sampler array.
+	**********************************************/
+	VkDescriptorUpdateTemplateEntryKHR entries[5] = {};
+	uint32_t entryCount = 0;
+
+	for (uint32_t i = 0; i < 4; i++)
+	{
+		entries[entryCount].dstBinding = layout->Bindings[i].binding;
+		entries[entryCount].dstArrayElement = 0;
+		entries[entryCount].descriptorCount = 1;
+		entries[entryCount].descriptorType = layout->Bindings[i].descriptorType;
+		entries[entryCount].offset = offsetof(ResourceContext, DescriptorBufferInfo) + sizeof(VkDescriptorBufferInfo) * i;
+		entries[entryCount].stride = sizeof(VkDescriptorBufferInfo);
+		entryCount++;
+	}
+
+	if (layout->BindingCount > 4)
+	{
+		entries[entryCount].dstBinding = layout->Bindings[4].binding;
+		entries[entryCount].dstArrayElement = 0;
+		entries[entryCount].descriptorCount = layout->Bindings[4].descriptorCount;
+		entries[entryCount].descriptorType = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+		entries[entryCount].offset = offsetof(ResourceContext, DescriptorImageInfo);
+		entries[entryCount].stride = sizeof(VkDescriptorImageInfo);
+		entryCount++;
+	}
+
+	VkDescriptorUpdateTemplateCreateInfoKHR descriptorUpdateTemplateCreateInfo = {};
+	descriptorUpdateTemplateCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_UPDATE_TEMPLATE_CREATE_INFO_KHR;
+	descriptorUpdateTemplateCreateInfo.pNext = NULL;
+	descriptorUpdateTemplateCreateInfo.flags = 0;
+	descriptorUpdateTemplateCreateInfo.descriptorUpdateEntryCount = entryCount;
+	descriptorUpdateTemplateCreateInfo.pDescriptorUpdateEntries = entries;
+	descriptorUpdateTemplateCreateInfo.templateType = VK_DESCRIPTOR_UPDATE_TEMPLATE_TYPE_DESCRIPTOR_SET_KHR;
+	descriptorUpdateTemplateCreateInfo.descriptorSetLayout = layout->DescriptorSetLayout;
+
+	result = mDevice->vkCreateDescriptorUpdateTemplateKHR(mDevice->mDevice, &descriptorUpdateTemplateCreateInfo, nullptr, &layout->DescriptorUpdateTemplate);
+	if (result != VK_SUCCESS)
+	{
+		//CreateDescriptorSet falls back to write arrays for this layout.
+		BOOST_LOG_TRIVIAL(warning) << "BufferManager::CreateDescriptorUpdateTemplate vkCreateDescriptorUpdateTemplateKHR failed with return code of " << result;
+		layout->DescriptorUpdateTemplate = VK_NULL_HANDLE;
+	}
+}
+
+VkResult BufferManager::AllocateFrameDescriptorSet(VkDescriptorSetLayout descriptorSetLayout, VkDescriptorSet& descriptorSet)
+{
+	VkResult result = VK_SUCCESS;
+	FrameDescriptorPool& framePool = mFrameDescriptorPools[mFrameIndex % mFrameDescriptorPools.size()];
+
+	mDescriptorSetAllocateInfo.pSetLayouts = &descriptorSetLayout;
+	mDescriptorSetAllocateInfo.descriptorSetCount = 1;
+
+	//Move down the pools of this frame until one has room, adding one when the frame has used them all.
+	for (;;)
+	{
+		if (framePool.CurrentPool == framePool.Pools.size())
+		{
+			VkDescriptorPool descriptorPool = VK_NULL_HANDLE;
+			result = mDevice->CreateDescriptorPool(descriptorPool, 0);
+			if (result != VK_SUCCESS)
+			{
+				BOOST_LOG_TRIVIAL(fatal) << "BufferManager::AllocateFrameDescriptorSet CreateDescriptorPool failed with return code of " << result;
+				break;
+			}
+			framePool.Pools.push_back(descriptorPool);
+		}
+
+		mDescriptorSetAllocateInfo.descriptorPool = framePool.Pools[framePool.CurrentPool];
+		result = vkAllocateDescriptorSets(mDevice->mDevice, &mDescriptorSetAllocateInfo, &descriptorSet);
+
+		if (result == VK_ERROR_OUT_OF_POOL_MEMORY || result == VK_ERROR_FRAGMENTED_POOL)
+		{
+			framePool.CurrentPool++;
+			continue;
+		}
+
+		if (result != VK_SUCCESS)
+		{
+			BOOST_LOG_TRIVIAL(fatal) << "BufferManager::AllocateFrameDescriptorSet vkAllocateDescriptorSets failed with return code of " << result;
+		}
+		else
+		{
+			mDevice->mStatistics.DescriptorSetAllocations++;
+		}
+		break;
+	}
+
+	mDescriptorSetAllocateInfo.descriptorPool = mDescriptorPools.front();
+
+	return result;
+}
+
+void BufferManager::ResetFrameDescriptorPools()
+{
+	VkResult result = VK_SUCCESS;
+
+	/*
+	Present waits for the fence of the frame these pools belong to before the draw buffer is flushed so nothing in flight still reads them.
+	Resetting a pool returns all of its sets at once.
+	*/
+	FrameDescriptorPool& framePool = mFrameDescriptorPools[mFrameIndex % mFrameDescriptorPools.size()];
+	for (size_t i = 0; i < framePool.Pools.size() && i <= framePool.CurrentPool; i++)
+	{
+		result = vkResetDescriptorPool(mDevice->mDevice, framePool.Pools[i], 0);
+		if (result != VK_SUCCESS)
+		{
+			BOOST_LOG_TRIVIAL(warning) << "BufferManager::ResetFrameDescriptorPools vkResetDescriptorPool failed with return code of " << result;
+		}
+	}
+	framePool.CurrentPool = 0;
+}
+
+void BufferManager::CreateBindlessTable()
+{
+	VkResult result = VK_SUCCESS;
+
+	/**********************************************
+	* Images and samplers are separate arrays so a texture only needs a slot once no matter how many samplers it is drawn with.
+	* Slots are written while the table is bound so every binding is update after bind and only the slots a draw reads have to be valid.
+	**********************************************/
+	VkDescriptorSetLayoutBinding bindings[2] = {};
+	bindings[0].binding = 0;
+	bindings[0].descriptorType = VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE;
+	bindings[0].descriptorCount = MAX_BINDLESS_TEXTURES;
+	bindings[0].stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+	bindings[0].pImmutableSamplers = NULL;
+
+	bindings[1].binding = 1;
+	bindings[1].descriptorType = VK_DESCRIPTOR_TYPE_SAMPLER;
+	bindings[1].descriptorCount = MAX_BINDLESS_SAMPLERS;
+	bindings[1].stageFlags = VK_SHADER_STAGE_FRAGMENT_BIT;
+	bindings[1].pImmutableSamplers = NULL;
+
+	const VkDescriptorBindingFlagsEXT bindingFlags[2] =
+	{
+		VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT_EXT | VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT_EXT | VK_DESCRIPTOR_BINDING_UPDATE_UNUSED_WHILE_PENDING_BIT_EXT,
+		VK_DESCRIPTOR_BINDING_PARTIALLY_BOUND_BIT_EXT | VK_DESCRIPTOR_BINDING_UPDATE_AFTER_BIND_BIT_EXT | VK_DESCRIPTOR_BINDING_UPDATE_UNUSED_WHILE_PENDING_BIT_EXT
+	};
+
+	VkDescriptorSetLayoutBindingFlagsCreateInfoEXT bindingFlagsCreateInfo = {};
+	bindingFlagsCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_BINDING_FLAGS_CREATE_INFO_EXT;
+	bindingFlagsCreateInfo.bindingCount = 2;
+	bindingFlagsCreateInfo.pBindingFlags = bindingFlags;
+
+	VkDescriptorSetLayoutCreateInfo descriptorSetLayoutCreateInfo = {};
+	descriptorSetLayoutCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_LAYOUT_CREATE_INFO;
+	descriptorSetLayoutCreateInfo.pNext = &bindingFlagsCreateInfo;
+	descriptorSetLayoutCreateInfo.flags = VK_DESCRIPTOR_SET_LAYOUT_CREATE_UPDATE_AFTER_BIND_POOL_BIT_EXT;
+	descriptorSetLayoutCreateInfo.bindingCount = 2;
+	descriptorSetLayoutCreateInfo.pBindings = bindings;
+
+	result = vkCreateDescriptorSetLayout(mDevice->mDevice, &descriptorSetLayoutCreateInfo, nullptr, &mBindlessDescriptorSetLayout);
+	if (result != VK_SUCCESS)
+	{
+		BOOST_LOG_TRIVIAL(fatal) << "BufferManager::CreateBindlessTable vkCreateDescriptorSetLayout failed with return code of " << result;
+		mUseFixedFunctionBindlessTextures = false;
+		return;
+	}
+
+	VkDescriptorPoolSize descriptorPoolSizes[2] = {};
+	descriptorPoolSizes[0].type = VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE;
+	descriptorPoolSizes[0].descriptorCount = MAX_BINDLESS_TEXTURES;
+	descriptorPoolSizes[1].type = VK_DESCRIPTOR_TYPE_SAMPLER;
+	descriptorPoolSizes[1].descriptorCount = MAX_BINDLESS_SAMPLERS;
+
+	VkDescriptorPoolCreateInfo descriptorPoolCreateInfo = {};
+	descriptorPoolCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+	descriptorPoolCreateInfo.pNext = NULL;
+	descriptorPoolCreateInfo.flags = VK_DESCRIPTOR_POOL_CREATE_UPDATE_AFTER_BIND_BIT_EXT;
+	descriptorPoolCreateInfo.maxSets = 1;
+	descriptorPoolCreateInfo.poolSizeCount = 2;
+	descriptorPoolCreateInfo.pPoolSizes = descriptorPoolSizes;
+
+	result = vkCreateDescriptorPool(mDevice->mDevice, &descriptorPoolCreateInfo, nullptr, &mBindlessDescriptorPool);
+	if (result != VK_SUCCESS)
+	{
+		BOOST_LOG_TRIVIAL(fatal) << "BufferManager::CreateBindlessTable vkCreateDescriptorPool failed with return code of " << result;
+		mUseFixedFunctionBindlessTextures = false;
+		return;
+	}
+
+	VkDescriptorSetAllocateInfo descriptorSetAllocateInfo = {};
+	descriptorSetAllocateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_SET_ALLOCATE_INFO;
+	descriptorSetAllocateInfo.pNext = NULL;
+	descriptorSetAllocateInfo.descriptorPool = mBindlessDescriptorPool;
+	descriptorSetAllocateInfo.descriptorSetCount = 1;
+	descriptorSetAllocateInfo.pSetLayouts = &mBindlessDescriptorSetLayout;
+
+	result = vkAllocateDescriptorSets(mDevice->mDevice, &descriptorSetAllocateInfo, &mBindlessDescriptorSet);
+	if (result != VK_SUCCESS)
+	{
+		BOOST_LOG_TRIVIAL(fatal) << "BufferManager::CreateBindlessTable vkAllocateDescriptorSets failed with return code of " << result;
+		mUseFixedFunctionBindlessTextures = false;
+		return;
+	}
+
+	BOOST_LOG_TRIVIAL(info) << "BufferManager::CreateBindlessTable created a table with " << MAX_BINDLESS_TEXTURES << " textures and " << MAX_BINDLESS_SAMPLERS << " samplers.";
+}
+
+void BufferManager::UpdateTextureSlot(uint32_t slot, VkImageView imageView)
+{
+	VkDescriptorImageInfo imageInfo = {};
+	imageInfo.sampler = VK_NULL_HANDLE;
+	imageInfo.imageView = imageView;
+	imageInfo.imageLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+
+	VkWriteDescriptorSet writeDescriptorSet = {};
+	writeDescriptorSet.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+	writeDescriptorSet.dstSet = mBindlessDescriptorSet;
+	writeDescriptorSet.dstBinding = 0;
+	writeDescriptorSet.dstArrayElement = slot;
+	writeDescriptorSet.descriptorType = VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE;
+	writeDescriptorSet.descriptorCount = 1;
+	writeDescriptorSet.pImageInfo = &imageInfo;
+
+	vkUpdateDescriptorSets(mDevice->mDevice, 1, &writeDescriptorSet, 0, nullptr);
+}
+
+void BufferManager::UpdateSamplerSlot(uint32_t slot, VkSampler sampler)
+{
+	VkDescriptorImageInfo imageInfo = {};
+	imageInfo.sampler = sampler;
+	imageInfo.imageView = VK_NULL_HANDLE;
+	imageInfo.imageLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+
+	VkWriteDescriptorSet writeDescriptorSet = {};
+	writeDescriptorSet.sType = VK_STRUCTURE_TYPE_WRITE_DESCRIPTOR_SET;
+	writeDescriptorSet.dstSet = mBindlessDescriptorSet;
+	writeDescriptorSet.dstBinding = 1;
+	writeDescriptorSet.dstArrayElement = slot;
+	writeDescriptorSet.descriptorType = VK_DESCRIPTOR_TYPE_SAMPLER;
+	writeDescriptorSet.descriptorCount = 1;
+	writeDescriptorSet.pImageInfo = &imageInfo;
+
+	vkUpdateDescriptorSets(mDevice->mDevice, 1, &writeDescriptorSet, 0, nullptr);
+}
+
+uint32_t BufferManager::AcquireTextureSlot(VkImageView imageView)
+{
+	uint32_t slot = 0;
+
+	if (mFreeTextureSlots.size())
+	{
+		slot = mFreeTextureSlots.back();
+		mFreeTextureSlots.pop_back();
+	}
+	else if (mNextTextureSlot < MAX_BINDLESS_TEXTURES)
+	{
+		slot = mNextTextureSlot++;
+	}
+	else
+	{
+		BOOST_LOG_TRIVIAL(warning) << "BufferManager::AcquireTextureSlot the bindless table is full so the default texture is used.";
+		return 0;
+	}
+
+	UpdateTextureSlot(slot, imageView);
+
+	return slot;
+}
+
+void BufferManager::ReleaseTextureSlot(uint32_t slot)
+{
+	//The frames in flight may still read the slot so it isn't handed out again until this frame has retired.
+	mRetiredTextureSlots[mFrameIndex % mRetiredTextureSlots.size()].push_back(slot);
+}
+
+uint32_t BufferManager::AcquireSamplerSlot(VkSampler sampler)
+{
+	uint32_t slot = 0;
+
+	if (mFreeSamplerSlots.size())
+	{
+		slot = mFreeSamplerSlots.back();
+		mFreeSamplerSlots.pop_back();
+	}
+	else if (mNextSamplerSlot < MAX_BINDLESS_SAMPLERS)
+	{
+		slot = mNextSamplerSlot++;
+	}
+	else
+	{
+		BOOST_LOG_TRIVIAL(warning) << "BufferManager::AcquireSamplerSlot the bindless table is full so the default sampler is used.";
+		return 0;
+	}
+
+	UpdateSamplerSlot(slot, sampler);
+
+	return slot;
+}
+
+void BufferManager::CreateSampler(std::shared_ptr<SamplerRequest> request)
+{
+	//https://msdn.microsoft.com/en-us/library/windows/desktop/bb172602(v=vs.85).aspx
+	//Mipmap filter to use during minification. See D3DTEXTUREFILTERTYPE. The default value is D3DTEXF_NONE.
+
+	VkSamplerCreateInfo samplerCreateInfo = {};
+	samplerCreateInfo.sType = VK_STRUCTURE_TYPE_SAMPLER_CREATE_INFO;
+	samplerCreateInfo.pNext = NULL;
+
+	samplerCreateInfo.magFilter = ConvertFilter(request->MagFilter);
 	samplerCreateInfo.minFilter = ConvertFilter(request->MinFilter);
 	samplerCreateInfo.addressModeU = ConvertTextureAddress(request->AddressModeU);
 	samplerCreateInfo.addressModeV = ConvertTextureAddress(request->AddressModeV);
@@ -1679,249 +2842,1712 @@ void BufferManager::CreateSampler(std::shared_ptr<SamplerRequest> request)
 	samplerCreateInfo.mipmapMode = ConvertMipmapMode(request->MipmapMode); //VK_SAMPLER_MIPMAP_MODE_NEAREST;
 	samplerCreateInfo.mipLodBias = request->MipLodBias;
 
-	if (mDevice->mDeviceFeatures.samplerAnisotropy)
+	if (mDevice->mDeviceFeatures.samplerAnisotropy)
+	{
+		// Use max. level of anisotropy for this example
+		samplerCreateInfo.maxAnisotropy = min(request->MaxAnisotropy, mDevice->mDeviceProperties.limits.maxSamplerAnisotropy);
+		
+		if (request->MinFilter == D3DTEXF_ANISOTROPIC ||
+			request->MagFilter == D3DTEXF_ANISOTROPIC ||
+			request->MipmapMode == D3DTEXF_ANISOTROPIC)
+		{
+			samplerCreateInfo.anisotropyEnable = VK_TRUE;
+		}
+		else {
+			samplerCreateInfo.anisotropyEnable = VK_FALSE;
+		}
+	}
+	else
+	{
+		// The device does not support anisotropic filtering
+		samplerCreateInfo.maxAnisotropy = 1.0;
+		samplerCreateInfo.anisotropyEnable = VK_FALSE;
+	}
+
+	samplerCreateInfo.borderColor = VK_BORDER_COLOR_FLOAT_OPAQUE_WHITE; // VK_BORDER_COLOR_INT_OPAQUE_BLACK;
+	samplerCreateInfo.unnormalizedCoordinates = VK_FALSE;
+	samplerCreateInfo.compareOp = VK_COMPARE_OP_NEVER; //VK_COMPARE_OP_ALWAYS
+	samplerCreateInfo.minLod = 0.0f;
+	samplerCreateInfo.maxLod = request->MaxLod;
+
+	if (request->MipmapMode == D3DTEXF_NONE)
+	{
+		samplerCreateInfo.maxLod = 0.0f;
+	}
+
+	mResult = vkCreateSampler(mDevice->mDevice, &samplerCreateInfo, NULL, &request->Sampler);
+	if (mResult != VK_SUCCESS)
+	{
+		BOOST_LOG_TRIVIAL(fatal) << "BufferManager::CreateSampler vkCreateSampler failed with return code of " << mResult;
+		return;
+	}
+
+	if (mUseFixedFunctionBindlessTextures)
+	{
+		request->Slot = AcquireSamplerSlot(request->Sampler);
+	}
+
+	mSamplers[request->Key] = request;
+}
+
+void BufferManager::UpdateStageSampler(DWORD stage, CTexture9* texture)
+{
+	auto& samplerStates = mDevice->mDeviceState.mSamplerStates[stage];
+
+	//Built on the stack so a cache hit doesn't allocate.
+	SamplerRequest request(nullptr);
+
+	request.MagFilter = (D3DTEXTUREFILTERTYPE)samplerStates[D3DSAMP_MAGFILTER];
+	request.MinFilter = (D3DTEXTUREFILTERTYPE)samplerStates[D3DSAMP_MINFILTER];
+	request.AddressModeU = (D3DTEXTUREADDRESS)samplerStates[D3DSAMP_ADDRESSU];
+	request.AddressModeV = (D3DTEXTUREADDRESS)samplerStates[D3DSAMP_ADDRESSV];
+	request.AddressModeW = (D3DTEXTUREADDRESS)samplerStates[D3DSAMP_ADDRESSW];
+	request.MaxAnisotropy = samplerStates[D3DSAMP_MAXANISOTROPY];
+	request.MipmapMode = (D3DTEXTUREFILTERTYPE)samplerStates[D3DSAMP_MIPFILTER];
+	request.MipLodBias = *(float*)&samplerStates[D3DSAMP_MIPMAPLODBIAS];
+	request.MaxLod = texture->mLevels;
+	request.UpdateKey();
+
+	//Draws earlier in this frame may have used the sampler this stage is giving up.
+	if (mStageSamplers[stage] != nullptr)
+	{
+		mStageSamplers[stage]->LastUsedFrame = mFrameIndex;
+	}
+
+	auto sampler = mSamplers.find(request.Key);
+	if (sampler != mSamplers.end())
+	{
+		mStageSamplers[stage] = sampler->second;
+		mDevice->mStatistics.SamplerCacheHits++;
+	}
+	else
+	{
+		std::shared_ptr<SamplerRequest> newRequest = std::make_shared<SamplerRequest>(request);
+		newRequest->mDevice = mDevice;
+		CreateSampler(newRequest);
+		mStageSamplers[stage] = newRequest;
+		mDevice->mStatistics.SamplerCacheMisses++;
+	}
+
+	mStageSamplers[stage]->LastUsedFrame = mFrameIndex;
+	mStageSamplerGenerations[stage] = mDevice->mDeviceState.mGenerations.Sampler[stage];
+}
+
+void BufferManager::UpdateFixedFunctionBuffers()
+{
+	DeviceState& state = mDevice->mDeviceState;
+
+	//The dirty lights are set by enable light, set light and applied state blocks.
+	mDirtyLights |= state.mDirtyLights & ((1u << MAX_LIGHTS) - 1);
+	state.mDirtyLights = 0;
+
+	if (state.mIsMaterialDirty)
+	{
+		mDirtyFixedFunctionBlocks |= (1 << FIXED_FUNCTION_MATERIAL);
+		state.mIsMaterialDirty = false;
+	}
+
+	//The dirty flag for render state is set by the render states that aren't part of the pipeline.
+	if (state.mIsRenderStateDirty)
+	{
+		const SpecializationConstants& constants = state.mSpecializationConstants;
+
+		mRenderState.textureFactor = constants.textureFactor;
+		mRenderState.globalAmbient = constants.ambient;
+		mRenderState.pointSize = state.hasPointSize ? *(float*)&constants.pointSize : 1.0f; //The constant default isn't a float.
+
+		mDirtyFixedFunctionBlocks |= (1 << FIXED_FUNCTION_RENDER_STATE);
+		state.mIsRenderStateDirty = false;
+	}
+
+	FrameConstantRing& ring = mConstantRings[mFrameIndex % mConstantRings.size()];
+
+	//Same as the shader constants, offsets into another buffer have to be written again.
+	if (ring.Buffer != mFixedFunctionBuffer || ring.Buffer == VK_NULL_HANDLE)
+	{
+		mDirtyFixedFunctionBlocks = (1 << FIXED_FUNCTION_BLOCK_COUNT) - 1;
+	}
+
+	/**********************************************
+	* Until a lit draw has read the current light slot the lights that changed are written into it in place.
+	* After that the draw still reads the slot so the change takes a fresh slot with every light like the other blocks.
+	**********************************************/
+	if (mDirtyLights && !(mDirtyFixedFunctionBlocks & (1 << FIXED_FUNCTION_LIGHTS)))
+	{
+		if (mIsLightSlotRead)
+		{
+			mDirtyFixedFunctionBlocks |= (1 << FIXED_FUNCTION_LIGHTS);
+		}
+		else
+		{
+			Light* lights = (Light*)(ring.Data + mFixedFunctionOffsets[FIXED_FUNCTION_LIGHTS]);
+			for (uint32_t i = 0; i < MAX_LIGHTS; i++)
+			{
+				if (!(mDirtyLights & (1 << i)))
+				{
+					continue;
+				}
+
+				if (i < state.mLights.size())
+				{
+					lights[i] = state.mLights[i];
+				}
+				else
+				{
+					lights[i] = {};
+				}
+				mDevice->mStatistics.FixedFunctionUploadBytes += sizeof(Light);
+			}
+			mDirtyLights = 0;
+		}
+	}
+
+	if (!mDirtyFixedFunctionBlocks)
+	{
+		return;
+	}
+
+	const VkDeviceSize alignment = max(mDevice->mDeviceProperties.limits.minUniformBufferOffsetAlignment, (VkDeviceSize)1);
+	VkDeviceSize required = 0;
+	for (uint32_t i = 0; i < FIXED_FUNCTION_BLOCK_COUNT; i++)
+	{
+		if (mDirtyFixedFunctionBlocks & (1 << i))
+		{
+			required += (mDescriptorBufferInfo[i].range + alignment - 1) & ~(alignment - 1);
+		}
+	}
+
+	if (ring.Buffer == VK_NULL_HANDLE || ring.Offset + required > ring.Size)
+	{
+		GrowConstantRing(ring, max(ring.Size * 2, mConstantRingSize));
+		if (ring.Data == nullptr)
+		{
+			return;
+		}
+		mDirtyFixedFunctionBlocks = (1 << FIXED_FUNCTION_BLOCK_COUNT) - 1;
+	}
+	mFixedFunctionBuffer = ring.Buffer;
+
+	/**********************************************
+	* Each changed buffer gets a fresh slot because draws earlier in the frame still read the old one. The lights past the ones set are zeroed so they read as disabled.
+	**********************************************/
+	for (uint32_t i = 0; i < FIXED_FUNCTION_BLOCK_COUNT; i++)
+	{
+		if (!(mDirtyFixedFunctionBlocks & (1 << i)))
+		{
+			continue;
+		}
+
+		char* destination = ring.Data + ring.Offset;
+		const size_t size = (size_t)mDescriptorBufferInfo[i].range;
+
+		switch (i)
+		{
+		case FIXED_FUNCTION_LIGHTS:
+		{
+			const size_t lightCount = min(state.mLights.size(), (size_t)MAX_LIGHTS);
+			if (lightCount)
+			{
+				memcpy(destination, state.mLights.data(), sizeof(Light) * lightCount);
+			}
+			memset(destination + sizeof(Light) * lightCount, 0, size - sizeof(Light) * lightCount);
+			mDirtyLights = 0;
+			mIsLightSlotRead = false;
+			break;
+		}
+		case FIXED_FUNCTION_MATERIAL:
+			memcpy(destination, &state.mMaterial, size);
+			break;
+		case FIXED_FUNCTION_RENDER_STATE:
+			memcpy(destination, &mRenderState, size);
+			break;
+		case FIXED_FUNCTION_SPECIALIZATION:
+			memcpy(destination, &mSpecializationBufferContents, size);
+			break;
+		default:
+			break;
+		}
+
+		mFixedFunctionOffsets[i] = (uint32_t)ring.Offset;
+		ring.Offset += (size + alignment - 1) & ~(alignment - 1);
+		mDevice->mStatistics.FixedFunctionUploadBytes += size;
+	}
+
+	//Pushed descriptors take the offset in the descriptor. Sets keep offset zero and take it at bind time.
+	for (uint32_t i = 0; i < FIXED_FUNCTION_BLOCK_COUNT; i++)
+	{
+		mDescriptorBufferInfo[i].buffer = mFixedFunctionBuffer;
+		mDescriptorBufferInfo[i].offset = (mFixedFunctionBufferType == VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER) ? mFixedFunctionOffsets[i] : 0;
+	}
+
+	mDirtyFixedFunctionBlocks = 0;
+	mDevice->mStatistics.FixedFunctionUploads++;
+}
+
+void BufferManager::LoadPipelineCache(std::vector<char>& data)
+{
+	PipelineCacheHeader header;
+	const VkPhysicalDeviceProperties& properties = mDevice->mDeviceProperties;
+
+	if (!mPipelineCacheFile.size())
+	{
+		return;
+	}
+
+	std::ifstream file(mPipelineCacheFile, std::ios::in | std::ios::binary | std::ios::ate);
+	if (!file.is_open())
+	{
+		BOOST_LOG_TRIVIAL(info) << "BufferManager::LoadPipelineCache no pipeline cache found at " << mPipelineCacheFile;
+		return;
+	}
+
+	const std::streamoff fileSize = file.tellg();
+	file.seekg(0, std::ios::beg);
+
+	if (fileSize < (std::streamoff)sizeof(PipelineCacheHeader) || !file.read((char*)&header, sizeof(PipelineCacheHeader)))
+	{
+		BOOST_LOG_TRIVIAL(warning) << "BufferManager::LoadPipelineCache " << mPipelineCacheFile << " is truncated.";
+		return;
+	}
+
+	if (header.Magic != PIPELINE_CACHE_MAGIC || header.Version != PIPELINE_CACHE_VERSION)
+	{
+		BOOST_LOG_TRIVIAL(warning) << "BufferManager::LoadPipelineCache " << mPipelineCacheFile << " is not a version " << PIPELINE_CACHE_VERSION << " pipeline cache.";
+		return;
+	}
+
+	if (header.VendorID != properties.vendorID
+		|| header.DeviceID != properties.deviceID
+		|| header.DriverVersion != properties.driverVersion
+		|| memcmp(header.PipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE) != 0)
+	{
+		BOOST_LOG_TRIVIAL(info) << "BufferManager::LoadPipelineCache " << mPipelineCacheFile << " was created by a different device or driver.";
+		return;
+	}
+
+	//Check against the real file size before allocating so a corrupt size field can't ask for gigabytes.
+	if (header.DataSize == 0 || header.DataSize != (uint64_t)(fileSize - (std::streamoff)sizeof(PipelineCacheHeader)))
+	{
+		BOOST_LOG_TRIVIAL(warning) << "BufferManager::LoadPipelineCache " << mPipelineCacheFile << " is truncated.";
+		return;
+	}
+
+	data.resize((size_t)header.DataSize);
+
+	if (!file.read(data.data(), data.size()))
+	{
+		BOOST_LOG_TRIVIAL(warning) << "BufferManager::LoadPipelineCache " << mPipelineCacheFile << " could not be read.";
+		data.clear();
+		return;
+	}
+
+	if ((uint64_t)boost::hash_range(data.begin(), data.end()) != header.Checksum)
+	{
+		BOOST_LOG_TRIVIAL(warning) << "BufferManager::LoadPipelineCache " << mPipelineCacheFile << " is corrupt.";
+		data.clear();
+		return;
+	}
+
+	BOOST_LOG_TRIVIAL(info) << "BufferManager::LoadPipelineCache loaded " << data.size() << " bytes from " << mPipelineCacheFile;
+}
+
+void BufferManager::SavePipelineCache()
+{
+	VkResult result = VK_SUCCESS;
+	PipelineCacheHeader header;
+	const VkPhysicalDeviceProperties& properties = mDevice->mDeviceProperties;
+	size_t dataSize = 0;
+
+	if (!mPipelineCacheFile.size())
+	{
+		return;
+	}
+
+	result = vkGetPipelineCacheData(mDevice->mDevice, mPipelineCache, &dataSize, nullptr);
+	if (result != VK_SUCCESS || dataSize == 0)
+	{
+		BOOST_LOG_TRIVIAL(warning) << "BufferManager::SavePipelineCache vkGetPipelineCacheData failed with return code of " << result;
+		return;
+	}
+
+	std::vector<char> data(dataSize);
+
+	result = vkGetPipelineCacheData(mDevice->mDevice, mPipelineCache, &dataSize, data.data());
+	if (result != VK_SUCCESS)
+	{
+		BOOST_LOG_TRIVIAL(warning) << "BufferManager::SavePipelineCache vkGetPipelineCacheData failed with return code of " << result;
+		return;
+	}
+
+	data.resize(dataSize);
+
+	header.VendorID = properties.vendorID;
+	header.DeviceID = properties.deviceID;
+	header.DriverVersion = properties.driverVersion;
+	memcpy(header.PipelineCacheUUID, properties.pipelineCacheUUID, VK_UUID_SIZE);
+	header.DataSize = data.size();
+	header.Checksum = boost::hash_range(data.begin(), data.end());
+
+	/*
+	Write to a temporary file and swap it in so a crash or a second instance never leaves a half written cache behind.
+	*/
+	std::string temporaryFile = mPipelineCacheFile + ".tmp";
+
+	std::ofstream file(temporaryFile, std::ios::out | std::ios::binary | std::ios::trunc);
+	if (!file.is_open())
+	{
+		BOOST_LOG_TRIVIAL(warning) << "BufferManager::SavePipelineCache unable to open " << temporaryFile;
+		return;
+	}
+
+	file.write((char*)&header, sizeof(PipelineCacheHeader));
+	file.write(data.data(), data.size());
+	file.close();
+
+	if (file.fail())
+	{
+		BOOST_LOG_TRIVIAL(warning) << "BufferManager::SavePipelineCache unable to write " << temporaryFile;
+		DeleteFileA(temporaryFile.c_str());
+		return;
+	}
+
+	if (!MoveFileExA(temporaryFile.c_str(), mPipelineCacheFile.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+	{
+		BOOST_LOG_TRIVIAL(warning) << "BufferManager::SavePipelineCache MoveFileEx failed with error code of " << GetLastError();
+		DeleteFileA(temporaryFile.c_str());
+		return;
+	}
+
+	BOOST_LOG_TRIVIAL(info) << "BufferManager::SavePipelineCache saved " << data.size() << " bytes to " << mPipelineCacheFile;
+}
+
+void BufferManager::LoadPipelineManifest(std::vector<PipelineManifestEntry>& entries)
+{
+	PipelineManifestHeader header;
+
+	if (!mPipelineManifestFile.size())
+	{
+		return;
+	}
+
+	std::ifstream file(mPipelineManifestFile, std::ios::in | std::ios::binary | std::ios::ate);
+	if (!file.is_open())
+	{
+		BOOST_LOG_TRIVIAL(info) << "BufferManager::LoadPipelineManifest no pipeline manifest found at " << mPipelineManifestFile;
+		return;
+	}
+
+	const std::streamoff fileSize = file.tellg();
+	file.seekg(0, std::ios::beg);
+
+	if (fileSize < (std::streamoff)sizeof(PipelineManifestHeader) || !file.read((char*)&header, sizeof(PipelineManifestHeader)))
+	{
+		BOOST_LOG_TRIVIAL(warning) << "BufferManager::LoadPipelineManifest " << mPipelineManifestFile << " is truncated.";
+		return;
+	}
+
+	//The entry size catches a SpecializationConstants layout change that wasn't followed by a version bump.
+	if (header.Magic != PIPELINE_MANIFEST_MAGIC || header.Version != PIPELINE_MANIFEST_VERSION || header.EntrySize != sizeof(PipelineManifestEntry))
+	{
+		BOOST_LOG_TRIVIAL(warning) << "BufferManager::LoadPipelineManifest " << mPipelineManifestFile << " is not a version " << PIPELINE_MANIFEST_VERSION << " pipeline manifest.";
+		return;
+	}
+
+	//Pipelines are created against the store render pass so they are only usable with the same attachment formats.
+	if (header.ColorFormat != mDevice->mFormat || header.DepthFormat != mDevice->mDepthFormat)
+	{
+		BOOST_LOG_TRIVIAL(info) << "BufferManager::LoadPipelineManifest " << mPipelineManifestFile << " was created for different render target formats.";
+		return;
+	}
+
+	if (header.EntryCount > PIPELINE_MANIFEST_MAX_ENTRIES || (uint64_t)header.EntryCount * sizeof(PipelineManifestEntry) != (uint64_t)(fileSize - (std::streamoff)sizeof(PipelineManifestHeader)))
+	{
+		BOOST_LOG_TRIVIAL(warning) << "BufferManager::LoadPipelineManifest " << mPipelineManifestFile << " is truncated.";
+		return;
+	}
+
+	entries.resize(header.EntryCount);
+
+	if (header.EntryCount && !file.read((char*)entries.data(), entries.size() * sizeof(PipelineManifestEntry)))
+	{
+		BOOST_LOG_TRIVIAL(warning) << "BufferManager::LoadPipelineManifest " << mPipelineManifestFile << " could not be read.";
+		entries.clear();
+		return;
+	}
+
+	const char* data = (const char*)entries.data();
+	if ((uint64_t)boost::hash_range(data, data + entries.size() * sizeof(PipelineManifestEntry)) != header.Checksum)
+	{
+		BOOST_LOG_TRIVIAL(warning) << "BufferManager::LoadPipelineManifest " << mPipelineManifestFile << " is corrupt.";
+		entries.clear();
+		return;
+	}
+
+	BOOST_LOG_TRIVIAL(info) << "BufferManager::LoadPipelineManifest loaded " << entries.size() << " entries from " << mPipelineManifestFile;
+}
+
+void BufferManager::SavePipelineManifest()
+{
+	PipelineManifestHeader header;
+
+	if (!mPipelineManifestFile.size() || !mPipelineManifest.size())
+	{
+		return;
+	}
+
+	const char* data = (const char*)mPipelineManifest.data();
+	const size_t dataSize = mPipelineManifest.size() * sizeof(PipelineManifestEntry);
+
+	header.EntrySize = sizeof(PipelineManifestEntry);
+	header.EntryCount = mPipelineManifest.size();
+	header.ColorFormat = mDevice->mFormat;
+	header.DepthFormat = mDevice->mDepthFormat;
+	header.Checksum = boost::hash_range(data, data + dataSize);
+
+	std::string temporaryFile = mPipelineManifestFile + ".tmp";
+
+	std::ofstream file(temporaryFile, std::ios::out | std::ios::binary | std::ios::trunc);
+	if (!file.is_open())
+	{
+		BOOST_LOG_TRIVIAL(warning) << "BufferManager::SavePipelineManifest unable to open " << temporaryFile;
+		return;
+	}
+
+	file.write((char*)&header, sizeof(PipelineManifestHeader));
+	file.write(data, dataSize);
+	file.close();
+
+	if (file.fail())
+	{
+		BOOST_LOG_TRIVIAL(warning) << "BufferManager::SavePipelineManifest unable to write " << temporaryFile;
+		DeleteFileA(temporaryFile.c_str());
+		return;
+	}
+
+	if (!MoveFileExA(temporaryFile.c_str(), mPipelineManifestFile.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH))
+	{
+		BOOST_LOG_TRIVIAL(warning) << "BufferManager::SavePipelineManifest MoveFileEx failed with error code of " << GetLastError();
+		DeleteFileA(temporaryFile.c_str());
+		return;
+	}
+
+	BOOST_LOG_TRIVIAL(info) << "BufferManager::SavePipelineManifest saved " << mPipelineManifest.size() << " entries to " << mPipelineManifestFile;
+}
+
+void BufferManager::RecordPipeline(std::shared_ptr<DrawContext> context)
+{
+	if (!mPipelineManifestFile.size() || !context->FVF || context->VertexDeclaration != nullptr || context->VertexShader != nullptr || context->PixelShader != nullptr)
+	{
+		return;
+	}
+
+	if (mPipelineManifest.size() >= PIPELINE_MANIFEST_MAX_ENTRIES || context->StreamCount > 16)
+	{
+		return;
+	}
+
+	//A hash collision only costs one prewarm on the next run.
+	if (!mPipelineManifestKeys.insert(context->Hash).second)
+	{
+		return;
+	}
+
+	PipelineManifestEntry entry;
+
+	entry.PrimitiveType = context->PrimitiveType;
+	entry.FVF = context->FVF;
+	entry.IsGeneric = context->IsGeneric;
+	entry.StreamCount = context->StreamCount;
+	entry.mSpecializationConstants = context->mSpecializationConstants;
+
+	for (int32_t i = 0; i < context->StreamCount; i++)
+	{
+		entry.Bindings[entry.BindingCount][0] = context->Bindings[i][0];
+		entry.Bindings[entry.BindingCount][1] = context->Bindings[i][1];
+		entry.BindingCount++;
+	}
+
+	mPipelineManifest.push_back(entry);
+}
+
+void BufferManager::PrewarmPipelines()
+{
+	std::vector<PipelineManifestEntry> entries;
+	uint32_t skipped = 0;
+
+	LoadPipelineManifest(entries);
+
+	BOOST_FOREACH(const PipelineManifestEntry& entry, entries)
+	{
+		if (entry.PrimitiveType < D3DPT_POINTLIST || entry.PrimitiveType > D3DPT_TRIANGLEFAN
+			|| !entry.FVF
+			|| entry.IsGeneric > 1
+			|| entry.StreamCount < 0 || entry.StreamCount > 16
+			|| entry.BindingCount != (uint32_t)entry.StreamCount)
+		{
+			skipped++;
+			continue;
+		}
+
+		std::shared_ptr<DrawContext> context = std::make_shared<DrawContext>(mDevice);
+
+		context->PrimitiveType = (D3DPRIMITIVETYPE)entry.PrimitiveType;
+		context->FVF = entry.FVF;
+		context->IsGeneric = entry.IsGeneric;
+		context->StreamCount = entry.StreamCount;
+		context->mSpecializationConstants = entry.mSpecializationConstants;
+		context->IsPrewarmed = true;
+
+		//CreatePipe reads the binding descriptions BeginDraw would have filled in.
+		for (uint32_t i = 0; i < entry.BindingCount; i++)
+		{
+			mVertexInputBindingDescription[i].binding = entry.Bindings[i][0];
+			mVertexInputBindingDescription[i].stride = entry.Bindings[i][1];
+			mVertexInputBindingDescription[i].inputRate = VK_VERTEX_INPUT_RATE_VERTEX;
+
+			context->Bindings[i][0] = entry.Bindings[i][0];
+			context->Bindings[i][1] = entry.Bindings[i][1];
+		}
+
+		context->UpdateHash();
+
+		if (mDrawBuffer.find(context) != mDrawBuffer.end())
+		{
+			context->mDevice = nullptr; //Not owner.
+			continue;
+		}
+
+		if (!CreatePipe(context))
+		{
+			skipped++;
+		}
+	}
+
+	if (entries.size())
+	{
+		BOOST_LOG_TRIVIAL(info) << "BufferManager::PrewarmPipelines queued " << (entries.size() - skipped) << " pipelines and skipped " << skipped << " stale entries.";
+	}
+}
+
+void BufferManager::UpdatePushConstants(const std::shared_ptr<DrawContext>& context)
+{
+	const StateGenerations& generations = mDevice->mDeviceState.mGenerations;
+	const BOOL isWorldDirty = !mAreTransformationsValid || generations.World != mWorldGeneration;
+	const BOOL isViewProjectionDirty = !mAreTransformationsValid || generations.ViewProjection != mViewProjectionGeneration;
+
+	/**********************************************
+	* Only rebuild the products whose transforms changed since the last fixed function draw.
+	* D3DMATRIX is row major with row vectors so its memory is already the column major transpose Eigen wants.
+	* The fixed size products are vectorized by Eigen so there is no need for hand written intrinsics here.
+	**********************************************/
+	if (isViewProjectionDirty)
+	{
+		auto view = mDevice->mDeviceState.mTransforms.find(D3DTS_VIEW);
+		if (view != mDevice->mDeviceState.mTransforms.end())
+		{
+			mTransformations.mView = Eigen::Map<const Eigen::Matrix4f>(&view->second.m[0][0]);
+		}
+		else
+		{
+			mTransformations.mView.setIdentity();
+		}
+
+		auto projection = mDevice->mDeviceState.mTransforms.find(D3DTS_PROJECTION);
+		if (projection != mDevice->mDeviceState.mTransforms.end())
+		{
+			mTransformations.mProjection = Eigen::Map<const Eigen::Matrix4f>(&projection->second.m[0][0]);
+		}
+		else
+		{
+			mTransformations.mProjection.setIdentity();
+		}
+
+		mTransformations.mViewProjection.noalias() = mTransformations.mProjection * mTransformations.mView;
+		mViewProjectionGeneration = generations.ViewProjection;
+		mDevice->mStatistics.ViewProjectionUpdates++;
+	}
+
+	if (isWorldDirty)
+	{
+		auto world = mDevice->mDeviceState.mTransforms.find(D3DTS_WORLD);
+		if (world != mDevice->mDeviceState.mTransforms.end())
+		{
+			mTransformations.mModel = Eigen::Map<const Eigen::Matrix4f>(&world->second.m[0][0]);
+		}
+		else
+		{
+			mTransformations.mModel.setIdentity();
+		}
+
+		mWorldGeneration = generations.World;
+		mDevice->mStatistics.WorldUpdates++;
+	}
+
+	if (isWorldDirty || isViewProjectionDirty)
+	{
+		mTransformations.mTotalTransformation.noalias() = mTransformations.mViewProjection * mTransformations.mModel;
+		mAreTransformationsValid = true;
+	}
+
+	//Only the words that differ from what the command buffer already has are pushed so a new world matrix with a static camera never resends more than the two matrices.
+	mCommandBufferState.PushConstantData(context->PipelineLayout, &mTransformations, UBO_SIZE * 2);
+	mDevice->mStatistics.TransformationPushes++;
+}
+
+static const size_t ShaderConstantBlockOffsets[SHADER_CONSTANT_BLOCK_COUNT] =
+{
+	offsetof(ShaderConstants, VertexFloats),
+	offsetof(ShaderConstants, VertexIntegers),
+	offsetof(ShaderConstants, PixelFloats),
+	offsetof(ShaderConstants, PixelIntegers)
+};
+
+void BufferManager::SetShaderConstants(ShaderConstantBlock block, size_t offset, const void* data, size_t size)
+{
+	char* destination = (char*)&mShaderConstants + ShaderConstantBlockOffsets[block] + offset;
+
+	//Registers past what was last uploaded have to go up even if they match the shadow.
+	if (offset + size > mConstantSizes[block])
+	{
+		mConstantSizes[block] = (uint32_t)(offset + size);
+		mDirtyConstantBlocks |= (1 << block);
+	}
+	else if (memcmp(destination, data, size) == 0)
+	{
+		mDevice->mStatistics.ConstantRedundantSets++;
+		return;
+	}
+
+	memcpy(destination, data, size);
+	mDirtyConstantBlocks |= (1 << block);
+}
+
+void BufferManager::UpdateShaderConstants()
+{
+	FrameConstantRing& ring = mConstantRings[mFrameIndex % mConstantRings.size()];
+
+	//Offsets from another frame or an outgrown buffer point into the wrong buffer so every block goes up again.
+	if (ring.Buffer != mConstantBuffer || ring.Buffer == VK_NULL_HANDLE)
+	{
+		mDirtyConstantBlocks = (1 << SHADER_CONSTANT_BLOCK_COUNT) - 1;
+	}
+
+	if (!mDirtyConstantBlocks)
+	{
+		return;
+	}
+
+	const VkDeviceSize alignment = max(mDevice->mDeviceProperties.limits.minUniformBufferOffsetAlignment, (VkDeviceSize)1);
+	VkDeviceSize required = 0;
+	for (uint32_t i = 0; i < SHADER_CONSTANT_BLOCK_COUNT; i++)
+	{
+		if (mDirtyConstantBlocks & (1 << i))
+		{
+			required += (mConstantSizes[i] + alignment - 1) & ~(alignment - 1);
+		}
+	}
+
+	if (ring.Buffer == VK_NULL_HANDLE || ring.Offset + required > ring.Size)
+	{
+		GrowConstantRing(ring, max(ring.Size * 2, mConstantRingSize));
+		if (ring.Data == nullptr)
+		{
+			return;
+		}
+		mDirtyConstantBlocks = (1 << SHADER_CONSTANT_BLOCK_COUNT) - 1;
+	}
+	mConstantBuffer = ring.Buffer;
+
+	/**********************************************
+	* Only the registers up to the highest one set are copied. A block bound at the end of the ring still has its full range inside the buffer.
+	**********************************************/
+	for (uint32_t i = 0; i < SHADER_CONSTANT_BLOCK_COUNT; i++)
+	{
+		if (!(mDirtyConstantBlocks & (1 << i)))
+		{
+			continue;
+		}
+
+		//Nothing set yet so any offset in range will do.
+		if (!mConstantSizes[i])
+		{
+			mConstantOffsets[i] = 0;
+			continue;
+		}
+
+		memcpy(ring.Data + ring.Offset, (char*)&mShaderConstants + ShaderConstantBlockOffsets[i], mConstantSizes[i]);
+		mConstantOffsets[i] = (uint32_t)ring.Offset;
+		ring.Offset += (mConstantSizes[i] + alignment - 1) & ~(alignment - 1);
+		mDevice->mStatistics.ConstantUploadBytes += mConstantSizes[i];
+	}
+
+	mDirtyConstantBlocks = 0;
+	mDevice->mStatistics.ConstantUploads++;
+}
+
+void BufferManager::GrowConstantRing(FrameConstantRing& ring, VkDeviceSize size)
+{
+	VkResult result = VK_SUCCESS;
+
+	//The device may still read the old buffer this frame so it is kept until the ring comes around again.
+	if (ring.Buffer != VK_NULL_HANDLE)
+	{
+		ring.RetiredBuffers.push_back(std::make_pair(ring.Buffer, ring.Memory));
+		mDevice->mStatistics.ConstantRingGrowths++;
+		BOOST_LOG_TRIVIAL(info) << "BufferManager::GrowConstantRing growing shader constant ring to " << size << " bytes.";
+	}
+
+	ring.Buffer = VK_NULL_HANDLE;
+	ring.Memory = VK_NULL_HANDLE;
+	ring.Data = nullptr;
+	ring.Size = 0;
+	ring.Offset = 0;
+
+	//Sets written with the old buffer can't be carried over to the next draw.
+	mConstantBuffer = VK_NULL_HANDLE;
+	mLastDescriptorSet = VK_NULL_HANDLE;
+
+	CreateBuffer(size + sizeof(ShaderConstants), VK_BUFFER_USAGE_UNIFORM_BUFFER_BIT, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, ring.Buffer, ring.Memory);
+	if (ring.Memory == VK_NULL_HANDLE)
+	{
+		BOOST_LOG_TRIVIAL(fatal) << "BufferManager::GrowConstantRing CreateBuffer failed.";
+		return;
+	}
+
+	void* data = nullptr;
+	result = vkMapMemory(mDevice->mDevice, ring.Memory, 0, VK_WHOLE_SIZE, 0, &data);
+	if (result != VK_SUCCESS)
+	{
+		BOOST_LOG_TRIVIAL(fatal) << "BufferManager::GrowConstantRing vkMapMemory failed with return code of " << result;
+		return;
+	}
+
+	ring.Data = (char*)data;
+	ring.Size = size;
+}
+
+void BufferManager::ResetConstantRing()
+{
+	/*
+	Present waits for the fence of the frame this ring belongs to before the draw buffer is flushed so nothing in flight still reads it.
+	*/
+	FrameConstantRing& ring = mConstantRings[mFrameIndex % mConstantRings.size()];
+
+	for (size_t i = 0; i < ring.RetiredBuffers.size(); i++)
+	{
+		vkDestroyBuffer(mDevice->mDevice, ring.RetiredBuffers[i].first, nullptr);
+		vkFreeMemory(mDevice->mDevice, ring.RetiredBuffers[i].second, nullptr);
+	}
+	ring.RetiredBuffers.clear();
+	ring.Offset = 0;
+
+	//The offsets pointed into the last frame's ring.
+	mConstantBuffer = VK_NULL_HANDLE;
+	mFixedFunctionBuffer = VK_NULL_HANDLE;
+}
+
+void BufferManager::FlushDrawBufffer()
+{
+	//Draws only look a stage's sampler up when its state changes so the samplers that stayed bound are stamped with the frame that just ended here.
+	for (size_t i = 0; i < 16; i++)
+	{
+		if (mStageSamplers[i] != nullptr)
+		{
+			mStageSamplers[i]->LastUsedFrame = mFrameIndex;
+		}
+	}
+
+	mFrameIndex++;
+
+	//Eviction below can destroy or recycle what the last draw used.
+	mLastDrawContext.reset();
+	mLastDescriptorSet = VK_NULL_HANDLE;
+
+	if (mDescriptorAllocator == DESCRIPTOR_ALLOCATOR_LINEAR)
+	{
+		mFrameResourceBuffer.clear();
+		ResetFrameDescriptorPools();
+	}
+
+	ResetConstantRing();
+
+	//Textures released while the frame that just retired was recorded can give their bindless slots to new textures now.
+	std::vector<uint32_t>& retiredTextureSlots = mRetiredTextureSlots[mFrameIndex % mRetiredTextureSlots.size()];
+	mFreeTextureSlots.insert(mFreeTextureSlots.end(), retiredTextureSlots.begin(), retiredTextureSlots.end());
+	retiredTextureSlots.clear();
+
+	/*
+	Pipelines are expensive to rebuild so they are only dropped once they haven't been drawn with for mMaximumPipelineAge frames or the cache is over one of its limits.
+	Pending pipelines still belong to a worker thread so they are never evicted. Prewarmed pipelines are kept until a draw uses them.
+	*/
+	if (mMaximumPipelineAge)
+	{
+		for (auto drawBuffer = mDrawBuffer.begin(); drawBuffer != mDrawBuffer.end();)
+		{
+			if (!(*drawBuffer)->IsPending && !(*drawBuffer)->IsPrewarmed && mFrameIndex - (*drawBuffer)->LastUsedFrame > mMaximumPipelineAge)
+			{
+				mPipelineMemory -= (*drawBuffer)->EstimatedSize;
+				mDevice->mStatistics.PipelineCacheEvictions++;
+				drawBuffer = mDrawBuffer.erase(drawBuffer);
+			}
+			else
+			{
+				++drawBuffer;
+			}
+		}
+	}
+
+	if (mDrawBuffer.size() > mMaximumPipelines || mPipelineMemory > mMaximumPipelineMemory)
+	{
+		std::vector< std::shared_ptr<DrawContext> > candidates;
+		candidates.reserve(mDrawBuffer.size());
+
+		BOOST_FOREACH(const std::shared_ptr<DrawContext>& context, mDrawBuffer)
+		{
+			if (!context->IsPending && !context->IsPrewarmed)
+			{
+				candidates.push_back(context);
+			}
+		}
+
+		std::sort(candidates.begin(), candidates.end(), [](const std::shared_ptr<DrawContext>& context1, const std::shared_ptr<DrawContext>& context2) { return context1->LastUsedFrame < context2->LastUsedFrame; });
+
+		for (size_t i = 0; i < candidates.size() && (mDrawBuffer.size() > mMaximumPipelines || mPipelineMemory > mMaximumPipelineMemory); i++)
+		{
+			//The limits are soft. The working set of the frames in flight is never evicted so a scene bigger than the cache doesn't recompile every frame.
+			if (candidates[i]->LastUsedFrame + mDevice->mMaximumFramesInFlight >= mFrameIndex)
+			{
+				break;
+			}
+
+			mPipelineMemory -= candidates[i]->EstimatedSize;
+			mDevice->mStatistics.PipelineCacheEvictions++;
+			mDrawBuffer.erase(candidates[i]);
+		}
+	}
+
+	/**********************************************
+	* Destroy the least recently used samplers once there are more than the limit. Samplers still bound to a stage are kept.
+	**********************************************/
+	if (mSamplers.size() > mMaximumSamplers)
+	{
+		std::vector< std::shared_ptr<SamplerRequest> > candidates;
+
+		BOOST_FOREACH(const auto& pair, mSamplers)
+		{
+			if (pair.second.use_count() == 1)
+			{
+				candidates.push_back(pair.second);
+			}
+		}
+
+		std::sort(candidates.begin(), candidates.end(), [](const std::shared_ptr<SamplerRequest>& a, const std::shared_ptr<SamplerRequest>& b) { return a->LastUsedFrame < b->LastUsedFrame; });
+
+		for (size_t i = 0; i < candidates.size() && mSamplers.size() > mMaximumSamplers; i++)
+		{
+			//Sets written with samplers the frames in flight used may still be read by the device.
+			if (candidates[i]->LastUsedFrame + mDevice->mMaximumFramesInFlight >= mFrameIndex)
+			{
+				break;
+			}
+
+			VkSampler evictedSampler = candidates[i]->Sampler;
+
+			//A descriptor set written with this sampler must not be matched again once the handle is reused by a new sampler.
+			for (auto resourceBuffer = mUsedResourceBuffer.begin(); resourceBuffer != mUsedResourceBuffer.end();)
+			{
+				BOOL usesSampler = false;
+				for (size_t k = 0; k < 16; k++)
+				{
+					if ((*resourceBuffer)->DescriptorImageInfo[k].sampler == evictedSampler)
+					{
+						usesSampler = true;
+						break;
+					}
+				}
+
+				if (usesSampler)
+				{
+					mUnusedResourceBuffer[(*resourceBuffer)->DescriptorSetLayout].push_back(*resourceBuffer);
+					resourceBuffer = mUsedResourceBuffer.erase(resourceBuffer);
+				}
+				else
+				{
+					++resourceBuffer;
+				}
+			}
+
+			if (candidates[i]->Slot != 0)
+			{
+				mFreeSamplerSlots.push_back(candidates[i]->Slot);
+			}
+
+			mSamplers.erase(candidates[i]->Key);
+		}
+	}
+
+	/*
+	Move descriptor sets that haven't been bound for mMaximumDescriptorSetAge frames to the unused list of their layout so they can be rewritten instead of allocated.
+	The age is never less than the number of frames in flight so nothing the device is still reading gets rewritten.
+	*/
+	for (auto resourceBuffer = mUsedResourceBuffer.begin(); resourceBuffer != mUsedResourceBuffer.end();)
+	{
+		if (mFrameIndex - (*resourceBuffer)->LastUsedFrame > mMaximumDescriptorSetAge)
+		{
+			mUnusedResourceBuffer[(*resourceBuffer)->DescriptorSetLayout].push_back(*resourceBuffer);
+			resourceBuffer = mUsedResourceBuffer.erase(resourceBuffer);
+		}
+		else
+		{
+			++resourceBuffer;
+		}
+	}
+
+	mIsDirty = true;
+}
+
+void BufferManager::CreateBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer& buffer, VkDeviceMemory& deviceMemory)
+{
+	VkResult result; // = VK_SUCCESS
+
+	VkBufferCreateInfo bufferInfo = {};
+	bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+	bufferInfo.size = size;
+	bufferInfo.usage = usage;
+	bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+
+	result = vkCreateBuffer(mDevice->mDevice, &bufferInfo, nullptr, &buffer);
+	if (result != VK_SUCCESS)
+	{
+		BOOST_LOG_TRIVIAL(fatal) << "BufferManager::CreateBuffer vkCreateBuffer failed with return code of " << mResult;
+		return;
+	}
+
+	VkMemoryRequirements memoryRequirements;
+	vkGetBufferMemoryRequirements(mDevice->mDevice, buffer, &memoryRequirements);
+
+	VkMemoryAllocateInfo allocInfo = {};
+	allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+	allocInfo.allocationSize = memoryRequirements.size;
+	//allocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits, properties);
+
+	if (!GetMemoryTypeFromProperties(mDevice->mDeviceMemoryProperties, memoryRequirements.memoryTypeBits, properties, &allocInfo.memoryTypeIndex))
+	{
+		BOOST_LOG_TRIVIAL(fatal) << "Memory type index not found!";
+		return;
+	}
+
+	result = vkAllocateMemory(mDevice->mDevice, &allocInfo, nullptr, &deviceMemory);
+	if (result != VK_SUCCESS)
+	{
+		BOOST_LOG_TRIVIAL(fatal) << "BufferManager::CreateBuffer vkCreateBuffer failed with return code of " << mResult;
+		return;
+	}
+
+	vkBindBufferMemory(mDevice->mDevice, buffer, deviceMemory, 0);
+}
+
+void BufferManager::CopyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size)
+{
+	//The device recycles the command buffer and fence. So far resetting a command buffer is about 10 times faster than allocating a new one.
+	VkCommandBuffer commandBuffer = mDevice->BeginOneTimeCommands();
+	if (commandBuffer == VK_NULL_HANDLE)
+	{
+		return;
+	}
+
+	mCopyRegion.size = size;
+	vkCmdCopyBuffer(commandBuffer, srcBuffer, dstBuffer, 1, &mCopyRegion);
+
+	mDevice->EndOneTimeCommands(commandBuffer);
+}
+
+void SamplerRequest::UpdateKey()
+{
+	//Every field fits in 64 bits so the key itself is compared instead of the fields. Anisotropy and level counts above 31 aren't meaningful.
+	//Filters take 4 bits because D3DTEXF_CONVOLUTIONMONO is 8.
+	uint32_t lodBias = 0;
+	memcpy(&lodBias, &MipLodBias, sizeof(uint32_t));
+
+	Key = (uint64_t)(MagFilter & 0xF)
+		| ((uint64_t)(MinFilter & 0xF) << 4)
+		| ((uint64_t)(MipmapMode & 0xF) << 8)
+		| ((uint64_t)(AddressModeU & 0x7) << 12)
+		| ((uint64_t)(AddressModeV & 0x7) << 15)
+		| ((uint64_t)(AddressModeW & 0x7) << 18)
+		| ((uint64_t)min(MaxAnisotropy, (DWORD)31) << 21)
+		| ((uint64_t)min((uint32_t)MaxLod, (uint32_t)31) << 26)
+		| ((uint64_t)lodBias << 32);
+}
+
+SamplerRequest::~SamplerRequest()
+{
+	if (mDevice != nullptr && Sampler != VK_NULL_HANDLE)
+	{
+		vkDestroySampler(mDevice->mDevice, Sampler, NULL);
+	}
+}
+
+void ResourceContext::UpdateHash()
+{
+	size_t hash = 0;
+
+	boost::hash_combine(hash, DescriptorSetLayout);
+
+	for (size_t i = 0; i < 16; i++)
+	{
+		boost::hash_combine(hash, DescriptorImageInfo[i].sampler);
+		boost::hash_combine(hash, DescriptorImageInfo[i].imageView);
+		boost::hash_combine(hash, DescriptorImageInfo[i].imageLayout);
+	}
+
+	for (size_t i = 0; i < 4; i++)
+	{
+		boost::hash_combine(hash, DescriptorBufferInfo[i].buffer);
+		boost::hash_combine(hash, DescriptorBufferInfo[i].offset);
+		boost::hash_combine(hash, DescriptorBufferInfo[i].range);
+	}
+
+	Hash = hash;
+}
+
+bool ResourceContextEqual::operator()(const std::shared_ptr<ResourceContext>& context1, const std::shared_ptr<ResourceContext>& context2) const
+{
+	if (context1->Hash != context2->Hash
+		|| context1->DescriptorSetLayout != context2->DescriptorSetLayout
+		|| memcmp(context1->DescriptorBufferInfo, context2->DescriptorBufferInfo, sizeof(context1->DescriptorBufferInfo)) != 0)
+	{
+		return false;
+	}
+
+	//VkDescriptorImageInfo has padding after imageLayout so compare it field by field.
+	for (size_t i = 0; i < 16; i++)
+	{
+		auto& imageData1 = context1->DescriptorImageInfo[i];
+		auto& imageData2 = context2->DescriptorImageInfo[i];
+
+		if (imageData1.imageLayout != imageData2.imageLayout
+			|| imageData1.imageView != imageData2.imageView
+			|| imageData1.sampler != imageData2.sampler)
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+ResourceContext::~ResourceContext()
+{
+	if (mDevice != nullptr && DescriptorSet != VK_NULL_HANDLE)
+	{
+		vkFreeDescriptorSets(mDevice->mDevice, DescriptorPool, 1, &DescriptorSet);
+	}
+}
+
+void ResourceContext::Reset(CDevice9* device)
+{
+	if (mDevice != nullptr && DescriptorSet != VK_NULL_HANDLE)
+	{
+		vkFreeDescriptorSets(mDevice->mDevice, DescriptorPool, 1, &DescriptorSet);
+	}
+
+	//Nothing left is owned so the copy from a fresh context doesn't free anything.
+	(*this) = ResourceContext(device);
+}
+
+PipelineRequest::PipelineRequest(const BufferManager& bufferManager, std::shared_ptr<DrawContext> context)
+	: Context(context)
+{
+	GraphicsPipelineCreateInfo = bufferManager.mGraphicsPipelineCreateInfo;
+	memcpy(PipelineShaderStageCreateInfo, bufferManager.mPipelineShaderStageCreateInfo, sizeof(PipelineShaderStageCreateInfo));
+	SpecializationInfo = bufferManager.mSpecializationInfo;
+	mSpecializationConstants = *reinterpret_cast<const SpecializationConstants*>(bufferManager.mSpecializationInfo.pData);
+
+	PipelineVertexInputStateCreateInfo = bufferManager.mPipelineVertexInputStateCreateInfo;
+	memcpy(VertexInputBindingDescription, bufferManager.mVertexInputBindingDescription, sizeof(VertexInputBindingDescription));
+	memcpy(VertexInputAttributeDescription, bufferManager.mVertexInputAttributeDescription, sizeof(VertexInputAttributeDescription));
+	PipelineInputAssemblyStateCreateInfo = bufferManager.mPipelineInputAssemblyStateCreateInfo;
+	PipelineRasterizationStateCreateInfo = bufferManager.mPipelineRasterizationStateCreateInfo;
+	memcpy(PipelineColorBlendAttachmentState, bufferManager.mPipelineColorBlendAttachmentState, sizeof(PipelineColorBlendAttachmentState));
+	PipelineColorBlendStateCreateInfo = bufferManager.mPipelineColorBlendStateCreateInfo;
+	PipelineDepthStencilStateCreateInfo = bufferManager.mPipelineDepthStencilStateCreateInfo;
+	PipelineViewportStateCreateInfo = bufferManager.mPipelineViewportStateCreateInfo;
+	PipelineMultisampleStateCreateInfo = bufferManager.mPipelineMultisampleStateCreateInfo;
+	PipelineDynamicStateCreateInfo = bufferManager.mPipelineDynamicStateCreateInfo;
+	memcpy(DynamicStateEnables, bufferManager.mDynamicStateEnables, sizeof(DynamicStateEnables));
+
+	/**********************************************
+	* Point the copies at each other instead of the BufferManager members.
+	**********************************************/
+	SpecializationInfo.pData = &mSpecializationConstants;
+	PipelineShaderStageCreateInfo[0].pSpecializationInfo = &SpecializationInfo;
+	PipelineShaderStageCreateInfo[1].pSpecializationInfo = &SpecializationInfo;
+
+	PipelineVertexInputStateCreateInfo.pVertexBindingDescriptions = VertexInputBindingDescription;
+	PipelineVertexInputStateCreateInfo.pVertexAttributeDescriptions = VertexInputAttributeDescription;
+	PipelineColorBlendStateCreateInfo.pAttachments = PipelineColorBlendAttachmentState;
+	PipelineDynamicStateCreateInfo.pDynamicStates = DynamicStateEnables;
+
+	GraphicsPipelineCreateInfo.pStages = PipelineShaderStageCreateInfo;
+	GraphicsPipelineCreateInfo.pVertexInputState = &PipelineVertexInputStateCreateInfo;
+	GraphicsPipelineCreateInfo.pInputAssemblyState = &PipelineInputAssemblyStateCreateInfo;
+	GraphicsPipelineCreateInfo.pRasterizationState = &PipelineRasterizationStateCreateInfo;
+	GraphicsPipelineCreateInfo.pColorBlendState = &PipelineColorBlendStateCreateInfo;
+	GraphicsPipelineCreateInfo.pDepthStencilState = &PipelineDepthStencilStateCreateInfo;
+	GraphicsPipelineCreateInfo.pViewportState = &PipelineViewportStateCreateInfo;
+	GraphicsPipelineCreateInfo.pMultisampleState = &PipelineMultisampleStateCreateInfo;
+	GraphicsPipelineCreateInfo.pDynamicState = &PipelineDynamicStateCreateInfo;
+}
+
+void LayoutContext::UpdateHash()
+{
+	size_t hash = 0;
+
+	boost::hash_combine(hash, BindingCount);
+	boost::hash_combine(hash, Flags);
+	boost::hash_combine(hash, SetLayoutCount);
+	boost::hash_combine(hash, PushConstantRangeCount);
+	boost::hash_combine(hash, PushConstantSize);
+	boost::hash_combine(hash, IsFixedFunction);
+
+	for (uint32_t i = 0; i < BindingCount; i++)
 	{
-		// Use max. level of anisotropy for this example
-		samplerCreateInfo.maxAnisotropy = min(request->MaxAnisotropy, mDevice->mDeviceProperties.limits.maxSamplerAnisotropy);
-		
-		if (request->MinFilter == D3DTEXF_ANISOTROPIC ||
-			request->MagFilter == D3DTEXF_ANISOTROPIC ||
-			request->MipmapMode == D3DTEXF_ANISOTROPIC)
+		boost::hash_combine(hash, Bindings[i].binding);
+		boost::hash_combine(hash, Bindings[i].descriptorType);
+		boost::hash_combine(hash, Bindings[i].descriptorCount);
+		boost::hash_combine(hash, Bindings[i].stageFlags);
+	}
+
+	Hash = hash;
+}
+
+bool LayoutContextEqual::operator()(const LayoutContext& context1, const LayoutContext& context2) const
+{
+	if (context1.Hash != context2.Hash
+		|| context1.BindingCount != context2.BindingCount
+		|| context1.Flags != context2.Flags
+		|| context1.SetLayoutCount != context2.SetLayoutCount
+		|| context1.PushConstantRangeCount != context2.PushConstantRangeCount
+		|| context1.PushConstantSize != context2.PushConstantSize
+		|| context1.IsFixedFunction != context2.IsFixedFunction)
+	{
+		return false;
+	}
+
+	//Compared field by field because of the padding after descriptorType.
+	for (uint32_t i = 0; i < context1.BindingCount; i++)
+	{
+		if (context1.Bindings[i].binding != context2.Bindings[i].binding
+			|| context1.Bindings[i].descriptorType != context2.Bindings[i].descriptorType
+			|| context1.Bindings[i].descriptorCount != context2.Bindings[i].descriptorCount
+			|| context1.Bindings[i].stageFlags != context2.Bindings[i].stageFlags
+			|| context1.Bindings[i].pImmutableSamplers != context2.Bindings[i].pImmutableSamplers)
 		{
-			samplerCreateInfo.anisotropyEnable = VK_TRUE;
-		}
-		else {
-			samplerCreateInfo.anisotropyEnable = VK_FALSE;
+			return false;
 		}
 	}
-	else
+
+	return true;
+}
+
+LayoutContext::~LayoutContext()
+{
+	if (mDevice != nullptr)
 	{
-		// The device does not support anisotropic filtering
-		samplerCreateInfo.maxAnisotropy = 1.0;
-		samplerCreateInfo.anisotropyEnable = VK_FALSE;
+		if (PipelineLayout != VK_NULL_HANDLE)
+		{
+			vkDestroyPipelineLayout(mDevice->mDevice, PipelineLayout, NULL);
+		}
+		if (DescriptorUpdateTemplate != VK_NULL_HANDLE)
+		{
+			mDevice->vkDestroyDescriptorUpdateTemplateKHR(mDevice->mDevice, DescriptorUpdateTemplate, NULL);
+		}
+		if (DescriptorSetLayout != VK_NULL_HANDLE)
+		{
+			vkDestroyDescriptorSetLayout(mDevice->mDevice, DescriptorSetLayout, NULL);
+		}
 	}
+}
 
-	samplerCreateInfo.borderColor = VK_BORDER_COLOR_FLOAT_OPAQUE_WHITE; // VK_BORDER_COLOR_INT_OPAQUE_BLACK;
-	samplerCreateInfo.unnormalizedCoordinates = VK_FALSE;
-	samplerCreateInfo.compareOp = VK_COMPARE_OP_NEVER; //VK_COMPARE_OP_ALWAYS
-	samplerCreateInfo.minLod = 0.0f;
-	samplerCreateInfo.maxLod = request->MaxLod;
+void DrawContext::UpdateHash()
+{
+	size_t hash = 0;
 
-	if (request->MipmapMode == D3DTEXF_NONE)
+	boost::hash_combine(hash, PrimitiveType);
+	boost::hash_combine(hash, FVF);
+	boost::hash_combine(hash, VertexDeclaration);
+	boost::hash_combine(hash, VertexShader);
+	boost::hash_combine(hash, PixelShader);
+	boost::hash_combine(hash, StreamCount);
+	boost::hash_combine(hash, IsGeneric);
+
+	boost::hash_range(hash, &Bindings[0][0], &Bindings[0][0] + StreamCount * 2);
+
+	//Every field is a 4 byte int or float so the whole block can be hashed as words.
+	const uint32_t* words = reinterpret_cast<const uint32_t*>(&mSpecializationConstants);
+	boost::hash_range(hash, words, words + (sizeof(SpecializationConstants) / sizeof(uint32_t)));
+
+	Hash = hash;
+}
+
+bool DrawContextEqual::operator()(const std::shared_ptr<DrawContext>& context1, const std::shared_ptr<DrawContext>& context2) const
+{
+	return context1->Hash == context2->Hash
+		&& context1->PrimitiveType == context2->PrimitiveType
+		&& context1->FVF == context2->FVF
+		&& context1->VertexDeclaration == context2->VertexDeclaration
+		&& context1->VertexShader == context2->VertexShader
+		&& context1->PixelShader == context2->PixelShader
+		&& context1->StreamCount == context2->StreamCount
+		&& context1->IsGeneric == context2->IsGeneric
+		&& memcmp(context1->Bindings, context2->Bindings, sizeof(UINT) * 2 * context1->StreamCount) == 0
+		&& memcmp(&context1->mSpecializationConstants, &context2->mSpecializationConstants, sizeof(SpecializationConstants)) == 0;
+}
+
+DrawContext::~DrawContext()
+{
+	Release();
+}
+
+void DrawContext::Reset(CDevice9* device)
+{
+	Release();
+
+	//IsPending is atomic so the context can't be copied over and every field is set instead.
+	memset(Bindings, 0, sizeof(Bindings));
+	PrimitiveType = D3DPT_FORCE_DWORD;
+	FVF = 0;
+	VertexDeclaration = nullptr;
+	VertexShader = nullptr;
+	PixelShader = nullptr;
+	StreamCount = 0;
+	IsGeneric = false;
+	mSpecializationConstants = {};
+	Hash = 0;
+	IsPending = false;
+	IsPrewarmed = false;
+	LastUsedFrame = 0;
+	EstimatedSize = 0;
+	mDevice = device;
+}
+
+void DrawContext::Release()
+{
+	if (mDevice != nullptr)
 	{
-		samplerCreateInfo.maxLod = 0.0f;
+		if (Pipeline != VK_NULL_HANDLE)
+		{
+			vkDestroyPipeline(mDevice->mDevice, Pipeline, NULL);
+		}
 	}
 
-	mResult = vkCreateSampler(mDevice->mDevice, &samplerCreateInfo, NULL, &request->Sampler);
-	if (mResult != VK_SUCCESS)
+	//The layouts belong to the layout cache so they are only forgotten.
+	Pipeline = VK_NULL_HANDLE;
+	PipelineLayout = VK_NULL_HANDLE;
+	DescriptorUpdateTemplate = VK_NULL_HANDLE;
+	DescriptorSetLayout = VK_NULL_HANDLE;
+}
+void CommandBufferState::Reset(VkCommandBuffer commandBuffer)
+{
+	CommandBufferState state;
+
+	state.CommandBuffer = commandBuffer;
+	state.mDevice = mDevice;
+	state.UseExtendedDynamicState = UseExtendedDynamicState;
+	state.UseExtendedDynamicState2 = UseExtendedDynamicState2;
+	state.UseExtendedDynamicState3 = UseExtendedDynamicState3;
+
+	(*this) = state;
+}
+
+void CommandBufferState::BindPipeline(VkPipeline pipeline)
+{
+	if (Pipeline == pipeline)
 	{
-		BOOST_LOG_TRIVIAL(fatal) << "CTexture9::GenerateSampler vkCreateSampler failed with return code of " << mResult;
 		return;
 	}
 
-	mSamplerRequests.push_back(request);
+	vkCmdBindPipeline(CommandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, pipeline);
+	Pipeline = pipeline;
 }
 
-void BufferManager::UpdateBuffer()
-{ //Vulkan doesn't allow vkCmdUpdateBuffer inside of a render pass.
+void CommandBufferState::BindDescriptorSet(VkPipelineLayout layout, VkDescriptorSet descriptorSet, uint32_t dynamicOffsetCount, const uint32_t* dynamicOffsets)
+{
+	if (dynamicOffsetCount > MAX_DYNAMIC_OFFSETS)
+	{
+		//Too many to shadow so just bind and forget what was there.
+		vkCmdBindDescriptorSets(CommandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, layout, 0, 1, &descriptorSet, dynamicOffsetCount, dynamicOffsets);
+		DescriptorSet = VK_NULL_HANDLE;
+		PushDescriptorLayout = VK_NULL_HANDLE;
+		TextureTableLayout = VK_NULL_HANDLE;
+		return;
+	}
+
+	if (PipelineLayout == layout
+		&& DescriptorSet == descriptorSet
+		&& DynamicOffsetCount == dynamicOffsetCount
+		&& (dynamicOffsetCount == 0 || memcmp(DynamicOffsets, dynamicOffsets, sizeof(uint32_t) * dynamicOffsetCount) == 0))
+	{
+		return;
+	}
+
+	vkCmdBindDescriptorSets(CommandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, layout, 0, 1, &descriptorSet, dynamicOffsetCount, dynamicOffsets);
 
-	//The dirty flag for lights can be set by enable light or set light.
-	if (mDevice->mDeviceState.mAreLightsDirty)
+	//Set 1 is only kept across a set 0 bind with the layout it was bound with.
+	if (PipelineLayout != layout)
 	{
-		vkCmdUpdateBuffer(mDevice->mSwapchainBuffers[mDevice->mCurrentBuffer], mLightBuffer, 0, sizeof(Light)*mDevice->mDeviceState.mLights.size(), mDevice->mDeviceState.mLights.data()); //context->mSpecializationConstants.lightCount
-		mDevice->mDeviceState.mAreLightsDirty = false;
+		TextureTableLayout = VK_NULL_HANDLE;
 	}
 
-	//
-	if (mDevice->mDeviceState.mIsMaterialDirty)
+	PipelineLayout = layout;
+	DescriptorSet = descriptorSet;
+	PushDescriptorLayout = VK_NULL_HANDLE;
+	DynamicOffsetCount = dynamicOffsetCount;
+	if (dynamicOffsetCount > 0)
 	{
-		vkCmdUpdateBuffer(mDevice->mSwapchainBuffers[mDevice->mCurrentBuffer], mMaterialBuffer, 0, sizeof(D3DMATERIAL9), &mDevice->mDeviceState.mMaterial);
-		mDevice->mDeviceState.mIsMaterialDirty = false;
+		memcpy(DynamicOffsets, dynamicOffsets, sizeof(uint32_t) * dynamicOffsetCount);
 	}
 }
 
-void BufferManager::UpdatePushConstants(std::shared_ptr<DrawContext> context)
+void CommandBufferState::BindVertexBuffer(uint32_t binding, VkBuffer buffer, VkDeviceSize offset, VkDeviceSize stride)
 {
-	VkResult result = VK_SUCCESS;
-	void* data = nullptr;
-
-	//if (!mDevice->mDeviceState.mHasTransformsChanged)
-	//{
-	//	return;
-	//}
+	//The stride is only bound with the buffer when it is dynamic. Otherwise it is part of the pipeline.
+	if (VertexBuffers[binding] == buffer && VertexBufferOffsets[binding] == offset && (!UseExtendedDynamicState || VertexBufferStrides[binding] == stride))
+	{
+		return;
+	}
 
-	mTransformations.mModel <<
-		1, 0, 0, 0,
-		0, 1, 0, 0,
-		0, 0, 1, 0,
-		0, 0, 0, 1;
+	VertexBuffers[binding] = buffer;
+	VertexBufferOffsets[binding] = offset;
+	VertexBufferStrides[binding] = stride;
+	IsVertexBufferDirty[binding] = true;
+}
 
-	mTransformations.mView <<
-		1, 0, 0, 0,
-		0, 1, 0, 0,
-		0, 0, 1, 0,
-		0, 0, 0, 1;
+void CommandBufferState::FlushVertexBuffers()
+{
+	//Contiguous dirty slots go out as one call.
+	uint32_t binding = 0;
+	while (binding < 16)
+	{
+		if (!IsVertexBufferDirty[binding])
+		{
+			binding++;
+			continue;
+		}
 
-	mTransformations.mProjection <<
-		1, 0, 0, 0,
-		0, 1, 0, 0,
-		0, 0, 1, 0,
-		0, 0, 0, 1;
+		uint32_t firstBinding = binding;
+		while (binding < 16 && IsVertexBufferDirty[binding])
+		{
+			IsVertexBufferDirty[binding] = false;
+			binding++;
+		}
 
-	BOOST_FOREACH(const auto& pair1, mDevice->mDeviceState.mTransforms)
-	{
-		switch (pair1.first)
+		if (UseExtendedDynamicState)
 		{
-		case D3DTS_WORLD:
+			mDevice->vkCmdBindVertexBuffers2EXT(CommandBuffer, firstBinding, binding - firstBinding, &VertexBuffers[firstBinding], &VertexBufferOffsets[firstBinding], nullptr, &VertexBufferStrides[firstBinding]);
+		}
+		else
+		{
+			vkCmdBindVertexBuffers(CommandBuffer, firstBinding, binding - firstBinding, &VertexBuffers[firstBinding], &VertexBufferOffsets[firstBinding]);
+		}
+	}
+}
 
-			mTransformations.mModel <<
-				pair1.second.m[0][0], pair1.second.m[1][0], pair1.second.m[2][0], pair1.second.m[3][0],
-				pair1.second.m[0][1], pair1.second.m[1][1], pair1.second.m[2][1], pair1.second.m[3][1],
-				pair1.second.m[0][2], pair1.second.m[1][2], pair1.second.m[2][2], pair1.second.m[3][2],
-				pair1.second.m[0][3], pair1.second.m[1][3], pair1.second.m[2][3], pair1.second.m[3][3];
+void CommandBufferState::BindIndexBuffer(VkBuffer buffer, VkDeviceSize offset, VkIndexType indexType)
+{
+	if (IndexBuffer == buffer && IndexBufferOffset == offset && IndexType == indexType)
+	{
+		return;
+	}
 
-			break;
-		case D3DTS_VIEW:
+	vkCmdBindIndexBuffer(CommandBuffer, buffer, offset, indexType);
+	IndexBuffer = buffer;
+	IndexBufferOffset = offset;
+	IndexType = indexType;
+}
 
-			mTransformations.mView <<
-				pair1.second.m[0][0], pair1.second.m[1][0], pair1.second.m[2][0], pair1.second.m[3][0],
-				pair1.second.m[0][1], pair1.second.m[1][1], pair1.second.m[2][1], pair1.second.m[3][1],
-				pair1.second.m[0][2], pair1.second.m[1][2], pair1.second.m[2][2], pair1.second.m[3][2],
-				pair1.second.m[0][3], pair1.second.m[1][3], pair1.second.m[2][3], pair1.second.m[3][3];
+void CommandBufferState::PushConstantData(VkPipelineLayout layout, const void* data, uint32_t size, uint32_t offset)
+{
+	const uint32_t* words = (const uint32_t*)data;
+	uint32_t base = offset / sizeof(uint32_t);
+	uint32_t wordCount = size / sizeof(uint32_t);
+	uint32_t first = 0;
+	uint32_t last = wordCount;
+
+	//Push constants stay valid across pipeline changes only while the layouts are compatible, so a new layout forgets every word.
+	if (PushConstantLayout != layout)
+	{
+		std::fill(std::begin(IsPushConstantValid), std::end(IsPushConstantValid), FALSE);
+		PushConstantLayout = layout;
+	}
 
-			break;
-		case D3DTS_PROJECTION:
+	while (first < wordCount && IsPushConstantValid[base + first] && PushConstants[base + first] == words[first])
+	{
+		first++;
+	}
 
-			mTransformations.mProjection <<
-				pair1.second.m[0][0], pair1.second.m[1][0], pair1.second.m[2][0], pair1.second.m[3][0],
-				pair1.second.m[0][1], pair1.second.m[1][1], pair1.second.m[2][1], pair1.second.m[3][1],
-				pair1.second.m[0][2], pair1.second.m[1][2], pair1.second.m[2][2], pair1.second.m[3][2],
-				pair1.second.m[0][3], pair1.second.m[1][3], pair1.second.m[2][3], pair1.second.m[3][3];
+	if (first == wordCount)
+	{
+		return;
+	}
 
-			break;
-		default:
-			BOOST_LOG_TRIVIAL(warning) << "BufferManager::UpdateUniformBuffer The following state type was ignored. " << pair1.first;
-			break;
-		}
+	while (last > first && IsPushConstantValid[base + last - 1] && PushConstants[base + last - 1] == words[last - 1])
+	{
+		last--;
 	}
 
-	mTransformations.mTotalTransformation = mTransformations.mProjection * mTransformations.mView * mTransformations.mModel;
-	//mTotalTransformation = mModel * mView * mProjection;
+	vkCmdPushConstants(CommandBuffer, layout, VK_SHADER_STAGE_ALL_GRAPHICS, (base + first) * sizeof(uint32_t), (last - first) * sizeof(uint32_t), &words[first]);
+	memcpy(&PushConstants[base + first], &words[first], (last - first) * sizeof(uint32_t));
+	std::fill(&IsPushConstantValid[base + first], &IsPushConstantValid[base + last], TRUE);
+}
+
+void CommandBufferState::BindTextureTable(VkPipelineLayout layout, VkDescriptorSet descriptorSet)
+{
+	if (TextureTableLayout == layout)
+	{
+		return;
+	}
 
-	vkCmdPushConstants(mDevice->mSwapchainBuffers[mDevice->mCurrentBuffer], context->PipelineLayout, VK_SHADER_STAGE_ALL_GRAPHICS, 0, UBO_SIZE * 2, &mTransformations);
+	vkCmdBindDescriptorSets(CommandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, layout, 1, 1, &descriptorSet, 0, nullptr);
+	TextureTableLayout = layout;
 }
 
-void BufferManager::FlushDrawBufffer()
+uint32_t CommandBufferState::PushDescriptorSet(VkPipelineLayout layout, const VkWriteDescriptorSet* writes, const VkDescriptorBufferInfo* bufferInfo, const VkDescriptorImageInfo* imageInfo, uint32_t imageCount)
 {
-	/*
-	Uses remove_if and chrono to remove elements that have not been used in over a second.
-	*/
-	mDrawBuffer.erase(std::remove_if(mDrawBuffer.begin(), mDrawBuffer.end(), [](const std::shared_ptr<DrawContext> & o) { return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - o->LastUsed).count() > CACHE_SECONDS; }), mDrawBuffer.end());
-	mSamplerRequests.erase(std::remove_if(mSamplerRequests.begin(), mSamplerRequests.end(), [](const std::shared_ptr<SamplerRequest> & o) { return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - o->LastUsed).count() > CACHE_SECONDS; }), mSamplerRequests.end());
+	VkWriteDescriptorSet pushWrites[5];
+	uint32_t writeCount = 0;
+	uint32_t descriptorCount = 0;
 
-	/*
-	Add expired buffers to unused list so they can be reused and then remove them from the used queue.
-	*/
+	//Like push constants pushed descriptors only carry over to a compatible layout, so a new layout gets every binding.
+	BOOL isFullPush = (PushDescriptorLayout != layout || PushedImageCount != imageCount);
 
-	for (size_t i = 0; i < mUsedResourceBuffer.size(); i++)
+	//writes holds the four uniform buffer bindings followed by the image binding.
+	for (uint32_t i = 0; i < 4; i++)
 	{
-		if (std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - mUsedResourceBuffer[i]->LastUsed).count() > CACHE_SECONDS)
+		if (isFullPush || memcmp(&PushedBufferInfo[i], &bufferInfo[i], sizeof(VkDescriptorBufferInfo)) != 0)
 		{
-			mUnusedResourceBuffer.push_back(mUsedResourceBuffer[i]);
+			pushWrites[writeCount] = writes[i];
+			pushWrites[writeCount].dstSet = VK_NULL_HANDLE;
+			pushWrites[writeCount].descriptorCount = 1;
+			pushWrites[writeCount].pBufferInfo = &bufferInfo[i];
+			writeCount++;
+			descriptorCount++;
+
+			PushedBufferInfo[i] = bufferInfo[i];
 		}
 	}
-	mUsedResourceBuffer.erase(std::remove_if(mUsedResourceBuffer.begin(), mUsedResourceBuffer.end(), [](const std::shared_ptr<ResourceContext> & o) { return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - o->LastUsed).count() > CACHE_SECONDS; }), mUsedResourceBuffer.end());
 
-	mIsDirty = true;
-}
+	uint32_t first = 0;
+	uint32_t last = imageCount;
+	if (!isFullPush)
+	{
+		while (first < imageCount
+			&& PushedImageInfo[first].sampler == imageInfo[first].sampler
+			&& PushedImageInfo[first].imageView == imageInfo[first].imageView
+			&& PushedImageInfo[first].imageLayout == imageInfo[first].imageLayout)
+		{
+			first++;
+		}
 
-void BufferManager::CreateBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer& buffer, VkDeviceMemory& deviceMemory)
-{
-	VkResult result; // = VK_SUCCESS
+		while (last > first
+			&& PushedImageInfo[last - 1].sampler == imageInfo[last - 1].sampler
+			&& PushedImageInfo[last - 1].imageView == imageInfo[last - 1].imageView
+			&& PushedImageInfo[last - 1].imageLayout == imageInfo[last - 1].imageLayout)
+		{
+			last--;
+		}
+	}
 
-	VkBufferCreateInfo bufferInfo = {};
-	bufferInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-	bufferInfo.size = size;
-	bufferInfo.usage = usage;
-	bufferInfo.sharingMode = VK_SHARING_MODE_EXCLUSIVE;
+	//Changed samplers go out as one write covering the first to the last that differ.
+	if (first < last)
+	{
+		pushWrites[writeCount] = writes[4];
+		pushWrites[writeCount].dstSet = VK_NULL_HANDLE;
+		pushWrites[writeCount].dstArrayElement = first;
+		pushWrites[writeCount].descriptorCount = last - first;
+		pushWrites[writeCount].pImageInfo = &imageInfo[first];
+		writeCount++;
+		descriptorCount += last - first;
+
+		std::copy(&imageInfo[first], &imageInfo[last], &PushedImageInfo[first]);
+	}
 
-	result = vkCreateBuffer(mDevice->mDevice, &bufferInfo, nullptr, &buffer);
-	if (result != VK_SUCCESS)
+	if (writeCount)
 	{
-		BOOST_LOG_TRIVIAL(fatal) << "BufferManager::CreateBuffer vkCreateBuffer failed with return code of " << mResult;
-		return;
+		mDevice->vkCmdPushDescriptorSetKHR(CommandBuffer, VK_PIPELINE_BIND_POINT_GRAPHICS, layout, 0, writeCount, pushWrites);
 	}
 
-	VkMemoryRequirements memoryRequirements;
-	vkGetBufferMemoryRequirements(mDevice->mDevice, buffer, &memoryRequirements);
+	if (PushDescriptorLayout != layout)
+	{
+		TextureTableLayout = VK_NULL_HANDLE;
+	}
 
-	VkMemoryAllocateInfo allocInfo = {};
-	allocInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	allocInfo.allocationSize = memoryRequirements.size;
-	//allocInfo.memoryTypeIndex = findMemoryType(memRequirements.memoryTypeBits, properties);
+	PushDescriptorLayout = layout;
+	PushedImageCount = imageCount;
+	PipelineLayout = VK_NULL_HANDLE;
+	DescriptorSet = VK_NULL_HANDLE;
 
-	if (!GetMemoryTypeFromProperties(mDevice->mDeviceMemoryProperties, memoryRequirements.memoryTypeBits, properties, &allocInfo.memoryTypeIndex))
+	return descriptorCount;
+}
+
+void CommandBufferState::SetViewport(const VkViewport& viewport)
+{
+	if (HasViewport && memcmp(&Viewport, &viewport, sizeof(VkViewport)) == 0)
 	{
-		BOOST_LOG_TRIVIAL(fatal) << "Memory type index not found!";
 		return;
 	}
 
-	result = vkAllocateMemory(mDevice->mDevice, &allocInfo, nullptr, &deviceMemory);
-	if (result != VK_SUCCESS)
+	vkCmdSetViewport(CommandBuffer, 0, 1, &viewport);
+	Viewport = viewport;
+	HasViewport = true;
+}
+
+void CommandBufferState::SetScissor(const VkRect2D& scissor)
+{
+	if (HasScissor && memcmp(&Scissor, &scissor, sizeof(VkRect2D)) == 0)
 	{
-		BOOST_LOG_TRIVIAL(fatal) << "BufferManager::CreateBuffer vkCreateBuffer failed with return code of " << mResult;
 		return;
 	}
 
-	vkBindBufferMemory(mDevice->mDevice, buffer, deviceMemory, 0);
+	vkCmdSetScissor(CommandBuffer, 0, 1, &scissor);
+	Scissor = scissor;
+	HasScissor = true;
 }
 
-void BufferManager::CopyBuffer(VkBuffer srcBuffer, VkBuffer dstBuffer, VkDeviceSize size)
+void CommandBufferState::SetDepthBias(float constantFactor, float clamp, float slopeFactor)
 {
-	vkBeginCommandBuffer(mCommandBuffer, &mBeginInfo);
+	if (HasDepthBias && DepthBias[0] == constantFactor && DepthBias[1] == clamp && DepthBias[2] == slopeFactor)
 	{
-		mCopyRegion.size = size;
-		vkCmdCopyBuffer(mCommandBuffer, srcBuffer, dstBuffer, 1, &mCopyRegion);
+		return;
 	}
-	vkEndCommandBuffer(mCommandBuffer);
 
-	vkQueueSubmit(mDevice->mQueue, 1, &mSubmitInfo, VK_NULL_HANDLE);
-	vkQueueWaitIdle(mDevice->mQueue);
-	vkResetCommandBuffer(mCommandBuffer, VK_COMMAND_BUFFER_RESET_RELEASE_RESOURCES_BIT); //So far resetting a command buffer is about 10 times faster than allocating a new one.
+	vkCmdSetDepthBias(CommandBuffer, constantFactor, clamp, slopeFactor);
+	DepthBias[0] = constantFactor;
+	DepthBias[1] = clamp;
+	DepthBias[2] = slopeFactor;
+	HasDepthBias = true;
 }
 
-SamplerRequest::~SamplerRequest()
+void CommandBufferState::SetBlendConstants(const float blendConstants[4])
 {
-	if (mDevice != nullptr && Sampler != VK_NULL_HANDLE)
+	if (HasBlendConstants && memcmp(BlendConstants, blendConstants, sizeof(BlendConstants)) == 0)
 	{
-		vkDestroySampler(mDevice->mDevice, Sampler, NULL);
+		return;
 	}
+
+	vkCmdSetBlendConstants(CommandBuffer, blendConstants);
+	memcpy(BlendConstants, blendConstants, sizeof(BlendConstants));
+	HasBlendConstants = true;
 }
 
-ResourceContext::~ResourceContext()
+void CommandBufferState::SetStencil(uint32_t compareMask, uint32_t writeMask, uint32_t reference)
 {
-	if (mDevice != nullptr && DescriptorSet != VK_NULL_HANDLE)
+	if (!HasStencil || StencilCompareMask != compareMask)
 	{
-		vkFreeDescriptorSets(mDevice->mDevice, mDevice->mDescriptorPool, 1, &DescriptorSet);
+		vkCmdSetStencilCompareMask(CommandBuffer, VK_STENCIL_FRONT_AND_BACK, compareMask);
+		StencilCompareMask = compareMask;
 	}
+
+	if (!HasStencil || StencilWriteMask != writeMask)
+	{
+		vkCmdSetStencilWriteMask(CommandBuffer, VK_STENCIL_FRONT_AND_BACK, writeMask);
+		StencilWriteMask = writeMask;
+	}
+
+	if (!HasStencil || StencilReference != reference)
+	{
+		vkCmdSetStencilReference(CommandBuffer, VK_STENCIL_FRONT_AND_BACK, reference);
+		StencilReference = reference;
+	}
+
+	HasStencil = true;
 }
 
-DrawContext::~DrawContext()
+void CommandBufferState::SetPipelineState(const DynamicPipelineState& state)
 {
-	if (mDevice != nullptr)
+	const DynamicPipelineState& current = PipelineState;
+	const BOOL hasState = HasPipelineState;
+
+	if (UseExtendedDynamicState)
 	{
-		if (Pipeline != VK_NULL_HANDLE)
+		if (!hasState || current.CullMode != state.CullMode)
 		{
-			vkDestroyPipeline(mDevice->mDevice, Pipeline, NULL);
+			mDevice->vkCmdSetCullModeEXT(CommandBuffer, state.CullMode);
 		}
-		if (PipelineLayout != VK_NULL_HANDLE)
+
+		if (!hasState || current.FrontFace != state.FrontFace)
 		{
-			vkDestroyPipelineLayout(mDevice->mDevice, PipelineLayout, NULL);
+			mDevice->vkCmdSetFrontFaceEXT(CommandBuffer, state.FrontFace);
 		}
-		if (DescriptorSetLayout != VK_NULL_HANDLE)
+
+		if (!hasState || current.PrimitiveTopology != state.PrimitiveTopology)
 		{
-			vkDestroyDescriptorSetLayout(mDevice->mDevice, DescriptorSetLayout, NULL);
+			mDevice->vkCmdSetPrimitiveTopologyEXT(CommandBuffer, state.PrimitiveTopology);
+		}
+
+		if (!hasState || current.DepthTestEnable != state.DepthTestEnable)
+		{
+			mDevice->vkCmdSetDepthTestEnableEXT(CommandBuffer, state.DepthTestEnable);
+		}
+
+		if (!hasState || current.DepthWriteEnable != state.DepthWriteEnable)
+		{
+			mDevice->vkCmdSetDepthWriteEnableEXT(CommandBuffer, state.DepthWriteEnable);
+		}
+
+		if (!hasState || current.DepthCompareOp != state.DepthCompareOp)
+		{
+			mDevice->vkCmdSetDepthCompareOpEXT(CommandBuffer, state.DepthCompareOp);
+		}
+
+		if (!hasState || current.StencilTestEnable != state.StencilTestEnable)
+		{
+			mDevice->vkCmdSetStencilTestEnableEXT(CommandBuffer, state.StencilTestEnable);
+		}
+
+		if (!hasState || memcmp(&current.Front, &state.Front, sizeof(VkStencilOpState)) != 0)
+		{
+			mDevice->vkCmdSetStencilOpEXT(CommandBuffer, VK_STENCIL_FACE_FRONT_BIT, state.Front.failOp, state.Front.passOp, state.Front.depthFailOp, state.Front.compareOp);
+		}
+
+		if (!hasState || memcmp(&current.Back, &state.Back, sizeof(VkStencilOpState)) != 0)
+		{
+			mDevice->vkCmdSetStencilOpEXT(CommandBuffer, VK_STENCIL_FACE_BACK_BIT, state.Back.failOp, state.Back.passOp, state.Back.depthFailOp, state.Back.compareOp);
+		}
+	}
+
+	if (UseExtendedDynamicState2)
+	{
+		if (!hasState || current.DepthBiasEnable != state.DepthBiasEnable)
+		{
+			mDevice->vkCmdSetDepthBiasEnableEXT(CommandBuffer, state.DepthBiasEnable);
+		}
+	}
+
+	if (UseExtendedDynamicState3)
+	{
+		if (!hasState || current.PolygonMode != state.PolygonMode)
+		{
+			mDevice->vkCmdSetPolygonModeEXT(CommandBuffer, state.PolygonMode);
+		}
+
+		if (!hasState || current.ColorBlendEnable != state.ColorBlendEnable)
+		{
+			mDevice->vkCmdSetColorBlendEnableEXT(CommandBuffer, 0, 1, &state.ColorBlendEnable);
+		}
+
+		if (!hasState || memcmp(&current.ColorBlendEquation, &state.ColorBlendEquation, sizeof(VkColorBlendEquationEXT)) != 0)
+		{
+			mDevice->vkCmdSetColorBlendEquationEXT(CommandBuffer, 0, 1, &state.ColorBlendEquation);
+		}
+
+		if (!hasState || current.ColorWriteMask != state.ColorWriteMask)
+		{
+			mDevice->vkCmdSetColorWriteMaskEXT(CommandBuffer, 0, 1, &state.ColorWriteMask);
 		}
 	}
 
-}
\ No newline at end of file
+	PipelineState = state;
+	HasPipelineState = true;
+}
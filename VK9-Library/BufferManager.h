@@ -22,19 +22,105 @@ misrepresented as being the original software.
 #define BUFFERMANAGER_H
 
 #define UBO_SIZE 64
+#define MAX_LIGHTS 4 //Must match MAX_LIGHTS in Shaders/UniformConstants.
+#define PIPELINE_CACHE_MAGIC 0x4839564B //VK9H
+#define PIPELINE_CACHE_VERSION 1
+#define PIPELINE_MANIFEST_MAGIC 0x4D39564B //VK9M
+#define PIPELINE_MANIFEST_VERSION 1
+#define PIPELINE_MANIFEST_MAX_ENTRIES 4096
+#define MAX_DYNAMIC_STATES 32
+#define MAX_SAMPLERS 1024 //Vulkan only promises 4000 for maxSamplerAllocationCount and the cache should stay well under it.
+#define MAX_BINDLESS_TEXTURES 16384 //Slots in the bindless texture table. A stage packs its slot into 16 bits so this can't go past 65536.
+#define MAX_BINDLESS_SAMPLERS (MAX_SAMPLERS * 2) //The sampler cache is only trimmed at the end of a frame so it can run over MAX_SAMPLERS until then.
+#define BINDLESS_STAGES 16 //Stage slots pushed after the transformations. Must match textureSlots in the textured fragment shaders.
+#define PIPELINE_ESTIMATED_SIZE 65536 //Drivers don't report what a pipeline costs so this is a rough per pipeline figure for the memory limit.
 
 #include <vulkan/vulkan.h>
 #include <vulkan/vk_sdk_platform.h>
 #include <boost/container/flat_map.hpp>
 #include <boost/container/small_vector.hpp>
+#include <boost/unordered_set.hpp>
+#include <boost/unordered_map.hpp>
 #include <Eigen/Dense>
 #include <memory>
 #include <chrono>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <string>
+#include <vector>
 
 #include "CTypes.h"
+#include "ShaderConverter.h"
 #include "CIndexBuffer9.h"
 
 class CDevice9;
+class CTexture9;
+class BufferManager;
+
+//What BeginDraw does when the pipeline it needs is still compiling on a worker thread.
+enum PipelineFallback
+{
+	PIPELINE_FALLBACK_WAIT = 0, //Block until the pipeline is ready.
+	PIPELINE_FALLBACK_SKIP = 1, //Drop the draw.
+	PIPELINE_FALLBACK_GENERIC = 2 //Draw with the generic pipeline for the same vertex format and fixed function pipeline state.
+};
+
+//Where CreateDescriptorSet gets its descriptor sets from.
+enum DescriptorAllocator
+{
+	DESCRIPTOR_ALLOCATOR_CACHED = 0, //Sets are kept across frames, looked up by their contents and recycled by age.
+	DESCRIPTOR_ALLOCATOR_LINEAR = 1 //Sets are allocated from the pools of the current frame and only shared within that frame. The pools are reset as a whole.
+};
+
+//The descriptor pools one frame allocates from when the linear allocator is used.
+struct FrameDescriptorPool
+{
+	std::vector<VkDescriptorPool> Pools;
+	size_t CurrentPool = 0;
+};
+
+/*
+Integer and boolean constants of one stage.
+Laid out for std140 as ivec4 Integers[16] followed by uvec4 Booleans[4].
+*/
+struct ShaderIntegerConstants
+{
+	int32_t Integers[MAX_SHADER_INTEGER_CONSTANTS * 4] = {};
+	BOOL Booleans[MAX_SHADER_BOOLEAN_CONSTANTS] = {};
+};
+
+//Every constant a D3D9 application can set. The getters read from here and draws upload the blocks that changed.
+struct ShaderConstants
+{
+	float VertexFloats[MAX_VERTEX_SHADER_FLOAT_CONSTANTS * 4] = {};
+	ShaderIntegerConstants VertexIntegers;
+	float PixelFloats[MAX_PIXEL_SHADER_FLOAT_CONSTANTS * 4] = {};
+	ShaderIntegerConstants PixelIntegers;
+};
+
+//The uniform buffers the fixed function shaders read in binding order. Each is a dynamic uniform buffer in the constant ring.
+enum FixedFunctionBlock
+{
+	FIXED_FUNCTION_LIGHTS = 0,
+	FIXED_FUNCTION_MATERIAL = 1,
+	FIXED_FUNCTION_RENDER_STATE = 2,
+	FIXED_FUNCTION_SPECIALIZATION = 3, //Only read by the generic shaders.
+	FIXED_FUNCTION_BLOCK_COUNT = 4
+};
+
+//The persistently mapped buffer one frame writes its shader constants and fixed function buffers into. A frame that runs out of room moves to a buffer twice the size.
+struct FrameConstantRing
+{
+	VkBuffer Buffer = VK_NULL_HANDLE;
+	VkDeviceMemory Memory = VK_NULL_HANDLE;
+	char* Data = nullptr;
+	VkDeviceSize Size = 0; //Bytes handed out. The buffer is a ShaderConstants larger so any block bound at the last offset stays inside it.
+	VkDeviceSize Offset = 0;
+	std::vector< std::pair<VkBuffer, VkDeviceMemory> > RetiredBuffers; //Outgrown this frame. Destroyed when the ring comes around again.
+};
 
 struct SamplerRequest
 {
@@ -42,7 +128,6 @@ struct SamplerRequest
 	VkSampler Sampler = VK_NULL_HANDLE;
 
 	//D3D9 State
-	DWORD SamplerIndex = 0;
 	D3DTEXTUREFILTERTYPE MagFilter = D3DTEXF_NONE;
 	D3DTEXTUREFILTERTYPE MinFilter = D3DTEXF_NONE;
 	D3DTEXTUREADDRESS AddressModeU = D3DTADDRESS_FORCE_DWORD;
@@ -53,36 +138,123 @@ struct SamplerRequest
 	float MipLodBias = 0.0f;
 	float MaxLod = 1.0f;
 
+	//Lookup
+	uint64_t Key = 0;
+	void UpdateKey();
+	uint32_t Slot = 0; //Where the sampler is in the bindless sampler table. 0 is the default sampler.
+
 	//Resource Handling.
-	std::chrono::steady_clock::time_point LastUsed = std::chrono::steady_clock::now();
+	uint64_t LastUsedFrame = 0;
 	CDevice9* mDevice = nullptr;
 	SamplerRequest(CDevice9* device) : mDevice(device) {}
 	~SamplerRequest();
 };
 
+//The descriptor infos come first and stay packed so an update template can read a set's contents straight out of the context.
 struct ResourceContext
 {
 	VkDescriptorImageInfo DescriptorImageInfo[16] = {};
+	VkDescriptorBufferInfo DescriptorBufferInfo[4] = {};
 
 	//Vulkan State
+	VkDescriptorSetLayout DescriptorSetLayout = VK_NULL_HANDLE;
 	VkDescriptorSet DescriptorSet = VK_NULL_HANDLE;
+	VkDescriptorPool DescriptorPool = VK_NULL_HANDLE; //The pool in the chain the set was allocated from.
+
+	//Lookup
+	size_t Hash = 0;
+	void UpdateHash();
 
 	//Resource Handling.
-	std::chrono::steady_clock::time_point LastUsed = std::chrono::steady_clock::now();
+	uint64_t LastUsedFrame = 0;
 	CDevice9* mDevice = nullptr;
 	ResourceContext(CDevice9* device) : mDevice(device) {}
 	~ResourceContext();
+	void Reset(CDevice9* device); //Frees anything owned and puts the context back the way the constructor left it.
 };
 
-struct DrawContext
+struct ResourceContextHash
 {
+	size_t operator()(const std::shared_ptr<ResourceContext>& context) const
+	{
+		return context->Hash;
+	}
+};
+
+struct ResourceContextEqual
+{
+	bool operator()(const std::shared_ptr<ResourceContext>& context1, const std::shared_ptr<ResourceContext>& context2) const;
+};
+
+/*
+A descriptor set layout and the pipeline layout built on it. Pipelines with the same bindings share one so descriptor sets and push constants carry over between them.
+Layouts are few and cheap to keep so they live as long as the BufferManager.
+*/
+struct LayoutContext
+{
+	//Key
+	VkDescriptorSetLayoutBinding Bindings[16 + SHADER_CONSTANT_BLOCK_COUNT] = {};
+	uint32_t BindingCount = 0;
+	VkDescriptorSetLayoutCreateFlags Flags = 0;
+	uint32_t SetLayoutCount = 1; //2 when the bindless texture table is set 1.
+	uint32_t PushConstantRangeCount = 0;
+	uint32_t PushConstantSize = 0;
+	BOOL IsFixedFunction = false;
+
 	//Vulkan State
 	VkDescriptorSetLayout DescriptorSetLayout = VK_NULL_HANDLE;
-	VkPipeline Pipeline = VK_NULL_HANDLE;
 	VkPipelineLayout PipelineLayout = VK_NULL_HANDLE;
+	VkDescriptorUpdateTemplateKHR DescriptorUpdateTemplate = VK_NULL_HANDLE; //Writes a ResourceContext into a set of DescriptorSetLayout.
+
+	//Lookup
+	size_t Hash = 0;
+	void UpdateHash();
+
+	//Resource Handling.
+	CDevice9* mDevice = nullptr;
+	LayoutContext(CDevice9* device) : mDevice(device) {}
+	~LayoutContext();
+};
+
+struct LayoutContextHash
+{
+	size_t operator()(const std::shared_ptr<LayoutContext>& context) const
+	{
+		return context->Hash;
+	}
+
+	//Lets FindLayout probe the cache with a key on the stack.
+	size_t operator()(const LayoutContext& context) const
+	{
+		return context.Hash;
+	}
+};
+
+struct LayoutContextEqual
+{
+	bool operator()(const LayoutContext& context1, const LayoutContext& context2) const;
+
+	bool operator()(const std::shared_ptr<LayoutContext>& context1, const std::shared_ptr<LayoutContext>& context2) const
+	{
+		return (*this)(*context1, *context2);
+	}
+
+	bool operator()(const LayoutContext& context1, const std::shared_ptr<LayoutContext>& context2) const
+	{
+		return (*this)(context1, *context2);
+	}
+};
+
+struct DrawContext
+{
+	//Vulkan State
+	VkDescriptorSetLayout DescriptorSetLayout = VK_NULL_HANDLE; //Not owner. Shared through the layout cache.
+	VkDescriptorUpdateTemplateKHR DescriptorUpdateTemplate = VK_NULL_HANDLE; //Not owner.
+	VkPipeline Pipeline = VK_NULL_HANDLE;
+	VkPipelineLayout PipelineLayout = VK_NULL_HANDLE; //Not owner.
 
 	//Misc
-	boost::container::flat_map<UINT, UINT> Bindings;
+	UINT Bindings[16][2] = {}; //stream, stride for the first StreamCount streams in stream order.
 
 	//D3D9 State - Pipe
 	D3DPRIMITIVETYPE PrimitiveType = D3DPT_FORCE_DWORD;
@@ -91,15 +263,215 @@ struct DrawContext
 	CVertexShader9* VertexShader = nullptr;
 	CPixelShader9* PixelShader = nullptr;
 	int32_t StreamCount = 0;
+	BOOL IsGeneric = false; //Uses the uniform constant shaders so only the pipeline state part of the constants is in the key.
 
 	//D3d9 State - Lights
 	SpecializationConstants mSpecializationConstants = {};	
 
+	//Lookup
+	size_t Hash = 0;
+	void UpdateHash();
+
+	//Set while the pipeline is queued on a worker thread. Pipeline is only valid once this is false.
+	std::atomic<bool> IsPending{ false };
+
+	//Compiled from the pipeline manifest and not drawn with yet. These don't age out until the first draw that uses them.
+	BOOL IsPrewarmed = false;
+
 	//Resource Handling.
-	std::chrono::steady_clock::time_point LastUsed = std::chrono::steady_clock::now();
+	uint64_t LastUsedFrame = 0;
+	size_t EstimatedSize = 0;
 	CDevice9* mDevice = nullptr;
 	DrawContext(CDevice9* device) : mDevice(device) {}
 	~DrawContext();
+	void Reset(CDevice9* device); //Destroys anything owned and puts the context back the way the constructor left it.
+	void Release();
+};
+
+//The hash is computed once in BeginDraw so the set only has to fall back to a full compare on a bucket hit.
+struct DrawContextHash
+{
+	size_t operator()(const std::shared_ptr<DrawContext>& context) const
+	{
+		return context->Hash;
+	}
+};
+
+struct DrawContextEqual
+{
+	bool operator()(const std::shared_ptr<DrawContext>& context1, const std::shared_ptr<DrawContext>& context2) const;
+};
+
+/*
+A copy of everything vkCreateGraphicsPipelines reads so the pipeline can be compiled on a worker thread while the draw thread keeps reusing the create info members of BufferManager.
+*/
+struct PipelineRequest
+{
+	std::shared_ptr<DrawContext> Context;
+
+	VkGraphicsPipelineCreateInfo GraphicsPipelineCreateInfo = {};
+	VkPipelineShaderStageCreateInfo PipelineShaderStageCreateInfo[2] = {};
+	VkSpecializationInfo SpecializationInfo = {};
+	SpecializationConstants mSpecializationConstants = {};
+
+	VkPipelineVertexInputStateCreateInfo PipelineVertexInputStateCreateInfo = {};
+	VkVertexInputBindingDescription VertexInputBindingDescription[16] = {};
+	VkVertexInputAttributeDescription VertexInputAttributeDescription[32] = {};
+	VkPipelineInputAssemblyStateCreateInfo PipelineInputAssemblyStateCreateInfo = {};
+	VkPipelineRasterizationStateCreateInfo PipelineRasterizationStateCreateInfo = {};
+	VkPipelineColorBlendAttachmentState PipelineColorBlendAttachmentState[1] = {};
+	VkPipelineColorBlendStateCreateInfo PipelineColorBlendStateCreateInfo = {};
+	VkPipelineDepthStencilStateCreateInfo PipelineDepthStencilStateCreateInfo = {};
+	VkPipelineViewportStateCreateInfo PipelineViewportStateCreateInfo = {};
+	VkPipelineMultisampleStateCreateInfo PipelineMultisampleStateCreateInfo = {};
+	VkPipelineDynamicStateCreateInfo PipelineDynamicStateCreateInfo = {};
+	VkDynamicState DynamicStateEnables[MAX_DYNAMIC_STATES] = {};
+
+	PipelineRequest(const BufferManager& bufferManager, std::shared_ptr<DrawContext> context);
+};
+
+/*
+Prefixed to the driver's pipeline cache blob on disk. The driver is supposed to reject foreign data itself but not all of them do so the identifying fields are checked before the blob is handed over.
+*/
+struct PipelineCacheHeader
+{
+	uint32_t Magic = PIPELINE_CACHE_MAGIC;
+	uint32_t Version = PIPELINE_CACHE_VERSION;
+	uint32_t VendorID = 0;
+	uint32_t DeviceID = 0;
+	uint32_t DriverVersion = 0;
+	uint8_t PipelineCacheUUID[VK_UUID_SIZE] = {};
+	uint64_t DataSize = 0;
+	uint64_t Checksum = 0;
+};
+
+/*
+The pipeline manifest lists the keys of the pipelines an application used so they can be compiled again before the first draw asks for them.
+Only keys that can be rebuilt without the application's objects are recorded. Vertex declarations and shaders are keyed by pointer so they can't be matched on the next run.
+*/
+struct PipelineManifestHeader
+{
+	uint32_t Magic = PIPELINE_MANIFEST_MAGIC;
+	uint32_t Version = PIPELINE_MANIFEST_VERSION;
+	uint32_t EntrySize = 0;
+	uint32_t EntryCount = 0;
+	VkFormat ColorFormat = VK_FORMAT_UNDEFINED;
+	VkFormat DepthFormat = VK_FORMAT_UNDEFINED;
+	uint64_t Checksum = 0;
+};
+
+struct PipelineManifestEntry
+{
+	uint32_t PrimitiveType = 0;
+	uint32_t FVF = 0;
+	uint32_t IsGeneric = 0;
+	int32_t StreamCount = 0;
+	uint32_t BindingCount = 0;
+	uint32_t Bindings[16][2] = {}; //stream, stride
+	SpecializationConstants mSpecializationConstants = {};
+};
+
+#define MAX_DYNAMIC_OFFSETS 8
+
+/*
+The render states that are set in the command buffer instead of the pipeline when the extended dynamic state extensions are in use.
+*/
+struct DynamicPipelineState
+{
+	//VK_EXT_extended_dynamic_state
+	VkCullModeFlags CullMode = VK_CULL_MODE_NONE;
+	VkFrontFace FrontFace = VK_FRONT_FACE_COUNTER_CLOCKWISE;
+	VkPrimitiveTopology PrimitiveTopology = VK_PRIMITIVE_TOPOLOGY_TRIANGLE_LIST;
+	VkBool32 DepthTestEnable = VK_FALSE;
+	VkBool32 DepthWriteEnable = VK_FALSE;
+	VkCompareOp DepthCompareOp = VK_COMPARE_OP_LESS_OR_EQUAL;
+	VkBool32 StencilTestEnable = VK_FALSE;
+	VkStencilOpState Front = {};
+	VkStencilOpState Back = {};
+
+	//VK_EXT_extended_dynamic_state2
+	VkBool32 DepthBiasEnable = VK_TRUE;
+
+	//VK_EXT_extended_dynamic_state3
+	VkPolygonMode PolygonMode = VK_POLYGON_MODE_FILL;
+	VkBool32 ColorBlendEnable = VK_FALSE;
+	VkColorBlendEquationEXT ColorBlendEquation = {};
+	VkColorComponentFlags ColorWriteMask = 0xf;
+};
+
+/*
+A shadow of what is bound on the command buffer being recorded so BeginDraw only emits the calls that change something.
+Bindings and dynamic state last for the whole command buffer, render pass breaks included, so Reset is only needed after vkBeginCommandBuffer.
+*/
+struct CommandBufferState
+{
+	VkCommandBuffer CommandBuffer = VK_NULL_HANDLE;
+
+	VkPipeline Pipeline = VK_NULL_HANDLE;
+
+	VkPipelineLayout PipelineLayout = VK_NULL_HANDLE; //The layout DescriptorSet was bound with.
+	VkDescriptorSet DescriptorSet = VK_NULL_HANDLE;
+	uint32_t DynamicOffsetCount = 0;
+	uint32_t DynamicOffsets[MAX_DYNAMIC_OFFSETS] = {};
+
+	VkBuffer VertexBuffers[16] = {};
+	VkDeviceSize VertexBufferOffsets[16] = {};
+	VkDeviceSize VertexBufferStrides[16] = {};
+	BOOL IsVertexBufferDirty[16] = {};
+
+	VkBuffer IndexBuffer = VK_NULL_HANDLE;
+	VkDeviceSize IndexBufferOffset = 0;
+	VkIndexType IndexType = VK_INDEX_TYPE_MAX_ENUM;
+
+	VkPipelineLayout PushConstantLayout = VK_NULL_HANDLE;
+	uint32_t PushConstants[UBO_SIZE * 2 / sizeof(uint32_t) + BINDLESS_STAGES] = {};
+	BOOL IsPushConstantValid[UBO_SIZE * 2 / sizeof(uint32_t) + BINDLESS_STAGES] = {};
+
+	VkPipelineLayout TextureTableLayout = VK_NULL_HANDLE; //The layout the bindless texture table was last bound to set 1 with.
+
+	BOOL HasViewport = false;
+	VkViewport Viewport = {};
+	BOOL HasScissor = false;
+	VkRect2D Scissor = {};
+	BOOL HasDepthBias = false;
+	float DepthBias[3] = {}; //constant, clamp, slope
+	BOOL HasBlendConstants = false;
+	float BlendConstants[4] = {};
+	BOOL HasStencil = false;
+	uint32_t StencilCompareMask = 0;
+	uint32_t StencilWriteMask = 0;
+	uint32_t StencilReference = 0;
+
+	BOOL HasPipelineState = false;
+	DynamicPipelineState PipelineState;
+
+	//What was last pushed with vkCmdPushDescriptorSetKHR. Binding a descriptor set to set 0 replaces it and the other way around.
+	VkPipelineLayout PushDescriptorLayout = VK_NULL_HANDLE;
+	VkDescriptorBufferInfo PushedBufferInfo[4] = {};
+	VkDescriptorImageInfo PushedImageInfo[16] = {};
+	uint32_t PushedImageCount = 0;
+
+	//Which extended dynamic state levels the pipelines are created with. These are kept across Reset.
+	CDevice9* mDevice = nullptr; //Not owner.
+	BOOL UseExtendedDynamicState = false;
+	BOOL UseExtendedDynamicState2 = false;
+	BOOL UseExtendedDynamicState3 = false;
+
+	void Reset(VkCommandBuffer commandBuffer);
+	void BindPipeline(VkPipeline pipeline);
+	void BindDescriptorSet(VkPipelineLayout layout, VkDescriptorSet descriptorSet, uint32_t dynamicOffsetCount = 0, const uint32_t* dynamicOffsets = nullptr);
+	void BindVertexBuffer(uint32_t binding, VkBuffer buffer, VkDeviceSize offset, VkDeviceSize stride);
+	void FlushVertexBuffers();
+	void BindIndexBuffer(VkBuffer buffer, VkDeviceSize offset, VkIndexType indexType);
+	void PushConstantData(VkPipelineLayout layout, const void* data, uint32_t size, uint32_t offset = 0);
+	void BindTextureTable(VkPipelineLayout layout, VkDescriptorSet descriptorSet);
+	uint32_t PushDescriptorSet(VkPipelineLayout layout, const VkWriteDescriptorSet* bufferWrites, const VkDescriptorBufferInfo* bufferInfo, const VkDescriptorImageInfo* imageInfo, uint32_t imageCount);
+	void SetViewport(const VkViewport& viewport);
+	void SetScissor(const VkRect2D& scissor);
+	void SetDepthBias(float constantFactor, float clamp, float slopeFactor);
+	void SetBlendConstants(const float blendConstants[4]);
+	void SetStencil(uint32_t compareMask, uint32_t writeMask, uint32_t reference);
+	void SetPipelineState(const DynamicPipelineState& state);
 };
 
 struct Transformations
@@ -109,13 +481,18 @@ struct Transformations
 	Eigen::Matrix4f mModel;
 	Eigen::Matrix4f mView;
 	Eigen::Matrix4f mProjection;
+	Eigen::Matrix4f mViewProjection; //Past the pushed range. Kept so a new world matrix only costs one product.
 };
 
-union PushConstants
+/*
+Mirrors RenderState in Shaders/Structures (std140).
+*/
+struct RenderState
 {
-	float Floats[64] = {};
-	uint32_t Integers[64];
-	BOOL Booleans[64];
+	uint32_t textureFactor = 0xFFFFFFFF;
+	uint32_t globalAmbient = 0;
+	float pointSize = 1.0f;
+	int32_t filler1 = 0;
 };
 
 class BufferManager
@@ -131,7 +508,7 @@ public:
 	CDevice9* mDevice = nullptr;
 	bool mIsDirty = true;
 
-	VkDynamicState mDynamicStateEnables[VK_DYNAMIC_STATE_RANGE_SIZE] = {};
+	VkDynamicState mDynamicStateEnables[MAX_DYNAMIC_STATES] = {};
 	VkPipelineColorBlendAttachmentState mPipelineColorBlendAttachmentState[1] = {};
 
 	VkPipelineVertexInputStateCreateInfo mPipelineVertexInputStateCreateInfo = {};
@@ -148,27 +525,27 @@ public:
 	VkPipelineShaderStageCreateInfo mPipelineShaderStageCreateInfo[2] = {};
 
 	VkDescriptorSetAllocateInfo mDescriptorSetAllocateInfo = {};
-	VkDescriptorSetLayoutBinding mDescriptorSetLayoutBinding[16] = {};
+	VkDescriptorSetLayoutBinding mDescriptorSetLayoutBinding[16 + SHADER_CONSTANT_BLOCK_COUNT] = {};
 	VkDescriptorSetLayoutCreateInfo mDescriptorSetLayoutCreateInfo = {};
 	VkPipelineLayoutCreateInfo mPipelineLayoutCreateInfo = {};
-	VkWriteDescriptorSet mWriteDescriptorSet[3] = {};
+	VkWriteDescriptorSet mWriteDescriptorSet[5] = {};
 	VkPushConstantRange mPushConstantRanges[1] = {};
-	VkDescriptorBufferInfo mDescriptorBufferInfo[2] = {};
+	VkDescriptorBufferInfo mDescriptorBufferInfo[4] = {};
 
 	//Created with max slots. I can pass a count to limit the number. This should prevent me from needing to realloc.
 	VkVertexInputBindingDescription mVertexInputBindingDescription[16] = {};
 	VkVertexInputAttributeDescription mVertexInputAttributeDescription[32] = {};
 
-	//Command Buffer & Buffer Copy Setup
-	VkCommandBufferAllocateInfo mCommandBufferAllocateInfo = {};
-	VkCommandBuffer mCommandBuffer = VK_NULL_HANDLE;
-	VkCommandBufferBeginInfo mBeginInfo = {};
+	//Buffer Copy Setup
 	VkBufferCopy mCopyRegion = {};
-	VkSubmitInfo mSubmitInfo = {};
 
 	//VkDescriptorSetLayout mDescriptorSetLayout;
 	//VkPipelineLayout mPipelineLayout;
 	VkPipelineCache mPipelineCache = VK_NULL_HANDLE;
+	std::string mPipelineCacheFile;
+	std::string mPipelineManifestFile;
+	std::vector<PipelineManifestEntry> mPipelineManifest;
+	boost::unordered_set<size_t> mPipelineManifestKeys;
 	//VkDescriptorSet mDescriptorSet;
 	//VkPipeline mPipeline;
 	
@@ -199,6 +576,34 @@ public:
 	VkShaderModule mVertShaderModule_XYZ_NORMAL_DIFFUSE_TEX2 = VK_NULL_HANDLE;
 	VkShaderModule mFragShaderModule_XYZ_NORMAL_DIFFUSE_TEX2 = VK_NULL_HANDLE;
 
+	//Built with UNIFORM_CONSTANTS so they read the fixed function state from the specialization block instead of specialization constants.
+	VkShaderModule mVertShaderModule_XYZ_DIFFUSE_Generic = VK_NULL_HANDLE;
+	VkShaderModule mFragShaderModule_XYZ_DIFFUSE_Generic = VK_NULL_HANDLE;
+
+	VkShaderModule mVertShaderModule_XYZ_TEX1_Generic = VK_NULL_HANDLE;
+	VkShaderModule mFragShaderModule_XYZ_TEX1_Generic = VK_NULL_HANDLE;
+
+	VkShaderModule mVertShaderModule_XYZ_TEX2_Generic = VK_NULL_HANDLE;
+	VkShaderModule mFragShaderModule_XYZ_TEX2_Generic = VK_NULL_HANDLE;
+
+	VkShaderModule mVertShaderModule_XYZ_DIFFUSE_TEX1_Generic = VK_NULL_HANDLE;
+	VkShaderModule mFragShaderModule_XYZ_DIFFUSE_TEX1_Generic = VK_NULL_HANDLE;
+
+	VkShaderModule mVertShaderModule_XYZ_DIFFUSE_TEX2_Generic = VK_NULL_HANDLE;
+	VkShaderModule mFragShaderModule_XYZ_DIFFUSE_TEX2_Generic = VK_NULL_HANDLE;
+
+	VkShaderModule mVertShaderModule_XYZ_NORMAL_Generic = VK_NULL_HANDLE;
+	VkShaderModule mFragShaderModule_XYZ_NORMAL_Generic = VK_NULL_HANDLE;
+
+	VkShaderModule mVertShaderModule_XYZ_NORMAL_TEX1_Generic = VK_NULL_HANDLE;
+	VkShaderModule mFragShaderModule_XYZ_NORMAL_TEX1_Generic = VK_NULL_HANDLE;
+
+	VkShaderModule mVertShaderModule_XYZ_NORMAL_DIFFUSE_Generic = VK_NULL_HANDLE;
+	VkShaderModule mFragShaderModule_XYZ_NORMAL_DIFFUSE_Generic = VK_NULL_HANDLE;
+
+	VkShaderModule mVertShaderModule_XYZ_NORMAL_DIFFUSE_TEX2_Generic = VK_NULL_HANDLE;
+	VkShaderModule mFragShaderModule_XYZ_NORMAL_DIFFUSE_TEX2_Generic = VK_NULL_HANDLE;
+
 	const VkSpecializationMapEntry mSpecializationMapEntries[251] =		
 	{ 
 		// id,offset,size
@@ -491,34 +896,153 @@ public:
 	
 	int32_t mVertexCount = 0;
 
-	VkBuffer mLightBuffer = VK_NULL_HANDLE;
-	VkDeviceMemory mLightBufferMemory = VK_NULL_HANDLE;
-	VkBuffer mMaterialBuffer = VK_NULL_HANDLE;
-	VkDeviceMemory mMaterialBufferMemory = VK_NULL_HANDLE;
-
-
-	boost::container::small_vector< std::shared_ptr<SamplerRequest>, 16> mSamplerRequests;
-	boost::container::small_vector< std::shared_ptr<DrawContext>, 16> mDrawBuffer;
-
-	boost::container::small_vector< std::shared_ptr<ResourceContext>, 16> mUsedResourceBuffer;
-	boost::container::small_vector< std::shared_ptr<ResourceContext>, 16> mUnusedResourceBuffer;
+	//Fixed function uniform buffers. Written into the frame's constant ring so changing them never leaves the render pass.
+	RenderState mRenderState;
+	SpecializationConstants mSpecializationBufferContents; //What the generic shaders read.
+	bool mIsSpecializationBufferDirty = true;
+	VkDescriptorType mFixedFunctionBufferType = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC; //Pushed descriptors can't be dynamic so they carry the offset themselves.
+	VkBuffer mFixedFunctionBuffer = VK_NULL_HANDLE; //The buffer mFixedFunctionOffsets point into.
+	uint32_t mFixedFunctionOffsets[FIXED_FUNCTION_BLOCK_COUNT] = {};
+	uint32_t mDirtyFixedFunctionBlocks = 0; //One bit per FixedFunctionBlock.
+	uint32_t mDirtyLights = 0; //One bit per light not yet written into the current light slot.
+	bool mIsLightSlotRead = false; //Set once a lit draw reads the current light slot. Until then changed lights are written into it in place.
+
+
+	boost::unordered_map<uint64_t, std::shared_ptr<SamplerRequest> > mSamplers;
+	uint32_t mMaximumSamplers = MAX_SAMPLERS;
+
+	//The sampler each stage resolved to and the stage generation it was resolved at.
+	std::shared_ptr<SamplerRequest> mStageSamplers[16];
+	uint32_t mStageSamplerGenerations[16] = {};
+	boost::unordered_set< std::shared_ptr<DrawContext>, DrawContextHash, DrawContextEqual> mDrawBuffer;
+
+	//Descriptor set and pipeline layouts shared by every pipeline with the same bindings.
+	boost::unordered_set< std::shared_ptr<LayoutContext>, LayoutContextHash, LayoutContextEqual> mLayouts;
+
+	//Descriptor sets with their contents in use. Sets drop out to the unused lists after mMaximumDescriptorSetAge frames and are rewritten when they are reused.
+	boost::unordered_set< std::shared_ptr<ResourceContext>, ResourceContextHash, ResourceContextEqual> mUsedResourceBuffer;
+	boost::unordered_map< VkDescriptorSetLayout, std::vector< std::shared_ptr<ResourceContext> > > mUnusedResourceBuffer;
+	std::vector<VkDescriptorPool> mDescriptorPools; //The first is the device's pool. The rest are chained on when it runs out.
+	uint32_t mMaximumDescriptorSetAge = 60; //In frames.
+
+	BOOL mUseDescriptorUpdateTemplates = false; //Fixed function sets are written with one template per layout instead of write arrays.
+
+	BOOL mUsePushDescriptors = false; //Fixed function draws push their descriptors instead of binding sets.
+
+	//Bindless texture table. Only fixed function shaders index it, with the stage slots pushed after the transformations. Only 2D textures have slots.
+	BOOL mUseFixedFunctionBindlessTextures = false;
+	VkDescriptorPool mBindlessDescriptorPool = VK_NULL_HANDLE;
+	VkDescriptorSetLayout mBindlessDescriptorSetLayout = VK_NULL_HANDLE;
+	VkDescriptorSet mBindlessDescriptorSet = VK_NULL_HANDLE;
+	uint32_t mNextTextureSlot = 1; //Slot 0 of both arrays holds the default image and sampler.
+	std::vector<uint32_t> mFreeTextureSlots;
+	std::vector< std::vector<uint32_t> > mRetiredTextureSlots; //Ring indexed by frame. Slots released while a frame was recorded are reused once it has retired.
+	uint32_t mNextSamplerSlot = 1;
+	std::vector<uint32_t> mFreeSamplerSlots;
+	uint32_t mStageSlots[BINDLESS_STAGES] = {}; //Sampler slot in the high 16 bits and texture slot in the low 16 bits.
+
+	DescriptorAllocator mDescriptorAllocator = DESCRIPTOR_ALLOCATOR_CACHED;
+	std::vector<FrameDescriptorPool> mFrameDescriptorPools; //Ring indexed by frame.
+	boost::unordered_set< std::shared_ptr<ResourceContext>, ResourceContextHash, ResourceContextEqual> mFrameResourceBuffer; //Sets allocated this frame by the linear allocator.
+
+	//Pipeline Cache Limits
+	uint64_t mFrameIndex = 0;
+	uint32_t mMaximumPipelines = 2048;
+	size_t mMaximumPipelineMemory = 256 * 1024 * 1024;
+	uint32_t mMaximumPipelineAge = 0; //In frames. Zero keeps pipelines until one of the other limits is reached.
+	size_t mPipelineMemory = 0;
+
+	//Pipeline Compilation
+	PipelineFallback mPipelineFallback = PIPELINE_FALLBACK_WAIT;
+	bool mUseGenericPipelines = false; //Fixed function draws always use the generic pipelines.
+
+	//Extended dynamic state. The states each level covers are left out of the pipeline key and set in BeginDraw instead.
+	BOOL mUseExtendedDynamicState = false;
+	BOOL mUseExtendedDynamicState2 = false;
+	BOOL mUseExtendedDynamicState3 = false;
+	BOOL mIsDynamicStateComparisonEnabled = false;
+	boost::unordered_set<size_t> mStaticPipelineKeys;
+	boost::unordered_set<size_t> mDynamicPipelineKeys;
+	std::vector<std::thread> mPipelineThreads;
+	std::deque< std::shared_ptr<PipelineRequest> > mPipelineRequests;
+	std::mutex mPipelineMutex;
+	std::condition_variable mPipelineRequestCondition;
+	std::condition_variable mPipelineCompleteCondition;
+	bool mIsStopping = false;
 
 	VkDescriptorSet mLastDescriptorSet = VK_NULL_HANDLE;
 	VkPipeline mLastVkPipeline = VK_NULL_HANDLE;
 
-	PushConstants mPushConstants;
+	//The last resolved draw. It is reused as long as none of the state it was resolved from has changed.
+	std::shared_ptr<DrawContext> mLastDrawContext;
+
+	/*
+	BeginDraw builds its keys in these. Draws that hit the caches hand them back untouched so they are reset and reused.
+	A new one is only allocated once a cache or a compile thread has kept a reference.
+	*/
+	std::shared_ptr<DrawContext> mDrawContext;
+	std::shared_ptr<DrawContext> mGenericContext; //The same for the key FindGenericContext builds.
+	std::shared_ptr<ResourceContext> mResourceContext;
+	StateGenerations mLastGenerations;
+	D3DPRIMITIVETYPE mLastPrimitiveType = D3DPT_FORCE_DWORD;
+	size_t mLastLightCount = 0;
+	size_t mLastTextureCount = 0;
+	uint64_t mTextureFrameNumber = 0; //Frame the bound textures were last stamped in.
+
+	//Shader constants. Draws with shaders copy the blocks that changed into the frame's ring and bind them with dynamic offsets.
+	ShaderConstants mShaderConstants;
+	std::vector<FrameConstantRing> mConstantRings; //Ring indexed by frame.
+	VkDeviceSize mConstantRingSize = 256 * 1024; //Starting size of each ring in bytes.
+	VkBuffer mConstantBuffer = VK_NULL_HANDLE; //The buffer mConstantOffsets point into.
+	uint32_t mConstantOffsets[SHADER_CONSTANT_BLOCK_COUNT] = {};
+	uint32_t mConstantSizes[SHADER_CONSTANT_BLOCK_COUNT] = {}; //Bytes up to the highest register the application has set in each block.
+	uint32_t mDirtyConstantBlocks = 0; //One bit per ShaderConstantBlock.
+
 	Transformations mTransformations;
+	BOOL mAreTransformationsValid = false;
+	uint32_t mWorldGeneration = 0; //The generations mTransformations were built from.
+	uint32_t mViewProjectionGeneration = 0;
+	CommandBufferState mCommandBufferState;
 
 	float mEpsilon = std::numeric_limits<float>::epsilon();
 
-	void BeginDraw(std::shared_ptr<DrawContext> context, std::shared_ptr<ResourceContext> resourceContext, D3DPRIMITIVETYPE type);
-	void CreatePipe(std::shared_ptr<DrawContext> context);
-	void CreateDescriptorSet(std::shared_ptr<DrawContext> context, std::shared_ptr<ResourceContext> resourceContext);
+	bool BeginDraw(D3DPRIMITIVETYPE type);
+	BOOL CreatePipe(const std::shared_ptr<DrawContext>& context);
+	void CompilePipelines();
+	void WaitForPipeline(const std::shared_ptr<DrawContext>& context);
+	std::shared_ptr<DrawContext> FindGenericContext(const std::shared_ptr<DrawContext>& context);
+	void StripDynamicPipelineState(const std::shared_ptr<DrawContext>& context, BOOL extendedDynamicState, BOOL extendedDynamicState3);
+	void GetDynamicPipelineState(const SpecializationConstants& constants, D3DPRIMITIVETYPE type, DynamicPipelineState& state);
+	void UpdateSpecializationBuffer(const SpecializationConstants& constants);
+	void CreateDescriptorSet(const std::shared_ptr<DrawContext>& context, const std::shared_ptr<ResourceContext>& resourceContext);
+	void CreateDescriptorUpdateTemplate(const std::shared_ptr<LayoutContext>& layout);
+	BOOL FindLayout(const std::shared_ptr<DrawContext>& context);
+	void CreateBindlessTable();
+	void UpdateTextureSlot(uint32_t slot, VkImageView imageView);
+	void UpdateSamplerSlot(uint32_t slot, VkSampler sampler);
+	uint32_t AcquireTextureSlot(VkImageView imageView);
+	void ReleaseTextureSlot(uint32_t slot);
+	uint32_t AcquireSamplerSlot(VkSampler sampler);
+	VkResult AllocateFrameDescriptorSet(VkDescriptorSetLayout descriptorSetLayout, VkDescriptorSet& descriptorSet);
+	void ResetFrameDescriptorPools();
 	void CreateSampler(std::shared_ptr<SamplerRequest> request);
+	void UpdateStageSampler(DWORD stage, CTexture9* texture);
+
+	void UpdateFixedFunctionBuffers();
+
+	void LoadPipelineCache(std::vector<char>& data);
+	void SavePipelineCache();
 
-	void UpdateBuffer();
+	void LoadPipelineManifest(std::vector<PipelineManifestEntry>& entries);
+	void SavePipelineManifest();
+	void RecordPipeline(std::shared_ptr<DrawContext> context);
+	void PrewarmPipelines();
 
-	void UpdatePushConstants(std::shared_ptr<DrawContext> context);
+	void UpdatePushConstants(const std::shared_ptr<DrawContext>& context);
+	void SetShaderConstants(ShaderConstantBlock block, size_t offset, const void* data, size_t size);
+	void UpdateShaderConstants();
+	void GrowConstantRing(FrameConstantRing& ring, VkDeviceSize size);
+	void ResetConstantRing();
 	void FlushDrawBufffer();
 
 	void CreateBuffer(VkDeviceSize size, VkBufferUsageFlags usage, VkMemoryPropertyFlags properties, VkBuffer& buffer, VkDeviceMemory& deviceMemory);
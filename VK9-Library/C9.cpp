@@ -45,7 +45,27 @@ C9::C9()
 	//Setup configuration & logging.
 
 	mOptionDescriptions.add_options()
-		("LogFile", boost::program_options::value<std::string>(), "The location of the log file.");
+		("LogFile", boost::program_options::value<std::string>(), "The location of the log file.")
+		("PipelineCacheFile", boost::program_options::value<std::string>(), "The location of the pipeline cache file. Defaults to the executable name with a .vk9cache extension. Leave empty to disable.")
+		("PipelineManifestFile", boost::program_options::value<std::string>(), "The location of the list of pipelines to compile at device creation. Defaults to the executable name with a .vk9manifest extension. Leave empty to disable.")
+		("PipelineCacheMaxEntries", boost::program_options::value<uint32_t>(), "The number of pipelines kept before the least recently used ones are destroyed.")
+		("PipelineCacheMaxMemory", boost::program_options::value<uint32_t>(), "The estimated memory in megabytes used by pipelines before the least recently used ones are destroyed.")
+		("PipelineCacheMaxFrames", boost::program_options::value<uint32_t>(), "The number of frames a pipeline can go unused before it is destroyed. Zero only destroys pipelines to stay under the other limits.")
+		("PipelineCompileThreads", boost::program_options::value<int32_t>(), "The number of threads used to compile pipelines. Zero compiles on the draw thread.")
+		("PipelineFallback", boost::program_options::value<std::string>(), "What to do with a draw whose pipeline is still compiling. Wait, Skip or Generic.")
+		("FixedFunctionShaders", boost::program_options::value<std::string>(), "Specialized compiles a pipeline for each fixed function state. Generic reads the state from a uniform buffer so fewer pipelines are compiled at the cost of slower shaders.")
+		("DynamicPipelineState", boost::program_options::value<bool>(), "Set states covered by the extended dynamic state extensions in the command buffer instead of compiling them into pipelines. Defaults to true when the device supports them.")
+		("DynamicPipelineStateComparison", boost::program_options::value<bool>(), "Log how many pipelines were needed with and without dynamic pipeline state when the device is destroyed.")
+		("DescriptorSetMaxFrames", boost::program_options::value<uint32_t>(), "The number of frames a descriptor set can go unbound before it is recycled for different resources.")
+		("DescriptorAllocator", boost::program_options::value<std::string>(), "Cached keeps descriptor sets across frames and reuses them by their contents. Linear allocates them from per frame pools that are reset as a whole.")
+		("PushDescriptors", boost::program_options::value<bool>(), "Push fixed function descriptors into the command buffer instead of allocating descriptor sets. Defaults to true when the device supports VK_KHR_push_descriptor.")
+		("FixedFunctionBindlessTextures", boost::program_options::value<bool>(), "Sample 2D textures in fixed function draws from one bindless table indexed by push constants. Cube and volume textures and shader draws are still bound per draw. Defaults to true when the device supports VK_EXT_descriptor_indexing.")
+		("DescriptorUpdateTemplates", boost::program_options::value<bool>(), "Write fixed function descriptor sets with one update template per layout. Defaults to true when the device supports VK_KHR_descriptor_update_template.")
+		("ShaderConstantRingSize", boost::program_options::value<uint32_t>(), "The starting size in kilobytes of the per frame buffers shader constants are written into. A frame that runs out of room doubles its buffer.")
+		("FramesInFlight", boost::program_options::value<uint32_t>(), "The number of frames the CPU can record ahead of the GPU. Each one keeps its own command buffer, semaphores and per frame buffers. Defaults to 2.")
+		("SubmissionThread", boost::program_options::value<bool>(), "Make queue submissions and presents on a dedicated thread so the API thread can start recording the next frame right away. Defaults to false.")
+		("CommandStream", boost::program_options::value<bool>(), "Record the common D3D9 calls into a command stream and replay them into Vulkan on a worker thread. Locks, state reads and resource creation wait for the stream to drain. Defaults to false.")
+		("LogStatistics", boost::program_options::value<bool>(), "Log the device's counters for pipelines, descriptors, uploads, submissions and the command stream when the device is destroyed. Defaults to false.");
 
 	boost::program_options::store(boost::program_options::parse_config_file<char>("VK9.conf", mOptionDescriptions), mOptions);
 	boost::program_options::notify(mOptions);
@@ -108,6 +128,10 @@ C9::C9()
 		{
 			mExtensionNames.push_back("VK_KHR_display");
 		}
+		if (strcmp(extension[i].extensionName, "VK_KHR_get_physical_device_properties2") == 0)
+		{
+			mExtensionNames.push_back("VK_KHR_get_physical_device_properties2");
+		}
 	}
 
 	delete[] extension;
@@ -175,6 +199,7 @@ C9::C9()
 	{
 		vkGetPhysicalDeviceDisplayPropertiesKHR = reinterpret_cast<PFN_vkGetPhysicalDeviceDisplayPropertiesKHR>(vkGetInstanceProcAddr(mInstance, "vkGetPhysicalDeviceDisplayPropertiesKHR"));
 		vkGetDisplayModePropertiesKHR = reinterpret_cast<PFN_vkGetDisplayModePropertiesKHR>(vkGetInstanceProcAddr(mInstance, "vkGetDisplayModePropertiesKHR"));
+		vkGetPhysicalDeviceFeatures2KHR = reinterpret_cast<PFN_vkGetPhysicalDeviceFeatures2KHR>(vkGetInstanceProcAddr(mInstance, "vkGetPhysicalDeviceFeatures2KHR"));
 
 #ifdef _DEBUG
 		/* Load VK_EXT_debug_report entry points in debug builds */
@@ -128,14 +128,158 @@ CDevice9::CDevice9(C9* Instance, UINT Adapter, D3DDEVTYPE DeviceType, HWND hFocu
 	VkExtensionProperties* extension = new VkExtensionProperties[extensionCount];
 	vkEnumerateDeviceExtensionProperties(mPhysicalDevice, nullptr, &extensionCount, extension);
 
+	BOOL hasExtendedDynamicState = false;
+	BOOL hasExtendedDynamicState2 = false;
+	BOOL hasExtendedDynamicState3 = false;
+	BOOL hasPushDescriptor = false;
+	BOOL hasDescriptorIndexing = false;
+	BOOL hasMaintenance3 = false;
+	BOOL hasDescriptorUpdateTemplate = false;
+
 	for (size_t i = 0; i < extensionCount; i++)
 	{
 		BOOST_LOG_TRIVIAL(info) << "CDevice9::CDevice9 extension available: " << extension[i].extensionName;
+
+		if (strcmp(extension[i].extensionName, VK_EXT_EXTENDED_DYNAMIC_STATE_EXTENSION_NAME) == 0)
+		{
+			hasExtendedDynamicState = true;
+		}
+		else if (strcmp(extension[i].extensionName, VK_EXT_EXTENDED_DYNAMIC_STATE_2_EXTENSION_NAME) == 0)
+		{
+			hasExtendedDynamicState2 = true;
+		}
+		else if (strcmp(extension[i].extensionName, VK_EXT_EXTENDED_DYNAMIC_STATE_3_EXTENSION_NAME) == 0)
+		{
+			hasExtendedDynamicState3 = true;
+		}
+		else if (strcmp(extension[i].extensionName, VK_KHR_PUSH_DESCRIPTOR_EXTENSION_NAME) == 0)
+		{
+			hasPushDescriptor = true;
+		}
+		else if (strcmp(extension[i].extensionName, VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME) == 0)
+		{
+			hasDescriptorIndexing = true;
+		}
+		else if (strcmp(extension[i].extensionName, VK_KHR_MAINTENANCE3_EXTENSION_NAME) == 0)
+		{
+			hasMaintenance3 = true;
+		}
+		else if (strcmp(extension[i].extensionName, VK_KHR_DESCRIPTOR_UPDATE_TEMPLATE_EXTENSION_NAME) == 0)
+		{
+			hasDescriptorUpdateTemplate = true;
+		}
 	}
 
 	delete[] extension;
 
 	mExtensionNames.push_back(VK_KHR_SWAPCHAIN_EXTENSION_NAME);
+
+	/*
+	The extended dynamic state extensions let render states be set in the command buffer instead of needing a pipeline for each combination.
+	Only the feature structures of extensions the device has are chained and each level is only used when every feature BufferManager needs from it is there.
+	*/
+	VkPhysicalDeviceExtendedDynamicStateFeaturesEXT extendedDynamicStateFeatures = {};
+	extendedDynamicStateFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTENDED_DYNAMIC_STATE_FEATURES_EXT;
+	VkPhysicalDeviceExtendedDynamicState2FeaturesEXT extendedDynamicState2Features = {};
+	extendedDynamicState2Features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTENDED_DYNAMIC_STATE_2_FEATURES_EXT;
+	VkPhysicalDeviceExtendedDynamicState3FeaturesEXT extendedDynamicState3Features = {};
+	extendedDynamicState3Features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_EXTENDED_DYNAMIC_STATE_3_FEATURES_EXT;
+
+	//Descriptor indexing backs the bindless texture table. It depends on VK_KHR_maintenance3.
+	hasDescriptorIndexing = hasDescriptorIndexing && hasMaintenance3;
+	VkPhysicalDeviceDescriptorIndexingFeaturesEXT descriptorIndexingFeatures = {};
+	descriptorIndexingFeatures.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_DESCRIPTOR_INDEXING_FEATURES_EXT;
+
+	if (mInstance->vkGetPhysicalDeviceFeatures2KHR != nullptr && (hasExtendedDynamicState || hasDescriptorIndexing))
+	{
+		VkPhysicalDeviceFeatures2KHR features = {};
+		features.sType = VK_STRUCTURE_TYPE_PHYSICAL_DEVICE_FEATURES_2_KHR;
+
+		void** next = &features.pNext;
+		if (hasExtendedDynamicState)
+		{
+			(*next) = &extendedDynamicStateFeatures;
+			next = &extendedDynamicStateFeatures.pNext;
+		}
+		if (hasExtendedDynamicState2)
+		{
+			(*next) = &extendedDynamicState2Features;
+			next = &extendedDynamicState2Features.pNext;
+		}
+		if (hasExtendedDynamicState3)
+		{
+			(*next) = &extendedDynamicState3Features;
+			next = &extendedDynamicState3Features.pNext;
+		}
+		if (hasDescriptorIndexing)
+		{
+			(*next) = &descriptorIndexingFeatures;
+			next = &descriptorIndexingFeatures.pNext;
+		}
+
+		mInstance->vkGetPhysicalDeviceFeatures2KHR(mPhysicalDevice, &features);
+
+		mIsExtendedDynamicStateSupported = hasExtendedDynamicState && extendedDynamicStateFeatures.extendedDynamicState;
+		mIsExtendedDynamicState2Supported = mIsExtendedDynamicStateSupported && hasExtendedDynamicState2 && extendedDynamicState2Features.extendedDynamicState2;
+		mIsExtendedDynamicState3Supported = mIsExtendedDynamicStateSupported && hasExtendedDynamicState3
+			&& extendedDynamicState3Features.extendedDynamicState3PolygonMode
+			&& extendedDynamicState3Features.extendedDynamicState3ColorBlendEnable
+			&& extendedDynamicState3Features.extendedDynamicState3ColorBlendEquation
+			&& extendedDynamicState3Features.extendedDynamicState3ColorWriteMask;
+
+		//Slots are written while the table is bound and most of them are empty at any time.
+		mIsDescriptorIndexingSupported = hasDescriptorIndexing
+			&& descriptorIndexingFeatures.runtimeDescriptorArray
+			&& descriptorIndexingFeatures.descriptorBindingPartiallyBound
+			&& descriptorIndexingFeatures.descriptorBindingSampledImageUpdateAfterBind
+			&& descriptorIndexingFeatures.descriptorBindingUpdateUnusedWhilePending;
+	}
+
+	BOOST_LOG_TRIVIAL(info) << "CDevice9::CDevice9 extended dynamic state support: " << mIsExtendedDynamicStateSupported << " " << mIsExtendedDynamicState2Supported << " " << mIsExtendedDynamicState3Supported;
+
+	void* deviceFeatures = nullptr;
+	if (mIsExtendedDynamicState3Supported)
+	{
+		extendedDynamicState3Features.pNext = deviceFeatures;
+		deviceFeatures = &extendedDynamicState3Features;
+		mExtensionNames.push_back(VK_EXT_EXTENDED_DYNAMIC_STATE_3_EXTENSION_NAME);
+	}
+	if (mIsExtendedDynamicState2Supported)
+	{
+		extendedDynamicState2Features.pNext = deviceFeatures;
+		deviceFeatures = &extendedDynamicState2Features;
+		mExtensionNames.push_back(VK_EXT_EXTENDED_DYNAMIC_STATE_2_EXTENSION_NAME);
+	}
+	if (mIsExtendedDynamicStateSupported)
+	{
+		extendedDynamicStateFeatures.pNext = deviceFeatures;
+		deviceFeatures = &extendedDynamicStateFeatures;
+		mExtensionNames.push_back(VK_EXT_EXTENDED_DYNAMIC_STATE_EXTENSION_NAME);
+	}
+
+	//Push descriptors need VK_KHR_get_physical_device_properties2 on the instance.
+	mIsPushDescriptorSupported = hasPushDescriptor && mInstance->vkGetPhysicalDeviceFeatures2KHR != nullptr;
+	if (mIsPushDescriptorSupported)
+	{
+		mExtensionNames.push_back(VK_KHR_PUSH_DESCRIPTOR_EXTENSION_NAME);
+	}
+	BOOST_LOG_TRIVIAL(info) << "CDevice9::CDevice9 push descriptor support: " << mIsPushDescriptorSupported;
+
+	mIsDescriptorUpdateTemplateSupported = hasDescriptorUpdateTemplate;
+	if (mIsDescriptorUpdateTemplateSupported)
+	{
+		mExtensionNames.push_back(VK_KHR_DESCRIPTOR_UPDATE_TEMPLATE_EXTENSION_NAME);
+	}
+	BOOST_LOG_TRIVIAL(info) << "CDevice9::CDevice9 descriptor update template support: " << mIsDescriptorUpdateTemplateSupported;
+
+	if (mIsDescriptorIndexingSupported)
+	{
+		descriptorIndexingFeatures.pNext = deviceFeatures;
+		deviceFeatures = &descriptorIndexingFeatures;
+		mExtensionNames.push_back(VK_KHR_MAINTENANCE3_EXTENSION_NAME);
+		mExtensionNames.push_back(VK_EXT_DESCRIPTOR_INDEXING_EXTENSION_NAME);
+	}
+	BOOST_LOG_TRIVIAL(info) << "CDevice9::CDevice9 descriptor indexing support: " << mIsDescriptorIndexingSupported;
 #ifdef _DEBUG
 	mLayerExtensionNames.push_back("VK_LAYER_LUNARG_standard_validation");
 #endif // _DEBUG
@@ -149,7 +293,7 @@ CDevice9::CDevice9(C9* Instance, UINT Adapter, D3DDEVTYPE DeviceType, HWND hFocu
 
 	VkDeviceCreateInfo device_info = {};
 	device_info.sType = VK_STRUCTURE_TYPE_DEVICE_CREATE_INFO;
-	device_info.pNext = nullptr;
+	device_info.pNext = deviceFeatures;
 	device_info.queueCreateInfoCount = 1;
 	device_info.pQueueCreateInfos = &queue_info;
 	device_info.enabledExtensionCount = mExtensionNames.size();
@@ -169,6 +313,46 @@ CDevice9::CDevice9(C9* Instance, UINT Adapter, D3DDEVTYPE DeviceType, HWND hFocu
 		BOOST_LOG_TRIVIAL(info) << "CDevice9::CDevice9 vkCreateDevice returned a valid device.";
 	}
 
+	if (mIsExtendedDynamicStateSupported)
+	{
+		vkCmdSetCullModeEXT = reinterpret_cast<PFN_vkCmdSetCullModeEXT>(vkGetDeviceProcAddr(mDevice, "vkCmdSetCullModeEXT"));
+		vkCmdSetFrontFaceEXT = reinterpret_cast<PFN_vkCmdSetFrontFaceEXT>(vkGetDeviceProcAddr(mDevice, "vkCmdSetFrontFaceEXT"));
+		vkCmdSetPrimitiveTopologyEXT = reinterpret_cast<PFN_vkCmdSetPrimitiveTopologyEXT>(vkGetDeviceProcAddr(mDevice, "vkCmdSetPrimitiveTopologyEXT"));
+		vkCmdBindVertexBuffers2EXT = reinterpret_cast<PFN_vkCmdBindVertexBuffers2EXT>(vkGetDeviceProcAddr(mDevice, "vkCmdBindVertexBuffers2EXT"));
+		vkCmdSetDepthTestEnableEXT = reinterpret_cast<PFN_vkCmdSetDepthTestEnableEXT>(vkGetDeviceProcAddr(mDevice, "vkCmdSetDepthTestEnableEXT"));
+		vkCmdSetDepthWriteEnableEXT = reinterpret_cast<PFN_vkCmdSetDepthWriteEnableEXT>(vkGetDeviceProcAddr(mDevice, "vkCmdSetDepthWriteEnableEXT"));
+		vkCmdSetDepthCompareOpEXT = reinterpret_cast<PFN_vkCmdSetDepthCompareOpEXT>(vkGetDeviceProcAddr(mDevice, "vkCmdSetDepthCompareOpEXT"));
+		vkCmdSetStencilTestEnableEXT = reinterpret_cast<PFN_vkCmdSetStencilTestEnableEXT>(vkGetDeviceProcAddr(mDevice, "vkCmdSetStencilTestEnableEXT"));
+		vkCmdSetStencilOpEXT = reinterpret_cast<PFN_vkCmdSetStencilOpEXT>(vkGetDeviceProcAddr(mDevice, "vkCmdSetStencilOpEXT"));
+	}
+
+	if (mIsExtendedDynamicState2Supported)
+	{
+		vkCmdSetDepthBiasEnableEXT = reinterpret_cast<PFN_vkCmdSetDepthBiasEnableEXT>(vkGetDeviceProcAddr(mDevice, "vkCmdSetDepthBiasEnableEXT"));
+	}
+
+	if (mIsExtendedDynamicState3Supported)
+	{
+		vkCmdSetPolygonModeEXT = reinterpret_cast<PFN_vkCmdSetPolygonModeEXT>(vkGetDeviceProcAddr(mDevice, "vkCmdSetPolygonModeEXT"));
+		vkCmdSetColorBlendEnableEXT = reinterpret_cast<PFN_vkCmdSetColorBlendEnableEXT>(vkGetDeviceProcAddr(mDevice, "vkCmdSetColorBlendEnableEXT"));
+		vkCmdSetColorBlendEquationEXT = reinterpret_cast<PFN_vkCmdSetColorBlendEquationEXT>(vkGetDeviceProcAddr(mDevice, "vkCmdSetColorBlendEquationEXT"));
+		vkCmdSetColorWriteMaskEXT = reinterpret_cast<PFN_vkCmdSetColorWriteMaskEXT>(vkGetDeviceProcAddr(mDevice, "vkCmdSetColorWriteMaskEXT"));
+	}
+
+	if (mIsPushDescriptorSupported)
+	{
+		vkCmdPushDescriptorSetKHR = reinterpret_cast<PFN_vkCmdPushDescriptorSetKHR>(vkGetDeviceProcAddr(mDevice, "vkCmdPushDescriptorSetKHR"));
+		mIsPushDescriptorSupported = (vkCmdPushDescriptorSetKHR != nullptr);
+	}
+
+	if (mIsDescriptorUpdateTemplateSupported)
+	{
+		vkCreateDescriptorUpdateTemplateKHR = reinterpret_cast<PFN_vkCreateDescriptorUpdateTemplateKHR>(vkGetDeviceProcAddr(mDevice, "vkCreateDescriptorUpdateTemplateKHR"));
+		vkDestroyDescriptorUpdateTemplateKHR = reinterpret_cast<PFN_vkDestroyDescriptorUpdateTemplateKHR>(vkGetDeviceProcAddr(mDevice, "vkDestroyDescriptorUpdateTemplateKHR"));
+		vkUpdateDescriptorSetWithTemplateKHR = reinterpret_cast<PFN_vkUpdateDescriptorSetWithTemplateKHR>(vkGetDeviceProcAddr(mDevice, "vkUpdateDescriptorSetWithTemplateKHR"));
+		mIsDescriptorUpdateTemplateSupported = (vkCreateDescriptorUpdateTemplateKHR != nullptr && vkDestroyDescriptorUpdateTemplateKHR != nullptr && vkUpdateDescriptorSetWithTemplateKHR != nullptr);
+	}
+
 	/*
 	Now that the rendering is setup the surface must be created.
 	The surface maybe inside of a window or a whole display. (Think SDL)
@@ -279,81 +463,25 @@ CDevice9::CDevice9(C9* Instance, UINT Adapter, D3DDEVTYPE DeviceType, HWND hFocu
 		BOOST_LOG_TRIVIAL(info) << "CDevice9::CDevice9 vkCreateCommandPool succeeded.";
 	}
 
-	//Setup the descriptor pool for resource binding.
-	VkDescriptorPoolSize descriptorPoolSizes[11] = {};
-#define MAX_DESCRIPTOR 2048
-
-	descriptorPoolSizes[0].type = VK_DESCRIPTOR_TYPE_SAMPLER;
-	descriptorPoolSizes[0].descriptorCount = min((uint32_t)MAX_DESCRIPTOR, mDeviceProperties.limits.maxDescriptorSetSamplers);
+	//The descriptor pools are clamped to these limits. They don't change so they are only logged once.
 	BOOST_LOG_TRIVIAL(info) << "CDevice9::CDevice9 maxDescriptorSetSamplers = " << mDeviceProperties.limits.maxDescriptorSetSamplers;
-
-	descriptorPoolSizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
-	descriptorPoolSizes[1].descriptorCount = min((uint32_t)MAX_DESCRIPTOR, mDeviceProperties.limits.maxPerStageDescriptorSamplers);
 	BOOST_LOG_TRIVIAL(info) << "CDevice9::CDevice9 maxPerStageDescriptorSamplers = " << mDeviceProperties.limits.maxPerStageDescriptorSamplers;
-
-	descriptorPoolSizes[2].type = VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE;
-	descriptorPoolSizes[2].descriptorCount = min((uint32_t)MAX_DESCRIPTOR, mDeviceProperties.limits.maxDescriptorSetSampledImages);
 	BOOST_LOG_TRIVIAL(info) << "CDevice9::CDevice9 maxDescriptorSetSampledImages = " << mDeviceProperties.limits.maxDescriptorSetSampledImages;
-
-	descriptorPoolSizes[3].type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
-	descriptorPoolSizes[3].descriptorCount = min((uint32_t)MAX_DESCRIPTOR, mDeviceProperties.limits.maxDescriptorSetStorageImages);
 	BOOST_LOG_TRIVIAL(info) << "CDevice9::CDevice9 maxDescriptorSetStorageImages = " << mDeviceProperties.limits.maxDescriptorSetStorageImages;
-
-	descriptorPoolSizes[4].type = VK_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER;
-	descriptorPoolSizes[4].descriptorCount = min((uint32_t)MAX_DESCRIPTOR, mDeviceProperties.limits.maxPerStageDescriptorSampledImages);
 	BOOST_LOG_TRIVIAL(info) << "CDevice9::CDevice9 maxPerStageDescriptorSampledImages = " << mDeviceProperties.limits.maxPerStageDescriptorSampledImages;
-
-	descriptorPoolSizes[5].type = VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER;
-	descriptorPoolSizes[5].descriptorCount = min((uint32_t)MAX_DESCRIPTOR, mDeviceProperties.limits.maxPerStageDescriptorStorageImages);
 	BOOST_LOG_TRIVIAL(info) << "CDevice9::CDevice9 maxPerStageDescriptorStorageImages = " << mDeviceProperties.limits.maxPerStageDescriptorStorageImages;
-
-	descriptorPoolSizes[6].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
-	descriptorPoolSizes[6].descriptorCount = min((uint32_t)MAX_DESCRIPTOR, mDeviceProperties.limits.maxDescriptorSetUniformBuffers);
 	BOOST_LOG_TRIVIAL(info) << "CDevice9::CDevice9 maxDescriptorSetUniformBuffers = " << mDeviceProperties.limits.maxDescriptorSetUniformBuffers;
-
-	descriptorPoolSizes[7].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
-	descriptorPoolSizes[7].descriptorCount = min((uint32_t)MAX_DESCRIPTOR, mDeviceProperties.limits.maxDescriptorSetStorageBuffers);
 	BOOST_LOG_TRIVIAL(info) << "CDevice9::CDevice9 maxDescriptorSetStorageBuffers = " << mDeviceProperties.limits.maxDescriptorSetStorageBuffers;
-
-	descriptorPoolSizes[8].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
-	descriptorPoolSizes[8].descriptorCount = min((uint32_t)MAX_DESCRIPTOR, mDeviceProperties.limits.maxDescriptorSetUniformBuffersDynamic);
 	BOOST_LOG_TRIVIAL(info) << "CDevice9::CDevice9 maxDescriptorSetUniformBuffersDynamic = " << mDeviceProperties.limits.maxDescriptorSetUniformBuffersDynamic;
-
-	descriptorPoolSizes[9].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
-	descriptorPoolSizes[9].descriptorCount = min((uint32_t)MAX_DESCRIPTOR, mDeviceProperties.limits.maxDescriptorSetStorageBuffersDynamic);
 	BOOST_LOG_TRIVIAL(info) << "CDevice9::CDevice9 maxDescriptorSetStorageBuffersDynamic = " << mDeviceProperties.limits.maxDescriptorSetStorageBuffersDynamic;
-
-	descriptorPoolSizes[10].type = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT;
-	descriptorPoolSizes[10].descriptorCount = min((uint32_t)MAX_DESCRIPTOR, mDeviceProperties.limits.maxDescriptorSetInputAttachments);
 	BOOST_LOG_TRIVIAL(info) << "CDevice9::CDevice9 maxDescriptorSetInputAttachments = " << mDeviceProperties.limits.maxDescriptorSetInputAttachments;
 
-
-	VkDescriptorPoolCreateInfo descriptorPoolCreateInfo = {};
-	descriptorPoolCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
-	descriptorPoolCreateInfo.pNext = NULL;
-	descriptorPoolCreateInfo.maxSets = min((uint32_t)MAX_DESCRIPTOR, mDeviceProperties.limits.maxDescriptorSetSamplers);
-	descriptorPoolCreateInfo.poolSizeCount = 11;
-	descriptorPoolCreateInfo.pPoolSizes = descriptorPoolSizes;
-
-	/*
-	This flag allows descriptors to return to the pool when they are freed.
-	If not set we'll have to reset the pool and frankly I don't want to code for that.
-	The only reason I can think that you wouldn't want to do this is if it makes create/destroy cheaper but it hardly seems with it.
-	*/
-	descriptorPoolCreateInfo.flags = VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT;
-
-	mResult = vkCreateDescriptorPool(mDevice, &descriptorPoolCreateInfo, nullptr, &mDescriptorPool);
+	//Setup the descriptor pool for resource binding.
+	mResult = CreateDescriptorPool(mDescriptorPool);
 	if (mResult != VK_SUCCESS)
 	{
-		BOOST_LOG_TRIVIAL(fatal) << "CDevice9::CDevice9 vkCreateDescriptorPool failed with return code of " << mResult;
 		return;
 	}
-	else
-	{
-		BOOST_LOG_TRIVIAL(info) << "CDevice9::CDevice9 vkCreateDescriptorPool succeeded.";
-	}
-
-	mGarbageManager.mDescriptorPool = mDescriptorPool;
 
 	//Create queue so we can submit command buffers.
 	vkGetDeviceQueue(mDevice, mGraphicsQueueIndex, 0, &mQueue);
@@ -1069,7 +1197,7 @@ CDevice9::CDevice9(C9* Instance, UINT Adapter, D3DDEVTYPE DeviceType, HWND hFocu
 	swapchainCreateInfo.imageFormat = mFormat;
 	swapchainCreateInfo.imageColorSpace = mSurfaceFormats[0].colorSpace;
 	swapchainCreateInfo.imageExtent = mSwapchainExtent;
-	swapchainCreateInfo.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT;
+	swapchainCreateInfo.imageUsage = VK_IMAGE_USAGE_COLOR_ATTACHMENT_BIT | VK_IMAGE_USAGE_TRANSFER_DST_BIT | (mSurfaceCapabilities.supportedUsageFlags & VK_IMAGE_USAGE_TRANSFER_SRC_BIT); //Transfer source lets GetRenderTargetData copy the back buffer.
 	swapchainCreateInfo.preTransform = mTransformFlags;
 	swapchainCreateInfo.compositeAlpha = VK_COMPOSITE_ALPHA_OPAQUE_BIT_KHR;
 	swapchainCreateInfo.imageArrayLayers = 1;
@@ -1109,7 +1237,6 @@ CDevice9::CDevice9(C9* Instance, UINT Adapter, D3DDEVTYPE DeviceType, HWND hFocu
 	}
 	mSwapchainImages = new VkImage[mSwapchainImageCount];
 	mSwapchainViews = new VkImageView[mSwapchainImageCount];
-	mSwapchainBuffers = new VkCommandBuffer[mSwapchainImageCount];
 	mResult = vkGetSwapchainImagesKHR(mDevice, mSwapchain, &mSwapchainImageCount, mSwapchainImages);
 	if (mResult != VK_SUCCESS)
 	{
@@ -1154,6 +1281,29 @@ CDevice9::CDevice9(C9* Instance, UINT Adapter, D3DDEVTYPE DeviceType, HWND hFocu
 		}
 	}
 
+	/*
+	Each frame in flight gets its own command buffer, semaphores and fence so Present only waits for the frame it is about to reuse.
+	*/
+	if (mInstance->mOptions.count("LogStatistics"))
+	{
+		mLogStatistics = mInstance->mOptions["LogStatistics"].as<bool>();
+	}
+
+	if (mInstance->mOptions.count("FramesInFlight"))
+	{
+		mMaximumFramesInFlight = mInstance->mOptions["FramesInFlight"].as<uint32_t>();
+	}
+	mMaximumFramesInFlight = max(mMaximumFramesInFlight, (uint32_t)1);
+	mFrames.resize(mMaximumFramesInFlight);
+
+	mSemaphoreCreateInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
+	mSemaphoreCreateInfo.pNext = nullptr;
+	mSemaphoreCreateInfo.flags = 0;
+
+	mFenceCreateInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+	mFenceCreateInfo.pNext = nullptr;
+	mFenceCreateInfo.flags = VK_FENCE_CREATE_SIGNALED_BIT;
+
 	VkCommandBufferAllocateInfo commandBufferInfo = {};
 	commandBufferInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
 	commandBufferInfo.pNext = nullptr;
@@ -1161,16 +1311,46 @@ CDevice9::CDevice9(C9* Instance, UINT Adapter, D3DDEVTYPE DeviceType, HWND hFocu
 	commandBufferInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
 	commandBufferInfo.commandBufferCount = 1;
 
-	for (size_t i = 0; i < mSwapchainImageCount; i++)
+	for (size_t i = 0; i < mFrames.size(); i++)
 	{
-		mResult = vkAllocateCommandBuffers(mDevice, &commandBufferInfo, &mSwapchainBuffers[i]);
+		mResult = vkAllocateCommandBuffers(mDevice, &commandBufferInfo, &mFrames[i].CommandBuffer);
 		if (mResult != VK_SUCCESS)
 		{
 			BOOST_LOG_TRIVIAL(fatal) << "CDevice9::CDevice9 vkAllocateCommandBuffers failed with return code of " << mResult;
 			return;
 		}
+
+		mResult = vkCreateSemaphore(mDevice, &mSemaphoreCreateInfo, nullptr, &mFrames[i].ImageAvailableSemaphore);
+		if (mResult != VK_SUCCESS)
+		{
+			BOOST_LOG_TRIVIAL(fatal) << "CDevice9::CDevice9 vkCreateSemaphore failed with return code of " << mResult;
+			return;
+		}
+
+		mResult = vkCreateSemaphore(mDevice, &mSemaphoreCreateInfo, nullptr, &mFrames[i].RenderFinishedSemaphore);
+		if (mResult != VK_SUCCESS)
+		{
+			BOOST_LOG_TRIVIAL(fatal) << "CDevice9::CDevice9 vkCreateSemaphore failed with return code of " << mResult;
+			return;
+		}
+
+		mResult = vkCreateFence(mDevice, &mFenceCreateInfo, nullptr, &mFrames[i].Fence);
+		if (mResult != VK_SUCCESS)
+		{
+			BOOST_LOG_TRIVIAL(fatal) << "CDevice9::CDevice9 vkCreateFence failed with return code of " << mResult;
+			return;
+		}
+
+		mStatistics.CommandBuffersCreated++;
+		mStatistics.SemaphoresCreated += 2;
+		mStatistics.FencesCreated++;
+
+		mFrames[i].Garbage.mDevice = mDevice;
+		mFrames[i].Garbage.mDescriptorPool = mDescriptorPool;
 	}
 
+	BOOST_LOG_TRIVIAL(info) << "CDevice9::CDevice9 using " << mMaximumFramesInFlight << " frames in flight.";
+
 	/*
 	Setup Depth stuff.
 	*/
@@ -1373,10 +1553,6 @@ CDevice9::CDevice9(C9* Instance, UINT Adapter, D3DDEVTYPE DeviceType, HWND hFocu
 		}
 	}
 
-	mPresentCompleteSemaphoreCreateInfo.sType = VK_STRUCTURE_TYPE_SEMAPHORE_CREATE_INFO;
-	mPresentCompleteSemaphoreCreateInfo.pNext = nullptr;
-	mPresentCompleteSemaphoreCreateInfo.flags = 0;
-
 	mCommandBufferInheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
 	mCommandBufferInheritanceInfo.pNext = nullptr;
 	mCommandBufferInheritanceInfo.renderPass = VK_NULL_HANDLE;
@@ -1419,7 +1595,32 @@ CDevice9::CDevice9(C9* Instance, UINT Adapter, D3DDEVTYPE DeviceType, HWND hFocu
 
 	mBufferManager = new BufferManager(this);
 
-	mGarbageManager.mDevice = mDevice;
+	/*
+	Hand queue submissions and presents to a thread that owns the queue so slow driver calls don't stall the API thread.
+	*/
+	if (mInstance->mOptions.count("SubmissionThread"))
+	{
+		mUseSubmissionThread = mInstance->mOptions["SubmissionThread"].as<bool>();
+	}
+
+	if (mUseSubmissionThread)
+	{
+		mSubmissionThread = std::thread(&CDevice9::ProcessSubmissions, this);
+	}
+
+	/*
+	Record the hot D3D9 calls into a ring and replay them on a worker thread so the game thread only pays for copying its arguments.
+	*/
+	if (mInstance->mOptions.count("CommandStream"))
+	{
+		mUseCommandStream = mInstance->mOptions["CommandStream"].as<bool>();
+	}
+
+	if (mUseCommandStream)
+	{
+		mCommandStream = new boost::lockfree::spsc_queue<uint8_t>(mCommandStreamSize);
+		mCommandStreamThread = std::thread(&CDevice9::ProcessCommandStream, this);
+	}
 
 	//Add implicit swap chain.
 	CSwapChain9* ptr = new CSwapChain9(pPresentationParameters);
@@ -1441,7 +1642,42 @@ CDevice9::~CDevice9()
 {
 	BOOST_LOG_TRIVIAL(info) << "CDevice9::~CDevice9";
 
-	mGarbageManager.DestroyHandles();
+	//The command stream thread replays whatever is left before it exits and may still hand submissions to the submission thread.
+	if (mCommandStreamThread.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lock(mCommandStreamMutex);
+			mIsCommandStreamThreadStopping = true;
+		}
+		mCommandStreamCondition.notify_one();
+		mCommandStreamThread.join();
+	}
+
+	//Resources released after the device still synchronize so they have to see the stream is gone.
+	mUseCommandStream = false;
+	delete mCommandStream;
+	mCommandStream = nullptr;
+
+	if (mSubmissionThread.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lock(mSubmissionMutex);
+			mIsSubmissionThreadStopping = true;
+		}
+		mSubmissionCondition.notify_one();
+		mSubmissionThread.join();
+	}
+
+	//Present no longer waits for the queue so the last frames may still be in flight.
+	if (mDevice != VK_NULL_HANDLE)
+	{
+		vkDeviceWaitIdle(mDevice);
+	}
+
+	if (mLogStatistics)
+	{
+		LogStatistics();
+	}
 
 	for (size_t i = 0; i < mSwapChains.size(); i++)
 	{
@@ -1449,6 +1685,7 @@ CDevice9::~CDevice9()
 	}
 
 	delete mBufferManager;
+	mBufferManager = nullptr; //Textures released after the device check this before handing back their table slot.
 
 	if (mFramebuffers != nullptr)
 	{
@@ -1472,10 +1709,39 @@ CDevice9::~CDevice9()
 		vkDestroyRenderPass(mDevice, mClearRenderPass, nullptr);
 	}
 
-	if (mSwapchainBuffers != nullptr)
+	if (mFreeCommandBuffers.size())
+	{
+		vkFreeCommandBuffers(mDevice, mCommandPool, (uint32_t)mFreeCommandBuffers.size(), mFreeCommandBuffers.data());
+	}
+
+	for (size_t i = 0; i < mFreeFences.size(); i++)
 	{
-		vkFreeCommandBuffers(mDevice, mCommandPool, mSwapchainImageCount, mSwapchainBuffers);
-		delete[] mSwapchainBuffers;
+		vkDestroyFence(mDevice, mFreeFences[i], nullptr);
+	}
+
+	for (size_t i = 0; i < mFrames.size(); i++)
+	{
+		mFrames[i].Garbage.DestroyHandles();
+
+		if (mFrames[i].CommandBuffer != VK_NULL_HANDLE)
+		{
+			vkFreeCommandBuffers(mDevice, mCommandPool, 1, &mFrames[i].CommandBuffer);
+		}
+
+		if (mFrames[i].ImageAvailableSemaphore != VK_NULL_HANDLE)
+		{
+			vkDestroySemaphore(mDevice, mFrames[i].ImageAvailableSemaphore, nullptr);
+		}
+
+		if (mFrames[i].RenderFinishedSemaphore != VK_NULL_HANDLE)
+		{
+			vkDestroySemaphore(mDevice, mFrames[i].RenderFinishedSemaphore, nullptr);
+		}
+
+		if (mFrames[i].Fence != VK_NULL_HANDLE)
+		{
+			vkDestroyFence(mDevice, mFrames[i].Fence, nullptr);
+		}
 	}
 
 	if (mDepthView != VK_NULL_HANDLE)
@@ -1556,6 +1822,20 @@ CDevice9::~CDevice9()
 
 HRESULT STDMETHODCALLTYPE CDevice9::Clear(DWORD Count, const D3DRECT *pRects, DWORD Flags, D3DCOLOR Color, float Z, DWORD Stencil)
 {
+	if (IsRecordingCommands())
+	{
+		DeviceCommand command;
+		command.Type = DEVICE_COMMAND_CLEAR;
+		command.Arguments[0] = Count;
+		command.Arguments[1] = Flags;
+		command.Arguments[2] = Color;
+		command.Arguments[3] = Stencil;
+		command.Float = Z;
+		command.DataSize = (pRects != nullptr) ? Count * sizeof(D3DRECT) : 0;
+		RecordCommand(command, pRects);
+		return D3D_OK;
+	}
+
 	if ((Flags & D3DCLEAR_TARGET) == D3DCLEAR_TARGET)
 	{
 		//VK_FORMAT_B8G8R8A8_UNORM 
@@ -1579,11 +1859,19 @@ HRESULT STDMETHODCALLTYPE CDevice9::Clear(DWORD Count, const D3DRECT *pRects, DW
 	subResourceRange.baseArrayLayer = 0;
 	subResourceRange.layerCount = 1;
 
+	if (mIsDeviceLost)
+	{
+		return D3D_OK;
+	}
+
 	if (mIsSceneStarted)
 	{
-		vkCmdEndRenderPass(mSwapchainBuffers[mCurrentBuffer]);
-		vkCmdClearColorImage(mSwapchainBuffers[mCurrentBuffer], mSwapchainImages[mCurrentBuffer], VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &mClearColorValue, 1, &subResourceRange);
-		vkCmdBeginRenderPass(mSwapchainBuffers[mCurrentBuffer], &mRenderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
+		vkCmdEndRenderPass(mFrames[mCurrentFrame].CommandBuffer);
+		vkCmdClearColorImage(mFrames[mCurrentFrame].CommandBuffer, mSwapchainImages[mCurrentBuffer], VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, &mClearColorValue, 1, &subResourceRange);
+		vkCmdBeginRenderPass(mFrames[mCurrentFrame].CommandBuffer, &mRenderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
+		mStatistics.RenderPassBegins++;
+		mStatistics.FrameRenderPassBegins++;
+		mStatistics.MaximumFrameRenderPassBegins = max(mStatistics.MaximumFrameRenderPassBegins, mStatistics.FrameRenderPassBegins);
 	}
 	else
 	{
@@ -1595,6 +1883,14 @@ HRESULT STDMETHODCALLTYPE CDevice9::Clear(DWORD Count, const D3DRECT *pRects, DW
 
 HRESULT STDMETHODCALLTYPE CDevice9::BeginScene() //
 {
+	if (IsRecordingCommands())
+	{
+		DeviceCommand command;
+		command.Type = DEVICE_COMMAND_BEGIN_SCENE;
+		RecordCommand(command);
+		return D3D_OK;
+	}
+
 	//According to a tip from the Nine team games don't always use the begin/end scene functions correctly.
 
 	if (!mIsSceneStarted)
@@ -1607,6 +1903,14 @@ HRESULT STDMETHODCALLTYPE CDevice9::BeginScene() //
 
 HRESULT STDMETHODCALLTYPE CDevice9::EndScene()
 {
+	if (IsRecordingCommands())
+	{
+		DeviceCommand command;
+		command.Type = DEVICE_COMMAND_END_SCENE;
+		RecordCommand(command);
+		return D3D_OK;
+	}
+
 	//According to a tip from the Nine team games don't always use the begin/end scene functions correctly.
 
 	return D3D_OK;
@@ -1614,6 +1918,36 @@ HRESULT STDMETHODCALLTYPE CDevice9::EndScene()
 
 HRESULT STDMETHODCALLTYPE CDevice9::Present(const RECT *pSourceRect, const RECT *pDestRect, HWND hDestWindowOverride, const RGNDATA *pDirtyRegion)
 {
+	if (IsRecordingCommands())
+	{
+		DeviceCommand command;
+		command.Type = DEVICE_COMMAND_PRESENT;
+		mQueuedPresents++;
+		RecordCommand(command);
+
+		//Only let the API thread get one frame ahead of the command stream thread per frame in flight so input latency stays bounded.
+		if (mQueuedPresents >= mMaximumFramesInFlight)
+		{
+			std::chrono::steady_clock::time_point waitStart = std::chrono::steady_clock::now();
+
+			{
+				std::unique_lock<std::mutex> lock(mCommandStreamMutex);
+				mCommandStreamProgressCondition.wait(lock, [this]() { return mQueuedPresents < mMaximumFramesInFlight; });
+			}
+
+			mStatistics.PresentThrottles++;
+			mStatistics.CommandStreamSynchronizationTime += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - waitStart).count();
+		}
+
+		return D3D_OK;
+	}
+
+	//The frame's command buffer may still be pending so nothing more can be recorded or submitted.
+	if (mIsDeviceLost)
+	{
+		return D3DERR_DEVICELOST;
+	}
+
 	if (!mIsSceneStarted)
 	{
 		this->StartScene();
@@ -1622,31 +1956,61 @@ HRESULT STDMETHODCALLTYPE CDevice9::Present(const RECT *pSourceRect, const RECT
 
 	VkResult result; // = VK_SUCCESS
 
-	mPresentInfo.pImageIndices = &mCurrentBuffer;
+	//The presentation engine waits for the frame's submission instead of the CPU waiting for the queue.
+	QueueSubmission submission;
+	submission.Type = QUEUE_SUBMISSION_PRESENT;
+	submission.WaitSemaphore = mFrames[mCurrentFrame].RenderFinishedSemaphore;
+	submission.ImageIndex = mCurrentBuffer;
 
-	result = vkQueuePresentKHR(mQueue, &mPresentInfo);
+	result = Submit(submission);
 	if (result != VK_SUCCESS)
 	{
-		BOOST_LOG_TRIVIAL(fatal) << "CDevice9::Present vkQueuePresentKHR failed with return code of " << mResult;
 		return D3DERR_INVALIDCALL;
 	}
 
-	result = vkQueueWaitIdle(mQueue);
+	/*
+	Move on to the next frame and only wait for the last submission that used it to retire.
+	The frames in between stay queued so the CPU can run up to mMaximumFramesInFlight frames ahead.
+	*/
+	mCurrentFrame = (mCurrentFrame + 1) % mMaximumFramesInFlight;
+	mFrameNumber++;
+	mStatistics.Frames++;
+	FrameContext& frame = mFrames[mCurrentFrame];
+
+	//With the submission thread the fence can't be touched until the submission that signals it has been issued.
+	result = WaitForSubmission(frame.SubmissionId);
 	if (result != VK_SUCCESS)
 	{
-		BOOST_LOG_TRIVIAL(fatal) << "CDevice9::Present vkQueueWaitIdle failed with return code of " << mResult;
+		//A failed submission never signals its fence so waiting on it would hang.
 		return D3DERR_INVALIDCALL;
 	}
 
-	vkDestroySemaphore(mDevice, mPresentCompleteSemaphore, nullptr);
+	result = vkGetFenceStatus(mDevice, frame.Fence);
+	if (result == VK_NOT_READY)
+	{
+		std::chrono::steady_clock::time_point waitStart = std::chrono::steady_clock::now();
+
+		result = vkWaitForFences(mDevice, 1, &frame.Fence, VK_TRUE, UINT64_MAX);
+
+		long long wait = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - waitStart).count();
+		mStatistics.FrameFenceWaits++;
+		mStatistics.FrameFenceWaitTime += wait;
+		mStatistics.MaximumFrameFenceWait = max(mStatistics.MaximumFrameFenceWait, wait);
+	}
+
+	if (result != VK_SUCCESS)
+	{
+		BOOST_LOG_TRIVIAL(fatal) << "CDevice9::Present vkWaitForFences failed with return code of " << result;
+		return D3DERR_INVALIDCALL;
+	}
 
-	vkResetCommandBuffer(mSwapchainBuffers[mCurrentBuffer], VK_COMMAND_BUFFER_RESET_RELEASE_RESOURCES_BIT);
+	vkResetCommandBuffer(frame.CommandBuffer, VK_COMMAND_BUFFER_RESET_RELEASE_RESOURCES_BIT);
 
-	//Clean up pipes.
+	//Clean up pipes. The buffer manager's frame index advances with mCurrentFrame so it recycles the rings of the frame that just retired.
 	mBufferManager->FlushDrawBufffer();
 
-	//Clean up unreferenced resources.
-	mGarbageManager.DestroyHandles();
+	//Clean up resources released the last time this frame was recorded.
+	frame.Garbage.DestroyHandles();
 
 	//Print(mDeviceState.mTransforms);
 
@@ -1697,6 +2061,8 @@ ULONG STDMETHODCALLTYPE CDevice9::Release(void)
 
 HRESULT STDMETHODCALLTYPE CDevice9::BeginStateBlock()
 {
+	SynchronizeCommandStream();
+
 	this->mCurrentStateRecording = new CStateBlock9(this);
 
 	//BOOST_LOG_TRIVIAL(info) << "CDevice9::BeginStateBlock " << this->mCurrentStateRecording;
@@ -1726,6 +2092,8 @@ HRESULT STDMETHODCALLTYPE CDevice9::CreateAdditionalSwapChain(D3DPRESENT_PARAMET
 
 HRESULT STDMETHODCALLTYPE CDevice9::CreateCubeTexture(UINT EdgeLength, UINT Levels, DWORD Usage, D3DFORMAT Format, D3DPOOL Pool, IDirect3DCubeTexture9 **ppCubeTexture, HANDLE *pSharedHandle)
 {
+	SynchronizeCommandStream();
+
 	HRESULT result = S_OK;
 
 	CCubeTexture9* obj = new CCubeTexture9(this, EdgeLength, Levels, Usage, Format, Pool, pSharedHandle);
@@ -1744,6 +2112,8 @@ HRESULT STDMETHODCALLTYPE CDevice9::CreateCubeTexture(UINT EdgeLength, UINT Leve
 
 HRESULT STDMETHODCALLTYPE CDevice9::CreateDepthStencilSurface(UINT Width, UINT Height, D3DFORMAT Format, D3DMULTISAMPLE_TYPE MultiSample, DWORD MultisampleQuality, BOOL Discard, IDirect3DSurface9 **ppSurface, HANDLE *pSharedHandle)
 {
+	SynchronizeCommandStream();
+
 	HRESULT result = S_OK;
 
 	CSurface9* obj = new CSurface9(this, nullptr, Width, Height, Format, MultiSample, MultisampleQuality, Discard, pSharedHandle);
@@ -1762,6 +2132,8 @@ HRESULT STDMETHODCALLTYPE CDevice9::CreateDepthStencilSurface(UINT Width, UINT H
 
 HRESULT STDMETHODCALLTYPE CDevice9::CreateIndexBuffer(UINT Length, DWORD Usage, D3DFORMAT Format, D3DPOOL Pool, IDirect3DIndexBuffer9 **ppIndexBuffer, HANDLE *pSharedHandle)
 {
+	SynchronizeCommandStream();
+
 	HRESULT result = S_OK;
 
 	CIndexBuffer9* obj = new CIndexBuffer9(this, Length, Usage, Format, Pool, pSharedHandle);
@@ -1782,6 +2154,8 @@ HRESULT STDMETHODCALLTYPE CDevice9::CreateIndexBuffer(UINT Length, DWORD Usage,
 
 HRESULT STDMETHODCALLTYPE CDevice9::CreateOffscreenPlainSurface(UINT Width, UINT Height, D3DFORMAT Format, D3DPOOL Pool, IDirect3DSurface9 **ppSurface, HANDLE *pSharedHandle)
 {
+	SynchronizeCommandStream();
+
 	HRESULT result = S_OK;
 
 	CSurface9* ptr = new CSurface9(this, nullptr, Width, Height, 1, 0, Format, Pool, pSharedHandle);
@@ -1800,6 +2174,8 @@ HRESULT STDMETHODCALLTYPE CDevice9::CreateOffscreenPlainSurface(UINT Width, UINT
 
 HRESULT STDMETHODCALLTYPE CDevice9::CreatePixelShader(const DWORD *pFunction, IDirect3DPixelShader9 **ppShader)
 {
+	SynchronizeCommandStream();
+
 	HRESULT result = S_OK;
 
 	CPixelShader9* obj = new CPixelShader9(this, pFunction);
@@ -1818,6 +2194,8 @@ HRESULT STDMETHODCALLTYPE CDevice9::CreatePixelShader(const DWORD *pFunction, ID
 
 HRESULT STDMETHODCALLTYPE CDevice9::CreateQuery(D3DQUERYTYPE Type, IDirect3DQuery9 **ppQuery)
 {
+	SynchronizeCommandStream();
+
 	/*
 	https://msdn.microsoft.com/en-us/library/windows/desktop/bb174360(v=vs.85).aspx
 	*/
@@ -1846,6 +2224,8 @@ HRESULT STDMETHODCALLTYPE CDevice9::CreateQuery(D3DQUERYTYPE Type, IDirect3DQuer
 
 HRESULT STDMETHODCALLTYPE CDevice9::CreateRenderTarget(UINT Width, UINT Height, D3DFORMAT Format, D3DMULTISAMPLE_TYPE MultiSample, DWORD MultisampleQuality, BOOL Lockable, IDirect3DSurface9 **ppSurface, HANDLE *pSharedHandle)
 {
+	SynchronizeCommandStream();
+
 	HRESULT result = S_OK;
 
 	//I added an extra int at the end so the signature would be different for this version. Locakable/Discard are both BOOL.
@@ -1865,6 +2245,8 @@ HRESULT STDMETHODCALLTYPE CDevice9::CreateRenderTarget(UINT Width, UINT Height,
 
 HRESULT STDMETHODCALLTYPE CDevice9::CreateStateBlock(D3DSTATEBLOCKTYPE Type, IDirect3DStateBlock9 **ppSB)
 {
+	SynchronizeCommandStream();
+
 	HRESULT result = S_OK;
 
 	CStateBlock9* obj = new CStateBlock9(this, Type);
@@ -1885,6 +2267,8 @@ HRESULT STDMETHODCALLTYPE CDevice9::CreateStateBlock(D3DSTATEBLOCKTYPE Type, IDi
 
 HRESULT STDMETHODCALLTYPE CDevice9::CreateTexture(UINT Width, UINT Height, UINT Levels, DWORD Usage, D3DFORMAT Format, D3DPOOL Pool, IDirect3DTexture9 **ppTexture, HANDLE *pSharedHandle)
 {
+	SynchronizeCommandStream();
+
 	HRESULT result = S_OK;
 
 	CTexture9* obj = new CTexture9(this, Width, Height, Levels, Usage, Format, Pool, pSharedHandle);
@@ -1905,6 +2289,8 @@ HRESULT STDMETHODCALLTYPE CDevice9::CreateTexture(UINT Width, UINT Height, UINT
 
 HRESULT STDMETHODCALLTYPE CDevice9::CreateVertexBuffer(UINT Length, DWORD Usage, DWORD FVF, D3DPOOL Pool, IDirect3DVertexBuffer9 **ppVertexBuffer, HANDLE *pSharedHandle)
 {
+	SynchronizeCommandStream();
+
 	HRESULT result = S_OK;
 
 	CVertexBuffer9* obj = new CVertexBuffer9(this, Length, Usage, FVF, Pool, pSharedHandle);
@@ -1925,6 +2311,8 @@ HRESULT STDMETHODCALLTYPE CDevice9::CreateVertexBuffer(UINT Length, DWORD Usage,
 
 HRESULT STDMETHODCALLTYPE CDevice9::CreateVertexDeclaration(const D3DVERTEXELEMENT9 *pVertexElements, IDirect3DVertexDeclaration9 **ppDecl)
 {
+	SynchronizeCommandStream();
+
 	HRESULT result = S_OK;
 
 	CVertexDeclaration9* obj = new CVertexDeclaration9(this, pVertexElements);
@@ -1943,6 +2331,8 @@ HRESULT STDMETHODCALLTYPE CDevice9::CreateVertexDeclaration(const D3DVERTEXELEME
 
 HRESULT STDMETHODCALLTYPE CDevice9::CreateVertexShader(const DWORD *pFunction, IDirect3DVertexShader9 **ppShader)
 {
+	SynchronizeCommandStream();
+
 	HRESULT result = S_OK;
 
 	CVertexShader9* obj = new CVertexShader9(this, pFunction);
@@ -1961,6 +2351,8 @@ HRESULT STDMETHODCALLTYPE CDevice9::CreateVertexShader(const DWORD *pFunction, I
 
 HRESULT STDMETHODCALLTYPE CDevice9::CreateVolumeTexture(UINT Width, UINT Height, UINT Depth, UINT Levels, DWORD Usage, D3DFORMAT Format, D3DPOOL Pool, IDirect3DVolumeTexture9 **ppVolumeTexture, HANDLE *pSharedHandle)
 {
+	SynchronizeCommandStream();
+
 	HRESULT result = S_OK;
 
 	CVolumeTexture9* obj = new CVolumeTexture9(this, Width, Height, Depth, Levels, Usage, Format, Pool, pSharedHandle);
@@ -1988,27 +2380,54 @@ HRESULT STDMETHODCALLTYPE CDevice9::DeletePatch(UINT Handle)
 
 HRESULT STDMETHODCALLTYPE CDevice9::DrawIndexedPrimitive(D3DPRIMITIVETYPE Type, INT BaseVertexIndex, UINT MinIndex, UINT NumVertices, UINT StartIndex, UINT PrimitiveCount)
 {
-	if (mDeviceState.mIndexBuffer == nullptr)
+	std::chrono::steady_clock::time_point drawStart = std::chrono::steady_clock::now();
+
+	if (IsRecordingCommands())
 	{
-		BOOST_LOG_TRIVIAL(warning) << "CDevice9::DrawIndexedPrimitive called with null index buffer.";
-		return D3DERR_INVALIDCALL;
-	}
+		//The index buffer belongs to the command stream thread so a missing one is only reported when the draw is replayed.
+		DeviceCommand command;
+		command.Type = DEVICE_COMMAND_DRAW_INDEXED_PRIMITIVE;
+		command.Arguments[0] = Type;
+		command.Arguments[1] = BaseVertexIndex;
+		command.Arguments[2] = MinIndex;
+		command.Arguments[3] = NumVertices;
+		command.Arguments[4] = StartIndex;
+		command.Arguments[5] = PrimitiveCount;
+		RecordCommand(command);
+
+		mStatistics.DrawsRecorded++;
+		mStatistics.DrawRecordTime += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - drawStart).count();
+
+		return D3D_OK;
+	}
+
+	if (mDeviceState.mIndexBuffer == nullptr)
+	{
+		BOOST_LOG_TRIVIAL(warning) << "CDevice9::DrawIndexedPrimitive called with null index buffer.";
+		return D3DERR_INVALIDCALL;
+	}
+
+	if (mIsDeviceLost)
+	{
+		return D3D_OK;
+	}
 
 	if (!mIsSceneStarted)
 	{
 		this->StartScene();
 	}
 
-	std::shared_ptr<DrawContext> context = std::make_shared<DrawContext>(this);
-	std::shared_ptr<ResourceContext> resourceContext = std::make_shared<ResourceContext>(this);
-
-	mBufferManager->BeginDraw(context, resourceContext, Type);
+	if (mBufferManager->BeginDraw(Type)) //Skipped while the pipeline is still compiling.
+	{
+		/*
+			https://msdn.microsoft.com/en-us/library/windows/desktop/bb174369(v=vs.85).aspx
+			https://www.khronos.org/registry/vulkan/specs/1.0/man/html/vkCmdDrawIndexed.html
+		*/
+		vkCmdDrawIndexed(mFrames[mCurrentFrame].CommandBuffer, min(mDeviceState.mIndexBuffer->mSize, ConvertPrimitiveCountToVertexCount(Type, PrimitiveCount)), 1, StartIndex, BaseVertexIndex, 0);
+	}
 
-	/*
-		https://msdn.microsoft.com/en-us/library/windows/desktop/bb174369(v=vs.85).aspx
-		https://www.khronos.org/registry/vulkan/specs/1.0/man/html/vkCmdDrawIndexed.html
-	*/
-	vkCmdDrawIndexed(mSwapchainBuffers[mCurrentBuffer], min(mDeviceState.mIndexBuffer->mSize, ConvertPrimitiveCountToVertexCount(Type, PrimitiveCount)), 1, StartIndex, BaseVertexIndex, 0);
+	mStatistics.DrawsExecuted++;
+	mStatistics.DrawExecuteTime += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - drawStart).count();
 
 	//BOOST_LOG_TRIVIAL(warning) << "CDevice9::DrawIndexedPrimitive";
 	//Print(mDeviceState.mTransforms);
@@ -2018,6 +2437,8 @@ HRESULT STDMETHODCALLTYPE CDevice9::DrawIndexedPrimitive(D3DPRIMITIVETYPE Type,
 
 HRESULT STDMETHODCALLTYPE CDevice9::DrawIndexedPrimitiveUP(D3DPRIMITIVETYPE PrimitiveType, UINT MinVertexIndex, UINT NumVertices, UINT PrimitiveCount, const void *pIndexData, D3DFORMAT IndexDataFormat, const void *pVertexStreamZeroData, UINT VertexStreamZeroStride)
 {
+	SynchronizeCommandStream();
+
 	if (!mIsSceneStarted)
 	{
 		this->StartScene();
@@ -2032,17 +2453,40 @@ HRESULT STDMETHODCALLTYPE CDevice9::DrawIndexedPrimitiveUP(D3DPRIMITIVETYPE Prim
 
 HRESULT STDMETHODCALLTYPE CDevice9::DrawPrimitive(D3DPRIMITIVETYPE PrimitiveType, UINT StartVertex, UINT PrimitiveCount)
 {
+	std::chrono::steady_clock::time_point drawStart = std::chrono::steady_clock::now();
+
+	if (IsRecordingCommands())
+	{
+		DeviceCommand command;
+		command.Type = DEVICE_COMMAND_DRAW_PRIMITIVE;
+		command.Arguments[0] = PrimitiveType;
+		command.Arguments[1] = StartVertex;
+		command.Arguments[2] = PrimitiveCount;
+		RecordCommand(command);
+
+		mStatistics.DrawsRecorded++;
+		mStatistics.DrawRecordTime += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - drawStart).count();
+
+		return D3D_OK;
+	}
+
+	if (mIsDeviceLost)
+	{
+		return D3D_OK;
+	}
+
 	if (!mIsSceneStarted)
 	{
 		this->StartScene();
 	}
 
-	std::shared_ptr<DrawContext> context = std::make_shared<DrawContext>(this);
-	std::shared_ptr<ResourceContext> resourceContext = std::make_shared<ResourceContext>(this);
-
-	mBufferManager->BeginDraw(context, resourceContext, PrimitiveType);
+	if (mBufferManager->BeginDraw(PrimitiveType)) //Skipped while the pipeline is still compiling.
+	{
+		vkCmdDraw(mFrames[mCurrentFrame].CommandBuffer, min(mBufferManager->mVertexCount, ConvertPrimitiveCountToVertexCount(PrimitiveType, PrimitiveCount)), 1, StartVertex, 0);
+	}
 
-	vkCmdDraw(mSwapchainBuffers[mCurrentBuffer], min(mBufferManager->mVertexCount, ConvertPrimitiveCountToVertexCount(PrimitiveType, PrimitiveCount)), 1, StartVertex, 0);
+	mStatistics.DrawsExecuted++;
+	mStatistics.DrawExecuteTime += std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - drawStart).count();
 
 	//Print(mDeviceState.mTransforms);
 
@@ -2051,6 +2495,8 @@ HRESULT STDMETHODCALLTYPE CDevice9::DrawPrimitive(D3DPRIMITIVETYPE PrimitiveType
 
 HRESULT STDMETHODCALLTYPE CDevice9::DrawPrimitiveUP(D3DPRIMITIVETYPE PrimitiveType, UINT PrimitiveCount, const void *pVertexStreamZeroData, UINT VertexStreamZeroStride)
 {
+	SynchronizeCommandStream();
+
 	if (!mIsSceneStarted)
 	{
 		this->StartScene();
@@ -2065,6 +2511,8 @@ HRESULT STDMETHODCALLTYPE CDevice9::DrawPrimitiveUP(D3DPRIMITIVETYPE PrimitiveTy
 
 HRESULT STDMETHODCALLTYPE CDevice9::DrawRectPatch(UINT Handle, const float *pNumSegs, const D3DRECTPATCH_INFO *pRectPatchInfo)
 {
+	SynchronizeCommandStream();
+
 	if (!mIsSceneStarted)
 	{
 		this->StartScene();
@@ -2079,6 +2527,8 @@ HRESULT STDMETHODCALLTYPE CDevice9::DrawRectPatch(UINT Handle, const float *pNum
 
 HRESULT STDMETHODCALLTYPE CDevice9::DrawTriPatch(UINT Handle, const float *pNumSegs, const D3DTRIPATCH_INFO *pTriPatchInfo)
 {
+	SynchronizeCommandStream();
+
 	if (!mIsSceneStarted)
 	{
 		this->StartScene();
@@ -2093,6 +2543,8 @@ HRESULT STDMETHODCALLTYPE CDevice9::DrawTriPatch(UINT Handle, const float *pNumS
 
 HRESULT STDMETHODCALLTYPE CDevice9::EndStateBlock(IDirect3DStateBlock9 **ppSB)
 {
+	SynchronizeCommandStream();
+
 	(*ppSB) = this->mCurrentStateRecording;
 
 	//BOOST_LOG_TRIVIAL(info) << "CDevice9::EndStateBlock " << this->mCurrentStateRecording;
@@ -2309,6 +2761,8 @@ HRESULT STDMETHODCALLTYPE CDevice9::GetFrontBufferData(UINT  iSwapChain, IDirect
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetFVF(DWORD *pFVF)
 {
+	SynchronizeCommandStream();
+
 	(*pFVF) = mDeviceState.mFVF;
 
 	return S_OK;
@@ -2334,6 +2788,8 @@ HRESULT STDMETHODCALLTYPE CDevice9::GetIndices(IDirect3DIndexBuffer9 **ppIndexDa
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetLight(DWORD Index, D3DLIGHT9 *pLight)
 {
+	SynchronizeCommandStream();
+
 	auto& light = mDeviceState.mLights[Index];
 
 	pLight->Type = (*(D3DLIGHTTYPE*)light.Type);
@@ -2357,6 +2813,8 @@ HRESULT STDMETHODCALLTYPE CDevice9::GetLight(DWORD Index, D3DLIGHT9 *pLight)
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetLightEnable(DWORD Index, BOOL *pEnable)
 {
+	SynchronizeCommandStream();
+
 	(*pEnable) = mDeviceState.mLights[Index].IsEnabled;
 
 	return S_OK;
@@ -2364,6 +2822,8 @@ HRESULT STDMETHODCALLTYPE CDevice9::GetLightEnable(DWORD Index, BOOL *pEnable)
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetMaterial(D3DMATERIAL9 *pMaterial)
 {
+	SynchronizeCommandStream();
+
 	(*pMaterial) = mDeviceState.mMaterial;
 
 	return S_OK;
@@ -2371,6 +2831,8 @@ HRESULT STDMETHODCALLTYPE CDevice9::GetMaterial(D3DMATERIAL9 *pMaterial)
 
 FLOAT STDMETHODCALLTYPE CDevice9::GetNPatchMode()
 {
+	SynchronizeCommandStream();
+
 	return mDeviceState.mNSegments;
 }
 
@@ -2394,6 +2856,8 @@ HRESULT STDMETHODCALLTYPE CDevice9::GetPaletteEntries(UINT PaletteNumber, PALETT
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetPixelShader(IDirect3DPixelShader9 **ppShader)
 {
+	SynchronizeCommandStream();
+
 	(*ppShader) = (IDirect3DPixelShader9*)mDeviceState.mPixelShader;
 
 	return S_OK;
@@ -2401,29 +2865,44 @@ HRESULT STDMETHODCALLTYPE CDevice9::GetPixelShader(IDirect3DPixelShader9 **ppSha
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetPixelShaderConstantB(UINT StartRegister, BOOL *pConstantData, UINT BoolCount)
 {
-	//TODO: Implement.
+	SynchronizeCommandStream();
+
+	if (pConstantData == nullptr || StartRegister + BoolCount > MAX_SHADER_BOOLEAN_CONSTANTS)
+	{
+		return D3DERR_INVALIDCALL;
+	}
 
-	BOOST_LOG_TRIVIAL(warning) << "CDevice9::GetPixelShaderConstantB is not implemented!";
+	memcpy(pConstantData, &this->mBufferManager->mShaderConstants.PixelIntegers.Booleans[StartRegister], BoolCount * sizeof(BOOL));
 
-	return E_NOTIMPL;
+	return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetPixelShaderConstantF(UINT StartRegister, float *pConstantData, UINT Vector4fCount)
 {
-	//TODO: Implement.
+	SynchronizeCommandStream();
 
-	BOOST_LOG_TRIVIAL(warning) << "CDevice9::GetPixelShaderConstantF is not implemented!";
+	if (pConstantData == nullptr || StartRegister + Vector4fCount > MAX_PIXEL_SHADER_FLOAT_CONSTANTS)
+	{
+		return D3DERR_INVALIDCALL;
+	}
 
-	return E_NOTIMPL;
+	memcpy(pConstantData, &this->mBufferManager->mShaderConstants.PixelFloats[StartRegister * 4], Vector4fCount * sizeof(float) * 4);
+
+	return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetPixelShaderConstantI(UINT StartRegister, int *pConstantData, UINT Vector4iCount)
 {
-	//TODO: Implement.
+	SynchronizeCommandStream();
+
+	if (pConstantData == nullptr || StartRegister + Vector4iCount > MAX_SHADER_INTEGER_CONSTANTS)
+	{
+		return D3DERR_INVALIDCALL;
+	}
 
-	BOOST_LOG_TRIVIAL(warning) << "CDevice9::GetPixelShaderConstantI is not implemented!";
+	memcpy(pConstantData, &this->mBufferManager->mShaderConstants.PixelIntegers.Integers[StartRegister * 4], Vector4iCount * sizeof(int) * 4);
 
-	return E_NOTIMPL;
+	return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetRasterStatus(UINT  iSwapChain, D3DRASTER_STATUS *pRasterStatus)
@@ -2437,6 +2916,8 @@ HRESULT STDMETHODCALLTYPE CDevice9::GetRasterStatus(UINT  iSwapChain, D3DRASTER_
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetRenderState(D3DRENDERSTATETYPE State, DWORD *pValue)
 {
+	SynchronizeCommandStream();
+
 	SpecializationConstants* constants = nullptr;
 
 	if (this->mCurrentStateRecording != nullptr)
@@ -2769,22 +3250,120 @@ HRESULT STDMETHODCALLTYPE CDevice9::GetRenderState(D3DRENDERSTATETYPE State, DWO
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetRenderTarget(DWORD RenderTargetIndex, IDirect3DSurface9 **ppRenderTarget)
 {
+	SynchronizeCommandStream();
+
+	if (ppRenderTarget == nullptr || RenderTargetIndex >= mRenderTargets.size())
+	{
+		return D3DERR_INVALIDCALL;
+	}
+
 	(*ppRenderTarget) = mRenderTargets[RenderTargetIndex];
 
+	if ((*ppRenderTarget) == nullptr)
+	{
+		return D3DERR_NOTFOUND;
+	}
+
+	(*ppRenderTarget)->AddRef();
+
 	return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetRenderTargetData(IDirect3DSurface9 *pRenderTarget, IDirect3DSurface9 *pDestSurface)
 {
-	//TODO: Implement.
+	SynchronizeCommandStream();
 
-	BOOST_LOG_TRIVIAL(warning) << "CDevice9::GetRenderTargetData is not implemented!";
+	VkResult result = VK_SUCCESS;
+	CSurface9* destination = (CSurface9*)pDestSurface;
 
-	return S_OK;
+	//Every draw goes to the swapchain image so that is the only render target there is to read.
+	if (pRenderTarget == nullptr || destination == nullptr || mRenderTargets.empty() || pRenderTarget != (IDirect3DSurface9*)mRenderTargets[0])
+	{
+		BOOST_LOG_TRIVIAL(warning) << "CDevice9::GetRenderTargetData only the implicit render target can be read.";
+		return D3DERR_INVALIDCALL;
+	}
+
+	if (!(mSurfaceCapabilities.supportedUsageFlags & VK_IMAGE_USAGE_TRANSFER_SRC_BIT))
+	{
+		BOOST_LOG_TRIVIAL(warning) << "CDevice9::GetRenderTargetData the surface doesn't allow copies from swapchain images.";
+		return D3DERR_INVALIDCALL;
+	}
+
+	if (mIsDeviceLost)
+	{
+		return D3DERR_DEVICELOST;
+	}
+
+	if (!mIsSceneStarted)
+	{
+		StartScene(false);
+	}
+
+	FrameContext& frame = mFrames[mCurrentFrame];
+
+	/*
+	The copy can't be recorded inside the render pass so the pass is ended and the frame so far is submitted and waited for.
+	The rest of the frame is then recorded into the same command buffer in a new store pass.
+	*/
+	vkCmdEndRenderPass(frame.CommandBuffer);
+
+	VkImageMemoryBarrier barriers[2] = {};
+	barriers[0].sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+	barriers[0].pNext = nullptr;
+	barriers[0].srcAccessMask = VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+	barriers[0].dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+	barriers[0].oldLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+	barriers[0].newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+	barriers[0].srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barriers[0].dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barriers[0].image = mSwapchainImages[mCurrentBuffer];
+	barriers[0].subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+
+	barriers[1].sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+	barriers[1].pNext = nullptr;
+	barriers[1].srcAccessMask = 0;
+	barriers[1].dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barriers[1].oldLayout = VK_IMAGE_LAYOUT_UNDEFINED; //Whatever was in the surface is overwritten.
+	barriers[1].newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+	barriers[1].srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barriers[1].dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barriers[1].image = destination->mStagingImage;
+	barriers[1].subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+
+	vkCmdPipelineBarrier(frame.CommandBuffer, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 2, barriers);
+
+	CopyImage(frame.CommandBuffer, mSwapchainImages[mCurrentBuffer], destination->mStagingImage, min(destination->mWidth, mSwapchainExtent.width), min(destination->mHeight, mSwapchainExtent.height), 0, 0);
+
+	barriers[0].srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+	barriers[0].dstAccessMask = VK_ACCESS_COLOR_ATTACHMENT_READ_BIT | VK_ACCESS_COLOR_ATTACHMENT_WRITE_BIT;
+	barriers[0].oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+	barriers[0].newLayout = VK_IMAGE_LAYOUT_PRESENT_SRC_KHR;
+
+	//LockRect maps the surface straight away so it is left in the general layout.
+	barriers[1].srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barriers[1].dstAccessMask = VK_ACCESS_HOST_READ_BIT;
+	barriers[1].oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+	barriers[1].newLayout = VK_IMAGE_LAYOUT_GENERAL;
+
+	vkCmdPipelineBarrier(frame.CommandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, VK_PIPELINE_STAGE_COLOR_ATTACHMENT_OUTPUT_BIT | VK_PIPELINE_STAGE_HOST_BIT, 0, 0, nullptr, 0, nullptr, 2, barriers);
+
+	//Leaves the frame begun and inside the store pass whether or not the submission worked.
+	result = SubmitPartialFrame();
+	if (result != VK_SUCCESS)
+	{
+		return mIsDeviceLost ? D3DERR_DEVICELOST : D3DERR_INVALIDCALL;
+	}
+
+	destination->mImageLayout = VK_IMAGE_LAYOUT_GENERAL;
+	destination->mIsFlushed = false;
+
+	return D3D_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetSamplerState(DWORD Sampler, D3DSAMPLERSTATETYPE Type, DWORD *pValue)
 {
+	SynchronizeCommandStream();
+
 	(*pValue) = mDeviceState.mSamplerStates[Sampler][Type];
 
 	return S_OK;
@@ -2792,6 +3371,8 @@ HRESULT STDMETHODCALLTYPE CDevice9::GetSamplerState(DWORD Sampler, D3DSAMPLERSTA
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetScissorRect(RECT *pRect)
 {
+	SynchronizeCommandStream();
+
 	(*pRect) = mDeviceState.m9Scissor;
 
 	return S_OK;
@@ -2808,6 +3389,8 @@ BOOL STDMETHODCALLTYPE CDevice9::GetSoftwareVertexProcessing()
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetStreamSource(UINT StreamNumber, IDirect3DVertexBuffer9 **ppStreamData, UINT *pOffsetInBytes, UINT *pStride)
 {
+	SynchronizeCommandStream();
+
 	StreamSource& value = mDeviceState.mStreamSources[StreamNumber];
 
 	(*ppStreamData) = (IDirect3DVertexBuffer9*)value.StreamData;
@@ -2848,6 +3431,8 @@ HRESULT STDMETHODCALLTYPE CDevice9::GetTexture(DWORD Stage, IDirect3DBaseTexture
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetTextureStageState(DWORD Stage, D3DTEXTURESTAGESTATETYPE Type, DWORD *pValue)
 {
+	SynchronizeCommandStream();
+
 	DeviceState* state = nullptr;
 
 	if (this->mCurrentStateRecording != nullptr)
@@ -3428,6 +4013,8 @@ HRESULT STDMETHODCALLTYPE CDevice9::GetTextureStageState(DWORD Stage, D3DTEXTURE
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetTransform(D3DTRANSFORMSTATETYPE State, D3DMATRIX* pMatrix)
 {
+	SynchronizeCommandStream();
+
 	(*pMatrix) = mDeviceState.mTransforms[State];
 
 	return S_OK;
@@ -3435,6 +4022,8 @@ HRESULT STDMETHODCALLTYPE CDevice9::GetTransform(D3DTRANSFORMSTATETYPE State, D3
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetVertexDeclaration(IDirect3DVertexDeclaration9 **ppDecl)
 {
+	SynchronizeCommandStream();
+
 	(*ppDecl) = (IDirect3DVertexDeclaration9*)this->mDeviceState.mVertexDeclaration;
 
 	return S_OK;
@@ -3442,6 +4031,8 @@ HRESULT STDMETHODCALLTYPE CDevice9::GetVertexDeclaration(IDirect3DVertexDeclarat
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetVertexShader(IDirect3DVertexShader9 **ppShader)
 {
+	SynchronizeCommandStream();
+
 	(*ppShader) = (IDirect3DVertexShader9*)mDeviceState.mVertexShader;
 
 	return S_OK;
@@ -3449,36 +4040,50 @@ HRESULT STDMETHODCALLTYPE CDevice9::GetVertexShader(IDirect3DVertexShader9 **ppS
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetVertexShaderConstantB(UINT StartRegister, BOOL *pConstantData, UINT BoolCount)
 {
-	for (size_t i = 0; i < BoolCount; i++)
+	SynchronizeCommandStream();
+
+	if (pConstantData == nullptr || StartRegister + BoolCount > MAX_SHADER_BOOLEAN_CONSTANTS)
 	{
-		pConstantData[i] = this->mBufferManager->mPushConstants.Booleans[(StartRegister * 4) + i];
+		return D3DERR_INVALIDCALL;
 	}
 
+	memcpy(pConstantData, &this->mBufferManager->mShaderConstants.VertexIntegers.Booleans[StartRegister], BoolCount * sizeof(BOOL));
+
 	return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetVertexShaderConstantF(UINT StartRegister, float *pConstantData, UINT Vector4fCount)
 {
-	for (size_t i = 0; i < Vector4fCount; i++)
+	SynchronizeCommandStream();
+
+	if (pConstantData == nullptr || StartRegister + Vector4fCount > MAX_VERTEX_SHADER_FLOAT_CONSTANTS)
 	{
-		pConstantData[i] = this->mBufferManager->mPushConstants.Floats[(StartRegister * 4) + i];
+		return D3DERR_INVALIDCALL;
 	}
 
+	memcpy(pConstantData, &this->mBufferManager->mShaderConstants.VertexFloats[StartRegister * 4], Vector4fCount * sizeof(float) * 4);
+
 	return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetVertexShaderConstantI(UINT StartRegister, int *pConstantData, UINT Vector4iCount)
 {
-	for (size_t i = 0; i < Vector4iCount; i++)
+	SynchronizeCommandStream();
+
+	if (pConstantData == nullptr || StartRegister + Vector4iCount > MAX_SHADER_INTEGER_CONSTANTS)
 	{
-		pConstantData[i] = this->mBufferManager->mPushConstants.Booleans[(StartRegister * 4) + i];
+		return D3DERR_INVALIDCALL;
 	}
 
+	memcpy(pConstantData, &this->mBufferManager->mShaderConstants.VertexIntegers.Integers[StartRegister * 4], Vector4iCount * sizeof(int) * 4);
+
 	return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::GetViewport(D3DVIEWPORT9 *pViewport)
 {
+	SynchronizeCommandStream();
+
 	(*pViewport) = mDeviceState.m9Viewport;
 
 	return S_OK;
@@ -3486,6 +4091,16 @@ HRESULT STDMETHODCALLTYPE CDevice9::GetViewport(D3DVIEWPORT9 *pViewport)
 
 HRESULT STDMETHODCALLTYPE CDevice9::LightEnable(DWORD LightIndex, BOOL bEnable)
 {
+	if (IsRecordingCommands())
+	{
+		DeviceCommand command;
+		command.Type = DEVICE_COMMAND_LIGHT_ENABLE;
+		command.Arguments[0] = LightIndex;
+		command.Arguments[1] = bEnable;
+		RecordCommand(command);
+		return D3D_OK;
+	}
+
 	DeviceState* state = nullptr;
 
 	if (this->mCurrentStateRecording != nullptr)
@@ -3503,12 +4118,17 @@ HRESULT STDMETHODCALLTYPE CDevice9::LightEnable(DWORD LightIndex, BOOL bEnable)
 	{
 		light.IsEnabled = bEnable;
 		state->mLights.push_back(light);
-		state->mAreLightsDirty = true;
+		state->mDirtyLights |= (LightIndex < 32) ? (1u << LightIndex) : 0;
 	}
 	else
 	{
+		if (this->mCurrentStateRecording == nullptr && state->mLights[LightIndex].IsEnabled == bEnable)
+		{
+			return S_OK;
+		}
+
 		state->mLights[LightIndex].IsEnabled = bEnable;
-		state->mAreLightsDirty = true;
+		state->mDirtyLights |= (LightIndex < 32) ? (1u << LightIndex) : 0;
 	}
 
 	return S_OK;
@@ -3606,6 +4226,15 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetDialogBoxMode(BOOL bEnableDialogs)
 
 HRESULT STDMETHODCALLTYPE CDevice9::SetFVF(DWORD FVF)
 {
+	if (IsRecordingCommands())
+	{
+		DeviceCommand command;
+		command.Type = DEVICE_COMMAND_SET_FVF;
+		command.Arguments[0] = FVF;
+		RecordCommand(command);
+		return D3D_OK;
+	}
+
 	if (this->mCurrentStateRecording != nullptr)
 	{
 		this->mCurrentStateRecording->mDeviceState.mFVF = FVF;
@@ -3614,9 +4243,15 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetFVF(DWORD FVF)
 	}
 	else
 	{
+		if (mDeviceState.mHasFVF && !mDeviceState.mHasVertexDeclaration && mDeviceState.mFVF == FVF)
+		{
+			return S_OK;
+		}
+
 		mDeviceState.mFVF = FVF;
 		mDeviceState.mHasFVF = true;
 		mDeviceState.mHasVertexDeclaration = false;
+		mDeviceState.mGenerations.Shader++;
 	}
 
 	return S_OK;
@@ -3631,6 +4266,15 @@ void STDMETHODCALLTYPE CDevice9::SetGammaRamp(UINT  iSwapChain, DWORD Flags, con
 
 HRESULT STDMETHODCALLTYPE CDevice9::SetIndices(IDirect3DIndexBuffer9 *pIndexData)
 {
+	if (IsRecordingCommands())
+	{
+		DeviceCommand command;
+		command.Type = DEVICE_COMMAND_SET_INDICES;
+		command.Object = pIndexData;
+		RecordCommand(command);
+		return D3D_OK;
+	}
+
 	DeviceState* state = nullptr;
 
 	if (this->mCurrentStateRecording != nullptr)
@@ -3642,6 +4286,11 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetIndices(IDirect3DIndexBuffer9 *pIndexData
 		state = &mDeviceState;
 	}
 
+	if (this->mCurrentStateRecording == nullptr && state->mHasIndexBuffer && state->mIndexBuffer == (CIndexBuffer9*)pIndexData)
+	{
+		return S_OK;
+	}
+
 	state->mIndexBuffer = (CIndexBuffer9*)pIndexData;
 	state->mHasIndexBuffer = true;
 
@@ -3650,6 +4299,16 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetIndices(IDirect3DIndexBuffer9 *pIndexData
 
 HRESULT STDMETHODCALLTYPE CDevice9::SetLight(DWORD Index, const D3DLIGHT9 *pLight)
 {
+	if (IsRecordingCommands())
+	{
+		DeviceCommand command;
+		command.Type = DEVICE_COMMAND_SET_LIGHT;
+		command.Arguments[0] = Index;
+		command.DataSize = sizeof(D3DLIGHT9);
+		RecordCommand(command, pLight);
+		return D3D_OK;
+	}
+
 	DeviceState* state = nullptr;
 
 	if (this->mCurrentStateRecording != nullptr)
@@ -3700,14 +4359,20 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetLight(DWORD Index, const D3DLIGHT9 *pLigh
 	if (state->mLights.size() == Index)
 	{
 		state->mLights.push_back(light);
-		state->mAreLightsDirty = true;
+		state->mDirtyLights |= (Index < 32) ? (1u << Index) : 0;
 	}
 	else
 	{
 		light.IsEnabled = state->mLights[Index].IsEnabled;
 
+		//An unchanged light isn't marked dirty so the next draw doesn't copy the lights into a new slot of the constant ring.
+		if (this->mCurrentStateRecording == nullptr && memcmp(&state->mLights[Index], &light, sizeof(Light)) == 0)
+		{
+			return S_OK;
+		}
+
 		state->mLights[Index] = light;
-		state->mAreLightsDirty = true;
+		state->mDirtyLights |= (Index < 32) ? (1u << Index) : 0;
 	}
 
 	return S_OK;
@@ -3715,6 +4380,15 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetLight(DWORD Index, const D3DLIGHT9 *pLigh
 
 HRESULT STDMETHODCALLTYPE CDevice9::SetMaterial(const D3DMATERIAL9 *pMaterial)
 {
+	if (IsRecordingCommands())
+	{
+		DeviceCommand command;
+		command.Type = DEVICE_COMMAND_SET_MATERIAL;
+		command.DataSize = sizeof(D3DMATERIAL9);
+		RecordCommand(command, pMaterial);
+		return D3D_OK;
+	}
+
 	if (this->mCurrentStateRecording != nullptr)
 	{
 		this->mCurrentStateRecording->mDeviceState.mMaterial = (*pMaterial);
@@ -3722,6 +4396,11 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetMaterial(const D3DMATERIAL9 *pMaterial)
 	}
 	else
 	{
+		if (memcmp(&mDeviceState.mMaterial, pMaterial, sizeof(D3DMATERIAL9)) == 0)
+		{
+			return S_OK;
+		}
+
 		mDeviceState.mMaterial = (*pMaterial);
 		mDeviceState.mIsMaterialDirty = true;
 	}
@@ -3731,6 +4410,8 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetMaterial(const D3DMATERIAL9 *pMaterial)
 
 HRESULT STDMETHODCALLTYPE CDevice9::SetNPatchMode(float nSegments)
 {
+	SynchronizeCommandStream();
+
 	if (nSegments > 0.0f)
 	{
 		BOOST_LOG_TRIVIAL(warning) << "CDevice9::SetNPatchMode nPatch greater than zero not supported.";
@@ -3760,6 +4441,20 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetPaletteEntries(UINT PaletteNumber, const
 
 HRESULT STDMETHODCALLTYPE CDevice9::SetPixelShader(IDirect3DPixelShader9 *pShader)
 {
+	if (IsRecordingCommands())
+	{
+		DeviceCommand command;
+		command.Type = DEVICE_COMMAND_SET_PIXEL_SHADER;
+		command.Object = pShader;
+		RecordCommand(command);
+		return D3D_OK;
+	}
+
+	if (this->mCurrentStateRecording == nullptr && mDeviceState.mHasPixelShader && mDeviceState.mPixelShader == (CPixelShader9*)pShader)
+	{
+		return S_OK;
+	}
+
 	if (pShader != nullptr)
 	{
 		pShader->AddRef();
@@ -3779,6 +4474,7 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetPixelShader(IDirect3DPixelShader9 *pShade
 
 		mDeviceState.mPixelShader = (CPixelShader9*)pShader;
 		mDeviceState.mHasPixelShader = true;
+		mDeviceState.mGenerations.Shader++;
 	}
 
 	return S_OK;
@@ -3786,33 +4482,86 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetPixelShader(IDirect3DPixelShader9 *pShade
 
 HRESULT STDMETHODCALLTYPE CDevice9::SetPixelShaderConstantB(UINT StartRegister, const BOOL *pConstantData, UINT BoolCount)
 {
-	//TODO: Implement.
+	if (pConstantData == nullptr || StartRegister + BoolCount > MAX_SHADER_BOOLEAN_CONSTANTS)
+	{
+		return D3DERR_INVALIDCALL;
+	}
+
+	if (IsRecordingCommands())
+	{
+		//The constants are copied so the caller can reuse its array as soon as this returns.
+		DeviceCommand command;
+		command.Type = DEVICE_COMMAND_SET_PIXEL_SHADER_CONSTANT_B;
+		command.Arguments[0] = StartRegister;
+		command.Arguments[1] = BoolCount;
+		command.DataSize = BoolCount * sizeof(BOOL);
+		RecordCommand(command, pConstantData);
+		return D3D_OK;
+	}
 
-	BOOST_LOG_TRIVIAL(warning) << "CDevice9::SetPixelShaderConstantB is not implemented!";
+	this->mBufferManager->SetShaderConstants(SHADER_CONSTANT_PIXEL_INTEGER, offsetof(ShaderIntegerConstants, Booleans) + StartRegister * sizeof(BOOL), pConstantData, BoolCount * sizeof(BOOL));
 
 	return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::SetPixelShaderConstantF(UINT StartRegister, const float *pConstantData, UINT Vector4fCount)
 {
-	//TODO: Implement.
+	if (pConstantData == nullptr || StartRegister + Vector4fCount > MAX_PIXEL_SHADER_FLOAT_CONSTANTS)
+	{
+		return D3DERR_INVALIDCALL;
+	}
+
+	if (IsRecordingCommands())
+	{
+		DeviceCommand command;
+		command.Type = DEVICE_COMMAND_SET_PIXEL_SHADER_CONSTANT_F;
+		command.Arguments[0] = StartRegister;
+		command.Arguments[1] = Vector4fCount;
+		command.DataSize = Vector4fCount * sizeof(float) * 4;
+		RecordCommand(command, pConstantData);
+		return D3D_OK;
+	}
 
-	BOOST_LOG_TRIVIAL(warning) << "CDevice9::SetPixelShaderConstantF is not implemented!";
+	this->mBufferManager->SetShaderConstants(SHADER_CONSTANT_PIXEL_FLOAT, StartRegister * sizeof(float) * 4, pConstantData, Vector4fCount * sizeof(float) * 4);
 
 	return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::SetPixelShaderConstantI(UINT StartRegister, const int *pConstantData, UINT Vector4iCount)
 {
-	//TODO: Implement.
+	if (pConstantData == nullptr || StartRegister + Vector4iCount > MAX_SHADER_INTEGER_CONSTANTS)
+	{
+		return D3DERR_INVALIDCALL;
+	}
 
-	BOOST_LOG_TRIVIAL(warning) << "CDevice9::SetPixelShaderConstantI is not implemented!";
+	if (IsRecordingCommands())
+	{
+		DeviceCommand command;
+		command.Type = DEVICE_COMMAND_SET_PIXEL_SHADER_CONSTANT_I;
+		command.Arguments[0] = StartRegister;
+		command.Arguments[1] = Vector4iCount;
+		command.DataSize = Vector4iCount * sizeof(int) * 4;
+		RecordCommand(command, pConstantData);
+		return D3D_OK;
+	}
+
+	this->mBufferManager->SetShaderConstants(SHADER_CONSTANT_PIXEL_INTEGER, offsetof(ShaderIntegerConstants, Integers) + StartRegister * sizeof(int) * 4, pConstantData, Vector4iCount * sizeof(int) * 4);
 
 	return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::SetRenderState(D3DRENDERSTATETYPE State, DWORD Value)
 {
+	if (IsRecordingCommands())
+	{
+		DeviceCommand command;
+		command.Type = DEVICE_COMMAND_SET_RENDER_STATE;
+		command.Arguments[0] = State;
+		command.Arguments[1] = Value;
+		RecordCommand(command);
+		return D3D_OK;
+	}
+
 	SpecializationConstants* constants = nullptr;
 	DeviceState* state = NULL;
 
@@ -3825,6 +4574,14 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetRenderState(D3DRENDERSTATETYPE State, DWO
 	{
 		constants = &mDeviceState.mSpecializationConstants;
 		state = &mDeviceState;
+
+		DWORD currentValue = 0;
+		if (GetRenderState(State, &currentValue) == S_OK && currentValue == Value)
+		{
+			return S_OK;
+		}
+
+		state->mGenerations.RenderState++;
 	}
 
 	switch (State)
@@ -3952,6 +4709,7 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetRenderState(D3DRENDERSTATETYPE State, DWO
 	case D3DRS_TEXTUREFACTOR:
 		constants->textureFactor = Value;
 		state->hasTextureFactor = true;
+		state->mIsRenderStateDirty = true;
 		break;
 	case D3DRS_WRAP0:
 		constants->wrap0 = Value;
@@ -3996,6 +4754,7 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetRenderState(D3DRENDERSTATETYPE State, DWO
 	case D3DRS_AMBIENT:
 		constants->ambient = Value;
 		state->hasAmbient = true;
+		state->mIsRenderStateDirty = true;
 		break;
 	case D3DRS_FOGVERTEXMODE:
 		constants->fogVertexMode = Value;
@@ -4040,6 +4799,7 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetRenderState(D3DRENDERSTATETYPE State, DWO
 	case D3DRS_POINTSIZE:
 		constants->pointSize = Value;
 		state->hasPointSize = true;
+		state->mIsRenderStateDirty = true;
 		break;
 	case D3DRS_POINTSIZE_MIN:
 		constants->pointSizeMinimum = Value;
@@ -4251,6 +5011,8 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetRenderState(D3DRENDERSTATETYPE State, DWO
 
 HRESULT STDMETHODCALLTYPE CDevice9::SetRenderTarget(DWORD RenderTargetIndex, IDirect3DSurface9 *pRenderTarget)
 {
+	SynchronizeCommandStream();
+
 	mRenderTargets[RenderTargetIndex] = (CRenderTargetSurface9*)pRenderTarget;
 
 	return S_OK;
@@ -4258,6 +5020,17 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetRenderTarget(DWORD RenderTargetIndex, IDi
 
 HRESULT STDMETHODCALLTYPE CDevice9::SetSamplerState(DWORD Sampler, D3DSAMPLERSTATETYPE Type, DWORD Value)
 {
+	if (IsRecordingCommands())
+	{
+		DeviceCommand command;
+		command.Type = DEVICE_COMMAND_SET_SAMPLER_STATE;
+		command.Arguments[0] = Sampler;
+		command.Arguments[1] = Type;
+		command.Arguments[2] = Value;
+		RecordCommand(command);
+		return D3D_OK;
+	}
+
 	DeviceState* state = NULL;
 
 	if (this->mCurrentStateRecording != nullptr)
@@ -4269,13 +5042,27 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetSamplerState(DWORD Sampler, D3DSAMPLERSTA
 		state = &mDeviceState;
 	}
 
-	state->mSamplerStates[Sampler][Type] = Value;
+	DWORD& samplerState = state->mSamplerStates[Sampler][Type];
+
+	if (this->mCurrentStateRecording == nullptr && samplerState == Value)
+	{
+		return S_OK;
+	}
+
+	samplerState = Value;
+	state->mGenerations.SamplerState++;
+	if (Sampler < 16)
+	{
+		state->mGenerations.Sampler[Sampler]++;
+	}
 
 	return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::SetScissorRect(const RECT *pRect)
 {
+	SynchronizeCommandStream();
+
 	if (this->mCurrentStateRecording != nullptr)
 	{
 		this->mCurrentStateRecording->mDeviceState.m9Scissor = (*pRect);
@@ -4287,6 +5074,11 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetScissorRect(const RECT *pRect)
 	}
 	else
 	{
+		if (memcmp(&mDeviceState.m9Scissor, pRect, sizeof(RECT)) == 0)
+		{
+			return S_OK;
+		}
+
 		mDeviceState.m9Scissor = (*pRect);
 
 		mDeviceState.mScissor.extent.width = mDeviceState.m9Scissor.right;
@@ -4309,6 +5101,18 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetSoftwareVertexProcessing(BOOL bSoftware)
 
 HRESULT STDMETHODCALLTYPE CDevice9::SetStreamSource(UINT StreamNumber, IDirect3DVertexBuffer9 *pStreamData, UINT OffsetInBytes, UINT Stride)
 {
+	if (IsRecordingCommands())
+	{
+		DeviceCommand command;
+		command.Type = DEVICE_COMMAND_SET_STREAM_SOURCE;
+		command.Arguments[0] = StreamNumber;
+		command.Arguments[1] = OffsetInBytes;
+		command.Arguments[2] = Stride;
+		command.Object = pStreamData;
+		RecordCommand(command);
+		return D3D_OK;
+	}
+
 	CVertexBuffer9* streamData = (CVertexBuffer9*)pStreamData;
 
 	if (this->mCurrentStateRecording != nullptr)
@@ -4317,6 +5121,22 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetStreamSource(UINT StreamNumber, IDirect3D
 	}
 	else
 	{
+		auto source = mDeviceState.mStreamSources.find(StreamNumber);
+
+		if (source == mDeviceState.mStreamSources.end())
+		{
+			mDeviceState.mGenerations.VertexInput++;
+		}
+		else if (source->second.StreamData == streamData && source->second.OffsetInBytes == OffsetInBytes && source->second.Stride == Stride)
+		{
+			return S_OK;
+		}
+		else if (source->second.Stride != Stride)
+		{
+			mDeviceState.mGenerations.VertexInput++;
+		}
+
+		//Only the stride and stream count are part of the pipeline. The buffer and offset are bound on every draw.
 		mDeviceState.mStreamSources[StreamNumber] = StreamSource(StreamNumber, streamData, OffsetInBytes, Stride);
 	}
 
@@ -4334,6 +5154,16 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetStreamSourceFreq(UINT StreamNumber, UINT
 
 HRESULT STDMETHODCALLTYPE CDevice9::SetTexture(DWORD Sampler, IDirect3DBaseTexture9 *pTexture)
 {
+	if (IsRecordingCommands())
+	{
+		DeviceCommand command;
+		command.Type = DEVICE_COMMAND_SET_TEXTURE;
+		command.Arguments[0] = Sampler;
+		command.Object = pTexture;
+		RecordCommand(command);
+		return D3D_OK;
+	}
+
 	auto texture = (CTexture9*)pTexture; //Check for compiler bugs.
 	DeviceState* state = NULL;
 
@@ -4346,17 +5176,28 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetTexture(DWORD Sampler, IDirect3DBaseTextu
 		state = &mDeviceState;
 	}
 
+	auto it = state->mTextures.find(Sampler);
+
 	if (pTexture == nullptr)
 	{
-		auto it = state->mTextures.find(Sampler);
 		if (it != state->mTextures.end())
 		{
 			state->mTextures.erase(it);
+			state->mGenerations.Texture++;
+			if (Sampler < 16)
+			{
+				state->mGenerations.Sampler[Sampler]++;
+			}
 		}
 	}
-	else
+	else if (it == state->mTextures.end() || it->second != texture)
 	{
 		state->mTextures[Sampler] = texture;
+		state->mGenerations.Texture++;
+		if (Sampler < 16)
+		{
+			state->mGenerations.Sampler[Sampler]++;
+		}
 		//texture->AddRef();
 	}
 
@@ -4365,6 +5206,17 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetTexture(DWORD Sampler, IDirect3DBaseTextu
 
 HRESULT STDMETHODCALLTYPE CDevice9::SetTextureStageState(DWORD Stage, D3DTEXTURESTAGESTATETYPE Type, DWORD Value)
 {
+	if (IsRecordingCommands())
+	{
+		DeviceCommand command;
+		command.Type = DEVICE_COMMAND_SET_TEXTURE_STAGE_STATE;
+		command.Arguments[0] = Stage;
+		command.Arguments[1] = Type;
+		command.Arguments[2] = Value;
+		RecordCommand(command);
+		return D3D_OK;
+	}
+
 	DeviceState* state = nullptr;
 
 	if (this->mCurrentStateRecording != nullptr)
@@ -4374,6 +5226,14 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetTextureStageState(DWORD Stage, D3DTEXTURE
 	else
 	{
 		state = &mDeviceState;
+
+		DWORD currentValue = 0;
+		if (GetTextureStageState(Stage, Type, &currentValue) == S_OK && currentValue == Value)
+		{
+			return S_OK;
+		}
+
+		state->mGenerations.TextureStageState++;
 	}
 
 	switch (Type)
@@ -4945,6 +5805,16 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetTextureStageState(DWORD Stage, D3DTEXTURE
 
 HRESULT STDMETHODCALLTYPE CDevice9::SetTransform(D3DTRANSFORMSTATETYPE State, const D3DMATRIX *pMatrix)
 {
+	if (IsRecordingCommands())
+	{
+		DeviceCommand command;
+		command.Type = DEVICE_COMMAND_SET_TRANSFORM;
+		command.Arguments[0] = State;
+		command.DataSize = sizeof(D3DMATRIX);
+		RecordCommand(command, pMatrix);
+		return D3D_OK;
+	}
+
 	if (this->mCurrentStateRecording != nullptr)
 	{
 		this->mCurrentStateRecording->mDeviceState.mTransforms[State] = (*pMatrix);
@@ -4952,8 +5822,28 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetTransform(D3DTRANSFORMSTATETYPE State, co
 	}
 	else
 	{
-		mDeviceState.mTransforms[State] = (*pMatrix);
+		D3DMATRIX& transform = mDeviceState.mTransforms[State];
+
+		if (memcmp(&transform, pMatrix, sizeof(D3DMATRIX)) == 0)
+		{
+			return S_OK;
+		}
+
+		transform = (*pMatrix);
 		mDeviceState.mHasTransformsChanged = true;
+
+		switch (State)
+		{
+		case D3DTS_WORLD:
+			mDeviceState.mGenerations.World++;
+			break;
+		case D3DTS_VIEW:
+		case D3DTS_PROJECTION:
+			mDeviceState.mGenerations.ViewProjection++;
+			break;
+		default:
+			break;
+		}
 	}
 
 	return S_OK;
@@ -4961,6 +5851,15 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetTransform(D3DTRANSFORMSTATETYPE State, co
 
 HRESULT STDMETHODCALLTYPE CDevice9::SetVertexDeclaration(IDirect3DVertexDeclaration9 *pDecl)
 {
+	if (IsRecordingCommands())
+	{
+		DeviceCommand command;
+		command.Type = DEVICE_COMMAND_SET_VERTEX_DECLARATION;
+		command.Object = pDecl;
+		RecordCommand(command);
+		return D3D_OK;
+	}
+
 	if (this->mCurrentStateRecording != nullptr)
 	{
 		this->mCurrentStateRecording->mDeviceState.mVertexDeclaration = (CVertexDeclaration9*)pDecl;
@@ -4970,10 +5869,16 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetVertexDeclaration(IDirect3DVertexDeclarat
 	}
 	else
 	{
+		if (mDeviceState.mHasVertexDeclaration && mDeviceState.mVertexDeclaration == (CVertexDeclaration9*)pDecl)
+		{
+			return S_OK;
+		}
+
 		mDeviceState.mVertexDeclaration = (CVertexDeclaration9*)pDecl;
 
 		mDeviceState.mHasVertexDeclaration = true;
 		mDeviceState.mHasFVF = false;
+		mDeviceState.mGenerations.Shader++;
 	}
 
 	return S_OK;
@@ -4981,6 +5886,20 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetVertexDeclaration(IDirect3DVertexDeclarat
 
 HRESULT STDMETHODCALLTYPE CDevice9::SetVertexShader(IDirect3DVertexShader9 *pShader)
 {
+	if (IsRecordingCommands())
+	{
+		DeviceCommand command;
+		command.Type = DEVICE_COMMAND_SET_VERTEX_SHADER;
+		command.Object = pShader;
+		RecordCommand(command);
+		return D3D_OK;
+	}
+
+	if (this->mCurrentStateRecording == nullptr && mDeviceState.mHasVertexShader && mDeviceState.mVertexShader == (CVertexShader9*)pShader)
+	{
+		return S_OK;
+	}
+
 	if (pShader != nullptr)
 	{
 		pShader->AddRef();
@@ -5001,6 +5920,7 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetVertexShader(IDirect3DVertexShader9 *pSha
 
 		mDeviceState.mVertexShader = (CVertexShader9*)pShader;
 		mDeviceState.mHasVertexShader = true;
+		mDeviceState.mGenerations.Shader++;
 	}
 
 	return S_OK;
@@ -5008,40 +5928,90 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetVertexShader(IDirect3DVertexShader9 *pSha
 
 HRESULT STDMETHODCALLTYPE CDevice9::SetVertexShaderConstantB(UINT StartRegister, const BOOL *pConstantData, UINT BoolCount)
 {
-	for (size_t i = 0; i < BoolCount; i++)
+	if (pConstantData == nullptr || StartRegister + BoolCount > MAX_SHADER_BOOLEAN_CONSTANTS)
+	{
+		return D3DERR_INVALIDCALL;
+	}
+
+	if (IsRecordingCommands())
 	{
-		this->mBufferManager->mPushConstants.Booleans[(StartRegister * 4) + i] = pConstantData[i];
+		DeviceCommand command;
+		command.Type = DEVICE_COMMAND_SET_VERTEX_SHADER_CONSTANT_B;
+		command.Arguments[0] = StartRegister;
+		command.Arguments[1] = BoolCount;
+		command.DataSize = BoolCount * sizeof(BOOL);
+		RecordCommand(command, pConstantData);
+		return D3D_OK;
 	}
 
+	this->mBufferManager->SetShaderConstants(SHADER_CONSTANT_VERTEX_INTEGER, offsetof(ShaderIntegerConstants, Booleans) + StartRegister * sizeof(BOOL), pConstantData, BoolCount * sizeof(BOOL));
+
 	return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::SetVertexShaderConstantF(UINT StartRegister, const float *pConstantData, UINT Vector4fCount)
 {
-	for (size_t i = 0; i < Vector4fCount; i++)
+	if (pConstantData == nullptr || StartRegister + Vector4fCount > MAX_VERTEX_SHADER_FLOAT_CONSTANTS)
 	{
-		this->mBufferManager->mPushConstants.Floats[(StartRegister * 4) + i] = pConstantData[i];
+		return D3DERR_INVALIDCALL;
+	}
+
+	if (IsRecordingCommands())
+	{
+		DeviceCommand command;
+		command.Type = DEVICE_COMMAND_SET_VERTEX_SHADER_CONSTANT_F;
+		command.Arguments[0] = StartRegister;
+		command.Arguments[1] = Vector4fCount;
+		command.DataSize = Vector4fCount * sizeof(float) * 4;
+		RecordCommand(command, pConstantData);
+		return D3D_OK;
 	}
 
+	this->mBufferManager->SetShaderConstants(SHADER_CONSTANT_VERTEX_FLOAT, StartRegister * sizeof(float) * 4, pConstantData, Vector4fCount * sizeof(float) * 4);
+
 	return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::SetVertexShaderConstantI(UINT StartRegister, const int *pConstantData, UINT Vector4iCount)
 {
-	for (size_t i = 0; i < Vector4iCount; i++)
+	if (pConstantData == nullptr || StartRegister + Vector4iCount > MAX_SHADER_INTEGER_CONSTANTS)
+	{
+		return D3DERR_INVALIDCALL;
+	}
+
+	if (IsRecordingCommands())
 	{
-		this->mBufferManager->mPushConstants.Booleans[(StartRegister * 4) + i] = pConstantData[i];
+		DeviceCommand command;
+		command.Type = DEVICE_COMMAND_SET_VERTEX_SHADER_CONSTANT_I;
+		command.Arguments[0] = StartRegister;
+		command.Arguments[1] = Vector4iCount;
+		command.DataSize = Vector4iCount * sizeof(int) * 4;
+		RecordCommand(command, pConstantData);
+		return D3D_OK;
 	}
 
+	this->mBufferManager->SetShaderConstants(SHADER_CONSTANT_VERTEX_INTEGER, offsetof(ShaderIntegerConstants, Integers) + StartRegister * sizeof(int) * 4, pConstantData, Vector4iCount * sizeof(int) * 4);
+
 	return S_OK;
 }
 
 HRESULT STDMETHODCALLTYPE CDevice9::SetViewport(const D3DVIEWPORT9 *pViewport)
 {
+	if (IsRecordingCommands())
+	{
+		DeviceCommand command;
+		command.Type = DEVICE_COMMAND_SET_VIEWPORT;
+		command.DataSize = sizeof(D3DVIEWPORT9);
+		RecordCommand(command, pViewport);
+		return D3D_OK;
+	}
+
 	if (this->mCurrentStateRecording != nullptr)
 	{
 		this->mCurrentStateRecording->mDeviceState.m9Viewport = (*pViewport);
 
+		this->mCurrentStateRecording->mDeviceState.mViewport.x = this->mCurrentStateRecording->mDeviceState.m9Viewport.X;
+		this->mCurrentStateRecording->mDeviceState.mViewport.y = this->mCurrentStateRecording->mDeviceState.m9Viewport.Y;
 		this->mCurrentStateRecording->mDeviceState.mViewport.width = mDeviceState.m9Viewport.Width;
 		this->mCurrentStateRecording->mDeviceState.mViewport.height = mDeviceState.m9Viewport.Height;
 		this->mCurrentStateRecording->mDeviceState.mViewport.minDepth = mDeviceState.m9Viewport.MinZ;
@@ -5049,8 +6019,15 @@ HRESULT STDMETHODCALLTYPE CDevice9::SetViewport(const D3DVIEWPORT9 *pViewport)
 	}
 	else
 	{
+		if (memcmp(&mDeviceState.m9Viewport, pViewport, sizeof(D3DVIEWPORT9)) == 0)
+		{
+			return S_OK;
+		}
+
 		mDeviceState.m9Viewport = (*pViewport);
 
+		mDeviceState.mViewport.x = mDeviceState.m9Viewport.X;
+		mDeviceState.mViewport.y = mDeviceState.m9Viewport.Y;
 		mDeviceState.mViewport.width = mDeviceState.m9Viewport.Width;
 		mDeviceState.mViewport.height = mDeviceState.m9Viewport.Height;
 		mDeviceState.mViewport.minDepth = mDeviceState.m9Viewport.MinZ;
@@ -5082,6 +6059,11 @@ HRESULT STDMETHODCALLTYPE CDevice9::TestCooperativeLevel()
 {
 	//TODO: Implement.
 
+	if (mIsDeviceLost)
+	{
+		return D3DERR_DEVICELOST;
+	}
+
 	BOOST_LOG_TRIVIAL(warning) << "CDevice9::TestCooperativeLevel is not implemented!";
 
 	return S_OK;
@@ -5119,7 +6101,6 @@ void CDevice9::SetImageLayout(VkImage image, VkImageAspectFlags aspectMask, VkIm
 	/*
 	This is just a helper method to reduce repeat code.
 	*/
-	VkResult result = VK_SUCCESS;
 	VkPipelineStageFlags sourceStages = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
 	VkPipelineStageFlags destinationStages = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
 	VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
@@ -5129,40 +6110,9 @@ void CDevice9::SetImageLayout(VkImage image, VkImageAspectFlags aspectMask, VkIm
 		aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
 	}
 
-	VkCommandBufferAllocateInfo commandBufferInfo = {};
-	commandBufferInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-	commandBufferInfo.pNext = nullptr;
-	commandBufferInfo.commandPool = mCommandPool;
-	commandBufferInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-	commandBufferInfo.commandBufferCount = 1;
-
-	result = vkAllocateCommandBuffers(mDevice, &commandBufferInfo, &commandBuffer);
-	if (result != VK_SUCCESS)
-	{
-		BOOST_LOG_TRIVIAL(fatal) << "CDevice9::SetImageLayout vkAllocateCommandBuffers failed with return code of " << mResult;
-		return;
-	}
-
-	VkCommandBufferInheritanceInfo commandBufferInheritanceInfo = {};
-	commandBufferInheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
-	commandBufferInheritanceInfo.pNext = nullptr;
-	commandBufferInheritanceInfo.renderPass = VK_NULL_HANDLE;
-	commandBufferInheritanceInfo.subpass = 0;
-	commandBufferInheritanceInfo.framebuffer = VK_NULL_HANDLE;
-	commandBufferInheritanceInfo.occlusionQueryEnable = VK_FALSE;
-	commandBufferInheritanceInfo.queryFlags = 0;
-	commandBufferInheritanceInfo.pipelineStatistics = 0;
-
-	VkCommandBufferBeginInfo commandBufferBeginInfo;
-	commandBufferBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-	commandBufferBeginInfo.pNext = nullptr;
-	commandBufferBeginInfo.flags = 0;
-	commandBufferBeginInfo.pInheritanceInfo = &commandBufferInheritanceInfo;
-
-	result = vkBeginCommandBuffer(commandBuffer, &commandBufferBeginInfo);
-	if (result != VK_SUCCESS)
+	commandBuffer = BeginOneTimeCommands();
+	if (commandBuffer == VK_NULL_HANDLE)
 	{
-		BOOST_LOG_TRIVIAL(fatal) << "CDevice9::SetImageLayout vkBeginCommandBuffer failed with return code of " << mResult;
 		return;
 	}
 
@@ -5247,41 +6197,772 @@ void CDevice9::SetImageLayout(VkImage image, VkImageAspectFlags aspectMask, VkIm
 
 	vkCmdPipelineBarrier(commandBuffer, sourceStages, destinationStages, 0, 0, nullptr, 0, nullptr, 1, &imageMemoryBarrier);
 
+	EndOneTimeCommands(commandBuffer);
+}
+
+VkCommandBuffer CDevice9::AcquireCommandBuffer()
+{
+	VkResult result = VK_SUCCESS;
+	VkCommandBuffer commandBuffer = VK_NULL_HANDLE;
+
+	if (mFreeCommandBuffers.size())
+	{
+		commandBuffer = mFreeCommandBuffers.back();
+		mFreeCommandBuffers.pop_back();
+	}
+	else
+	{
+		VkCommandBufferAllocateInfo commandBufferInfo = {};
+		commandBufferInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
+		commandBufferInfo.pNext = nullptr;
+		commandBufferInfo.commandPool = mCommandPool;
+		commandBufferInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
+		commandBufferInfo.commandBufferCount = 1;
+
+		result = vkAllocateCommandBuffers(mDevice, &commandBufferInfo, &commandBuffer);
+		if (result != VK_SUCCESS)
+		{
+			BOOST_LOG_TRIVIAL(fatal) << "CDevice9::AcquireCommandBuffer vkAllocateCommandBuffers failed with return code of " << result;
+			return VK_NULL_HANDLE;
+		}
+		mStatistics.CommandBuffersCreated++;
+	}
+
+	mStatistics.CommandBuffersInUse++;
+	mStatistics.MaximumCommandBuffersInUse = max(mStatistics.MaximumCommandBuffersInUse, mStatistics.CommandBuffersInUse);
+
+	return commandBuffer;
+}
+
+void CDevice9::ReleaseCommandBuffer(VkCommandBuffer commandBuffer)
+{
+	//The submission must have retired. The pool allows individual resets so beginning the buffer again resets it.
+	mFreeCommandBuffers.push_back(commandBuffer);
+	mStatistics.CommandBuffersInUse--;
+}
+
+VkFence CDevice9::AcquireFence()
+{
+	VkResult result = VK_SUCCESS;
+	VkFence fence = VK_NULL_HANDLE;
+
+	if (mFreeFences.size())
+	{
+		fence = mFreeFences.back();
+		mFreeFences.pop_back();
+	}
+	else
+	{
+		VkFenceCreateInfo fenceCreateInfo = {};
+		fenceCreateInfo.sType = VK_STRUCTURE_TYPE_FENCE_CREATE_INFO;
+		fenceCreateInfo.pNext = nullptr;
+		fenceCreateInfo.flags = 0;
+
+		result = vkCreateFence(mDevice, &fenceCreateInfo, nullptr, &fence);
+		if (result != VK_SUCCESS)
+		{
+			BOOST_LOG_TRIVIAL(fatal) << "CDevice9::AcquireFence vkCreateFence failed with return code of " << result;
+			return VK_NULL_HANDLE;
+		}
+		mStatistics.FencesCreated++;
+	}
+
+	mStatistics.FencesInUse++;
+	mStatistics.MaximumFencesInUse = max(mStatistics.MaximumFencesInUse, mStatistics.FencesInUse);
+
+	return fence;
+}
+
+void CDevice9::ReleaseFence(VkFence fence)
+{
+	//Fences on the free list are always unsignaled.
+	VkResult result = vkResetFences(mDevice, 1, &fence);
+	if (result != VK_SUCCESS)
+	{
+		BOOST_LOG_TRIVIAL(warning) << "CDevice9::ReleaseFence vkResetFences failed with return code of " << result;
+		vkDestroyFence(mDevice, fence, nullptr);
+	}
+	else
+	{
+		mFreeFences.push_back(fence);
+	}
+	mStatistics.FencesInUse--;
+}
+
+VkCommandBuffer CDevice9::BeginOneTimeCommands()
+{
+	VkResult result = VK_SUCCESS;
+	VkCommandBuffer commandBuffer = AcquireCommandBuffer();
+
+	if (commandBuffer == VK_NULL_HANDLE)
+	{
+		return VK_NULL_HANDLE;
+	}
+
+	VkCommandBufferBeginInfo commandBufferBeginInfo = {};
+	commandBufferBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
+	commandBufferBeginInfo.pNext = nullptr;
+	commandBufferBeginInfo.flags = VK_COMMAND_BUFFER_USAGE_ONE_TIME_SUBMIT_BIT;
+	commandBufferBeginInfo.pInheritanceInfo = nullptr;
+
+	result = vkBeginCommandBuffer(commandBuffer, &commandBufferBeginInfo);
+	if (result != VK_SUCCESS)
+	{
+		BOOST_LOG_TRIVIAL(fatal) << "CDevice9::BeginOneTimeCommands vkBeginCommandBuffer failed with return code of " << result;
+		ReleaseCommandBuffer(commandBuffer);
+		return VK_NULL_HANDLE;
+	}
+
+	return commandBuffer;
+}
+
+VkResult CDevice9::EndOneTimeCommands(VkCommandBuffer commandBuffer)
+{
+	VkResult result = VK_SUCCESS;
+
 	result = vkEndCommandBuffer(commandBuffer);
 	if (result != VK_SUCCESS)
 	{
-		BOOST_LOG_TRIVIAL(fatal) << "CDevice9::SetImageLayout vkEndCommandBuffer failed with return code of " << result;
+		BOOST_LOG_TRIVIAL(fatal) << "CDevice9::EndOneTimeCommands vkEndCommandBuffer failed with return code of " << result;
+		ReleaseCommandBuffer(commandBuffer);
+		return result;
+	}
+
+	VkFence fence = AcquireFence();
+	if (fence == VK_NULL_HANDLE)
+	{
+		ReleaseCommandBuffer(commandBuffer);
+		return VK_ERROR_INITIALIZATION_FAILED;
+	}
+
+	QueueSubmission submission;
+	submission.Type = QUEUE_SUBMISSION_SUBMIT;
+	submission.CommandBuffer = commandBuffer;
+	submission.Fence = fence;
+
+	//Goes through the submission thread when it is enabled so it stays the only thread using the queue.
+	result = Submit(submission);
+	if (result != VK_SUCCESS)
+	{
+		ReleaseFence(fence);
+		ReleaseCommandBuffer(commandBuffer);
+		return result;
+	}
+	mStatistics.OneTimeSubmits++;
+
+	//Only this submission is waited for. Waiting for the queue to go idle would also wait for the frames in flight.
+	result = WaitForSubmission(mLastSubmissionId);
+	if (result != VK_SUCCESS)
+	{
+		return result; //Not handed back since the failure may belong to another submission and this one may still be pending.
+	}
+
+	result = vkWaitForFences(mDevice, 1, &fence, VK_TRUE, UINT64_MAX);
+	if (result != VK_SUCCESS)
+	{
+		BOOST_LOG_TRIVIAL(fatal) << "CDevice9::EndOneTimeCommands vkWaitForFences failed with return code of " << result;
+		return result; //Not handed back since the submission may still be pending.
+	}
+
+	ReleaseFence(fence);
+	ReleaseCommandBuffer(commandBuffer);
+
+	return result;
+}
+
+VkResult CDevice9::Submit(const QueueSubmission& submission)
+{
+	VkResult result = VK_SUCCESS;
+
+	mLastSubmissionId++;
+
+	if (!mUseSubmissionThread)
+	{
+		result = ExecuteSubmission(submission);
+		mCompletedSubmissionId = mLastSubmissionId;
+		return result;
+	}
+
+	//The queue only fills up if the submission thread is stuck in a driver call so just wait for room.
+	while (!mSubmissions.push(submission))
+	{
+		mStatistics.SubmissionQueueFull++;
+		std::this_thread::yield();
+	}
+
+	//Taking the lock before notifying keeps the wake up from slipping in between the thread's check and its wait.
+	{
+		std::lock_guard<std::mutex> lock(mSubmissionMutex);
+	}
+	mSubmissionCondition.notify_one();
+
+	return result;
+}
+
+VkResult CDevice9::WaitForSubmission(uint64_t submissionId)
+{
+	if (mCompletedSubmissionId >= submissionId)
+	{
+		return mSubmissionResult.exchange(VK_SUCCESS);
+	}
+
+	std::chrono::steady_clock::time_point waitStart = std::chrono::steady_clock::now();
+
+	{
+		std::unique_lock<std::mutex> lock(mSubmissionMutex);
+		mSubmissionCompleteCondition.wait(lock, [this, submissionId]() { return mCompletedSubmissionId >= submissionId; });
+	}
+
+	mStatistics.SubmissionWaits++;
+	mStatistics.SubmissionWaitTime += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - waitStart).count();
+
+	//Submit can't report failures from the submission thread so the first wait after one reports it instead.
+	return mSubmissionResult.exchange(VK_SUCCESS);
+}
+
+BOOL CDevice9::IsFrameInFlight(uint64_t frameNumber)
+{
+	//Present already waited for every frame more than mMaximumFramesInFlight back. The frame being recorded counts as in flight.
+	return frameNumber != 0 && frameNumber + mMaximumFramesInFlight > mFrameNumber;
+}
+
+void CDevice9::WaitForFrame(uint64_t frameNumber)
+{
+	//The frame being recorded hasn't been submitted so there is nothing to wait for yet.
+	if (!IsFrameInFlight(frameNumber) || frameNumber == mFrameNumber)
+	{
 		return;
 	}
 
-	VkCommandBuffer commandBuffers[] = { commandBuffer };
-	VkFence nullFence = VK_NULL_HANDLE;
-	VkSubmitInfo submitInfo = {};
-	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-	submitInfo.pNext = NULL;
-	submitInfo.waitSemaphoreCount = 0;
-	submitInfo.pWaitSemaphores = NULL;
-	submitInfo.pWaitDstStageMask = NULL;
-	submitInfo.commandBufferCount = 1;
-	submitInfo.pCommandBuffers = commandBuffers;
-	submitInfo.signalSemaphoreCount = 0;
-	submitInfo.pSignalSemaphores = NULL;
-
-	result = vkQueueSubmit(mQueue, 1, &submitInfo, nullFence);
+	FrameContext& frame = mFrames[(mCurrentFrame + mMaximumFramesInFlight - (uint32_t)(mFrameNumber - frameNumber)) % mMaximumFramesInFlight];
+
+	VkResult result = WaitForSubmission(frame.SubmissionId);
 	if (result != VK_SUCCESS)
 	{
-		BOOST_LOG_TRIVIAL(fatal) << "CDevice9::SetImageLayout vkQueueSubmit failed with return code of " << result;
+		BOOST_LOG_TRIVIAL(fatal) << "CDevice9::WaitForFrame submission failed with return code of " << result;
 		return;
 	}
 
-	result = vkQueueWaitIdle(mQueue);
+	std::chrono::steady_clock::time_point waitStart = std::chrono::steady_clock::now();
+
+	result = vkWaitForFences(mDevice, 1, &frame.Fence, VK_TRUE, UINT64_MAX);
+	if (result != VK_SUCCESS)
+	{
+		BOOST_LOG_TRIVIAL(fatal) << "CDevice9::WaitForFrame vkWaitForFences failed with return code of " << result;
+	}
+
+	mStatistics.ResourceFenceWaits++;
+	mStatistics.ResourceFenceWaitTime += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - waitStart).count();
+}
+
+VkResult CDevice9::SubmitPartialFrame()
+{
+	/*
+	Submits what has been recorded of the current frame and waits for it so the caller can touch the results or the resources it used.
+	The caller has already ended the render pass. The rest of the frame is recorded into the same command buffer in a new store pass.
+	Failures before the submission is issued drop what was recorded and resume the frame. Later failures leave the command buffer possibly pending so the device is lost.
+	*/
+	VkResult result = VK_SUCCESS;
+	FrameContext& frame = mFrames[mCurrentFrame];
+
+	result = vkEndCommandBuffer(frame.CommandBuffer);
+	if (result != VK_SUCCESS)
+	{
+		BOOST_LOG_TRIVIAL(fatal) << "CDevice9::SubmitPartialFrame vkEndCommandBuffer failed with return code of " << result;
+		ResumeFrame();
+		return result;
+	}
+
+	VkFence fence = AcquireFence();
+	if (fence == VK_NULL_HANDLE)
+	{
+		ResumeFrame();
+		return VK_ERROR_INITIALIZATION_FAILED;
+	}
+
+	QueueSubmission submission;
+	submission.Type = QUEUE_SUBMISSION_SUBMIT;
+	submission.CommandBuffer = frame.CommandBuffer;
+	if (!frame.IsImageAvailableWaited)
+	{
+		submission.WaitSemaphore = frame.ImageAvailableSemaphore;
+		submission.WaitStage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT;
+	}
+	submission.Fence = fence;
+
+	result = Submit(submission);
+	if (result != VK_SUCCESS)
+	{
+		//Nothing was queued so the semaphore is still waiting for the rest of the frame.
+		ReleaseFence(fence);
+		ResumeFrame();
+		return result;
+	}
+	frame.IsImageAvailableWaited = true;
+	mStatistics.PartialFrameSubmits++;
+
+	result = WaitForSubmission(mLastSubmissionId);
+	if (result != VK_SUCCESS)
+	{
+		BOOST_LOG_TRIVIAL(fatal) << "CDevice9::SubmitPartialFrame submission failed with return code of " << result;
+		mIsDeviceLost = true;
+		return result;
+	}
+
+	result = vkWaitForFences(mDevice, 1, &fence, VK_TRUE, UINT64_MAX);
+	if (result != VK_SUCCESS)
+	{
+		BOOST_LOG_TRIVIAL(fatal) << "CDevice9::SubmitPartialFrame vkWaitForFences failed with return code of " << result;
+		mIsDeviceLost = true;
+		return result;
+	}
+	ReleaseFence(fence);
+
+	return ResumeFrame();
+}
+
+VkResult CDevice9::ResumeFrame()
+{
+	VkResult result = VK_SUCCESS;
+	FrameContext& frame = mFrames[mCurrentFrame];
+
+	//The command buffer isn't pending so beginning it again resets it.
+	result = vkBeginCommandBuffer(frame.CommandBuffer, &mCommandBufferBeginInfo);
 	if (result != VK_SUCCESS)
 	{
-		BOOST_LOG_TRIVIAL(fatal) << "CDevice9::SetImageLayout vkQueueWaitIdle failed with return code of " << result;
+		BOOST_LOG_TRIVIAL(fatal) << "CDevice9::ResumeFrame vkBeginCommandBuffer failed with return code of " << result;
+		mIsDeviceLost = true;
+		return result;
+	}
+	mBufferManager->mCommandBufferState.Reset(frame.CommandBuffer);
+
+	//StartScene left the store pass in the begin info.
+	vkCmdBeginRenderPass(frame.CommandBuffer, &mRenderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE);
+	mStatistics.RenderPassBegins++;
+	mStatistics.FrameRenderPassBegins++;
+	mStatistics.MaximumFrameRenderPassBegins = max(mStatistics.MaximumFrameRenderPassBegins, mStatistics.FrameRenderPassBegins);
+
+	return result;
+}
+
+VkResult CDevice9::ExecuteSubmission(const QueueSubmission& submission)
+{
+	VkResult result = VK_SUCCESS;
+	std::chrono::steady_clock::time_point callStart = std::chrono::steady_clock::now();
+
+	switch (submission.Type)
+	{
+	case QUEUE_SUBMISSION_SUBMIT:
+	{
+		VkSubmitInfo submitInfo = {};
+		submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
+		submitInfo.pNext = nullptr;
+		submitInfo.waitSemaphoreCount = (submission.WaitSemaphore != VK_NULL_HANDLE) ? 1 : 0;
+		submitInfo.pWaitSemaphores = &submission.WaitSemaphore;
+		submitInfo.pWaitDstStageMask = &submission.WaitStage;
+		submitInfo.commandBufferCount = 1;
+		submitInfo.pCommandBuffers = &submission.CommandBuffer;
+		submitInfo.signalSemaphoreCount = (submission.SignalSemaphore != VK_NULL_HANDLE) ? 1 : 0;
+		submitInfo.pSignalSemaphores = &submission.SignalSemaphore;
+
+		result = vkQueueSubmit(mQueue, 1, &submitInfo, submission.Fence);
+		if (result != VK_SUCCESS)
+		{
+			BOOST_LOG_TRIVIAL(fatal) << "CDevice9::ExecuteSubmission vkQueueSubmit failed with return code of " << result;
+		}
+	}
+	break;
+	case QUEUE_SUBMISSION_PRESENT:
+	{
+		VkPresentInfoKHR presentInfo = mPresentInfo;
+		presentInfo.waitSemaphoreCount = 1;
+		presentInfo.pWaitSemaphores = &submission.WaitSemaphore;
+		presentInfo.pImageIndices = &submission.ImageIndex;
+
+		if (mUseSubmissionThread)
+		{
+			std::lock_guard<std::mutex> lock(mSwapchainMutex);
+			result = vkQueuePresentKHR(mQueue, &presentInfo);
+		}
+		else
+		{
+			result = vkQueuePresentKHR(mQueue, &presentInfo);
+		}
+
+		if (result != VK_SUCCESS)
+		{
+			BOOST_LOG_TRIVIAL(fatal) << "CDevice9::ExecuteSubmission vkQueuePresentKHR failed with return code of " << result;
+		}
+	}
+	break;
+	default:
+		break;
+	}
+
+	mStatistics.QueueCallTime += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - callStart).count();
+
+	return result;
+}
+
+void CDevice9::ProcessSubmissions()
+{
+	QueueSubmission submission;
+
+	for (;;)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mSubmissionMutex);
+			mSubmissionCondition.wait(lock, [this]() { return mIsSubmissionThreadStopping || mSubmissions.read_available(); });
+
+			//Everything already queued is still issued so waiters and the device wait idle in the destructor see it.
+			if (mIsSubmissionThreadStopping && !mSubmissions.read_available())
+			{
+				return;
+			}
+		}
+
+		while (mSubmissions.pop(submission))
+		{
+			VkResult result = ExecuteSubmission(submission);
+			if (result != VK_SUCCESS)
+			{
+				mSubmissionResult = result;
+			}
+
+			{
+				std::lock_guard<std::mutex> lock(mSubmissionMutex);
+				mCompletedSubmissionId++;
+			}
+			mSubmissionCompleteCondition.notify_all();
+		}
+	}
+}
+
+BOOL CDevice9::IsRecordingCommands()
+{
+	//The command stream thread replays by calling the same entry points so it has to execute them instead of recording them again.
+	return mUseCommandStream && std::this_thread::get_id() != mCommandStreamThread.get_id();
+}
+
+void CDevice9::RecordCommand(const DeviceCommand& command, const void* data)
+{
+	WriteCommandStream(&command, sizeof(DeviceCommand));
+
+	if (command.DataSize)
+	{
+		WriteCommandStream(data, command.DataSize);
+	}
+
+	mRecordedCommands++;
+
+	//Pairs with the fence in ProcessCommandStream so either the thread sees the command or this sees the thread waiting.
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (mIsCommandStreamThreadWaiting)
+	{
+		{
+			std::lock_guard<std::mutex> lock(mCommandStreamMutex);
+		}
+		mCommandStreamCondition.notify_one();
+	}
+}
+
+void CDevice9::WriteCommandStream(const void* data, size_t size)
+{
+	const uint8_t* bytes = (const uint8_t*)data;
+
+	//Commands can be split across the end of the ring or be larger than the space left so keep pushing whatever fits.
+	while (size)
+	{
+		size_t written = mCommandStream->push(bytes, size);
+
+		if (!written)
+		{
+			mStatistics.CommandStreamFull++;
+
+			//A command larger than the ring is never finished so the thread has to be woken to make room for the rest.
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			if (mIsCommandStreamThreadWaiting)
+			{
+				{
+					std::lock_guard<std::mutex> lock(mCommandStreamMutex);
+				}
+				mCommandStreamCondition.notify_one();
+			}
+
+			std::this_thread::yield();
+			continue;
+		}
+
+		bytes += written;
+		size -= written;
+	}
+}
+
+void CDevice9::ReadCommandStream(void* data, size_t size)
+{
+	uint8_t* bytes = (uint8_t*)data;
+
+	//The API thread may still be writing the rest of the command.
+	while (size)
+	{
+		size_t read = mCommandStream->pop(bytes, size);
+
+		if (!read)
+		{
+			std::this_thread::yield();
+			continue;
+		}
+
+		bytes += read;
+		size -= read;
+	}
+}
+
+void CDevice9::SynchronizeCommandStream()
+{
+	if (!IsRecordingCommands() || mExecutedCommands == mRecordedCommands)
+	{
 		return;
 	}
 
-	vkFreeCommandBuffers(mDevice, mCommandPool, 1, commandBuffers);
+	std::chrono::steady_clock::time_point waitStart = std::chrono::steady_clock::now();
+
+	{
+		std::unique_lock<std::mutex> lock(mCommandStreamMutex);
+		mCommandStreamProgressCondition.wait(lock, [this]() { return mExecutedCommands == mRecordedCommands; });
+	}
+
+	mStatistics.CommandStreamSynchronizations++;
+	mStatistics.CommandStreamSynchronizationTime += std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - waitStart).count();
+}
+
+void CDevice9::ExecuteCommand(const DeviceCommand& command, const void* data)
+{
+	const DWORD* arguments = command.Arguments;
+
+	switch (command.Type)
+	{
+	case DEVICE_COMMAND_CLEAR:
+		Clear(arguments[0], (const D3DRECT*)data, arguments[1], arguments[2], command.Float, arguments[3]);
+		break;
+	case DEVICE_COMMAND_BEGIN_SCENE:
+		BeginScene();
+		break;
+	case DEVICE_COMMAND_END_SCENE:
+		EndScene();
+		break;
+	case DEVICE_COMMAND_PRESENT:
+		Present(nullptr, nullptr, nullptr, nullptr);
+		break;
+	case DEVICE_COMMAND_DRAW_PRIMITIVE:
+		DrawPrimitive((D3DPRIMITIVETYPE)arguments[0], arguments[1], arguments[2]);
+		break;
+	case DEVICE_COMMAND_DRAW_INDEXED_PRIMITIVE:
+		DrawIndexedPrimitive((D3DPRIMITIVETYPE)arguments[0], (INT)arguments[1], arguments[2], arguments[3], arguments[4], arguments[5]);
+		break;
+	case DEVICE_COMMAND_LIGHT_ENABLE:
+		LightEnable(arguments[0], arguments[1]);
+		break;
+	case DEVICE_COMMAND_SET_FVF:
+		SetFVF(arguments[0]);
+		break;
+	case DEVICE_COMMAND_SET_INDICES:
+		SetIndices((IDirect3DIndexBuffer9*)command.Object);
+		break;
+	case DEVICE_COMMAND_SET_LIGHT:
+		SetLight(arguments[0], (const D3DLIGHT9*)data);
+		break;
+	case DEVICE_COMMAND_SET_MATERIAL:
+		SetMaterial((const D3DMATERIAL9*)data);
+		break;
+	case DEVICE_COMMAND_SET_PIXEL_SHADER:
+		SetPixelShader((IDirect3DPixelShader9*)command.Object);
+		break;
+	case DEVICE_COMMAND_SET_PIXEL_SHADER_CONSTANT_B:
+		SetPixelShaderConstantB(arguments[0], (const BOOL*)data, arguments[1]);
+		break;
+	case DEVICE_COMMAND_SET_PIXEL_SHADER_CONSTANT_F:
+		SetPixelShaderConstantF(arguments[0], (const float*)data, arguments[1]);
+		break;
+	case DEVICE_COMMAND_SET_PIXEL_SHADER_CONSTANT_I:
+		SetPixelShaderConstantI(arguments[0], (const int*)data, arguments[1]);
+		break;
+	case DEVICE_COMMAND_SET_RENDER_STATE:
+		SetRenderState((D3DRENDERSTATETYPE)arguments[0], arguments[1]);
+		break;
+	case DEVICE_COMMAND_SET_SAMPLER_STATE:
+		SetSamplerState(arguments[0], (D3DSAMPLERSTATETYPE)arguments[1], arguments[2]);
+		break;
+	case DEVICE_COMMAND_SET_STREAM_SOURCE:
+		SetStreamSource(arguments[0], (IDirect3DVertexBuffer9*)command.Object, arguments[1], arguments[2]);
+		break;
+	case DEVICE_COMMAND_SET_TEXTURE:
+		SetTexture(arguments[0], (IDirect3DBaseTexture9*)command.Object);
+		break;
+	case DEVICE_COMMAND_SET_TEXTURE_STAGE_STATE:
+		SetTextureStageState(arguments[0], (D3DTEXTURESTAGESTATETYPE)arguments[1], arguments[2]);
+		break;
+	case DEVICE_COMMAND_SET_TRANSFORM:
+		SetTransform((D3DTRANSFORMSTATETYPE)arguments[0], (const D3DMATRIX*)data);
+		break;
+	case DEVICE_COMMAND_SET_VERTEX_DECLARATION:
+		SetVertexDeclaration((IDirect3DVertexDeclaration9*)command.Object);
+		break;
+	case DEVICE_COMMAND_SET_VERTEX_SHADER:
+		SetVertexShader((IDirect3DVertexShader9*)command.Object);
+		break;
+	case DEVICE_COMMAND_SET_VERTEX_SHADER_CONSTANT_B:
+		SetVertexShaderConstantB(arguments[0], (const BOOL*)data, arguments[1]);
+		break;
+	case DEVICE_COMMAND_SET_VERTEX_SHADER_CONSTANT_F:
+		SetVertexShaderConstantF(arguments[0], (const float*)data, arguments[1]);
+		break;
+	case DEVICE_COMMAND_SET_VERTEX_SHADER_CONSTANT_I:
+		SetVertexShaderConstantI(arguments[0], (const int*)data, arguments[1]);
+		break;
+	case DEVICE_COMMAND_SET_VIEWPORT:
+		SetViewport((const D3DVIEWPORT9*)data);
+		break;
+	default:
+		BOOST_LOG_TRIVIAL(warning) << "CDevice9::ExecuteCommand unknown command type " << command.Type;
+		break;
+	}
+}
+
+void CDevice9::ProcessCommandStream()
+{
+	DeviceCommand command;
+
+	for (;;)
+	{
+		if (!mCommandStream->read_available())
+		{
+			std::unique_lock<std::mutex> lock(mCommandStreamMutex);
+
+			//Everything recorded so far has been executed so wake anyone synchronizing before going to sleep.
+			mCommandStreamProgressCondition.notify_all();
+
+			mIsCommandStreamThreadWaiting = true;
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			mCommandStreamCondition.wait(lock, [this]() { return mIsCommandStreamThreadStopping || mCommandStream->read_available(); });
+			mIsCommandStreamThreadWaiting = false;
+
+			//Everything already recorded is still replayed so the last frame is submitted before the device goes away.
+			if (mIsCommandStreamThreadStopping && !mCommandStream->read_available())
+			{
+				return;
+			}
+		}
+
+		ReadCommandStream(&command, sizeof(DeviceCommand));
+
+		if (command.DataSize)
+		{
+			if (mCommandData.size() < command.DataSize)
+			{
+				mCommandData.resize(command.DataSize);
+			}
+			ReadCommandStream(mCommandData.data(), command.DataSize);
+		}
+
+		ExecuteCommand(command, command.DataSize ? mCommandData.data() : nullptr);
+
+		if (command.Type == DEVICE_COMMAND_PRESENT)
+		{
+			{
+				std::lock_guard<std::mutex> lock(mCommandStreamMutex);
+				mQueuedPresents--;
+				mExecutedCommands++;
+			}
+			mCommandStreamProgressCondition.notify_all();
+		}
+		else
+		{
+			mExecutedCommands++;
+		}
+	}
+}
+
+#define MAX_DESCRIPTOR 2048
+
+VkResult CDevice9::CreateDescriptorPool(VkDescriptorPool& descriptorPool, VkDescriptorPoolCreateFlags flags)
+{
+	VkDescriptorPoolSize descriptorPoolSizes[11] = {};
+
+	descriptorPoolSizes[0].type = VK_DESCRIPTOR_TYPE_SAMPLER;
+	descriptorPoolSizes[0].descriptorCount = min((uint32_t)MAX_DESCRIPTOR, mDeviceProperties.limits.maxDescriptorSetSamplers);
+
+	descriptorPoolSizes[1].type = VK_DESCRIPTOR_TYPE_COMBINED_IMAGE_SAMPLER;
+	descriptorPoolSizes[1].descriptorCount = min((uint32_t)MAX_DESCRIPTOR, mDeviceProperties.limits.maxPerStageDescriptorSamplers);
+
+	descriptorPoolSizes[2].type = VK_DESCRIPTOR_TYPE_SAMPLED_IMAGE;
+	descriptorPoolSizes[2].descriptorCount = min((uint32_t)MAX_DESCRIPTOR, mDeviceProperties.limits.maxDescriptorSetSampledImages);
+
+	descriptorPoolSizes[3].type = VK_DESCRIPTOR_TYPE_STORAGE_IMAGE;
+	descriptorPoolSizes[3].descriptorCount = min((uint32_t)MAX_DESCRIPTOR, mDeviceProperties.limits.maxDescriptorSetStorageImages);
+
+	descriptorPoolSizes[4].type = VK_DESCRIPTOR_TYPE_UNIFORM_TEXEL_BUFFER;
+	descriptorPoolSizes[4].descriptorCount = min((uint32_t)MAX_DESCRIPTOR, mDeviceProperties.limits.maxPerStageDescriptorSampledImages);
+
+	descriptorPoolSizes[5].type = VK_DESCRIPTOR_TYPE_STORAGE_TEXEL_BUFFER;
+	descriptorPoolSizes[5].descriptorCount = min((uint32_t)MAX_DESCRIPTOR, mDeviceProperties.limits.maxPerStageDescriptorStorageImages);
+
+	descriptorPoolSizes[6].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER;
+	descriptorPoolSizes[6].descriptorCount = min((uint32_t)MAX_DESCRIPTOR, mDeviceProperties.limits.maxDescriptorSetUniformBuffers);
+
+	descriptorPoolSizes[7].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER;
+	descriptorPoolSizes[7].descriptorCount = min((uint32_t)MAX_DESCRIPTOR, mDeviceProperties.limits.maxDescriptorSetStorageBuffers);
+
+	descriptorPoolSizes[8].type = VK_DESCRIPTOR_TYPE_UNIFORM_BUFFER_DYNAMIC;
+	descriptorPoolSizes[8].descriptorCount = min((uint32_t)MAX_DESCRIPTOR, mDeviceProperties.limits.maxDescriptorSetUniformBuffersDynamic);
+
+	descriptorPoolSizes[9].type = VK_DESCRIPTOR_TYPE_STORAGE_BUFFER_DYNAMIC;
+	descriptorPoolSizes[9].descriptorCount = min((uint32_t)MAX_DESCRIPTOR, mDeviceProperties.limits.maxDescriptorSetStorageBuffersDynamic);
+
+	descriptorPoolSizes[10].type = VK_DESCRIPTOR_TYPE_INPUT_ATTACHMENT;
+	descriptorPoolSizes[10].descriptorCount = min((uint32_t)MAX_DESCRIPTOR, mDeviceProperties.limits.maxDescriptorSetInputAttachments);
+
+
+	VkDescriptorPoolCreateInfo descriptorPoolCreateInfo = {};
+	descriptorPoolCreateInfo.sType = VK_STRUCTURE_TYPE_DESCRIPTOR_POOL_CREATE_INFO;
+	descriptorPoolCreateInfo.pNext = NULL;
+	descriptorPoolCreateInfo.maxSets = min((uint32_t)MAX_DESCRIPTOR, mDeviceProperties.limits.maxDescriptorSetSamplers);
+	descriptorPoolCreateInfo.poolSizeCount = 11;
+	descriptorPoolCreateInfo.pPoolSizes = descriptorPoolSizes;
+
+	/*
+	VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT allows descriptors to return to the pool when they are freed.
+	Pools that are only ever reset as a whole leave it off so the driver can allocate linearly.
+	*/
+	descriptorPoolCreateInfo.flags = flags;
+
+	VkResult result = vkCreateDescriptorPool(mDevice, &descriptorPoolCreateInfo, nullptr, &descriptorPool);
+	if (result != VK_SUCCESS)
+	{
+		BOOST_LOG_TRIVIAL(fatal) << "CDevice9::CreateDescriptorPool vkCreateDescriptorPool failed with return code of " << result;
+		return result;
+	}
+
+	return result;
+}
+
+void CDevice9::LogStatistics()
+{
+	const DeviceStatistics& s = mStatistics;
+
+	BOOST_LOG_TRIVIAL(info) << "CDevice9::LogStatistics frames: " << s.Frames << " frames, " << s.RenderPassBegins << " render passes (at most " << s.MaximumFrameRenderPassBegins << " in a frame), " << s.FrameFenceWaits << " frame fence waits for " << s.FrameFenceWaitTime << "us (longest " << s.MaximumFrameFenceWait << "us), "
+		<< s.ResourceFenceWaits << " resource waits for " << s.ResourceFenceWaitTime << "us, " << s.BufferRenames << " buffer renames and " << s.PartialFrameSubmits << " partial frame submits.";
+	BOOST_LOG_TRIVIAL(info) << "CDevice9::LogStatistics draws: " << s.DrawCount << " draws, " << s.DrawContextAllocations << " draw contexts and " << s.ResourceContextAllocations << " resource contexts allocated, "
+		<< s.DrawsRecorded << " recorded in " << s.DrawRecordTime << "ns and " << s.DrawsExecuted << " executed in " << s.DrawExecuteTime << "ns.";
+	BOOST_LOG_TRIVIAL(info) << "CDevice9::LogStatistics pipelines: " << s.PipelineCount << " created, longest stall " << s.MaximumPipelineStall << "us, cache " << s.PipelineCacheHits << " hits, " << s.PipelineCacheMisses << " misses and " << s.PipelineCacheEvictions << " evictions, "
+		<< s.StaticPipelineKeys << " keys without dynamic state and " << s.DynamicPipelineKeys << " with it.";
+	BOOST_LOG_TRIVIAL(info) << "CDevice9::LogStatistics descriptors: samplers " << s.SamplerCacheHits << "/" << s.SamplerCacheMisses << ", layouts " << s.LayoutCacheHits << "/" << s.LayoutCacheMisses << ", sets " << s.DescriptorSetHits << "/" << s.DescriptorSetMisses << " hits/misses, "
+		<< s.DescriptorSetAllocations << " sets from " << s.DescriptorPools << " pools, " << s.DescriptorSetWrites << " writes in " << s.DescriptorSetWriteTime << "ns and " << s.PushDescriptorWrites << " descriptors in " << s.PushDescriptorCount << " pushes.";
+	BOOST_LOG_TRIVIAL(info) << "CDevice9::LogStatistics constants: " << s.WorldUpdates << " world and " << s.ViewProjectionUpdates << " view projection rebuilds for " << s.TransformationPushes << " pushes, " << s.FixedFunctionUploadBytes << " fixed function bytes in " << s.FixedFunctionUploads << " uploads, "
+		<< s.ConstantUploadBytes << " shader constant bytes in " << s.ConstantUploads << " uploads, " << s.ConstantRedundantSets << " redundant sets and " << s.ConstantRingGrowths << " ring growths.";
+	BOOST_LOG_TRIVIAL(info) << "CDevice9::LogStatistics submissions: " << s.CommandBuffersCreated << " command buffers, " << s.FencesCreated << " fences and " << s.SemaphoresCreated << " semaphores created, " << s.OneTimeSubmits << " one time submits, at most " << s.MaximumCommandBuffersInUse << " command buffers and " << s.MaximumFencesInUse << " fences in use, "
+		<< s.QueueCallTime << "us in queue calls, " << s.SubmissionWaits << " waits for " << s.SubmissionWaitTime << "us, " << s.SubmissionQueueFull << " full queues and " << s.AcquireRetries << " acquire retries.";
+	BOOST_LOG_TRIVIAL(info) << "CDevice9::LogStatistics command stream: " << mRecordedCommands << " commands, " << s.CommandStreamFull << " full streams, " << s.CommandStreamSynchronizations << " synchronizations for " << s.CommandStreamSynchronizationTime << "us and " << s.PresentThrottles << " throttled presents.";
 }
 
 void CDevice9::StartScene(bool clear)
@@ -5292,30 +6973,64 @@ void CDevice9::StartScene(bool clear)
 
 	//BeginPaint(mFocusWindow, mPaintInformation);
 
-	result = vkCreateSemaphore(mDevice, &mPresentCompleteSemaphoreCreateInfo, nullptr, &mPresentCompleteSemaphore);
-	if (result != VK_SUCCESS)
+	//Present already waited for this frame's fence so its semaphores are free to reuse.
+	FrameContext& frame = mFrames[mCurrentFrame];
+
+	if (mUseSubmissionThread)
 	{
-		BOOST_LOG_TRIVIAL(fatal) << "CDevice9::StartScene vkCreateSemaphore failed with return code of " << mResult;
-		return;
-	}
+		/*
+		The submission thread presents to the same swapchain so the acquire has to hold the swapchain lock.
+		A blocking acquire would hold the lock while the present that would free an image is still queued so while anything is queued the acquire only polls and then sleeps until the submission thread finishes something.
+		Once nothing is queued no present needs the lock and the acquire can block.
+		*/
+		for (;;)
+		{
+			uint64_t completedSubmissionId = mCompletedSubmissionId;
+			uint64_t timeout = (completedSubmissionId >= mLastSubmissionId) ? UINT64_MAX : 0;
+
+			{
+				std::lock_guard<std::mutex> lock(mSwapchainMutex);
+				result = vkAcquireNextImageKHR(mDevice, mSwapchain, timeout, frame.ImageAvailableSemaphore, (VkFence)0, &mCurrentBuffer);
+			}
+
+			if (result != VK_NOT_READY && result != VK_TIMEOUT)
+			{
+				break;
+			}
 
-	result = vkAcquireNextImageKHR(mDevice, mSwapchain, UINT64_MAX, mPresentCompleteSemaphore, (VkFence)0, &mCurrentBuffer);
+			mStatistics.AcquireRetries++;
+
+			{
+				std::unique_lock<std::mutex> lock(mSubmissionMutex);
+				mSubmissionCompleteCondition.wait(lock, [this, completedSubmissionId]() { return mCompletedSubmissionId != completedSubmissionId; });
+			}
+		}
+	}
+	else
+	{
+		result = vkAcquireNextImageKHR(mDevice, mSwapchain, UINT64_MAX, frame.ImageAvailableSemaphore, (VkFence)0, &mCurrentBuffer);
+	}
 	if (result != VK_SUCCESS)
 	{
 		BOOST_LOG_TRIVIAL(fatal) << "CDevice9::StartScene vkAcquireNextImageKHR failed with return code of " << mResult;
 		return;
 	}
 
+	frame.IsImageAvailableWaited = false;
+
 	//maybe add back later
 	//SetImageLayout(mSwapchainImages[mCurrentBuffer], VK_IMAGE_ASPECT_COLOR_BIT, VK_IMAGE_LAYOUT_UNDEFINED, VK_IMAGE_LAYOUT_PRESENT_SRC_KHR); //VK_IMAGE_LAYOUT_COLOR_ATTACHMENT_OPTIMAL
 
-	result = vkBeginCommandBuffer(mSwapchainBuffers[mCurrentBuffer], &mCommandBufferBeginInfo);
+	result = vkBeginCommandBuffer(frame.CommandBuffer, &mCommandBufferBeginInfo);
 	if (result != VK_SUCCESS)
 	{
 		BOOST_LOG_TRIVIAL(fatal) << "CDevice9::StartScene vkBeginCommandBuffer failed with return code of " << mResult;
 		return;
 	}
 
+	//Nothing is bound on a freshly begun command buffer.
+	mBufferManager->mCommandBufferState.Reset(frame.CommandBuffer);
+
 	mImageMemoryBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
 	mImageMemoryBarrier.pNext = nullptr;
 	mImageMemoryBarrier.srcAccessMask = 0;
@@ -5327,14 +7042,7 @@ void CDevice9::StartScene(bool clear)
 	mImageMemoryBarrier.image = mSwapchainImages[mCurrentBuffer];
 	mImageMemoryBarrier.subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
 
-	vkCmdPipelineBarrier(mSwapchainBuffers[mCurrentBuffer], VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 0, nullptr, 1, &mImageMemoryBarrier);
-
-	/*
-	The Vulkan spec doesn't allow updating buffers inside of a render pass so we need to put as much buffer update logic into this method to reduce violations.
-	The previous UBO implementation was updating inside of a render pass and it seemed to work on Desktop but that may vary from driver to driver.
-	In addition performance is not guaranteed in case of spec violation.
-	*/
-	mBufferManager->UpdateBuffer();
+	vkCmdPipelineBarrier(frame.CommandBuffer, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 0, nullptr, 1, &mImageMemoryBarrier);
 
 	mClearValues[0].color = mClearColorValue;
 	mClearValues[1].depthStencil = { 1.0f, 0 };
@@ -5357,11 +7065,13 @@ void CDevice9::StartScene(bool clear)
 	mRenderPassBeginInfo.clearValueCount = 2;
 	mRenderPassBeginInfo.pClearValues = mClearValues;
 
-	vkCmdBeginRenderPass(mSwapchainBuffers[mCurrentBuffer], &mRenderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE); //why doesn't this return a result.
+	vkCmdBeginRenderPass(frame.CommandBuffer, &mRenderPassBeginInfo, VK_SUBPASS_CONTENTS_INLINE); //why doesn't this return a result.
+	mStatistics.RenderPassBegins++;
+	mStatistics.FrameRenderPassBegins = 1;
+	mStatistics.MaximumFrameRenderPassBegins = max(mStatistics.MaximumFrameRenderPassBegins, mStatistics.FrameRenderPassBegins);
 	//Set the pass back to store so draw calls won't be lost if they require stop/start of render pass.
 	mRenderPassBeginInfo.renderPass = mStoreRenderPass; 
-	vkCmdSetViewport(mSwapchainBuffers[mCurrentBuffer], 0, 1, &mDeviceState.mViewport);
-	vkCmdSetScissor(mSwapchainBuffers[mCurrentBuffer], 0, 1, &mDeviceState.mScissor);
+	//Viewport and scissor are set at the next draw by the buffer manager.
 }
 
 void CDevice9::StopScene()
@@ -5369,19 +7079,20 @@ void CDevice9::StopScene()
 	mIsSceneStarted = false;
 
 	VkResult result; // = VK_SUCCESS
-	mPipeStageFlags = VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT;
+	FrameContext& frame = mFrames[mCurrentFrame];
 
-	mSubmitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-	mSubmitInfo.pNext = nullptr;
-	mSubmitInfo.waitSemaphoreCount = 1;
-	mSubmitInfo.pWaitSemaphores = &mPresentCompleteSemaphore;
-	mSubmitInfo.pWaitDstStageMask = &mPipeStageFlags;
-	mSubmitInfo.commandBufferCount = 1;
-	mSubmitInfo.pCommandBuffers = &mSwapchainBuffers[mCurrentBuffer];
-	mSubmitInfo.signalSemaphoreCount = 0;
-	mSubmitInfo.pSignalSemaphores = nullptr;
+	QueueSubmission submission;
+	submission.Type = QUEUE_SUBMISSION_SUBMIT;
+	submission.CommandBuffer = frame.CommandBuffer;
+	if (!frame.IsImageAvailableWaited)
+	{
+		submission.WaitSemaphore = frame.ImageAvailableSemaphore;
+		submission.WaitStage = VK_PIPELINE_STAGE_ALL_COMMANDS_BIT; //The previous frame may still be on the GPU so nothing in this one may touch the swapchain image before it is acquired.
+	}
+	submission.SignalSemaphore = frame.RenderFinishedSemaphore;
+	submission.Fence = frame.Fence;
 
-	vkCmdEndRenderPass(mSwapchainBuffers[mCurrentBuffer]); // Why no result?
+	vkCmdEndRenderPass(frame.CommandBuffer); // Why no result?
 
 	mPrePresentBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
 	mPrePresentBarrier.pNext = nullptr;
@@ -5395,21 +7106,28 @@ void CDevice9::StopScene()
 
 	mPrePresentBarrier.image = mSwapchainImages[mCurrentBuffer];
 	VkImageMemoryBarrier* memoryBarrier = &mPrePresentBarrier;
-	vkCmdPipelineBarrier(mSwapchainBuffers[mCurrentBuffer], VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 0, nullptr, 1, memoryBarrier);
+	vkCmdPipelineBarrier(frame.CommandBuffer, VK_PIPELINE_STAGE_ALL_COMMANDS_BIT, VK_PIPELINE_STAGE_BOTTOM_OF_PIPE_BIT, 0, 0, nullptr, 0, nullptr, 1, memoryBarrier);
 
-	result = vkEndCommandBuffer(mSwapchainBuffers[mCurrentBuffer]);
+	result = vkEndCommandBuffer(frame.CommandBuffer);
 	if (result != VK_SUCCESS)
 	{
 		BOOST_LOG_TRIVIAL(fatal) << "CDevice9::EndScene vkEndCommandBuffer failed with return code of " << mResult;
 		return;
 	}
 
-	result = vkQueueSubmit(mQueue, 1, &mSubmitInfo, mNullFence);
+	result = vkResetFences(mDevice, 1, &frame.Fence);
+	if (result != VK_SUCCESS)
+	{
+		BOOST_LOG_TRIVIAL(fatal) << "CDevice9::EndScene vkResetFences failed with return code of " << result;
+		return;
+	}
+
+	result = Submit(submission);
 	if (result != VK_SUCCESS)
 	{
-		BOOST_LOG_TRIVIAL(fatal) << "CDevice9::EndScene vkQueueSubmit failed with return code of " << mResult;
 		return;
 	}
+	frame.SubmissionId = mLastSubmissionId;
 
 	//result = vkQueueWaitIdle(mQueue);
 	//if (result != VK_SUCCESS)
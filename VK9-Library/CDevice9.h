@@ -28,6 +28,11 @@ misrepresented as being the original software.
 #include <vulkan/vk_sdk_platform.h>
 #include <boost/container/small_vector.hpp>
 #include <boost/container/flat_map.hpp>
+#include <boost/lockfree/spsc_queue.hpp>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 
 #include "CVertexDeclaration9.h"
 #include "CSurface9.h"
@@ -43,6 +48,85 @@ misrepresented as being the original software.
 
 #include "BufferManager.h"
 #include "GarbageManager.h"
+#include "DeviceStatistics.h"
+
+/*
+Everything one frame in flight records into or waits on.
+The fence is signaled when the frame's submission retires so its command buffer, semaphores and garbage can be reused without waiting for the whole queue.
+*/
+struct FrameContext
+{
+	VkCommandBuffer CommandBuffer = VK_NULL_HANDLE;
+	VkSemaphore ImageAvailableSemaphore = VK_NULL_HANDLE;
+	VkSemaphore RenderFinishedSemaphore = VK_NULL_HANDLE;
+	VkFence Fence = VK_NULL_HANDLE; //Created signaled so the first wait on each frame returns immediately.
+	GarbageManager Garbage; //Handles released while the frame was recorded. Destroyed once its fence is signaled.
+	uint64_t SubmissionId = 0; //The submission that signals Fence. Its fence can't be waited on until the submission has been issued.
+	BOOL IsImageAvailableWaited = false; //A read back submitted part of the frame early. Only that submission waits on ImageAvailableSemaphore.
+};
+
+enum QueueSubmissionType
+{
+	QUEUE_SUBMISSION_SUBMIT,
+	QUEUE_SUBMISSION_PRESENT
+};
+
+/*
+One vkQueueSubmit or vkQueuePresentKHR. These are handed to the submission thread when it is enabled so it is the only thread touching the queue.
+*/
+struct QueueSubmission
+{
+	QueueSubmissionType Type = QUEUE_SUBMISSION_SUBMIT;
+	VkCommandBuffer CommandBuffer = VK_NULL_HANDLE;
+	VkSemaphore WaitSemaphore = VK_NULL_HANDLE;
+	VkPipelineStageFlags WaitStage = 0;
+	VkSemaphore SignalSemaphore = VK_NULL_HANDLE;
+	VkFence Fence = VK_NULL_HANDLE;
+	uint32_t ImageIndex = 0; //Only used to present.
+};
+
+enum DeviceCommandType
+{
+	DEVICE_COMMAND_CLEAR,
+	DEVICE_COMMAND_BEGIN_SCENE,
+	DEVICE_COMMAND_END_SCENE,
+	DEVICE_COMMAND_PRESENT,
+	DEVICE_COMMAND_DRAW_PRIMITIVE,
+	DEVICE_COMMAND_DRAW_INDEXED_PRIMITIVE,
+	DEVICE_COMMAND_LIGHT_ENABLE,
+	DEVICE_COMMAND_SET_FVF,
+	DEVICE_COMMAND_SET_INDICES,
+	DEVICE_COMMAND_SET_LIGHT,
+	DEVICE_COMMAND_SET_MATERIAL,
+	DEVICE_COMMAND_SET_PIXEL_SHADER,
+	DEVICE_COMMAND_SET_PIXEL_SHADER_CONSTANT_B,
+	DEVICE_COMMAND_SET_PIXEL_SHADER_CONSTANT_F,
+	DEVICE_COMMAND_SET_PIXEL_SHADER_CONSTANT_I,
+	DEVICE_COMMAND_SET_RENDER_STATE,
+	DEVICE_COMMAND_SET_SAMPLER_STATE,
+	DEVICE_COMMAND_SET_STREAM_SOURCE,
+	DEVICE_COMMAND_SET_TEXTURE,
+	DEVICE_COMMAND_SET_TEXTURE_STAGE_STATE,
+	DEVICE_COMMAND_SET_TRANSFORM,
+	DEVICE_COMMAND_SET_VERTEX_DECLARATION,
+	DEVICE_COMMAND_SET_VERTEX_SHADER,
+	DEVICE_COMMAND_SET_VERTEX_SHADER_CONSTANT_B,
+	DEVICE_COMMAND_SET_VERTEX_SHADER_CONSTANT_F,
+	DEVICE_COMMAND_SET_VERTEX_SHADER_CONSTANT_I,
+	DEVICE_COMMAND_SET_VIEWPORT
+};
+
+/*
+One recorded D3D9 call. Scalar arguments are stored in order and anything passed by pointer (matrices, constants, rects) is copied into the stream right after the command.
+*/
+struct DeviceCommand
+{
+	DeviceCommandType Type = DEVICE_COMMAND_BEGIN_SCENE;
+	DWORD Arguments[6] = {};
+	void* Object = nullptr; //Texture, buffer, declaration or shader being bound. Bindings don't hold a reference so neither does the command.
+	float Float = 0.0f;
+	uint32_t DataSize = 0;
+};
 
 class C9;
 
@@ -186,7 +270,6 @@ public:
 
 	//Managers
 	BufferManager* mBufferManager = nullptr;
-	GarbageManager mGarbageManager;
 
 	//Device Vulkan Handles
 	VkPhysicalDevice mPhysicalDevice = VK_NULL_HANDLE;
@@ -201,6 +284,34 @@ public:
 	VkPhysicalDeviceFeatures mDeviceFeatures = {};
 	VkPhysicalDeviceMemoryProperties mDeviceMemoryProperties = {};
 	VkQueueFamilyProperties* mQueueFamilyProperties = nullptr;
+	BOOL mIsExtendedDynamicStateSupported = false;
+	BOOL mIsExtendedDynamicState2Supported = false;
+	BOOL mIsExtendedDynamicState3Supported = false;
+	BOOL mIsPushDescriptorSupported = false;
+	BOOL mIsDescriptorIndexingSupported = false;
+	BOOL mIsDescriptorUpdateTemplateSupported = false;
+
+	//Extended dynamic state entry points. Only loaded when the matching level is supported.
+	PFN_vkCmdSetCullModeEXT vkCmdSetCullModeEXT = nullptr;
+	PFN_vkCmdSetFrontFaceEXT vkCmdSetFrontFaceEXT = nullptr;
+	PFN_vkCmdSetPrimitiveTopologyEXT vkCmdSetPrimitiveTopologyEXT = nullptr;
+	PFN_vkCmdBindVertexBuffers2EXT vkCmdBindVertexBuffers2EXT = nullptr;
+	PFN_vkCmdSetDepthTestEnableEXT vkCmdSetDepthTestEnableEXT = nullptr;
+	PFN_vkCmdSetDepthWriteEnableEXT vkCmdSetDepthWriteEnableEXT = nullptr;
+	PFN_vkCmdSetDepthCompareOpEXT vkCmdSetDepthCompareOpEXT = nullptr;
+	PFN_vkCmdSetStencilTestEnableEXT vkCmdSetStencilTestEnableEXT = nullptr;
+	PFN_vkCmdSetStencilOpEXT vkCmdSetStencilOpEXT = nullptr;
+	PFN_vkCmdSetDepthBiasEnableEXT vkCmdSetDepthBiasEnableEXT = nullptr;
+	PFN_vkCmdSetPolygonModeEXT vkCmdSetPolygonModeEXT = nullptr;
+	PFN_vkCmdSetColorBlendEnableEXT vkCmdSetColorBlendEnableEXT = nullptr;
+	PFN_vkCmdSetColorBlendEquationEXT vkCmdSetColorBlendEquationEXT = nullptr;
+	PFN_vkCmdSetColorWriteMaskEXT vkCmdSetColorWriteMaskEXT = nullptr;
+	PFN_vkCmdPushDescriptorSetKHR vkCmdPushDescriptorSetKHR = nullptr; //Only loaded when VK_KHR_push_descriptor is supported.
+
+	//Descriptor update template entry points. Only loaded when VK_KHR_descriptor_update_template is supported.
+	PFN_vkCreateDescriptorUpdateTemplateKHR vkCreateDescriptorUpdateTemplateKHR = nullptr;
+	PFN_vkDestroyDescriptorUpdateTemplateKHR vkDestroyDescriptorUpdateTemplateKHR = nullptr;
+	PFN_vkUpdateDescriptorSetWithTemplateKHR vkUpdateDescriptorSetWithTemplateKHR = nullptr;
 
 	//Swapchain / surface / display
 	VkSurfaceCapabilitiesKHR mSurfaceCapabilities = {};
@@ -215,7 +326,6 @@ public:
 	VkPresentModeKHR* mPresentationModes = nullptr;
 	uint32_t mPresentationModeCount = 0;
 	VkImage* mSwapchainImages = nullptr;
-	VkCommandBuffer* mSwapchainBuffers = nullptr;
 	VkImageView* mSwapchainViews = nullptr;
 	uint32_t mSwapchainImageCount = 0;
 	VkFormat mFormat = VK_FORMAT_UNDEFINED;
@@ -241,34 +351,101 @@ public:
 	boost::container::small_vector<char*,16> mExtensionNames;
 	boost::container::small_vector<char*,16> mLayerExtensionNames;
 	uint32_t mCurrentBuffer = 0;
+
+	//Counters for the device and its buffer manager. Only logged when LogStatistics is set.
+	DeviceStatistics mStatistics;
+	BOOL mLogStatistics = false;
+
+	//Frames in flight. The buffer manager's per frame rings are indexed the same way so mCurrentFrame always matches its frame index.
+	std::vector<FrameContext> mFrames;
+	uint32_t mCurrentFrame = 0;
+	uint32_t mMaximumFramesInFlight = 2;
+	uint64_t mFrameNumber = 1; //Advances with mCurrentFrame. Resources remember the number of the last frame that used them so zero means never used.
+
+	//Command buffers and fences for one time submissions. They go back on these lists once their submission has retired so steady state uploads create none.
+	std::vector<VkCommandBuffer> mFreeCommandBuffers;
+	std::vector<VkFence> mFreeFences;
+
+	//Submission thread. The API thread pushes submissions and presents and keeps recording while the thread makes the queue calls.
+	BOOL mUseSubmissionThread = false;
+	std::thread mSubmissionThread;
+	boost::lockfree::spsc_queue<QueueSubmission, boost::lockfree::capacity<64> > mSubmissions;
+	uint64_t mLastSubmissionId = 0; //Only touched by the thread running device calls. The API thread and the command stream thread are serialized by SynchronizeCommandStream so they never touch it at the same time.
+	std::atomic<uint64_t> mCompletedSubmissionId{ 0 };
+	std::atomic<VkResult> mSubmissionResult{ VK_SUCCESS }; //Last failure on the submission thread. Handed back by the next WaitForSubmission.
+	std::mutex mSubmissionMutex; //Only guards sleeping and waking. The submissions themselves go through the lock free queue.
+	std::condition_variable mSubmissionCondition;
+	std::condition_variable mSubmissionCompleteCondition;
+	BOOL mIsSubmissionThreadStopping = false;
+	std::mutex mSwapchainMutex; //Acquire and present both need the swapchain externally synchronized.
+
+	/*
+	Command stream. The hot D3D9 calls are recorded into a ring and return right away while a worker thread replays them into Vulkan.
+	Every other entry point synchronizes first so only one thread touches the device state at a time.
+	*/
+	BOOL mUseCommandStream = false;
+	std::thread mCommandStreamThread;
+	boost::lockfree::spsc_queue<uint8_t>* mCommandStream = nullptr;
+	size_t mCommandStreamSize = 4 * 1024 * 1024; //bytes
+	std::vector<uint8_t> mCommandData; //Only touched by the command stream thread.
+	uint64_t mRecordedCommands = 0; //Only touched by the API thread.
+	std::atomic<uint64_t> mExecutedCommands{ 0 };
+	std::atomic<uint32_t> mQueuedPresents{ 0 };
+	std::atomic<bool> mIsCommandStreamThreadWaiting{ false };
+	std::mutex mCommandStreamMutex; //Only guards sleeping and waking. The commands themselves go through the lock free ring.
+	std::condition_variable mCommandStreamCondition;
+	std::condition_variable mCommandStreamProgressCondition;
+	BOOL mIsCommandStreamThreadStopping = false;
+
 	VkCommandPool mCommandPool = VK_NULL_HANDLE;
 	VkDescriptorPool mDescriptorPool = VK_NULL_HANDLE;
 	VkCommandBuffer mCommandBuffer = VK_NULL_HANDLE;
 	VkQueue mQueue = VK_NULL_HANDLE;
-	VkSemaphore mPresentCompleteSemaphore = VK_NULL_HANDLE;
-	VkFence mNullFence = VK_NULL_HANDLE;
 	VkRenderPass mStoreRenderPass = VK_NULL_HANDLE;
 	VkRenderPass mClearRenderPass = VK_NULL_HANDLE;
 	VkClearColorValue mClearColorValue = {};	
-	VkSemaphoreCreateInfo mPresentCompleteSemaphoreCreateInfo = {};
+	VkSemaphoreCreateInfo mSemaphoreCreateInfo = {};
+	VkFenceCreateInfo mFenceCreateInfo = {};
 	VkCommandBufferInheritanceInfo mCommandBufferInheritanceInfo = {};
 	VkCommandBufferBeginInfo mCommandBufferBeginInfo = {};
 	VkClearValue mClearValues[2] = {};
 	VkRenderPassBeginInfo mRenderPassBeginInfo = {};
 	VkImageMemoryBarrier mImageMemoryBarrier = {};
-	VkSubmitInfo mSubmitInfo = {};
 	VkImageMemoryBarrier mPrePresentBarrier = {};
 	VkPresentInfoKHR mPresentInfo = {};
 	VkPushConstantRange mPushConstants[1] = {};
-	VkPipelineStageFlags mPipeStageFlags = {};
 	boost::container::small_vector<CRenderTargetSurface9*,16> mRenderTargets;
 
 	BOOL mIsDirty = true;
 	BOOL mIsSceneStarted = false;
+	BOOL mIsDeviceLost = false; //A partial frame submission failed after it may have been issued so the frame's command buffer can't be recorded again.
 	
 	PAINTSTRUCT* mPaintInformation = {};
 
 	void SetImageLayout(VkImage image, VkImageAspectFlags aspectMask, VkImageLayout oldImageLayout, VkImageLayout newImageLayout, uint32_t levelCount = 1, uint32_t mipIndex = 0);
+	VkCommandBuffer AcquireCommandBuffer();
+	void ReleaseCommandBuffer(VkCommandBuffer commandBuffer);
+	VkFence AcquireFence();
+	void ReleaseFence(VkFence fence);
+	VkCommandBuffer BeginOneTimeCommands();
+	VkResult EndOneTimeCommands(VkCommandBuffer commandBuffer);
+	VkResult Submit(const QueueSubmission& submission);
+	VkResult WaitForSubmission(uint64_t submissionId);
+	BOOL IsFrameInFlight(uint64_t frameNumber);
+	void WaitForFrame(uint64_t frameNumber);
+	VkResult SubmitPartialFrame();
+	VkResult ResumeFrame();
+	VkResult ExecuteSubmission(const QueueSubmission& submission);
+	void ProcessSubmissions();
+	BOOL IsRecordingCommands();
+	void RecordCommand(const DeviceCommand& command, const void* data = nullptr);
+	void WriteCommandStream(const void* data, size_t size);
+	void ReadCommandStream(void* data, size_t size);
+	void SynchronizeCommandStream();
+	void ExecuteCommand(const DeviceCommand& command, const void* data);
+	void ProcessCommandStream();
+	VkResult CreateDescriptorPool(VkDescriptorPool& descriptorPool, VkDescriptorPoolCreateFlags flags = VK_DESCRIPTOR_POOL_CREATE_FREE_DESCRIPTOR_SET_BIT);
+	void LogStatistics();
 	void StartScene(bool clear = false);
 	void StopScene();
 };
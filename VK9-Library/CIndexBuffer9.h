@@ -34,6 +34,9 @@ private:
 	D3DFORMAT mFormat; 
 	D3DPOOL mPool;
 	HANDLE* mSharedHandle;
+private:
+	VkResult CreateBuffer(VkBuffer& buffer, VkDeviceMemory& memory);
+	VkResult Rename(bool preserveContents);
 public:
 	CIndexBuffer9(CDevice9* device, UINT Length, DWORD Usage, D3DFORMAT Format, D3DPOOL Pool, HANDLE* pSharedHandle);
 	~CIndexBuffer9();
@@ -45,6 +48,7 @@ public:
 	int32_t mCapacity;
 	bool mIsDirty;
 	uint32_t mLockCount;
+	uint64_t mLastFrameUsed = 0; //Number of the last frame that drew with the buffer. See CDevice9::mFrameNumber.
 
 	VkMemoryRequirements mMemoryRequirements = {};
 	VkBuffer mBuffer;
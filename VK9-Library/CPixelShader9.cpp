@@ -84,6 +84,7 @@ ULONG STDMETHODCALLTYPE CPixelShader9::Release(void)
 
 	if (ref == 0)
 	{
+		mDevice->SynchronizeCommandStream();
 		delete this;
 	}
 
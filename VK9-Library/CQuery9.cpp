@@ -87,6 +87,8 @@ ULONG STDMETHODCALLTYPE CQuery9::Release(void)
 
 HRESULT STDMETHODCALLTYPE CQuery9::GetData(void* pData, DWORD dwSize, DWORD dwGetDataFlags)
 {
+	mDevice->SynchronizeCommandStream();
+
 	//TODO: Implement.
 
 	BOOST_LOG_TRIVIAL(warning) << "CQuery9::GetData is not implemented!";
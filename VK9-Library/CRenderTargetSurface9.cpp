@@ -79,6 +79,7 @@ ULONG STDMETHODCALLTYPE CRenderTargetSurface9::Release(void)
 
 	if (ref == 0)
 	{
+		mDevice->SynchronizeCommandStream();
 		delete this;
 	}
 
@@ -128,6 +128,8 @@ ULONG STDMETHODCALLTYPE CStateBlock9::Release(void)
 
 HRESULT STDMETHODCALLTYPE CStateBlock9::Capture()
 {
+	mDevice->SynchronizeCommandStream();
+
 	/*
 	Capture only captures the current state of state that has already been recorded (eg update not insert)
 	https://msdn.microsoft.com/en-us/library/windows/desktop/bb205890(v=vs.85).aspx
@@ -141,7 +143,24 @@ HRESULT STDMETHODCALLTYPE CStateBlock9::Capture()
 
 HRESULT STDMETHODCALLTYPE CStateBlock9::Apply()
 {
+	mDevice->SynchronizeCommandStream();
+
 	MergeState(mDeviceState, this->mDevice->mDeviceState,mType);	
+
+	//Applying a block doesn't go through the setters so treat every group as changed.
+	StateGenerations& generations = this->mDevice->mDeviceState.mGenerations;
+	generations.RenderState++;
+	generations.TextureStageState++;
+	generations.SamplerState++;
+	generations.Texture++;
+	generations.Shader++;
+	generations.VertexInput++;
+	for (size_t i = 0; i < 16; i++)
+	{
+		generations.Sampler[i]++;
+	}
+	generations.World++;
+	generations.ViewProjection++;
 	
 	//if (mDeviceState.mTransforms.size())
 	//{
@@ -220,13 +239,19 @@ void MergeState(const DeviceState& sourceState, DeviceState& targetState, D3DSTA
 				targetState.mLights.push_back(sourceState.mLights[i]);
 			}
 		}
-		targetState.mAreLightsDirty = true;
+		targetState.mDirtyLights = UINT32_MAX;
 
 		//IDirect3DDevice9::SetMaterial
 		targetState.mMaterial = sourceState.mMaterial;
 		targetState.mIsMaterialDirty = true;
 	}
 
+	//IDirect3DDevice9::SetRenderState
+	if (sourceState.hasTextureFactor || sourceState.hasAmbient || sourceState.hasPointSize)
+	{
+		targetState.mIsRenderStateDirty = true;
+	}
+
 	//IDirect3DDevice9::SetNPatchMode
 	if (sourceState.mNSegments != -1 && (!onlyIfExists || targetState.mNSegments != -1) && (type == D3DSBT_ALL || type == D3DSBT_VERTEXSTATE))
 	{
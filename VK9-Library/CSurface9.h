@@ -31,7 +31,6 @@ class CSurface9 : public IDirect3DSurface9
 {
 private:
 	void* mData = nullptr;
-	VkImage mStagingImage = VK_NULL_HANDLE;
 	VkDeviceMemory mStagingDeviceMemory = VK_NULL_HANDLE;
 public:
 	CSurface9(CDevice9* Device, CTexture9* Texture, UINT Width, UINT Height, D3DFORMAT Format, D3DMULTISAMPLE_TYPE MultiSample, DWORD MultisampleQuality, BOOL Discard, HANDLE *pSharedHandle);
@@ -57,8 +56,10 @@ public:
 
 	VkFormat mRealFormat = VK_FORMAT_R8G8B8A8_UNORM;
 
+	VkImage mStagingImage = VK_NULL_HANDLE; //GetRenderTargetData copies into this.
+
 	VkMemoryAllocateInfo mMemoryAllocateInfo = {};
-	VkImageLayout mImageLayout = VK_IMAGE_LAYOUT_GENERAL;
+	VkImageLayout mImageLayout = VK_IMAGE_LAYOUT_PREINITIALIZED; //Current layout of the staging image.
 	VkSubresourceLayout mLayout = {};
 	VkImageSubresource mSubresource = {};
 
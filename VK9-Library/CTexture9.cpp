@@ -121,6 +121,11 @@ CTexture9::CTexture9(CDevice9* device, UINT Width, UINT Height, UINT Levels, DWO
 		return;
 	}
 
+	if (mDevice->mBufferManager != nullptr && mDevice->mBufferManager->mUseFixedFunctionBindlessTextures)
+	{
+		mTextureSlot = mDevice->mBufferManager->AcquireTextureSlot(mImageView);
+	}
+
 	mSurfaces.reserve(mLevels);
 	UINT width = mWidth, height = mHeight;
 	for (size_t i = 0; i < mLevels; i++)
@@ -140,25 +145,43 @@ CTexture9::~CTexture9()
 {
 	BOOST_LOG_TRIVIAL(info) << "CTexture9::~CTexture9";
 
-	if (mImageView != VK_NULL_HANDLE)
+	if (mTextureSlot != 0 && mDevice->mBufferManager != nullptr)
 	{
-		vkDestroyImageView(mDevice->mDevice, mImageView, NULL);
+		mDevice->mBufferManager->ReleaseTextureSlot(mTextureSlot);
 	}
 
-	if (mSampler != VK_NULL_HANDLE)
+	if (mDevice->mBufferManager != nullptr)
 	{
-		vkDestroySampler(mDevice->mDevice, mSampler, NULL);
+		//The frames in flight may still sample the texture so the handles are destroyed once the frame being recorded has retired.
+		GarbageManager& garbage = mDevice->mFrames[mDevice->mCurrentFrame].Garbage;
+		garbage.mImageViews.push_back(mImageView);
+		garbage.mSamplers.push_back(mSampler);
+		garbage.mImages.push_back(mImage);
+		garbage.mMemories.push_back(mDeviceMemory);
 		mSampler = VK_NULL_HANDLE;
 	}
-
-	if (mImage != VK_NULL_HANDLE)
-	{
-		vkDestroyImage(mDevice->mDevice, mImage, NULL);
-	}
-
-	if (mDeviceMemory != VK_NULL_HANDLE)
+	else
 	{
-		vkFreeMemory(mDevice->mDevice, mDeviceMemory, NULL);
+		if (mImageView != VK_NULL_HANDLE)
+		{
+			vkDestroyImageView(mDevice->mDevice, mImageView, NULL);
+		}
+
+		if (mSampler != VK_NULL_HANDLE)
+		{
+			vkDestroySampler(mDevice->mDevice, mSampler, NULL);
+			mSampler = VK_NULL_HANDLE;
+		}
+
+		if (mImage != VK_NULL_HANDLE)
+		{
+			vkDestroyImage(mDevice->mDevice, mImage, NULL);
+		}
+
+		if (mDeviceMemory != VK_NULL_HANDLE)
+		{
+			vkFreeMemory(mDevice->mDevice, mDeviceMemory, NULL);
+		}
 	}
 
 	for (size_t i = 0; i < mSurfaces.size(); i++)
@@ -218,6 +241,8 @@ ULONG STDMETHODCALLTYPE CTexture9::Release(void)
 
 	if (ref == 0)
 	{
+		//Draws recorded before the last reference went away may still use this so let them execute first.
+		mDevice->SynchronizeCommandStream();
 		delete this;
 	}
 
@@ -287,72 +312,55 @@ HRESULT STDMETHODCALLTYPE CTexture9::SetPrivateData(REFGUID refguid, const void*
 
 VOID STDMETHODCALLTYPE CTexture9::GenerateMipSubLevels()
 {
-	VkResult result = VK_SUCCESS;
-	VkPipelineStageFlags sourceStages = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
-	VkPipelineStageFlags destinationStages = VK_PIPELINE_STAGE_TOP_OF_PIPE_BIT;
+	mDevice->SynchronizeCommandStream();
+
+	const VkPipelineStageFlags shaderStages = VK_PIPELINE_STAGE_VERTEX_SHADER_BIT | VK_PIPELINE_STAGE_FRAGMENT_SHADER_BIT;
 	VkCommandBuffer commandBuffer;
 	VkFilter realFilter = ConvertFilter(mMipFilter);
 
-	VkCommandBufferAllocateInfo commandBufferInfo = {};
-	commandBufferInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-	commandBufferInfo.pNext = nullptr;
-	commandBufferInfo.commandPool = mDevice->mCommandPool;
-	commandBufferInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-	commandBufferInfo.commandBufferCount = 1;
-
-	result = vkAllocateCommandBuffers(mDevice->mDevice, &commandBufferInfo, &commandBuffer);
-	if (result != VK_SUCCESS)
+	if (mLevels < 2)
 	{
-		BOOST_LOG_TRIVIAL(fatal) << "CTexture9::GenerateMipSubLevels vkAllocateCommandBuffers failed with return code of " << mResult;
 		return;
 	}
 
-	VkCommandBufferInheritanceInfo commandBufferInheritanceInfo = {};
-	commandBufferInheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
-	commandBufferInheritanceInfo.pNext = nullptr;
-	commandBufferInheritanceInfo.renderPass = VK_NULL_HANDLE;
-	commandBufferInheritanceInfo.subpass = 0;
-	commandBufferInheritanceInfo.framebuffer = VK_NULL_HANDLE;
-	commandBufferInheritanceInfo.occlusionQueryEnable = VK_FALSE;
-	commandBufferInheritanceInfo.queryFlags = 0;
-	commandBufferInheritanceInfo.pipelineStatistics = 0;
-
-	VkCommandBufferBeginInfo commandBufferBeginInfo;
-	commandBufferBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-	commandBufferBeginInfo.pNext = nullptr;
-	commandBufferBeginInfo.flags = 0;
-	commandBufferBeginInfo.pInheritanceInfo = &commandBufferInheritanceInfo;
-
-	result = vkBeginCommandBuffer(commandBuffer, &commandBufferBeginInfo);
-	if (result != VK_SUCCESS)
+	//Draws recorded this frame or still in flight may be sampling the levels that are about to be replaced.
+	WaitForDraws();
+
+	commandBuffer = mDevice->BeginOneTimeCommands();
+	if (commandBuffer == VK_NULL_HANDLE)
 	{
-		BOOST_LOG_TRIVIAL(fatal) << "CTexture9::GenerateMipSubLevels vkBeginCommandBuffer failed with return code of " << mResult;
 		return;
 	}
 
-	VkImageMemoryBarrier imageMemoryBarrier = {};
-	imageMemoryBarrier.sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
-	imageMemoryBarrier.pNext = nullptr;
-	imageMemoryBarrier.srcAccessMask = 0;
-	imageMemoryBarrier.dstAccessMask = 0;
-
-	VkImageSubresourceRange mipSubRange = {};
-	mipSubRange.aspectMask = VK_IMAGE_ASPECT_COLOR_BIT;
-	mipSubRange.levelCount = 1;
-	mipSubRange.layerCount = 1;
-
 	/*
 	I'm debating whether or not to have the population of the image here. If I don't I'll end up creating another command for that. On the other hand this method should purely populate the other levels as per the spec.
 	*/
 
-	// Transition zero mip level to transfer source
-	//mipSubRange.baseMipLevel = 0;
-
-	//imageMemoryBarrier.oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-	//imageMemoryBarrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
-	//imageMemoryBarrier.image = mImage;
-	//imageMemoryBarrier.subresourceRange = mipSubRange;
-	//vkCmdPipelineBarrier(commandBuffer, sourceStages, destinationStages, 0, 0, nullptr, 0, nullptr, 1, &imageMemoryBarrier);
+	//Level zero was left ready for sampling by its surface. The other levels are overwritten so their old contents can be discarded.
+	VkImageMemoryBarrier barriers[2] = {};
+	barriers[0].sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+	barriers[0].pNext = nullptr;
+	barriers[0].srcAccessMask = VK_ACCESS_SHADER_READ_BIT;
+	barriers[0].dstAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+	barriers[0].oldLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
+	barriers[0].newLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+	barriers[0].srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barriers[0].dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barriers[0].image = mImage;
+	barriers[0].subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 0, 1, 0, 1 };
+
+	barriers[1].sType = VK_STRUCTURE_TYPE_IMAGE_MEMORY_BARRIER;
+	barriers[1].pNext = nullptr;
+	barriers[1].srcAccessMask = 0;
+	barriers[1].dstAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barriers[1].oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
+	barriers[1].newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+	barriers[1].srcQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barriers[1].dstQueueFamilyIndex = VK_QUEUE_FAMILY_IGNORED;
+	barriers[1].image = mImage;
+	barriers[1].subresourceRange = { VK_IMAGE_ASPECT_COLOR_BIT, 1, mLevels - 1, 0, 1 };
+
+	vkCmdPipelineBarrier(commandBuffer, shaderStages, VK_PIPELINE_STAGE_TRANSFER_BIT, 0, 0, nullptr, 0, nullptr, 2, barriers);
 
 	for (UINT i = 1; i < mLevels; i++) //Changed to match mLevels datatype
 	{
@@ -374,55 +382,24 @@ VOID STDMETHODCALLTYPE CTexture9::GenerateMipSubLevels()
 		imageBlit.dstOffsets[1].y = int32_t(mHeight >> i);
 		imageBlit.dstOffsets[1].z = 1;
 
-		mipSubRange.baseMipLevel = i;
-
-		// Transition current mip level to transfer dest
-		imageMemoryBarrier.oldLayout = VK_IMAGE_LAYOUT_UNDEFINED;
-		imageMemoryBarrier.newLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
-		imageMemoryBarrier.image = mImage;
-		imageMemoryBarrier.subresourceRange = mipSubRange;
-		vkCmdPipelineBarrier(commandBuffer, sourceStages, destinationStages, 0, 0, nullptr, 0, nullptr, 1, &imageMemoryBarrier);
-
 		// Blit from zero level
 		vkCmdBlitImage(commandBuffer, mImage, VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL, mImage, VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL, 1, &imageBlit, VK_FILTER_LINEAR);
 	}
 
-	result = vkEndCommandBuffer(commandBuffer);
-	if (result != VK_SUCCESS)
-	{
-		BOOST_LOG_TRIVIAL(fatal) << "CTexture9::GenerateMipSubLevels vkEndCommandBuffer failed with return code of " << result;
-		return;
-	}
+	//Every level goes back to being sampled.
+	barriers[0].srcAccessMask = VK_ACCESS_TRANSFER_READ_BIT;
+	barriers[0].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+	barriers[0].oldLayout = VK_IMAGE_LAYOUT_TRANSFER_SRC_OPTIMAL;
+	barriers[0].newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
 
-	VkCommandBuffer commandBuffers[] = { commandBuffer };
-	VkFence nullFence = VK_NULL_HANDLE;
-	VkSubmitInfo submitInfo = {};
-	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-	submitInfo.pNext = NULL;
-	submitInfo.waitSemaphoreCount = 0;
-	submitInfo.pWaitSemaphores = NULL;
-	submitInfo.pWaitDstStageMask = NULL;
-	submitInfo.commandBufferCount = 1;
-	submitInfo.pCommandBuffers = commandBuffers;
-	submitInfo.signalSemaphoreCount = 0;
-	submitInfo.pSignalSemaphores = NULL;
-
-	result = vkQueueSubmit(mDevice->mQueue, 1, &submitInfo, nullFence);
-	if (result != VK_SUCCESS)
-	{
-		BOOST_LOG_TRIVIAL(fatal) << "CTexture9::GenerateMipSubLevels vkQueueSubmit failed with return code of " << result;
-		return;
-	}
+	barriers[1].srcAccessMask = VK_ACCESS_TRANSFER_WRITE_BIT;
+	barriers[1].dstAccessMask = VK_ACCESS_SHADER_READ_BIT;
+	barriers[1].oldLayout = VK_IMAGE_LAYOUT_TRANSFER_DST_OPTIMAL;
+	barriers[1].newLayout = VK_IMAGE_LAYOUT_SHADER_READ_ONLY_OPTIMAL;
 
-	result = vkQueueWaitIdle(mDevice->mQueue);
-	if (result != VK_SUCCESS)
-	{
-		BOOST_LOG_TRIVIAL(fatal) << "CTexture9::GenerateMipSubLevels vkQueueWaitIdle failed with return code of " << result;
-		return;
-	}
+	vkCmdPipelineBarrier(commandBuffer, VK_PIPELINE_STAGE_TRANSFER_BIT, shaderStages, 0, 0, nullptr, 0, nullptr, 2, barriers);
 
-	vkFreeCommandBuffers(mDevice->mDevice, mDevice->mCommandPool, 1, commandBuffers);
-	commandBuffer = VK_NULL_HANDLE;
+	mDevice->EndOneTimeCommands(commandBuffer);
 
 	return;
 }
@@ -527,43 +504,17 @@ HRESULT STDMETHODCALLTYPE CTexture9::UnlockRect(UINT Level)
 
 void CTexture9::CopyImage(VkImage srcImage, VkImage dstImage, uint32_t width, uint32_t height, uint32_t srcMip, uint32_t dstMip)
 {
-	VkResult result = VK_SUCCESS;
 	VkCommandBuffer commandBuffer;
 
-	VkCommandBufferAllocateInfo commandBufferInfo = {};
-	commandBufferInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_ALLOCATE_INFO;
-	commandBufferInfo.pNext = nullptr;
-	commandBufferInfo.commandPool = mDevice->mCommandPool;
-	commandBufferInfo.level = VK_COMMAND_BUFFER_LEVEL_PRIMARY;
-	commandBufferInfo.commandBufferCount = 1;
-
-	result = vkAllocateCommandBuffers(mDevice->mDevice, &commandBufferInfo, &commandBuffer);
-	if (result != VK_SUCCESS)
+	//The caller handles the layouts but the copy still can't overtake draws that sample this texture.
+	if (srcImage == mImage || dstImage == mImage)
 	{
-		BOOST_LOG_TRIVIAL(fatal) << "CTexture9::CopyImage vkAllocateCommandBuffers failed with return code of " << result;
-		return;
+		WaitForDraws();
 	}
 
-	VkCommandBufferInheritanceInfo commandBufferInheritanceInfo = {};
-	commandBufferInheritanceInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_INHERITANCE_INFO;
-	commandBufferInheritanceInfo.pNext = nullptr;
-	commandBufferInheritanceInfo.renderPass = VK_NULL_HANDLE;
-	commandBufferInheritanceInfo.subpass = 0;
-	commandBufferInheritanceInfo.framebuffer = VK_NULL_HANDLE;
-	commandBufferInheritanceInfo.occlusionQueryEnable = VK_FALSE;
-	commandBufferInheritanceInfo.queryFlags = 0;
-	commandBufferInheritanceInfo.pipelineStatistics = 0;
-
-	VkCommandBufferBeginInfo commandBufferBeginInfo;
-	commandBufferBeginInfo.sType = VK_STRUCTURE_TYPE_COMMAND_BUFFER_BEGIN_INFO;
-	commandBufferBeginInfo.pNext = nullptr;
-	commandBufferBeginInfo.flags = 0;
-	commandBufferBeginInfo.pInheritanceInfo = &commandBufferInheritanceInfo;
-
-	result = vkBeginCommandBuffer(commandBuffer, &commandBufferBeginInfo);
-	if (result != VK_SUCCESS)
+	commandBuffer = mDevice->BeginOneTimeCommands();
+	if (commandBuffer == VK_NULL_HANDLE)
 	{
-		BOOST_LOG_TRIVIAL(fatal) << "CTexture9::CopyImage vkBeginCommandBuffer failed with return code of " << result;
 		return;
 	}
 
@@ -595,41 +546,7 @@ void CTexture9::CopyImage(VkImage srcImage, VkImage dstImage, uint32_t width, ui
 		1, &region
 	);
 
-	result = vkEndCommandBuffer(commandBuffer);
-	if (result != VK_SUCCESS)
-	{
-		BOOST_LOG_TRIVIAL(fatal) << "CTexture9::CopyImage vkEndCommandBuffer failed with return code of " << result;
-		return;
-	}
-
-	VkCommandBuffer commandBuffers[] = { commandBuffer };
-	VkFence nullFence = VK_NULL_HANDLE;
-	VkSubmitInfo submitInfo = {};
-	submitInfo.sType = VK_STRUCTURE_TYPE_SUBMIT_INFO;
-	submitInfo.pNext = NULL;
-	submitInfo.waitSemaphoreCount = 0;
-	submitInfo.pWaitSemaphores = NULL;
-	submitInfo.pWaitDstStageMask = NULL;
-	submitInfo.commandBufferCount = 1;
-	submitInfo.pCommandBuffers = commandBuffers;
-	submitInfo.signalSemaphoreCount = 0;
-	submitInfo.pSignalSemaphores = NULL;
-
-	result = vkQueueSubmit(mDevice->mQueue, 1, &submitInfo, nullFence);
-	if (result != VK_SUCCESS)
-	{
-		BOOST_LOG_TRIVIAL(fatal) << "CTexture9::CopyImage vkQueueSubmit failed with return code of " << result;
-		return;
-	}
-
-	result = vkQueueWaitIdle(mDevice->mQueue);
-	if (result != VK_SUCCESS)
-	{
-		BOOST_LOG_TRIVIAL(fatal) << "CTexture9::CopyImage vkQueueWaitIdle failed with return code of " << result;
-		return;
-	}
-
-	vkFreeCommandBuffers(mDevice->mDevice, mDevice->mCommandPool, 1, commandBuffers);
+	mDevice->EndOneTimeCommands(commandBuffer);
 }
 
 void CTexture9::Flush()
@@ -638,4 +555,19 @@ void CTexture9::Flush()
 	{
 		mSurfaces[i]->Flush();
 	}
+}
+
+void CTexture9::WaitForDraws()
+{
+	/*
+	Draws already recorded in this frame have to keep seeing the old texels so the frame so far is submitted and waited for first.
+	After that only earlier frames can still be sampling the image. Their fences are waited for like a buffer lock would.
+	*/
+	if (mLastFrameUsed == mDevice->mFrameNumber && mDevice->mIsSceneStarted && !mDevice->mIsDeviceLost)
+	{
+		vkCmdEndRenderPass(mDevice->mFrames[mDevice->mCurrentFrame].CommandBuffer);
+		mDevice->SubmitPartialFrame();
+	}
+
+	mDevice->WaitForFrame(min(mLastFrameUsed, mDevice->mFrameNumber - 1));
 }
\ No newline at end of file
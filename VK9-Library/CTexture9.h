@@ -58,11 +58,14 @@ public:
 
 	VkSampler mSampler = VK_NULL_HANDLE;
 	VkImageView mImageView = VK_NULL_HANDLE;
+	uint32_t mTextureSlot = 0; //Where the image view is in the bindless texture table. 0 is the default texture.
+	uint64_t mLastFrameUsed = 0; //Number of the last frame that drew with the texture bound. See CDevice9::mFrameNumber.
 
 	boost::container::small_vector<CSurface9*,5> mSurfaces;
 
 	void CopyImage(VkImage srcImage, VkImage dstImage, uint32_t width, uint32_t height, uint32_t srcMip, uint32_t dstMip);
 	void Flush();
+	void WaitForDraws();
 
 public:
 	//IUnknown
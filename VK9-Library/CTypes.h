@@ -376,6 +376,22 @@ struct SpecializationConstants
 	int blendOperationAlpha = D3DBLENDOP_ADD;
 };
 
+/*
+Each group is bumped by its setters when a value actually changes. BeginDraw compares them with the last draw to skip resolving state that can't have changed.
+*/
+struct StateGenerations
+{
+	uint32_t RenderState = 0; //SetRenderState
+	uint32_t TextureStageState = 0; //SetTextureStageState
+	uint32_t SamplerState = 0; //SetSamplerState
+	uint32_t Texture = 0; //SetTexture
+	uint32_t Shader = 0; //SetFVF, SetVertexDeclaration, SetVertexShader, SetPixelShader
+	uint32_t VertexInput = 0; //SetStreamSource when the stream count or a stride changes.
+	uint32_t Sampler[16] = {}; //SetSamplerState and SetTexture for a single stage.
+	uint32_t World = 0; //SetTransform with D3DTS_WORLD
+	uint32_t ViewProjection = 0; //SetTransform with D3DTS_VIEW or D3DTS_PROJECTION
+};
+
 struct DeviceState
 {
 	//IDirect3DDevice9::LightEnable
@@ -392,12 +408,15 @@ struct DeviceState
 	//IDirect3DDevice9::SetLight
 	//boost::container::small_vector<Light, 4> mLights;
 	std::vector<Light> mLights;
-	BOOL mAreLightsDirty = true;
+	uint32_t mDirtyLights = UINT32_MAX; //One bit per light changed since the buffer manager last looked. Only the first MAX_LIGHTS are uploaded.
 
 	//IDirect3DDevice9::SetMaterial
 	D3DMATERIAL9 mMaterial = {};
 	BOOL mIsMaterialDirty = true;
 
+	//IDirect3DDevice9::SetRenderState (values in RenderStateBlock)
+	BOOL mIsRenderStateDirty = true;
+
 	//IDirect3DDevice9::SetNPatchMode
 	float mNSegments = -1;
 
@@ -554,6 +573,8 @@ struct DeviceState
 
 	//Used for shader specialization.
 	SpecializationConstants mSpecializationConstants = {};
+
+	StateGenerations mGenerations;
 };
 
 struct color_A8R8G8B8
@@ -40,45 +40,9 @@ CVertexBuffer9::CVertexBuffer9(CDevice9* device, UINT Length, DWORD Usage, DWORD
 	mBuffer(VK_NULL_HANDLE),
 	mMemory(VK_NULL_HANDLE)
 {
-	VkBufferCreateInfo bufferCreateInfo = {};
-	bufferCreateInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
-	bufferCreateInfo.pNext = NULL;
-	bufferCreateInfo.size = mLength;
-	bufferCreateInfo.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
-	bufferCreateInfo.flags = 0;
-
-	VkMemoryAllocateInfo memoryAllocateInfo = {};
-	memoryAllocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
-	memoryAllocateInfo.pNext = NULL;
-	memoryAllocateInfo.allocationSize = 0;
-	memoryAllocateInfo.memoryTypeIndex = 0;
-
-	mMemoryRequirements = {};
-
-	mResult = vkCreateBuffer(mDevice->mDevice, &bufferCreateInfo, NULL, &mBuffer);
-	if (mResult != VK_SUCCESS)
-	{
-		BOOST_LOG_TRIVIAL(fatal) << "CVertexBuffer9::CVertexBuffer9 vkCreateBuffer failed with return code of " << mResult;
-		return;
-	}
-
-	vkGetBufferMemoryRequirements(mDevice->mDevice, mBuffer, &mMemoryRequirements);
-
-	memoryAllocateInfo.allocationSize = mMemoryRequirements.size;
-
-	GetMemoryTypeFromProperties(mDevice->mDeviceMemoryProperties, mMemoryRequirements.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &memoryAllocateInfo.memoryTypeIndex);
-
-	mResult = vkAllocateMemory(mDevice->mDevice, &memoryAllocateInfo, NULL, &mMemory);
+	mResult = CreateBuffer(mBuffer, mMemory);
 	if (mResult != VK_SUCCESS)
 	{
-		BOOST_LOG_TRIVIAL(fatal) << "CVertexBuffer9::CVertexBuffer9 vkAllocateMemory failed with return code of " << mResult;
-		return;
-	}
-
-	mResult = vkBindBufferMemory(mDevice->mDevice, mBuffer, mMemory, 0);
-	if (mResult != VK_SUCCESS)
-	{
-		BOOST_LOG_TRIVIAL(fatal) << "CVertexBuffer9::CVertexBuffer9 vkBindBufferMemory failed with return code of " << mResult;
 		return;
 	}
 
@@ -145,8 +109,122 @@ CVertexBuffer9::CVertexBuffer9(CDevice9* device, UINT Length, DWORD Usage, DWORD
 	}
 }
 
+VkResult CVertexBuffer9::CreateBuffer(VkBuffer& buffer, VkDeviceMemory& memory)
+{
+	VkBufferCreateInfo bufferCreateInfo = {};
+	bufferCreateInfo.sType = VK_STRUCTURE_TYPE_BUFFER_CREATE_INFO;
+	bufferCreateInfo.pNext = NULL;
+	bufferCreateInfo.size = mLength;
+	bufferCreateInfo.usage = VK_BUFFER_USAGE_VERTEX_BUFFER_BIT;
+	bufferCreateInfo.flags = 0;
+
+	VkMemoryAllocateInfo memoryAllocateInfo = {};
+	memoryAllocateInfo.sType = VK_STRUCTURE_TYPE_MEMORY_ALLOCATE_INFO;
+	memoryAllocateInfo.pNext = NULL;
+	memoryAllocateInfo.allocationSize = 0;
+	memoryAllocateInfo.memoryTypeIndex = 0;
+
+	mMemoryRequirements = {};
+
+	VkResult result = vkCreateBuffer(mDevice->mDevice, &bufferCreateInfo, NULL, &buffer);
+	if (result != VK_SUCCESS)
+	{
+		BOOST_LOG_TRIVIAL(fatal) << "CVertexBuffer9::CreateBuffer vkCreateBuffer failed with return code of " << result;
+		return result;
+	}
+
+	vkGetBufferMemoryRequirements(mDevice->mDevice, buffer, &mMemoryRequirements);
+
+	memoryAllocateInfo.allocationSize = mMemoryRequirements.size;
+
+	GetMemoryTypeFromProperties(mDevice->mDeviceMemoryProperties, mMemoryRequirements.memoryTypeBits, VK_MEMORY_PROPERTY_HOST_VISIBLE_BIT | VK_MEMORY_PROPERTY_HOST_COHERENT_BIT, &memoryAllocateInfo.memoryTypeIndex);
+
+	result = vkAllocateMemory(mDevice->mDevice, &memoryAllocateInfo, NULL, &memory);
+	if (result != VK_SUCCESS)
+	{
+		BOOST_LOG_TRIVIAL(fatal) << "CVertexBuffer9::CreateBuffer vkAllocateMemory failed with return code of " << result;
+		vkDestroyBuffer(mDevice->mDevice, buffer, NULL);
+		buffer = VK_NULL_HANDLE;
+		return result;
+	}
+
+	result = vkBindBufferMemory(mDevice->mDevice, buffer, memory, 0);
+	if (result != VK_SUCCESS)
+	{
+		BOOST_LOG_TRIVIAL(fatal) << "CVertexBuffer9::CreateBuffer vkBindBufferMemory failed with return code of " << result;
+		vkDestroyBuffer(mDevice->mDevice, buffer, NULL);
+		vkFreeMemory(mDevice->mDevice, memory, NULL);
+		buffer = VK_NULL_HANDLE;
+		memory = VK_NULL_HANDLE;
+		return result;
+	}
+
+	return result;
+}
+
+VkResult CVertexBuffer9::Rename(bool preserveContents)
+{
+	VkBuffer buffer = VK_NULL_HANDLE;
+	VkDeviceMemory memory = VK_NULL_HANDLE;
+
+	VkResult result = CreateBuffer(buffer, memory);
+	if (result != VK_SUCCESS)
+	{
+		return result;
+	}
+
+	result = vkMapMemory(mDevice->mDevice, memory, 0, mMemoryRequirements.size, 0, &mData);
+	if (result != VK_SUCCESS)
+	{
+		BOOST_LOG_TRIVIAL(fatal) << "CVertexBuffer9::Rename vkMapMemory failed with return code of " << result;
+		vkDestroyBuffer(mDevice->mDevice, buffer, NULL);
+		vkFreeMemory(mDevice->mDevice, memory, NULL);
+		mData = nullptr;
+		return result;
+	}
+
+	if (preserveContents)
+	{
+		void* oldData = nullptr;
+		result = vkMapMemory(mDevice->mDevice, mMemory, 0, mMemoryRequirements.size, 0, &oldData);
+		if (result != VK_SUCCESS)
+		{
+			BOOST_LOG_TRIVIAL(fatal) << "CVertexBuffer9::Rename vkMapMemory failed with return code of " << result;
+			vkUnmapMemory(mDevice->mDevice, memory);
+			vkDestroyBuffer(mDevice->mDevice, buffer, NULL);
+			vkFreeMemory(mDevice->mDevice, memory, NULL);
+			mData = nullptr;
+			return result;
+		}
+
+		memcpy(mData, oldData, mLength);
+		vkUnmapMemory(mDevice->mDevice, mMemory);
+	}
+
+	//Draws already recorded keep the old storage so it is destroyed once the frame being recorded retires.
+	GarbageManager& garbage = mDevice->mFrames[mDevice->mCurrentFrame].Garbage;
+	garbage.mBuffers.push_back(mBuffer);
+	garbage.mMemories.push_back(mMemory);
+
+	mBuffer = buffer;
+	mMemory = memory;
+	mLastFrameUsed = 0;
+	mDevice->mStatistics.BufferRenames++;
+
+	return result;
+}
+
 CVertexBuffer9::~CVertexBuffer9()
 {	
+	if (mDevice->mBufferManager != nullptr)
+	{
+		//The frames in flight may still read the buffer so it is destroyed once the frame being recorded has retired.
+		GarbageManager& garbage = mDevice->mFrames[mDevice->mCurrentFrame].Garbage;
+		garbage.mBuffers.push_back(mBuffer);
+		garbage.mMemories.push_back(mMemory);
+		return;
+	}
+
 	if (mBuffer != VK_NULL_HANDLE)
 	{
 		vkDestroyBuffer(mDevice->mDevice, mBuffer, NULL);
@@ -200,6 +278,7 @@ ULONG STDMETHODCALLTYPE CVertexBuffer9::Release(void)
 
 	if (ref == 0)
 	{
+		mDevice->SynchronizeCommandStream();
 		delete this;
 	}
 
@@ -289,6 +368,8 @@ HRESULT STDMETHODCALLTYPE CVertexBuffer9::GetDesc(D3DVERTEXBUFFER_DESC* pDesc)
 
 HRESULT STDMETHODCALLTYPE CVertexBuffer9::Lock(UINT OffsetToLock, UINT SizeToLock, VOID** ppbData, DWORD Flags)
 {
+	mDevice->SynchronizeCommandStream();
+
 	VkResult result = VK_SUCCESS;
 
 	if (mPool == D3DPOOL_MANAGED)
@@ -299,14 +380,33 @@ HRESULT STDMETHODCALLTYPE CVertexBuffer9::Lock(UINT OffsetToLock, UINT SizeToLoc
 		}
 	}
 
-	if (mData == nullptr)
+	/*
+	The frames in flight may still read the buffer so a write lock can't just hand back the live memory.
+	NOOVERWRITE promises not to touch anything in use and READONLY doesn't write so neither needs anything.
+	DISCARD gets new storage. Otherwise the lock waits for the submitted frames that used the buffer.
+	The frame being recorded can't be waited on so a buffer it already used gets new storage with the old contents copied over.
+	Nested locks already have the memory mapped and handed out so they are left alone.
+	*/
+	if (mData == nullptr && !(Flags & (D3DLOCK_READONLY | D3DLOCK_NOOVERWRITE)) && mDevice->IsFrameInFlight(mLastFrameUsed))
+	{
+		if ((Flags & D3DLOCK_DISCARD) || mLastFrameUsed == mDevice->mFrameNumber)
+		{
+			result = Rename(!(Flags & D3DLOCK_DISCARD));
+		}
+		else
+		{
+			mDevice->WaitForFrame(mLastFrameUsed);
+		}
+	}
+
+	if (mData == nullptr && result == VK_SUCCESS)
 	{
 		result = vkMapMemory(mDevice->mDevice, mMemory, 0, mMemoryRequirements.size, 0, &mData);
 	}
 
 	if (result != VK_SUCCESS)
 	{
-		BOOST_LOG_TRIVIAL(fatal) << "CVertexBuffer9::Lock vkMapMemory failed with return code of " << result;
+		BOOST_LOG_TRIVIAL(fatal) << "CVertexBuffer9::Lock failed with return code of " << result;
 		*ppbData = nullptr;
 
 		return D3DERR_INVALIDCALL;
@@ -320,6 +420,8 @@ HRESULT STDMETHODCALLTYPE CVertexBuffer9::Lock(UINT OffsetToLock, UINT SizeToLoc
 
 HRESULT STDMETHODCALLTYPE CVertexBuffer9::Unlock()
 {
+	mDevice->SynchronizeCommandStream();
+
 	VkResult result = VK_SUCCESS;
 
 	if (mData != nullptr)
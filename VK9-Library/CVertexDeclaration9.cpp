@@ -102,6 +102,7 @@ ULONG STDMETHODCALLTYPE CVertexDeclaration9::Release(void)
 
 	if (ref == 0)
 	{
+		mDevice->SynchronizeCommandStream();
 		delete this;
 	}
 
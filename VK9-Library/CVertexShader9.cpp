@@ -85,6 +85,7 @@ ULONG STDMETHODCALLTYPE CVertexShader9::Release(void)
 
 	if (ref == 0)
 	{
+		mDevice->SynchronizeCommandStream();
 		delete this;
 	}
 
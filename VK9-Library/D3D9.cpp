@@ -29,9 +29,80 @@ misrepresented as being the original software.
 #include <boost/log/sources/severity_logger.hpp>
 #include <boost/log/sources/record_ostream.hpp>
 #include "C9.h"
+#include "CDevice9.h"
 
 #include "PrivateTypes.h"
 
+#include <atomic>
+#include <new>
+#include <stdlib.h>
+
+/*
+Every allocation the library makes goes through these so tests can check that steady state calls don't touch the heap.
+Only the count is kept so the cost is one relaxed increment.
+*/
+static std::atomic<uint64_t> gHeapAllocations{ 0 };
+
+void* operator new(size_t size)
+{
+	gHeapAllocations.fetch_add(1, std::memory_order_relaxed);
+
+	void* memory = malloc(size != 0 ? size : 1);
+	if (memory == nullptr)
+	{
+		throw std::bad_alloc();
+	}
+
+	return memory;
+}
+
+void* operator new[](size_t size)
+{
+	return operator new(size);
+}
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept
+{
+	gHeapAllocations.fetch_add(1, std::memory_order_relaxed);
+
+	return malloc(size != 0 ? size : 1);
+}
+
+void* operator new[](size_t size, const std::nothrow_t& nothrow) noexcept
+{
+	return operator new(size, nothrow);
+}
+
+void operator delete(void* memory) noexcept
+{
+	free(memory);
+}
+
+void operator delete[](void* memory) noexcept
+{
+	free(memory);
+}
+
+void operator delete(void* memory, size_t) noexcept
+{
+	free(memory);
+}
+
+void operator delete[](void* memory, size_t) noexcept
+{
+	free(memory);
+}
+
+void operator delete(void* memory, const std::nothrow_t&) noexcept
+{
+	free(memory);
+}
+
+void operator delete[](void* memory, const std::nothrow_t&) noexcept
+{
+	free(memory);
+}
+
 IDirect3D9* WINAPI Direct3DCreate9(UINT SDKVersion)
 {
 	C9* instance = new C9();
@@ -56,6 +127,29 @@ HRESULT WINAPI Direct3DCreate9Ex(UINT SDKVersion, IDirect3D9Ex** out)
 	return E_NOTIMPL;
 }
 
+/*
+Not part of D3D9. Copies the device's counters so a test can check them without parsing the log.
+Drains the command stream and the submission thread first so the counters cover every call made before this one.
+*/
+HRESULT WINAPI VK9GetDeviceStatistics(IDirect3DDevice9* device, DeviceStatistics* statistics)
+{
+	if (device == nullptr || statistics == nullptr)
+	{
+		return D3DERR_INVALIDCALL;
+	}
+
+	CDevice9* device9 = (CDevice9*)device;
+
+	device9->SynchronizeCommandStream();
+	device9->WaitForSubmission(device9->mLastSubmissionId);
+
+	(*statistics) = device9->mStatistics;
+	statistics->RecordedCommands = device9->mRecordedCommands;
+	statistics->HeapAllocations = gHeapAllocations.load(std::memory_order_relaxed);
+
+	return S_OK;
+}
+
 /* Other things to possibly implement.
 
 D3DPERF_BeginEvent
@@ -0,0 +1,113 @@
+/*
+Copyright(c) 2016 Christopher Joseph Dean Schaefer
+
+This software is provided 'as-is', without any express or implied
+warranty.In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions :
+
+1. The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software.If you use this software
+in a product, an acknowledgment in the product documentation would be
+appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#ifndef DEVICESTATISTICS_H
+#define DEVICESTATISTICS_H
+
+#include <stdint.h>
+
+/*
+Counters the device keeps about itself. CDevice9 owns one and the buffer manager writes into it through the device.
+Nothing reads them while the device runs. Setting LogStatistics logs them when the device is destroyed and VK9GetDeviceStatistics copies them out so tests can check them.
+Only fixed size fields so the layout is the same for anything that includes this header.
+*/
+struct DeviceStatistics
+{
+	//Frames
+	uint64_t Frames = 0;
+	uint64_t RenderPassBegins = 0;
+	uint32_t FrameRenderPassBegins = 0; //Render passes begun since the current frame's scene started.
+	uint32_t MaximumFrameRenderPassBegins = 0; //More than one means something split a frame's render pass.
+	uint64_t FrameFenceWaits = 0; //Presents that had to block until the GPU retired the frame being reused.
+	long long FrameFenceWaitTime = 0; //microseconds
+	long long MaximumFrameFenceWait = 0; //microseconds
+	uint64_t ResourceFenceWaits = 0; //Buffer locks and texture uploads that had to block until the frames reading the resource retired.
+	long long ResourceFenceWaitTime = 0; //microseconds
+	uint64_t BufferRenames = 0; //Buffer locks that got new storage instead of waiting.
+	uint64_t PartialFrameSubmits = 0; //Read backs and texture uploads that submitted the frame so far because its draws used the image.
+
+	//Draws
+	uint64_t DrawCount = 0;
+	uint64_t DrawContextAllocations = 0;
+	uint64_t ResourceContextAllocations = 0;
+	uint64_t HeapAllocations = 0; //operator new calls made by the library on any thread since it was loaded. Only filled in by VK9GetDeviceStatistics.
+	uint64_t DrawsRecorded = 0;
+	long long DrawRecordTime = 0; //nanoseconds the API thread spent recording draws. Draws are too short to count in microseconds.
+	uint64_t DrawsExecuted = 0;
+	long long DrawExecuteTime = 0; //nanoseconds spent turning draws into Vulkan commands on whichever thread executes them.
+
+	//Pipelines
+	uint64_t PipelineCount = 0;
+	long long MaximumPipelineStall = 0; //microseconds a draw waited on the thread recording it for its pipeline.
+	uint64_t PipelineCacheHits = 0;
+	uint64_t PipelineCacheMisses = 0;
+	uint64_t PipelineCacheEvictions = 0;
+	uint64_t StaticPipelineKeys = 0; //Only counted with DynamicPipelineStateComparison.
+	uint64_t DynamicPipelineKeys = 0;
+
+	//Descriptors and samplers
+	uint64_t SamplerCacheHits = 0;
+	uint64_t SamplerCacheMisses = 0;
+	uint64_t LayoutCacheHits = 0;
+	uint64_t LayoutCacheMisses = 0;
+	uint64_t DescriptorSetHits = 0;
+	uint64_t DescriptorSetMisses = 0;
+	uint64_t DescriptorSetAllocations = 0;
+	uint64_t DescriptorPools = 0;
+	uint64_t DescriptorSetWrites = 0;
+	long long DescriptorSetWriteTime = 0; //nanoseconds
+	uint64_t PushDescriptorCount = 0;
+	uint64_t PushDescriptorWrites = 0;
+
+	//Constants and fixed function buffers
+	uint64_t WorldUpdates = 0;
+	uint64_t ViewProjectionUpdates = 0;
+	uint64_t TransformationPushes = 0;
+	uint64_t FixedFunctionUploads = 0;
+	uint64_t FixedFunctionUploadBytes = 0;
+	uint64_t ConstantUploads = 0;
+	uint64_t ConstantUploadBytes = 0;
+	uint64_t ConstantRedundantSets = 0;
+	uint64_t ConstantRingGrowths = 0;
+
+	//Command buffers, fences and submissions
+	uint64_t CommandBuffersCreated = 0;
+	uint64_t FencesCreated = 0;
+	uint64_t SemaphoresCreated = 0;
+	uint64_t OneTimeSubmits = 0;
+	uint32_t CommandBuffersInUse = 0;
+	uint32_t FencesInUse = 0;
+	uint32_t MaximumCommandBuffersInUse = 0;
+	uint32_t MaximumFencesInUse = 0;
+	long long QueueCallTime = 0; //microseconds spent in vkQueueSubmit and vkQueuePresentKHR on whichever thread owns the queue.
+	uint64_t SubmissionWaits = 0; //Times the API thread had to wait for the submission thread to catch up.
+	long long SubmissionWaitTime = 0; //microseconds
+	uint64_t SubmissionQueueFull = 0;
+	uint64_t AcquireRetries = 0;
+
+	//Command stream
+	uint64_t RecordedCommands = 0; //Copied from the device when the statistics are read.
+	uint64_t CommandStreamFull = 0;
+	uint64_t CommandStreamSynchronizations = 0; //Times the API thread had to wait for the stream to drain.
+	long long CommandStreamSynchronizationTime = 0; //microseconds including throttled presents.
+	uint64_t PresentThrottles = 0; //Presents that waited because the API thread was too many frames ahead.
+};
+
+#endif // DEVICESTATISTICS_H
@@ -32,6 +32,16 @@ GarbageManager::~GarbageManager()
 
 void GarbageManager::DestroyHandles()
 {
+	//ImageViews
+	for (size_t i = 0; i < mImageViews.size(); i++)
+	{
+		if (mImageViews[i] != VK_NULL_HANDLE)
+		{
+			vkDestroyImageView(mDevice, mImageViews[i], NULL);
+		}
+	}
+	mImageViews.clear();
+
 	//Images
 	for (size_t i = 0; i < mImages.size(); i++)
 	{
@@ -42,6 +52,16 @@ void GarbageManager::DestroyHandles()
 	}
 	mImages.clear();
 
+	//Buffers
+	for (size_t i = 0; i < mBuffers.size(); i++)
+	{
+		if (mBuffers[i] != VK_NULL_HANDLE)
+		{
+			vkDestroyBuffer(mDevice, mBuffers[i], NULL);
+		}
+	}
+	mBuffers.clear();
+
 	//Memories
 	for (size_t i = 0; i < mMemories.size(); i++)
 	{
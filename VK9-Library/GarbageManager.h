@@ -42,7 +42,9 @@ class GarbageManager
 		VkDescriptorPool mDescriptorPool = VK_NULL_HANDLE;
 
 		//Handles to destroy	
+		boost::container::small_vector<VkImageView,16> mImageViews;
 		boost::container::small_vector<VkImage,16> mImages;
+		boost::container::small_vector<VkBuffer,16> mBuffers;
 		boost::container::small_vector<VkDeviceMemory,16> mMemories;
 		boost::container::small_vector<VkSampler,16> mSamplers;
 		boost::container::small_vector<VkDescriptorSet,16> mDescriptorSets;
@@ -190,7 +190,7 @@ uint32_t ShaderConverter::GetSpirVTypeId(TypeDescription& registerType)
 
 			mTypeInstructions.push_back(Pack(4, registerType.PrimaryType)); //size,Type
 			mTypeInstructions.push_back(id); //Id
-			mTypeInstructions.push_back(spv::StorageClassInput); //Storage Class
+			mTypeInstructions.push_back(registerType.StorageClass); //Storage Class
 			mTypeInstructions.push_back(pointerTypeId); // Type
 			break;
 		case spv::OpTypeSampler:
@@ -263,6 +263,65 @@ To make sure each call gets the latest id number the lookups must be updated.
 */
 uint32_t ShaderConverter::GetNextVersionId(const Token& token)
 {
+	D3DSHADER_PARAM_REGISTER_TYPE registerType = GetRegisterType(token.i);
+	uint32_t registerNumber = GetRegisterNumber(token.i);
+	uint32_t usage = UINT_MAX;
+	uint32_t usageIndex = registerNumber;
+	TypeDescription typeDescription;
+	uint32_t typeId = 0;
+	uint32_t outputId = 0;
+
+	//Vertex shaders before 3.0 and all pixel shaders write outputs without declaring them so the variable is made on the first write.
+	switch (registerType)
+	{
+	case D3DSPR_RASTOUT:
+		if (registerNumber == 0)
+		{
+			usage = D3DDECLUSAGE_POSITION;
+		}
+		else if (registerNumber == 1)
+		{
+			usage = D3DDECLUSAGE_FOG;
+		}
+		else
+		{
+			BOOST_LOG_TRIVIAL(warning) << "GetNextVersionId - Unsupported rasterizer output " << registerNumber;
+		}
+		usageIndex = 0;
+		break;
+	case D3DSPR_ATTROUT:
+	case D3DSPR_COLOROUT:
+		usage = D3DDECLUSAGE_COLOR;
+		break;
+	case D3DSPR_TEXCRDOUT:
+		if (mIsVertexShader && mMajorVersion < 3)
+		{
+			usage = D3DDECLUSAGE_TEXCOORD;
+		}
+		break;
+	default:
+		break;
+	}
+
+	if (usage != UINT_MAX && mOutputIdsByRegister[registerType].find(registerNumber) == mOutputIdsByRegister[registerType].end())
+	{
+		typeDescription.PrimaryType = spv::OpTypePointer;
+		typeDescription.SecondaryType = spv::OpTypeVector;
+		typeDescription.TernaryType = spv::OpTypeFloat;
+		typeDescription.ComponentCount = 4;
+		typeDescription.StorageClass = spv::StorageClassOutput;
+		typeId = GetSpirVTypeId(typeDescription);
+		outputId = GetNextId();
+		mIdTypePairs[outputId] = typeDescription;
+
+		mTypeInstructions.push_back(Pack(4, spv::OpVariable)); //size,Type
+		mTypeInstructions.push_back(typeId); //ResultType (Id) Must be OpTypePointer with the pointer's type being what you care about.
+		mTypeInstructions.push_back(outputId); //Result (Id)
+		mTypeInstructions.push_back(spv::StorageClassOutput); //Storage Class
+
+		DeclareOutput(token, outputId, usage, usageIndex);
+	}
+
 	uint32_t id = GetNextId();
 
 	SetIdByRegister(token, id);
@@ -277,6 +336,11 @@ uint32_t ShaderConverter::GetIdByRegister(const Token& token)
 	TypeDescription description;
 	uint32_t id = 0;
 	uint32_t typeId = 0;
+	uint32_t blockId = 0;
+	uint32_t memberId = 0;
+	uint32_t elementId = 0;
+	uint32_t componentId = 0;
+	uint32_t registerCount = 0;
 
 	switch (registerType)
 	{
@@ -310,28 +374,93 @@ uint32_t ShaderConverter::GetIdByRegister(const Token& token)
 	case D3DSPR_CONST2:
 	case D3DSPR_CONST3:
 	case D3DSPR_CONST4:
+		//Float registers are elements of the stage's float block. Registers the application can't set would read past the block so they are clamped.
+		registerCount = mIsVertexShader ? MAX_VERTEX_SHADER_FLOAT_CONSTANTS : MAX_PIXEL_SHADER_FLOAT_CONSTANTS;
+		if (registerNumber >= registerCount)
+		{
+			BOOST_LOG_TRIVIAL(warning) << "GetIdByRegister - Float constant " << registerNumber << " is past the last register " << registerCount - 1;
+		}
+
+		description.PrimaryType = spv::OpTypePointer;
+		description.SecondaryType = spv::OpTypeVector;
+		description.TernaryType = spv::OpTypeFloat;
+		description.ComponentCount = 4;
+		description.StorageClass = spv::StorageClassUniform;
+		typeId = GetSpirVTypeId(description);
+		blockId = GetConstantBlockId(false);
+		memberId = GetIndexId(0);
+		elementId = GetIndexId(min(registerNumber, registerCount - 1));
 		id = GetNextId();
+
+		mUniformAccessInstructions.push_back(Pack(6, spv::OpAccessChain)); //size,Type
+		mUniformAccessInstructions.push_back(typeId); //Result Type (Id)
+		mUniformAccessInstructions.push_back(id); //Result (Id)
+		mUniformAccessInstructions.push_back(blockId); //Base (Id)
+		mUniformAccessInstructions.push_back(memberId); //Indexes (Id)
+		mUniformAccessInstructions.push_back(elementId);
+		break;
+	case D3DSPR_CONSTINT:
+		if (registerNumber >= MAX_SHADER_INTEGER_CONSTANTS)
+		{
+			BOOST_LOG_TRIVIAL(warning) << "GetIdByRegister - Integer constant " << registerNumber << " is past the last register " << MAX_SHADER_INTEGER_CONSTANTS - 1;
+		}
+
+		//The block declares the integers unsigned. The bits are the same as the signed values the application set.
 		description.PrimaryType = spv::OpTypePointer;
 		description.SecondaryType = spv::OpTypeVector;
-		description.TernaryType = spv::OpTypeFloat; //TODO: find a way to tell if this is an integer or float.
+		description.TernaryType = spv::OpTypeInt;
 		description.ComponentCount = 4;
+		description.StorageClass = spv::StorageClassUniform;
 		typeId = GetSpirVTypeId(description);
+		blockId = GetConstantBlockId(true);
+		memberId = GetIndexId(0);
+		elementId = GetIndexId(min(registerNumber, (uint32_t)MAX_SHADER_INTEGER_CONSTANTS - 1));
+		id = GetNextId();
 
-		mIdsByRegister[registerType][registerNumber] = id;
-		mRegistersById[registerType][id] = registerNumber;
-		mIdTypePairs[id] = description;
+		mUniformAccessInstructions.push_back(Pack(6, spv::OpAccessChain)); //size,Type
+		mUniformAccessInstructions.push_back(typeId); //Result Type (Id)
+		mUniformAccessInstructions.push_back(id); //Result (Id)
+		mUniformAccessInstructions.push_back(blockId); //Base (Id)
+		mUniformAccessInstructions.push_back(memberId); //Indexes (Id)
+		mUniformAccessInstructions.push_back(elementId);
+		break;
+	case D3DSPR_CONSTBOOL:
+		if (registerNumber >= MAX_SHADER_BOOLEAN_CONSTANTS)
+		{
+			BOOST_LOG_TRIVIAL(warning) << "GetIdByRegister - Boolean constant " << registerNumber << " is past the last register " << MAX_SHADER_BOOLEAN_CONSTANTS - 1;
+		}
 
-		mTypeInstructions.push_back(Pack(4, spv::OpVariable)); //size,Type
-		mTypeInstructions.push_back(typeId); //ResultType (Id) Must be OpTypePointer with the pointer's type being what you care about.
-		mTypeInstructions.push_back(id); //Result (Id)
-		mTypeInstructions.push_back(spv::StorageClassPushConstant); //Storage Class
+		//Booleans are packed four to an element after the integers.
+		description.PrimaryType = spv::OpTypePointer;
+		description.SecondaryType = spv::OpTypeInt;
+		description.StorageClass = spv::StorageClassUniform;
+		typeId = GetSpirVTypeId(description);
+		blockId = GetConstantBlockId(true);
+		memberId = GetIndexId(1);
+		elementId = GetIndexId(min(registerNumber, (uint32_t)MAX_SHADER_BOOLEAN_CONSTANTS - 1) / 4);
+		componentId = GetIndexId(min(registerNumber, (uint32_t)MAX_SHADER_BOOLEAN_CONSTANTS - 1) % 4);
+		id = GetNextId();
 
+		mUniformAccessInstructions.push_back(Pack(7, spv::OpAccessChain)); //size,Type
+		mUniformAccessInstructions.push_back(typeId); //Result Type (Id)
+		mUniformAccessInstructions.push_back(id); //Result (Id)
+		mUniformAccessInstructions.push_back(blockId); //Base (Id)
+		mUniformAccessInstructions.push_back(memberId); //Indexes (Id)
+		mUniformAccessInstructions.push_back(elementId);
+		mUniformAccessInstructions.push_back(componentId);
 		break;
 	default:
 		BOOST_LOG_TRIVIAL(warning) << "GetIdByRegister - Id not found register " << registerNumber << " (" << registerType << ")";
 		break;
 	}
 
+	if (id)
+	{
+		mIdsByRegister[registerType][registerNumber] = id;
+		mRegistersById[registerType][id] = registerNumber;
+		mIdTypePairs[id] = description;
+	}
+
 	return id;
 }
 
@@ -389,15 +518,35 @@ uint32_t ShaderConverter::GetSwizzledId(const Token& token, uint32_t inputId)
 	uint32_t outputComponentCount = 4; //TODO: figure out how to determine this.
 	uint32_t vectorTypeId = 0;
 	uint32_t registerNumber = 0;
-	//TypeDescription typeDescription;
+	TypeDescription typeDescription;
 	D3DSHADER_PARAM_REGISTER_TYPE registerType;
 
 	registerType = GetRegisterType(token.i);
-	//typeDescription = GetTypeByRegister(token.DestinationParameterToken.RegisterNumber);
 
 	if (inputId == UINT_MAX)
 	{
 		inputId = GetIdByRegister(token);
+
+		//Registers held in variables such as inputs and constants have to be loaded before they can be used as a value.
+		boost::container::flat_map<uint32_t, TypeDescription>::iterator it = mIdTypePairs.find(inputId);
+		if (it != mIdTypePairs.end() && it->second.PrimaryType == spv::OpTypePointer)
+		{
+			typeDescription = it->second;
+			typeDescription.PrimaryType = typeDescription.SecondaryType;
+			typeDescription.SecondaryType = typeDescription.TernaryType;
+			typeDescription.TernaryType = spv::OpTypeVoid;
+			typeDescription.StorageClass = spv::StorageClassInput;
+
+			uint32_t pointerId = inputId;
+			uint32_t dataTypeId = GetSpirVTypeId(typeDescription);
+			inputId = GetNextId();
+			mIdTypePairs[inputId] = typeDescription;
+
+			mFunctionDefinitionInstructions.push_back(Pack(4, spv::OpLoad)); //size,Type
+			mFunctionDefinitionInstructions.push_back(dataTypeId); //Result Type (Id)
+			mFunctionDefinitionInstructions.push_back(inputId); //result (Id)
+			mFunctionDefinitionInstructions.push_back(pointerId); //pointer (Id)
+		}
 	}
 
 	if (swizzle == 0 || swizzle == D3DVS_NOSWIZZLE || outputComponentCount == 0)
@@ -627,6 +776,272 @@ uint32_t ShaderConverter::GetSwizzledId(const Token& token, uint32_t inputId)
 	return outputId;
 }
 
+uint32_t ShaderConverter::GetIndexId(uint32_t index)
+{
+	boost::container::flat_map<uint32_t, uint32_t>::iterator it = mIndexIds.find(index);
+
+	if (it != mIndexIds.end())
+	{
+		return it->second;
+	}
+
+	uint32_t typeId = GetSpirVTypeId(spv::OpTypeInt);
+	uint32_t id = GetNextId();
+	mIndexIds[index] = id;
+
+	mTypeInstructions.push_back(Pack(4, spv::OpConstant)); //size,Type
+	mTypeInstructions.push_back(typeId); //Result Type (Id)
+	mTypeInstructions.push_back(id); //Result (Id)
+	mTypeInstructions.push_back(index); //Literal Value
+
+	return id;
+}
+
+/*
+Declares the stage's float or integer constant block the first time a register in it is read.
+The layouts match ShaderConstants so the buffer manager can bind its blocks at SHADER_CONSTANT_BINDING and up.
+Float block: vec4 Floats[256 or 224]
+Integer block: uvec4 Integers[16] followed by uvec4 Booleans[4]
+*/
+uint32_t ShaderConverter::GetConstantBlockId(bool isInteger)
+{
+	uint32_t& blockId = isInteger ? mIntegerConstantsId : mFloatConstantsId;
+
+	if (blockId)
+	{
+		return blockId;
+	}
+
+	uint32_t binding = SHADER_CONSTANT_BINDING;
+	uint32_t structureId = 0;
+	uint32_t pointerId = 0;
+
+	if (isInteger)
+	{
+		binding += mIsVertexShader ? SHADER_CONSTANT_VERTEX_INTEGER : SHADER_CONSTANT_PIXEL_INTEGER;
+
+		uint32_t vectorTypeId = GetSpirVTypeId(spv::OpTypeVector, spv::OpTypeInt, 4);
+		uint32_t integerLengthId = GetIndexId(MAX_SHADER_INTEGER_CONSTANTS);
+		uint32_t booleanLengthId = GetIndexId(MAX_SHADER_BOOLEAN_CONSTANTS / 4);
+		uint32_t integerArrayId = GetNextId();
+		uint32_t booleanArrayId = GetNextId();
+		structureId = GetNextId();
+
+		mTypeInstructions.push_back(Pack(4, spv::OpTypeArray)); //size,Type
+		mTypeInstructions.push_back(integerArrayId); //Result (Id)
+		mTypeInstructions.push_back(vectorTypeId); //Element Type (Id)
+		mTypeInstructions.push_back(integerLengthId); //Length (Id)
+
+		mTypeInstructions.push_back(Pack(4, spv::OpTypeArray)); //size,Type
+		mTypeInstructions.push_back(booleanArrayId); //Result (Id)
+		mTypeInstructions.push_back(vectorTypeId); //Element Type (Id)
+		mTypeInstructions.push_back(booleanLengthId); //Length (Id)
+
+		mTypeInstructions.push_back(Pack(4, spv::OpTypeStruct)); //size,Type
+		mTypeInstructions.push_back(structureId); //Result (Id)
+		mTypeInstructions.push_back(integerArrayId); //Member 0 type (Id)
+		mTypeInstructions.push_back(booleanArrayId); //Member 1 type (Id)
+
+		mDecorateInstructions.push_back(Pack(4, spv::OpDecorate)); //size,Type
+		mDecorateInstructions.push_back(integerArrayId); //target (Id)
+		mDecorateInstructions.push_back(spv::DecorationArrayStride); //Decoration Type (Id)
+		mDecorateInstructions.push_back(sizeof(uint32_t) * 4); //Array Stride
+
+		mDecorateInstructions.push_back(Pack(4, spv::OpDecorate)); //size,Type
+		mDecorateInstructions.push_back(booleanArrayId); //target (Id)
+		mDecorateInstructions.push_back(spv::DecorationArrayStride); //Decoration Type (Id)
+		mDecorateInstructions.push_back(sizeof(uint32_t) * 4); //Array Stride
+
+		mMemberDecorateInstructions.push_back(Pack(5, spv::OpMemberDecorate)); //size,Type
+		mMemberDecorateInstructions.push_back(structureId); //target (Id)
+		mMemberDecorateInstructions.push_back(0); //Member
+		mMemberDecorateInstructions.push_back(spv::DecorationOffset); //Decoration Type (Id)
+		mMemberDecorateInstructions.push_back(0); //Byte Offset
+
+		mMemberDecorateInstructions.push_back(Pack(5, spv::OpMemberDecorate)); //size,Type
+		mMemberDecorateInstructions.push_back(structureId); //target (Id)
+		mMemberDecorateInstructions.push_back(1); //Member
+		mMemberDecorateInstructions.push_back(spv::DecorationOffset); //Decoration Type (Id)
+		mMemberDecorateInstructions.push_back(MAX_SHADER_INTEGER_CONSTANTS * sizeof(uint32_t) * 4); //Byte Offset
+	}
+	else
+	{
+		binding += mIsVertexShader ? SHADER_CONSTANT_VERTEX_FLOAT : SHADER_CONSTANT_PIXEL_FLOAT;
+
+		uint32_t vectorTypeId = GetSpirVTypeId(spv::OpTypeVector, spv::OpTypeFloat, 4);
+		uint32_t lengthId = GetIndexId(mIsVertexShader ? MAX_VERTEX_SHADER_FLOAT_CONSTANTS : MAX_PIXEL_SHADER_FLOAT_CONSTANTS);
+		uint32_t arrayId = GetNextId();
+		structureId = GetNextId();
+
+		mTypeInstructions.push_back(Pack(4, spv::OpTypeArray)); //size,Type
+		mTypeInstructions.push_back(arrayId); //Result (Id)
+		mTypeInstructions.push_back(vectorTypeId); //Element Type (Id)
+		mTypeInstructions.push_back(lengthId); //Length (Id)
+
+		mTypeInstructions.push_back(Pack(3, spv::OpTypeStruct)); //size,Type
+		mTypeInstructions.push_back(structureId); //Result (Id)
+		mTypeInstructions.push_back(arrayId); //Member 0 type (Id)
+
+		mDecorateInstructions.push_back(Pack(4, spv::OpDecorate)); //size,Type
+		mDecorateInstructions.push_back(arrayId); //target (Id)
+		mDecorateInstructions.push_back(spv::DecorationArrayStride); //Decoration Type (Id)
+		mDecorateInstructions.push_back(sizeof(float) * 4); //Array Stride
+
+		mMemberDecorateInstructions.push_back(Pack(5, spv::OpMemberDecorate)); //size,Type
+		mMemberDecorateInstructions.push_back(structureId); //target (Id)
+		mMemberDecorateInstructions.push_back(0); //Member
+		mMemberDecorateInstructions.push_back(spv::DecorationOffset); //Decoration Type (Id)
+		mMemberDecorateInstructions.push_back(0); //Byte Offset
+	}
+
+	pointerId = GetNextId();
+	blockId = GetNextId();
+
+	mTypeInstructions.push_back(Pack(4, spv::OpTypePointer)); //size,Type
+	mTypeInstructions.push_back(pointerId); //Result (Id)
+	mTypeInstructions.push_back(spv::StorageClassUniform); //Storage Class
+	mTypeInstructions.push_back(structureId); // Type
+
+	mTypeInstructions.push_back(Pack(4, spv::OpVariable)); //size,Type
+	mTypeInstructions.push_back(pointerId); //ResultType (Id) Must be OpTypePointer with the pointer's type being what you care about.
+	mTypeInstructions.push_back(blockId); //Result (Id)
+	mTypeInstructions.push_back(spv::StorageClassUniform); //Storage Class
+
+	mDecorateInstructions.push_back(Pack(3, spv::OpDecorate)); //size,Type
+	mDecorateInstructions.push_back(structureId); //target (Id)
+	mDecorateInstructions.push_back(spv::DecorationBlock); //Decoration Type (Id)
+
+	mDecorateInstructions.push_back(Pack(4, spv::OpDecorate)); //size,Type
+	mDecorateInstructions.push_back(blockId); //target (Id)
+	mDecorateInstructions.push_back(spv::DecorationDescriptorSet); //Decoration Type (Id)
+	mDecorateInstructions.push_back(0); //Descriptor Set
+
+	mDecorateInstructions.push_back(Pack(4, spv::OpDecorate)); //size,Type
+	mDecorateInstructions.push_back(blockId); //target (Id)
+	mDecorateInstructions.push_back(spv::DecorationBinding); //Decoration Type (Id)
+	mDecorateInstructions.push_back(binding); //Binding
+
+	return blockId;
+}
+
+/*
+Direct3D links the stages by usage rather than by register so both stages take the location from the usage.
+Colors get the first two locations and texture coordinates the next eight. Other usages share the ones after that by index.
+*/
+uint32_t ShaderConverter::GetUsageLocation(uint32_t usage, uint32_t usageIndex)
+{
+	switch (usage)
+	{
+	case D3DDECLUSAGE_COLOR:
+		return usageIndex;
+	case D3DDECLUSAGE_TEXCOORD:
+		return 2 + usageIndex;
+	default:
+		return 10 + usageIndex;
+	}
+}
+
+void ShaderConverter::DeclareOutput(const Token& token, uint32_t id, uint32_t usage, uint32_t usageIndex)
+{
+	mOutputIdsByRegister[GetRegisterType(token.i)][GetRegisterNumber(token.i)] = id;
+	mInterfaceIds.push_back(id); //Used by entry point opcode.
+
+	if (mIsVertexShader && usage == D3DDECLUSAGE_POSITION && usageIndex == 0)
+	{
+		mPositionId = id;
+
+		mDecorateInstructions.push_back(Pack(4, spv::OpDecorate)); //size,Type
+		mDecorateInstructions.push_back(id); //target (Id)
+		mDecorateInstructions.push_back(spv::DecorationBuiltIn); //Decoration Type (Id)
+		mDecorateInstructions.push_back(spv::BuiltInPosition); //BuiltIn
+	}
+	else
+	{
+		mDecorateInstructions.push_back(Pack(4, spv::OpDecorate)); //size,Type
+		mDecorateInstructions.push_back(id); //target (Id)
+		mDecorateInstructions.push_back(spv::DecorationLocation); //Decoration Type (Id)
+		mDecorateInstructions.push_back(GetUsageLocation(usage, usageIndex)); //Location offset
+	}
+}
+
+/*
+Writes to output registers only make new ids so the last value each register got is stored to its variable before the entry point returns.
+*/
+void ShaderConverter::StoreOutputs()
+{
+	for (auto& outputs : mOutputIdsByRegister)
+	{
+		for (auto& output : outputs.second)
+		{
+			uint32_t variableId = output.second;
+			uint32_t valueId = mIdsByRegister[outputs.first][output.first];
+			TypeDescription valueType = mIdTypePairs[variableId];
+
+			if (valueId == variableId)
+			{
+				continue; //Declared but never written.
+			}
+
+			valueType.PrimaryType = valueType.SecondaryType;
+			valueType.SecondaryType = valueType.TernaryType;
+			valueType.TernaryType = spv::OpTypeVoid;
+			valueType.StorageClass = spv::StorageClassInput;
+
+			boost::container::flat_map<uint32_t, TypeDescription>::iterator it = mIdTypePairs.find(valueId);
+			if (it != mIdTypePairs.end() && !(it->second == valueType))
+			{
+				BOOST_LOG_TRIVIAL(warning) << "ShaderConverter::StoreOutputs output register " << output.first << " (" << outputs.first << ") was written with a different type than it was declared with.";
+				continue;
+			}
+
+			//Direct3D clip space has y pointing up and Vulkan has it pointing down.
+			if (variableId == mPositionId)
+			{
+				uint32_t floatTypeId = GetSpirVTypeId(spv::OpTypeFloat);
+				uint32_t vectorTypeId = GetSpirVTypeId(valueType);
+				uint32_t oneId = GetNextId();
+				uint32_t negativeOneId = GetNextId();
+				uint32_t flipId = GetNextId();
+				uint32_t flippedId = GetNextId();
+				Token one;
+				Token negativeOne;
+				one.f = 1.0f;
+				negativeOne.f = -1.0f;
+
+				mTypeInstructions.push_back(Pack(4, spv::OpConstant)); //size,Type
+				mTypeInstructions.push_back(floatTypeId); //Result Type (Id)
+				mTypeInstructions.push_back(oneId); //Result (Id)
+				mTypeInstructions.push_back(one.i); //Literal Value
+
+				mTypeInstructions.push_back(Pack(4, spv::OpConstant)); //size,Type
+				mTypeInstructions.push_back(floatTypeId); //Result Type (Id)
+				mTypeInstructions.push_back(negativeOneId); //Result (Id)
+				mTypeInstructions.push_back(negativeOne.i); //Literal Value
+
+				mTypeInstructions.push_back(Pack(7, spv::OpConstantComposite)); //size,Type
+				mTypeInstructions.push_back(vectorTypeId); //Result Type (Id)
+				mTypeInstructions.push_back(flipId); //Result (Id)
+				mTypeInstructions.push_back(oneId); //Literal Value Ids
+				mTypeInstructions.push_back(negativeOneId);
+				mTypeInstructions.push_back(oneId);
+				mTypeInstructions.push_back(oneId);
+
+				mFunctionDefinitionInstructions.push_back(Pack(5, spv::OpFMul)); //size,Type
+				mFunctionDefinitionInstructions.push_back(vectorTypeId); //Result Type (Id)
+				mFunctionDefinitionInstructions.push_back(flippedId); //result (Id)
+				mFunctionDefinitionInstructions.push_back(valueId); //argument1 (Id)
+				mFunctionDefinitionInstructions.push_back(flipId); //argument2 (Id)
+
+				valueId = flippedId;
+			}
+
+			mFunctionDefinitionInstructions.push_back(Pack(3, spv::OpStore)); //size,Type
+			mFunctionDefinitionInstructions.push_back(variableId); //pointer (Id)
+			mFunctionDefinitionInstructions.push_back(valueId); //object (Id)
+		}
+	}
+}
+
 void ShaderConverter::CombineSpirVOpCodes()
 {
 	mInstructions.insert(std::end(mInstructions), std::begin(mCapabilityInstructions), std::end(mCapabilityInstructions));
@@ -758,6 +1173,8 @@ void ShaderConverter::Process_DCL_Pixel()
 	switch (registerType)
 	{
 	case D3DSPR_INPUT:
+		mInterfaceIds.push_back(tokenId); //Used by entry point opcode.
+
 		resultTypeId = GetSpirVTypeId(typeDescription);
 
 		mTypeInstructions.push_back(Pack(4, spv::OpVariable)); //size,Type
@@ -765,6 +1182,12 @@ void ShaderConverter::Process_DCL_Pixel()
 		mTypeInstructions.push_back(tokenId); //Result (Id)
 		mTypeInstructions.push_back(spv::StorageClassInput); //Storage Class
 		//Optional initializer
+
+		//Before 3.0 the input registers are the diffuse and specular colors.
+		mDecorateInstructions.push_back(Pack(4, spv::OpDecorate)); //size,Type
+		mDecorateInstructions.push_back(tokenId); //target (Id)
+		mDecorateInstructions.push_back(spv::DecorationLocation); //Decoration Type (Id)
+		mDecorateInstructions.push_back((mMajorVersion >= 3) ? GetUsageLocation(usage, usageIndex) : GetUsageLocation(D3DDECLUSAGE_COLOR, registerNumber)); //Location offset
 		break;
 	case D3DSPR_TEXTURE:
 		resultTypeId = GetSpirVTypeId(spv::OpTypePointer, spv::OpTypeImage);
@@ -865,6 +1288,11 @@ void ShaderConverter::Process_DCL_Vertex()
 
 		resultTypeId = GetSpirVTypeId(typeDescription);
 
+		mDecorateInstructions.push_back(Pack(4, spv::OpDecorate)); //size,Type
+		mDecorateInstructions.push_back(tokenId); //target (Id)
+		mDecorateInstructions.push_back(spv::DecorationLocation); //Decoration Type (Id)
+		mDecorateInstructions.push_back(mConvertedShader.mVertexInputAttributeDescriptionCount); //Location offset
+
 		mTypeInstructions.push_back(Pack(4, spv::OpVariable)); //size,Type
 		mTypeInstructions.push_back(resultTypeId); //ResultType (Id) Must be OpTypePointer with the pointer's type being what you care about.
 		mTypeInstructions.push_back(tokenId); //Result (Id)
@@ -896,6 +1324,8 @@ void ShaderConverter::Process_DCL_Vertex()
 
 		break;
 	case D3DSPR_OUTPUT:
+		typeDescription.StorageClass = spv::StorageClassOutput;
+		mIdTypePairs[tokenId] = typeDescription;
 		resultTypeId = GetSpirVTypeId(typeDescription);
 
 		mTypeInstructions.push_back(Pack(4, spv::OpVariable)); //size,Type
@@ -904,6 +1334,8 @@ void ShaderConverter::Process_DCL_Vertex()
 		mTypeInstructions.push_back(spv::StorageClassOutput); //Storage Class
 		//Optional initializer
 
+		DeclareOutput(registerToken, tokenId, usage, usageIndex);
+
 		if (usage == D3DDECLUSAGE_POSITION)
 		{
 			mPositionRegister = usageIndex; //might need this later.
@@ -1046,6 +1478,7 @@ void ShaderConverter::Process_MOV()
 	//spv::Op dataType;
 	uint32_t dataTypeId;
 	uint32_t argumentId1;
+	uint32_t resultId;
 	//uint32_t argumentId2;
 
 	Token resultToken = GetNextToken();
@@ -1055,15 +1488,25 @@ void ShaderConverter::Process_MOV()
 	_D3DSHADER_PARAM_REGISTER_TYPE argumentRegisterType1 = GetRegisterType(argumentToken1.i);
 
 	typeDescription = GetTypeByRegister(argumentToken1);
-	dataTypeId = GetSpirVTypeId(typeDescription);
 
-	mIdTypePairs[mNextId] = typeDescription; //snag next id before increment.
+	//GetSwizzledId loads registers held in variables so the copy is of the pointed to type.
+	if (typeDescription.PrimaryType == spv::OpTypePointer)
+	{
+		typeDescription.PrimaryType = typeDescription.SecondaryType;
+		typeDescription.SecondaryType = typeDescription.TernaryType;
+		typeDescription.TernaryType = spv::OpTypeVoid;
+		typeDescription.StorageClass = spv::StorageClassInput;
+	}
+	dataTypeId = GetSpirVTypeId(typeDescription);
 
 	argumentId1 = GetSwizzledId(argumentToken1);
 
+	resultId = GetNextVersionId(resultToken);
+	mIdTypePairs[resultId] = typeDescription;
+
 	mFunctionDefinitionInstructions.push_back(Pack(4, spv::OpCopyObject)); //size,Type
 	mFunctionDefinitionInstructions.push_back(dataTypeId); //Result Type (Id)
-	mFunctionDefinitionInstructions.push_back(GetNextVersionId(resultToken)); //result (Id)
+	mFunctionDefinitionInstructions.push_back(resultId); //result (Id)
 	mFunctionDefinitionInstructions.push_back(argumentId1); //argument1 (Id)
 }
 
@@ -1656,6 +2099,7 @@ ConvertedShader ShaderConverter::Convert(uint32_t* shader)
 
 	mFunctionDefinitionInstructions.push_back(Pack(2, spv::OpLabel)); //size,Type
 	mFunctionDefinitionInstructions.push_back(GetNextId()); //result (Id)
+	size_t entryBlockStart = mFunctionDefinitionInstructions.size();
 
 	//Read DXBC instructions
 	while (token != D3DPS_END())
@@ -1922,6 +2366,11 @@ ConvertedShader ShaderConverter::Convert(uint32_t* shader)
 
 	}
 
+	//The constant registers are only known once every instruction has been read so their access chains are put ahead of the first use.
+	mFunctionDefinitionInstructions.insert(mFunctionDefinitionInstructions.begin() + entryBlockStart, std::begin(mUniformAccessInstructions), std::end(mUniformAccessInstructions));
+
+	StoreOutputs();
+
 	//End of entry point
 	mFunctionDefinitionInstructions.push_back(Pack(1, spv::OpReturn)); //size,Type
 	mFunctionDefinitionInstructions.push_back(Pack(1, spv::OpFunctionEnd)); //size,Type
@@ -1973,7 +2422,7 @@ ConvertedShader ShaderConverter::Convert(uint32_t* shader)
 	{
 		mExecutionModeInstructions.push_back(Pack(3, spv::OpExecutionMode)); //size,Type
 		mExecutionModeInstructions.push_back(mEntryPointId); //Entry Point (Id)
-		mExecutionModeInstructions.push_back(spv::ExecutionModeOriginLowerLeft); //Execution Mode
+		mExecutionModeInstructions.push_back(spv::ExecutionModeOriginUpperLeft); //Execution Mode (Vulkan only allows upper left)
 	}
 	else
 	{
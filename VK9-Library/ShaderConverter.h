@@ -41,6 +41,22 @@ https://github.com/ValveSoftware/ToGL
     ((uint32_t)(uint8_t)(c2) << 8) | \
     ((uint32_t)(uint8_t)(c3)))
 
+#define MAX_VERTEX_SHADER_FLOAT_CONSTANTS 256
+#define MAX_PIXEL_SHADER_FLOAT_CONSTANTS 224
+#define MAX_SHADER_INTEGER_CONSTANTS 16
+#define MAX_SHADER_BOOLEAN_CONSTANTS 16
+#define SHADER_CONSTANT_BINDING 16 //First binding of the constant blocks. The converter numbers its samplers from 0 so they can't collide.
+
+//The blocks of the shader constants. Each is its own dynamic uniform buffer binding so a draw only uploads the blocks that changed.
+enum ShaderConstantBlock
+{
+	SHADER_CONSTANT_VERTEX_FLOAT = 0,
+	SHADER_CONSTANT_VERTEX_INTEGER = 1, //Integer and boolean constants.
+	SHADER_CONSTANT_PIXEL_FLOAT = 2,
+	SHADER_CONSTANT_PIXEL_INTEGER = 3,
+	SHADER_CONSTANT_BLOCK_COUNT = 4
+};
+
 struct ConvertedShader
 {
 	UINT Size = 0;
@@ -96,16 +112,34 @@ struct TypeDescription
 	spv::Op SecondaryType = spv::OpTypeVoid;
 	spv::Op TernaryType = spv::OpTypeVoid;
 	uint32_t ComponentCount = 0;
+	spv::StorageClass StorageClass = spv::StorageClassInput; //Only used by pointers.
 	std::vector<uint32_t> Arguments;
 
 	bool operator ==(const TypeDescription &value) const
 	{
-		return this->PrimaryType == value.PrimaryType && this->SecondaryType == value.SecondaryType && this->TernaryType == value.TernaryType && this->ComponentCount == value.ComponentCount;
+		return this->PrimaryType == value.PrimaryType && this->SecondaryType == value.SecondaryType && this->TernaryType == value.TernaryType && this->ComponentCount == value.ComponentCount
+			&& (this->PrimaryType != spv::OpTypePointer || this->StorageClass == value.StorageClass);
 	}
 
 	bool operator <(const TypeDescription &value) const
 	{
-		return this->PrimaryType < value.PrimaryType || this->SecondaryType < value.SecondaryType || this->TernaryType < value.TernaryType || this->ComponentCount < value.ComponentCount;
+		if (this->PrimaryType != value.PrimaryType)
+		{
+			return this->PrimaryType < value.PrimaryType;
+		}
+		if (this->SecondaryType != value.SecondaryType)
+		{
+			return this->SecondaryType < value.SecondaryType;
+		}
+		if (this->TernaryType != value.TernaryType)
+		{
+			return this->TernaryType < value.TernaryType;
+		}
+		if (this->ComponentCount != value.ComponentCount)
+		{
+			return this->ComponentCount < value.ComponentCount;
+		}
+		return this->PrimaryType == spv::OpTypePointer && this->StorageClass < value.StorageClass;
 	}
 };
 
@@ -197,6 +231,14 @@ private:
 	std::vector<uint32_t> mTypeInstructions;
 	std::vector<uint32_t> mFunctionDeclarationInstructions;
 	std::vector<uint32_t> mFunctionDefinitionInstructions;
+	std::vector<uint32_t> mUniformAccessInstructions; //Access chains to the constant registers. They go at the top of the entry point so any instruction can use them.
+
+	boost::container::flat_map<uint32_t, uint32_t> mIndexIds; //Unsigned constants used as access chain indices.
+	uint32_t mFloatConstantsId = 0;
+	uint32_t mIntegerConstantsId = 0;
+
+	boost::container::flat_map<D3DSHADER_PARAM_REGISTER_TYPE, boost::container::flat_map<uint32_t, uint32_t> > mOutputIdsByRegister; //Output variables. The last value written to the register is stored to them at the end of the entry point.
+	uint32_t mPositionId = 0;
 
 	uint32_t* mBaseToken = nullptr;
 	uint32_t* mNextToken = nullptr;
@@ -230,6 +272,11 @@ private:
 	void SetIdByRegister(const Token& token, uint32_t id);
 	TypeDescription GetTypeByRegister(const Token& token);
 	uint32_t GetSwizzledId(const Token& token, uint32_t inputId = UINT_MAX);
+	uint32_t GetIndexId(uint32_t index);
+	uint32_t GetConstantBlockId(bool isInteger);
+	uint32_t GetUsageLocation(uint32_t usage, uint32_t usageIndex);
+	void DeclareOutput(const Token& token, uint32_t id, uint32_t usage, uint32_t usageIndex);
+	void StoreOutputs();
 
 	void CombineSpirVOpCodes();
 	void CreateSpirVModule();
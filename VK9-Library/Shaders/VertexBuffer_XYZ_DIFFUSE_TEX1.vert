@@ -28,7 +28,7 @@ misrepresented as being the original software.
 
 layout(std140,binding = 0) uniform LightBlock
 {
-	Light lights[lightCount];
+	Light lights[LIGHT_ARRAY_SIZE];
 };
 
 layout(binding = 1) uniform MaterialBlock
@@ -36,6 +36,11 @@ layout(binding = 1) uniform MaterialBlock
 	Material material;
 };
 
+layout(std140,binding = 3) uniform RenderStateBlock
+{
+	RenderState renderState;
+};
+
 layout(push_constant) uniform UniformBufferObject {
     mat4 totalTransformation;
 	mat4 modelTransformation;
@@ -53,12 +58,14 @@ layout (location = 4) out vec2 texcoord;
 out gl_PerVertex 
 {
         vec4 gl_Position;
+        float gl_PointSize;
 };
 
 void main() 
 {	
 	gl_Position = ubo.totalTransformation * vec4(position,1.0);
 	gl_Position *= vec4(1.0,-1.0,1.0,1.0);
+	gl_PointSize = renderState.pointSize;
 
 	texcoord = attr2;
 
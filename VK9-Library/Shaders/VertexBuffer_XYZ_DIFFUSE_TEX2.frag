@@ -21,6 +21,9 @@ misrepresented as being the original software.
 #version 400
 #extension GL_ARB_separate_shader_objects : enable
 #extension GL_ARB_shading_language_420pack : enable
+#ifdef BINDLESS_TEXTURES
+#extension GL_EXT_nonuniform_qualifier : enable
+#endif
 
 #include "Constants"
 #include "Structures"
@@ -28,7 +31,7 @@ misrepresented as being the original software.
 
 layout(std140,binding = 0) uniform LightBlock
 {
-	Light lights[lightCount];
+	Light lights[LIGHT_ARRAY_SIZE];
 };
 
 layout(binding = 1) uniform MaterialBlock
@@ -36,13 +39,25 @@ layout(binding = 1) uniform MaterialBlock
 	Material material;
 };
 
-layout(binding = 2) uniform sampler2D textures[textureCount];
+layout(std140,binding = 3) uniform RenderStateBlock
+{
+	RenderState renderState;
+};
+
+#ifndef BINDLESS_TEXTURES
+layout(binding = 2) uniform sampler2D textures[2];
+#endif
 
 layout(push_constant) uniform UniformBufferObject {
     mat4 totalTransformation;
 	mat4 modelTransformation;
+#ifdef BINDLESS_TEXTURES
+	uint textureSlots[16];
+#endif
 } ubo;
 
+#include "BindlessTextures"
+
 layout (location = 0) in vec4 diffuseColor;
 layout (location = 1) in vec4 ambientColor;
 layout (location = 2) in vec4 specularColor;
@@ -76,7 +91,7 @@ void main()
 
 	if(textureCount>0)
 	{
-		processStage(textures[0],texureCoordinateIndex_0, Constant_0, Result_0,
+		processStage(STAGE_TEXTURE(0),texureCoordinateIndex_0, Constant_0, Result_0,
 		result, temp, result, temp,
 		colorOperation_0, colorArgument1_0, colorArgument2_0, colorArgument0_0,
 		alphaOperation_0, alphaArgument1_0, alphaArgument2_0, alphaArgument0_0);
@@ -84,7 +99,7 @@ void main()
 
 	if(textureCount>1)
 	{
-		processStage(textures[1],texureCoordinateIndex_1, Constant_1, Result_1,
+		processStage(STAGE_TEXTURE(1),texureCoordinateIndex_1, Constant_1, Result_1,
 		result, temp, result, temp,
 		colorOperation_1, colorArgument1_1, colorArgument2_1, colorArgument0_1,
 		alphaOperation_1, alphaArgument1_1, alphaArgument2_1, alphaArgument0_1);
@@ -21,6 +21,9 @@ misrepresented as being the original software.
 #version 400
 #extension GL_ARB_separate_shader_objects : enable
 #extension GL_ARB_shading_language_420pack : enable
+#ifdef BINDLESS_TEXTURES
+#extension GL_EXT_nonuniform_qualifier : enable
+#endif
 
 #include "Constants"
 #include "Structures"
@@ -28,7 +31,7 @@ misrepresented as being the original software.
 
 layout(std140,binding = 0) uniform LightBlock
 {
-	Light lights[lightCount];
+	Light lights[LIGHT_ARRAY_SIZE];
 };
 
 layout(binding = 1) uniform MaterialBlock
@@ -36,13 +39,25 @@ layout(binding = 1) uniform MaterialBlock
 	Material material;
 };
 
+layout(std140,binding = 3) uniform RenderStateBlock
+{
+	RenderState renderState;
+};
+
+#ifndef BINDLESS_TEXTURES
 layout(binding = 2) uniform sampler2D textures[1];
+#endif
 
 layout(push_constant) uniform UniformBufferObject {
     mat4 totalTransformation;
 	mat4 modelTransformation;
+#ifdef BINDLESS_TEXTURES
+	uint textureSlots[16];
+#endif
 } ubo;
 
+#include "BindlessTextures"
+
 layout (location = 0) in vec4 diffuseColor;
 layout (location = 1) in vec4 ambientColor;
 layout (location = 2) in vec4 specularColor;
@@ -75,7 +90,7 @@ void main()
 
 	if(textureCount>0)
 	{
-		processStage(textures[0],texureCoordinateIndex_0, Constant_0, Result_0,
+		processStage(STAGE_TEXTURE(0),texureCoordinateIndex_0, Constant_0, Result_0,
 		result, temp, result, temp,
 		colorOperation_0, colorArgument1_0, colorArgument2_0, colorArgument0_0,
 		alphaOperation_0, alphaArgument1_0, alphaArgument2_0, alphaArgument0_0);
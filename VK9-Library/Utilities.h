@@ -366,6 +366,21 @@ inline VkPrimitiveTopology ConvertPrimitiveType(D3DPRIMITIVETYPE input)
 	return output;
 }
 
+//With dynamic topology a pipeline only fixes the topology class so every type is keyed by the list of its class.
+inline D3DPRIMITIVETYPE ConvertPrimitiveTypeToClass(D3DPRIMITIVETYPE input)
+{
+	switch (input)
+	{
+	case D3DPT_POINTLIST:
+		return D3DPT_POINTLIST;
+	case D3DPT_LINELIST:
+	case D3DPT_LINESTRIP:
+		return D3DPT_LINELIST;
+	default:
+		return D3DPT_TRIANGLELIST;
+	}
+}
+
 inline bool GetMemoryTypeFromProperties(const VkPhysicalDeviceMemoryProperties& deviceMemoryProperties, uint32_t typeBits, VkFlags requirements_mask, uint32_t *typeIndex)
 {
 	// Search memtypes to find first index with those properties
@@ -25,6 +25,7 @@
 #include <d3d9.h>
 #include <d3dx9.h>
 #include "resource.h"
+#include "Scenarios.h"
 
 //-----------------------------------------------------------------------------
 // GLOBALS
@@ -123,6 +124,18 @@ int WINAPI WinMain(HINSTANCE hInstance,
 	UpdateWindow(g_hWnd);
 
 	init();
+
+	//A scenario name on the command line runs that scenario instead of the sample and exits with its result.
+	if (lpCmdLine != NULL && lpCmdLine[0] != '\0')
+	{
+		int result = RunScenario(g_pd3dDevice, lpCmdLine);
+
+		shutDown();
+		UnregisterClass("MY_WINDOWS_CLASS", winClass.hInstance);
+
+		return result;
+	}
+
 	initShader();
 
 	while (uMsg.message != WM_QUIT)
@@ -0,0 +1,1796 @@
+/*
+Copyright(c) 2016 Christopher Joseph Dean Schaefer
+
+This software is provided 'as-is', without any express or implied
+warranty.In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions :
+
+1. The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software.If you use this software
+in a product, an acknowledgement in the product documentation would be
+appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+
+#define STRICT
+#define WIN32_LEAN_AND_MEAN
+
+#include <windows.h>
+#include <d3d9.h>
+#include <d3dx9.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+
+#include "Scenarios.h"
+#include "../VK9-Library/DeviceStatistics.h"
+
+typedef HRESULT(WINAPI *VK9GetDeviceStatisticsFunction)(IDirect3DDevice9* device, DeviceStatistics* statistics);
+
+struct ScenarioVertex
+{
+	float x, y, z;
+	float nx, ny, nz;
+	DWORD color;
+};
+
+#define SCENARIO_FVF (D3DFVF_XYZ | D3DFVF_NORMAL | D3DFVF_DIFFUSE)
+
+ScenarioVertex g_scenarioQuad[] =
+{
+	{ -1.0f, 1.0f, 0.0f, 0.0f, 0.0f, -1.0f, 0xffffff00 },
+	{ 1.0f, 1.0f, 0.0f, 0.0f, 0.0f, -1.0f, 0xff00ff00 },
+	{ -1.0f,-1.0f, 0.0f, 0.0f, 0.0f, -1.0f, 0xffff0000 },
+	{ 1.0f,-1.0f, 0.0f, 0.0f, 0.0f, -1.0f, 0xff0000ff }
+};
+
+void Report(const char* format, ...)
+{
+	char message[1024];
+
+	va_list arguments;
+	va_start(arguments, format);
+	vsnprintf(message, sizeof(message), format, arguments);
+	va_end(arguments);
+
+	OutputDebugString(message);
+	OutputDebugString("\n");
+
+	FILE* file = fopen("Scenarios.log", "a");
+	if (file != NULL)
+	{
+		fprintf(file, "%s\n", message);
+		fclose(file);
+	}
+}
+
+bool GetStatistics(IDirect3DDevice9* device, DeviceStatistics& statistics)
+{
+	static VK9GetDeviceStatisticsFunction getDeviceStatistics = (VK9GetDeviceStatisticsFunction)GetProcAddress(GetModuleHandle("d3d9.dll"), "VK9GetDeviceStatistics");
+
+	if (getDeviceStatistics == NULL)
+	{
+		Report("The loaded d3d9.dll doesn't export VK9GetDeviceStatistics so it isn't VK9.");
+		return false;
+	}
+
+	return SUCCEEDED(getDeviceStatistics(device, &statistics));
+}
+
+//Keeps the window responsive while a scenario renders without the main loop.
+void PumpMessages()
+{
+	MSG message;
+	while (PeekMessage(&message, NULL, 0, 0, PM_REMOVE))
+	{
+		TranslateMessage(&message);
+		DispatchMessage(&message);
+	}
+}
+
+IDirect3DVertexBuffer9* CreateQuad(IDirect3DDevice9* device)
+{
+	IDirect3DVertexBuffer9* vertexBuffer = NULL;
+	void* vertices = NULL;
+
+	if (FAILED(device->CreateVertexBuffer(sizeof(g_scenarioQuad), D3DUSAGE_WRITEONLY, SCENARIO_FVF, D3DPOOL_DEFAULT, &vertexBuffer, NULL)))
+	{
+		return NULL;
+	}
+
+	if (FAILED(vertexBuffer->Lock(0, sizeof(g_scenarioQuad), &vertices, 0)))
+	{
+		vertexBuffer->Release();
+		return NULL;
+	}
+	memcpy(vertices, g_scenarioQuad, sizeof(g_scenarioQuad));
+	vertexBuffer->Unlock();
+
+	device->SetFVF(SCENARIO_FVF);
+	device->SetStreamSource(0, vertexBuffer, 0, sizeof(ScenarioVertex));
+
+	D3DXMATRIX projection;
+	D3DXMATRIX view;
+	D3DXMatrixPerspectiveFovLH(&projection, D3DXToRadian(45.0f), 640.0f / 480.0f, 0.1f, 100.0f);
+	D3DXMatrixIdentity(&view);
+	device->SetTransform(D3DTS_PROJECTION, &projection);
+	device->SetTransform(D3DTS_VIEW, &view);
+
+	return vertexBuffer;
+}
+
+void SetWorld(IDirect3DDevice9* device, int draw)
+{
+	D3DXMATRIX world;
+	D3DXMatrixTranslation(&world, (float)(draw % 8) - 3.5f, (float)(draw / 8 % 8) - 3.5f, 12.0f);
+	device->SetTransform(D3DTS_WORLD, &world);
+}
+
+void ReleaseTextures(IDirect3DTexture9** textures, int count)
+{
+	for (int i = 0; i < count; i++)
+	{
+		if (textures[i] != NULL)
+		{
+			textures[i]->Release();
+			textures[i] = NULL;
+		}
+	}
+}
+
+//Creates count small textures that each have their own colour. Nothing is left behind when one of them can't be created.
+bool CreateTextures(IDirect3DDevice9* device, IDirect3DTexture9** textures, int count)
+{
+	for (int i = 0; i < count; i++)
+	{
+		D3DLOCKED_RECT lockedRect = {};
+
+		textures[i] = NULL;
+		if (FAILED(device->CreateTexture(4, 4, 1, 0, D3DFMT_X8R8G8B8, D3DPOOL_MANAGED, &textures[i], NULL)) || FAILED(textures[i]->LockRect(0, &lockedRect, NULL, 0)))
+		{
+			ReleaseTextures(textures, i + 1);
+			return false;
+		}
+
+		for (int y = 0; y < 4; y++)
+		{
+			DWORD* row = (DWORD*)((BYTE*)lockedRect.pBits + y * lockedRect.Pitch);
+			for (int x = 0; x < 4; x++)
+			{
+				row[x] = D3DCOLOR_XRGB(i * 37 % 256, i * 91 % 256, i * 13 % 256);
+			}
+		}
+
+		textures[i]->UnlockRect(0);
+	}
+
+	return true;
+}
+
+/*
+Draws the same mix of state every frame. Once every combination has been drawn and the frames in flight have cycled the buffer manager should reuse its draw and resource contexts instead of allocating new ones.
+The library counts its operator new calls so the draw loops of the measured frames also have to leave the heap alone.
+Arguments: [warm up frames] [measured frames]
+*/
+int ContextAllocations(IDirect3DDevice9* device, const char* arguments)
+{
+	int warmUpFrames = 60;
+	int measuredFrames = 300;
+	sscanf(arguments, "%d %d", &warmUpFrames, &measuredFrames);
+
+	IDirect3DVertexBuffer9* vertexBuffer = CreateQuad(device);
+	if (vertexBuffer == NULL)
+	{
+		Report("ContextAllocations couldn't create its vertex buffer.");
+		return SCENARIO_ERROR;
+	}
+
+	device->SetRenderState(D3DRS_LIGHTING, FALSE);
+
+	DeviceStatistics warm = {};
+	DeviceStatistics measured = {};
+	DeviceStatistics beforeDraws = {};
+	DeviceStatistics afterDraws = {};
+	unsigned long long drawLoopAllocations = 0;
+	int result = SCENARIO_PASSED;
+
+	for (int frame = 0; frame < warmUpFrames + measuredFrames; frame++)
+	{
+		if (frame == warmUpFrames && !GetStatistics(device, warm))
+		{
+			result = SCENARIO_ERROR;
+			break;
+		}
+
+		PumpMessages();
+
+		device->Clear(0, NULL, D3DCLEAR_TARGET | D3DCLEAR_ZBUFFER, D3DCOLOR_XRGB(0, 0, 0), 1.0f, 0);
+		device->BeginScene();
+
+		//Present and clear may allocate so only the draw loop is counted.
+		if (frame >= warmUpFrames && !GetStatistics(device, beforeDraws))
+		{
+			result = SCENARIO_ERROR;
+			break;
+		}
+
+		for (int draw = 0; draw < 16; draw++)
+		{
+			device->SetRenderState(D3DRS_CULLMODE, (draw & 1) ? D3DCULL_NONE : D3DCULL_CCW);
+			device->SetRenderState(D3DRS_ALPHABLENDENABLE, (draw & 2) ? TRUE : FALSE);
+			device->SetRenderState(D3DRS_ZFUNC, (draw & 4) ? D3DCMP_LESSEQUAL : D3DCMP_ALWAYS);
+			device->SetRenderState(D3DRS_ZWRITEENABLE, (draw & 8) ? TRUE : FALSE);
+			SetWorld(device, draw);
+
+			if (FAILED(device->DrawPrimitive(D3DPT_TRIANGLESTRIP, 0, 2)))
+			{
+				result = SCENARIO_ERROR;
+			}
+		}
+
+		if (frame >= warmUpFrames)
+		{
+			if (!GetStatistics(device, afterDraws))
+			{
+				result = SCENARIO_ERROR;
+				break;
+			}
+			drawLoopAllocations += afterDraws.HeapAllocations - beforeDraws.HeapAllocations;
+		}
+
+		device->EndScene();
+		if (FAILED(device->Present(NULL, NULL, NULL, NULL)))
+		{
+			result = SCENARIO_ERROR;
+		}
+	}
+
+	if (result == SCENARIO_PASSED && !GetStatistics(device, measured))
+	{
+		result = SCENARIO_ERROR;
+	}
+
+	vertexBuffer->Release();
+
+	if (result != SCENARIO_PASSED)
+	{
+		Report("ContextAllocations failed to render.");
+		return result;
+	}
+
+	Report("ContextAllocations heap allocations: %llu in the draw loops of %d frames.", drawLoopAllocations, measuredFrames);
+
+	Report("ContextAllocations draw contexts: %llu after %d warm up frames, %llu after %d more.", warm.DrawContextAllocations, warmUpFrames, measured.DrawContextAllocations, measuredFrames);
+	Report("ContextAllocations resource contexts: %llu after %d warm up frames, %llu after %d more.", warm.ResourceContextAllocations, warmUpFrames, measured.ResourceContextAllocations, measuredFrames);
+
+	if (measured.DrawContextAllocations != warm.DrawContextAllocations || measured.ResourceContextAllocations != warm.ResourceContextAllocations)
+	{
+		Report("ContextAllocations failed: steady state draws allocated contexts.");
+		return SCENARIO_FAILED;
+	}
+
+	if (drawLoopAllocations != 0)
+	{
+		Report("ContextAllocations failed: steady state draws allocated from the heap.");
+		return SCENARIO_FAILED;
+	}
+
+	Report("ContextAllocations passed.");
+	return SCENARIO_PASSED;
+}
+
+/*
+Switches the texture, filters and address mode of stage 0 on every draw, cycling through twelve samplers.
+Once every sampler has been created the stage lookups should all hit the sampler cache and the draw loops should leave the heap alone.
+Arguments: [warm up frames] [measured frames] [draws per frame]
+*/
+int SamplerChurn(IDirect3DDevice9* device, const char* arguments)
+{
+	const int textureCount = 4;
+	const DWORD filters[] = { D3DTEXF_POINT, D3DTEXF_LINEAR };
+	const DWORD addressModes[] = { D3DTADDRESS_WRAP, D3DTADDRESS_MIRROR, D3DTADDRESS_CLAMP };
+
+	int warmUpFrames = 10;
+	int measuredFrames = 100;
+	int drawsPerFrame = 96;
+	sscanf(arguments, "%d %d %d", &warmUpFrames, &measuredFrames, &drawsPerFrame);
+
+	IDirect3DTexture9* textures[textureCount] = {};
+	IDirect3DVertexBuffer9* vertexBuffer = CreateQuad(device);
+	if (vertexBuffer == NULL || !CreateTextures(device, textures, textureCount))
+	{
+		if (vertexBuffer != NULL)
+		{
+			vertexBuffer->Release();
+		}
+		Report("SamplerChurn couldn't create its vertex buffer and textures.");
+		return SCENARIO_ERROR;
+	}
+
+	device->SetRenderState(D3DRS_LIGHTING, FALSE);
+	device->SetRenderState(D3DRS_CULLMODE, D3DCULL_NONE);
+
+	DeviceStatistics warm = {};
+	DeviceStatistics measured = {};
+	DeviceStatistics beforeDraws = {};
+	DeviceStatistics afterDraws = {};
+	unsigned long long drawLoopAllocations = 0;
+	int result = SCENARIO_PASSED;
+
+	for (int frame = 0; frame < warmUpFrames + measuredFrames && result == SCENARIO_PASSED; frame++)
+	{
+		if (frame == warmUpFrames && !GetStatistics(device, warm))
+		{
+			result = SCENARIO_ERROR;
+			break;
+		}
+
+		PumpMessages();
+
+		device->Clear(0, NULL, D3DCLEAR_TARGET | D3DCLEAR_ZBUFFER, D3DCOLOR_XRGB(0, 0, 0), 1.0f, 0);
+		device->BeginScene();
+
+		if (frame >= warmUpFrames && !GetStatistics(device, beforeDraws))
+		{
+			result = SCENARIO_ERROR;
+			break;
+		}
+
+		for (int draw = 0; draw < drawsPerFrame; draw++)
+		{
+			device->SetTexture(0, textures[draw % textureCount]);
+			device->SetSamplerState(0, D3DSAMP_MINFILTER, filters[draw / 4 % 2]);
+			device->SetSamplerState(0, D3DSAMP_MAGFILTER, filters[draw / 8 % 2]);
+			device->SetSamplerState(0, D3DSAMP_ADDRESSU, addressModes[draw / 16 % 3]);
+			SetWorld(device, draw);
+
+			if (FAILED(device->DrawPrimitive(D3DPT_TRIANGLESTRIP, 0, 2)))
+			{
+				result = SCENARIO_ERROR;
+			}
+		}
+
+		if (frame >= warmUpFrames)
+		{
+			if (!GetStatistics(device, afterDraws))
+			{
+				result = SCENARIO_ERROR;
+				break;
+			}
+			drawLoopAllocations += afterDraws.HeapAllocations - beforeDraws.HeapAllocations;
+		}
+
+		device->EndScene();
+		if (FAILED(device->Present(NULL, NULL, NULL, NULL)))
+		{
+			result = SCENARIO_ERROR;
+		}
+	}
+
+	if (result == SCENARIO_PASSED && !GetStatistics(device, measured))
+	{
+		result = SCENARIO_ERROR;
+	}
+
+	device->SetTexture(0, NULL);
+	ReleaseTextures(textures, textureCount);
+	vertexBuffer->Release();
+
+	if (result != SCENARIO_PASSED)
+	{
+		Report("SamplerChurn failed to render.");
+		return result;
+	}
+
+	Report("SamplerChurn %d measured frames: %llu sampler cache hits, %llu misses and %llu heap allocations in the draw loops.", measuredFrames, measured.SamplerCacheHits - warm.SamplerCacheHits, measured.SamplerCacheMisses - warm.SamplerCacheMisses, drawLoopAllocations);
+
+	if (measured.SamplerCacheMisses != warm.SamplerCacheMisses)
+	{
+		Report("SamplerChurn failed: steady state draws created samplers.");
+		return SCENARIO_FAILED;
+	}
+
+	if (measured.SamplerCacheHits == warm.SamplerCacheHits)
+	{
+		Report("SamplerChurn failed: the stages never looked their samplers up.");
+		return SCENARIO_FAILED;
+	}
+
+	if (drawLoopAllocations != 0)
+	{
+		Report("SamplerChurn failed: steady state draws allocated from the heap.");
+		return SCENARIO_FAILED;
+	}
+
+	Report("SamplerChurn passed.");
+	return SCENARIO_PASSED;
+}
+
+/*
+Binds a different pair of textures to stages 0 and 1 for every draw, 5,000 unique bindings per frame by default, and repeats the same bindings every frame.
+Reports the descriptor set hits, misses, allocations and pools of the measured frames.
+With the cached allocator they should all hit sets written in the warm up frames. The linear allocator writes each frame's sets again but shouldn't need more pools.
+Push descriptors and bindless textures keep fixed function draws off descriptor sets so then only the allocations are checked.
+Arguments: [warm up frames] [measured frames] [draws per frame] [textures]
+*/
+int DescriptorChurn(IDirect3DDevice9* device, const char* arguments)
+{
+	int warmUpFrames = 4;
+	int measuredFrames = 8;
+	int drawsPerFrame = 5000;
+	int textureCount = 100;
+	sscanf(arguments, "%d %d %d %d", &warmUpFrames, &measuredFrames, &drawsPerFrame, &textureCount);
+	textureCount = max(textureCount, 2);
+	drawsPerFrame = min(drawsPerFrame, textureCount * (textureCount - 1)); //Every draw still gets its own pair.
+
+	IDirect3DTexture9** textures = new IDirect3DTexture9*[textureCount];
+	IDirect3DVertexBuffer9* vertexBuffer = CreateQuad(device);
+	if (vertexBuffer == NULL || !CreateTextures(device, textures, textureCount))
+	{
+		if (vertexBuffer != NULL)
+		{
+			vertexBuffer->Release();
+		}
+		delete[] textures;
+		Report("DescriptorChurn couldn't create its vertex buffer and textures.");
+		return SCENARIO_ERROR;
+	}
+
+	device->SetRenderState(D3DRS_LIGHTING, FALSE);
+	device->SetRenderState(D3DRS_CULLMODE, D3DCULL_NONE);
+
+	DeviceStatistics warm = {};
+	DeviceStatistics measured = {};
+	int result = SCENARIO_PASSED;
+
+	for (int frame = 0; frame < warmUpFrames + measuredFrames && result == SCENARIO_PASSED; frame++)
+	{
+		if (frame == warmUpFrames && !GetStatistics(device, warm))
+		{
+			result = SCENARIO_ERROR;
+			break;
+		}
+
+		PumpMessages();
+
+		device->Clear(0, NULL, D3DCLEAR_TARGET | D3DCLEAR_ZBUFFER, D3DCOLOR_XRGB(0, 0, 0), 1.0f, 0);
+		device->BeginScene();
+
+		for (int draw = 0; draw < drawsPerFrame; draw++)
+		{
+			//The first texture runs through all of them before the second one moves on so no pair repeats within a frame.
+			int first = draw % textureCount;
+			int second = (first + draw / textureCount + 1) % textureCount;
+
+			device->SetTexture(0, textures[first]);
+			device->SetTexture(1, textures[second]);
+			SetWorld(device, draw);
+
+			if (FAILED(device->DrawPrimitive(D3DPT_TRIANGLESTRIP, 0, 2)))
+			{
+				result = SCENARIO_ERROR;
+			}
+		}
+
+		device->EndScene();
+		if (FAILED(device->Present(NULL, NULL, NULL, NULL)))
+		{
+			result = SCENARIO_ERROR;
+		}
+	}
+
+	if (result == SCENARIO_PASSED && !GetStatistics(device, measured))
+	{
+		result = SCENARIO_ERROR;
+	}
+
+	device->SetTexture(0, NULL);
+	device->SetTexture(1, NULL);
+	ReleaseTextures(textures, textureCount);
+	delete[] textures;
+	vertexBuffer->Release();
+
+	if (result != SCENARIO_PASSED)
+	{
+		Report("DescriptorChurn failed to render.");
+		return result;
+	}
+
+	unsigned long long hits = measured.DescriptorSetHits - warm.DescriptorSetHits;
+	unsigned long long misses = measured.DescriptorSetMisses - warm.DescriptorSetMisses;
+	unsigned long long allocations = measured.DescriptorSetAllocations - warm.DescriptorSetAllocations;
+
+	Report("DescriptorChurn %d measured frames of %d unique bindings: %llu set hits, %llu misses and %llu allocations, %llu pools after warm up and %llu at the end, %llu pushes.",
+		measuredFrames, drawsPerFrame, hits, misses, allocations, warm.DescriptorPools, measured.DescriptorPools, measured.PushDescriptorCount - warm.PushDescriptorCount);
+
+	if (measured.DescriptorPools != warm.DescriptorPools)
+	{
+		Report("DescriptorChurn failed: steady state frames chained more descriptor pools.");
+		return SCENARIO_FAILED;
+	}
+
+	if (hits == 0 && misses == 0)
+	{
+		if (allocations != 0)
+		{
+			Report("DescriptorChurn failed: draws without descriptor sets still allocated them.");
+			return SCENARIO_FAILED;
+		}
+	}
+	else if (hits != 0 && (misses != 0 || allocations != 0))
+	{
+		Report("DescriptorChurn failed: bindings seen in the warm up frames missed the descriptor set cache.");
+		return SCENARIO_FAILED;
+	}
+
+	Report("DescriptorChurn passed.");
+	return SCENARIO_PASSED;
+}
+
+/*
+Animates the render states that only feed dynamic state or the render state buffer and checks that no new pipelines are created.
+Texture factor, ambient, point size, blend factor, stencil reference, stencil masks and depth bias get a new value every draw.
+Then animates the stage 0 color operation, which is still part of the pipeline key, so the two pipeline counts can be compared.
+Arguments: [frames per pass] [draws per frame]
+*/
+int RenderStateAnimation(IDirect3DDevice9* device, const char* arguments)
+{
+	const DWORD colorOperations[] = { D3DTOP_SELECTARG1, D3DTOP_SELECTARG2, D3DTOP_MODULATE, D3DTOP_MODULATE2X, D3DTOP_ADD, D3DTOP_SUBTRACT };
+	const int colorOperationCount = sizeof(colorOperations) / sizeof(colorOperations[0]);
+
+	int frames = 16;
+	int drawsPerFrame = 500;
+	sscanf(arguments, "%d %d", &frames, &drawsPerFrame);
+
+	IDirect3DVertexBuffer9* vertexBuffer = CreateQuad(device);
+	if (vertexBuffer == NULL)
+	{
+		Report("RenderStateAnimation couldn't create its vertex buffer.");
+		return SCENARIO_ERROR;
+	}
+
+	device->SetRenderState(D3DRS_LIGHTING, FALSE);
+	device->SetRenderState(D3DRS_CULLMODE, D3DCULL_NONE);
+	device->SetTextureStageState(0, D3DTSS_COLORARG1, D3DTA_TFACTOR);
+	device->SetTextureStageState(0, D3DTSS_COLORARG2, D3DTA_DIFFUSE);
+
+	DeviceStatistics before = {};
+	DeviceStatistics animated = {};
+	DeviceStatistics after = {};
+	int result = SCENARIO_PASSED;
+
+	//The first frame creates the pipeline the animated states should keep using, the second pass animates the contrast state.
+	for (int pass = 0; pass < 3 && result == SCENARIO_PASSED; pass++)
+	{
+		int passFrames = (pass == 0) ? 1 : frames;
+
+		for (int frame = 0; frame < passFrames && result == SCENARIO_PASSED; frame++)
+		{
+			PumpMessages();
+
+			device->Clear(0, NULL, D3DCLEAR_TARGET | D3DCLEAR_ZBUFFER, D3DCOLOR_XRGB(0, 0, 0), 1.0f, 0);
+			device->BeginScene();
+
+			for (int draw = 0; draw < drawsPerFrame; draw++)
+			{
+				DWORD value = (DWORD)(frame * drawsPerFrame + draw);
+
+				if (pass == 1)
+				{
+					float pointSize = 1.0f + (float)(value % 64);
+					float depthBias = (float)(value % 256) * -0.00001f;
+
+					device->SetRenderState(D3DRS_TEXTUREFACTOR, D3DCOLOR_XRGB(value % 256, (value / 256) % 256, 255 - value % 256));
+					device->SetRenderState(D3DRS_AMBIENT, D3DCOLOR_XRGB(255 - value % 256, value % 256, 0));
+					device->SetRenderState(D3DRS_POINTSIZE, *(DWORD*)&pointSize);
+					device->SetRenderState(D3DRS_BLENDFACTOR, D3DCOLOR_XRGB(value % 256, 0, value % 256));
+					device->SetRenderState(D3DRS_STENCILREF, value % 256);
+					device->SetRenderState(D3DRS_STENCILMASK, ~value);
+					device->SetRenderState(D3DRS_STENCILWRITEMASK, value);
+					device->SetRenderState(D3DRS_DEPTHBIAS, *(DWORD*)&depthBias);
+				}
+				else if (pass == 2)
+				{
+					device->SetTextureStageState(0, D3DTSS_COLOROP, colorOperations[value % colorOperationCount]);
+				}
+
+				SetWorld(device, draw);
+
+				if (FAILED(device->DrawPrimitive(D3DPT_TRIANGLESTRIP, 0, 2)))
+				{
+					result = SCENARIO_ERROR;
+				}
+			}
+
+			device->EndScene();
+			if (FAILED(device->Present(NULL, NULL, NULL, NULL)))
+			{
+				result = SCENARIO_ERROR;
+			}
+		}
+
+		if (result == SCENARIO_PASSED && !GetStatistics(device, (pass == 0) ? before : (pass == 1) ? animated : after))
+		{
+			result = SCENARIO_ERROR;
+		}
+	}
+
+	float defaultPointSize = 1.0f;
+	device->SetRenderState(D3DRS_POINTSIZE, *(DWORD*)&defaultPointSize);
+	device->SetRenderState(D3DRS_DEPTHBIAS, 0);
+	device->SetRenderState(D3DRS_STENCILMASK, 0xFFFFFFFF);
+	device->SetRenderState(D3DRS_STENCILWRITEMASK, 0xFFFFFFFF);
+	device->SetTextureStageState(0, D3DTSS_COLOROP, D3DTOP_MODULATE);
+	device->SetTextureStageState(0, D3DTSS_COLORARG1, D3DTA_TEXTURE);
+	device->SetTextureStageState(0, D3DTSS_COLORARG2, D3DTA_CURRENT);
+	vertexBuffer->Release();
+
+	if (result != SCENARIO_PASSED)
+	{
+		Report("RenderStateAnimation failed to render.");
+		return result;
+	}
+
+	unsigned long long animatedPipelines = animated.PipelineCount - before.PipelineCount;
+	unsigned long long contrastPipelines = after.PipelineCount - animated.PipelineCount;
+
+	Report("RenderStateAnimation %d draws animating non-structural states created %llu pipelines with %llu misses, animating the color operation created %llu.",
+		frames * drawsPerFrame, animatedPipelines, animated.PipelineCacheMisses - before.PipelineCacheMisses, contrastPipelines);
+
+	if (animatedPipelines != 0 || animated.PipelineCacheMisses != before.PipelineCacheMisses)
+	{
+		Report("RenderStateAnimation failed: non-structural render states created pipelines.");
+		return SCENARIO_FAILED;
+	}
+
+	if (contrastPipelines == 0)
+	{
+		Report("RenderStateAnimation the contrast state isn't structural in this configuration so the comparison proves nothing.");
+		return SCENARIO_ERROR;
+	}
+
+	Report("RenderStateAnimation passed.");
+	return SCENARIO_PASSED;
+}
+
+/*
+Compares what a draw costs the game thread with what it costs to turn into Vulkan commands.
+With CommandStream true in VK9.conf the game thread only records draws and a worker thread executes them so recording should be the cheaper of the two.
+Without the command stream every draw is executed on the game thread and only that cost is reported.
+Arguments: [warm up frames] [measured frames] [draws per frame]
+*/
+int CommandStreamCost(IDirect3DDevice9* device, const char* arguments)
+{
+	int warmUpFrames = 4;
+	int measuredFrames = 32;
+	int drawsPerFrame = 2000;
+	sscanf(arguments, "%d %d %d", &warmUpFrames, &measuredFrames, &drawsPerFrame);
+
+	IDirect3DVertexBuffer9* vertexBuffer = CreateQuad(device);
+	if (vertexBuffer == NULL)
+	{
+		Report("CommandStreamCost couldn't create its vertex buffer.");
+		return SCENARIO_ERROR;
+	}
+
+	device->SetRenderState(D3DRS_LIGHTING, FALSE);
+	device->SetRenderState(D3DRS_CULLMODE, D3DCULL_NONE);
+
+	DeviceStatistics warm = {};
+	DeviceStatistics measured = {};
+	int result = SCENARIO_PASSED;
+
+	for (int frame = 0; frame < warmUpFrames + measuredFrames && result == SCENARIO_PASSED; frame++)
+	{
+		if (frame == warmUpFrames && !GetStatistics(device, warm))
+		{
+			result = SCENARIO_ERROR;
+			break;
+		}
+
+		PumpMessages();
+
+		device->Clear(0, NULL, D3DCLEAR_TARGET | D3DCLEAR_ZBUFFER, D3DCOLOR_XRGB(0, 0, 0), 1.0f, 0);
+		device->BeginScene();
+
+		for (int draw = 0; draw < drawsPerFrame; draw++)
+		{
+			SetWorld(device, draw);
+
+			if (FAILED(device->DrawPrimitive(D3DPT_TRIANGLESTRIP, 0, 2)))
+			{
+				result = SCENARIO_ERROR;
+			}
+		}
+
+		device->EndScene();
+		if (FAILED(device->Present(NULL, NULL, NULL, NULL)))
+		{
+			result = SCENARIO_ERROR;
+		}
+	}
+
+	if (result == SCENARIO_PASSED && !GetStatistics(device, measured))
+	{
+		result = SCENARIO_ERROR;
+	}
+
+	vertexBuffer->Release();
+
+	if (result != SCENARIO_PASSED)
+	{
+		Report("CommandStreamCost failed to render.");
+		return result;
+	}
+
+	unsigned long long recorded = measured.DrawsRecorded - warm.DrawsRecorded;
+	unsigned long long executed = measured.DrawsExecuted - warm.DrawsExecuted;
+	long long recordCost = (recorded != 0) ? (measured.DrawRecordTime - warm.DrawRecordTime) / (long long)recorded : 0;
+	long long executeCost = (executed != 0) ? (measured.DrawExecuteTime - warm.DrawExecuteTime) / (long long)executed : 0;
+
+	if (recorded == 0)
+	{
+		Report("CommandStreamCost the command stream is off: %llu draws executed on the game thread at %lldns per draw.", executed, executeCost);
+		Report("CommandStreamCost passed.");
+		return SCENARIO_PASSED;
+	}
+
+	Report("CommandStreamCost %llu draws recorded at %lldns per draw on the game thread and %llu executed at %lldns per draw on the worker thread.", recorded, recordCost, executed, executeCost);
+
+	if (recorded != executed)
+	{
+		Report("CommandStreamCost failed: the worker thread didn't execute every recorded draw.");
+		return SCENARIO_FAILED;
+	}
+
+	if (recordCost >= executeCost)
+	{
+		Report("CommandStreamCost failed: recording a draw cost the game thread as much as executing it.");
+		return SCENARIO_FAILED;
+	}
+
+	Report("CommandStreamCost passed.");
+	return SCENARIO_PASSED;
+}
+
+/*
+Binds a pair of textures no earlier draw has used for every draw so each draw has to write a new descriptor set.
+Reports how many descriptor set writes the library manages per second of write time.
+Run it with DescriptorUpdateTemplates true and false in VK9.conf to compare template updates with vkUpdateDescriptorSets.
+Push descriptors and bindless textures don't write sets for texture changes so set PushDescriptors and FixedFunctionBindlessTextures to false first.
+Arguments: [frames] [draws per frame] [minimum writes per second]
+*/
+int DescriptorWrites(IDirect3DDevice9* device, const char* arguments)
+{
+	const int textureCount = 100;
+
+	int frames = 9;
+	int drawsPerFrame = 1000;
+	double minimumWritesPerSecond = 0.0;
+	sscanf(arguments, "%d %d %lf", &frames, &drawsPerFrame, &minimumWritesPerSecond);
+	frames = min(frames, textureCount * (textureCount - 1) / max(drawsPerFrame, 1)); //Every draw of the run still gets its own pair.
+
+	IDirect3DTexture9* textures[textureCount] = {};
+	IDirect3DVertexBuffer9* vertexBuffer = CreateQuad(device);
+	if (vertexBuffer == NULL || !CreateTextures(device, textures, textureCount))
+	{
+		if (vertexBuffer != NULL)
+		{
+			vertexBuffer->Release();
+		}
+		Report("DescriptorWrites couldn't create its vertex buffer and textures.");
+		return SCENARIO_ERROR;
+	}
+
+	device->SetRenderState(D3DRS_LIGHTING, FALSE);
+	device->SetRenderState(D3DRS_CULLMODE, D3DCULL_NONE);
+
+	DeviceStatistics before = {};
+	DeviceStatistics after = {};
+	int result = GetStatistics(device, before) ? SCENARIO_PASSED : SCENARIO_ERROR;
+
+	for (int frame = 0; frame < frames && result == SCENARIO_PASSED; frame++)
+	{
+		PumpMessages();
+
+		device->Clear(0, NULL, D3DCLEAR_TARGET | D3DCLEAR_ZBUFFER, D3DCOLOR_XRGB(0, 0, 0), 1.0f, 0);
+		device->BeginScene();
+
+		for (int draw = 0; draw < drawsPerFrame; draw++)
+		{
+			int pair = frame * drawsPerFrame + draw;
+			int first = pair % textureCount;
+			int second = (first + pair / textureCount + 1) % textureCount;
+
+			device->SetTexture(0, textures[first]);
+			device->SetTexture(1, textures[second]);
+
+			if (FAILED(device->DrawPrimitive(D3DPT_TRIANGLESTRIP, 0, 2)))
+			{
+				result = SCENARIO_ERROR;
+			}
+		}
+
+		device->EndScene();
+		if (FAILED(device->Present(NULL, NULL, NULL, NULL)))
+		{
+			result = SCENARIO_ERROR;
+		}
+	}
+
+	if (result == SCENARIO_PASSED && !GetStatistics(device, after))
+	{
+		result = SCENARIO_ERROR;
+	}
+
+	device->SetTexture(0, NULL);
+	device->SetTexture(1, NULL);
+	ReleaseTextures(textures, textureCount);
+	vertexBuffer->Release();
+
+	if (result != SCENARIO_PASSED)
+	{
+		Report("DescriptorWrites failed to render.");
+		return result;
+	}
+
+	unsigned long long writes = after.DescriptorSetWrites - before.DescriptorSetWrites;
+	unsigned long long misses = after.DescriptorSetMisses - before.DescriptorSetMisses;
+	long long writeTime = after.DescriptorSetWriteTime - before.DescriptorSetWriteTime;
+
+	if (writes == 0)
+	{
+		Report("DescriptorWrites no descriptor sets were written. Set PushDescriptors and FixedFunctionBindlessTextures to false.");
+		return SCENARIO_ERROR;
+	}
+
+	double writesPerSecond = (writeTime > 0) ? (double)writes * 1000000000.0 / (double)writeTime : 0.0;
+	Report("DescriptorWrites %llu writes for %llu misses in %lldns: %.0f writes per second, %lldns per write.", writes, misses, writeTime, writesPerSecond, writeTime / (long long)writes);
+
+	if (writes != misses)
+	{
+		Report("DescriptorWrites failed: every write should come from a descriptor set miss.");
+		return SCENARIO_FAILED;
+	}
+
+	if (minimumWritesPerSecond > 0.0 && writesPerSecond < minimumWritesPerSecond)
+	{
+		Report("DescriptorWrites failed: %.0f writes per second is below %.0f.", writesPerSecond, minimumWritesPerSecond);
+		return SCENARIO_FAILED;
+	}
+
+	Report("DescriptorWrites passed.");
+	return SCENARIO_PASSED;
+}
+
+/*
+Binds textures to four stages and then switches only the stage 0 texture between draws.
+Reports the execute cost per draw along with the pushes or descriptor sets the draws needed.
+Run it once with PushDescriptors true and once with false in VK9.conf to compare the two.
+Pushed draws should only send the bindings that changed rather than all four textures and pooled draws shouldn't push at all.
+Arguments: [warm up frames] [measured frames] [draws per frame]
+*/
+int DescriptorPush(IDirect3DDevice9* device, const char* arguments)
+{
+	const int stageCount = 4;
+	const int textureCount = 16;
+
+	int warmUpFrames = 4;
+	int measuredFrames = 16;
+	int drawsPerFrame = 2000;
+	sscanf(arguments, "%d %d %d", &warmUpFrames, &measuredFrames, &drawsPerFrame);
+
+	IDirect3DTexture9* textures[textureCount] = {};
+	IDirect3DVertexBuffer9* vertexBuffer = CreateQuad(device);
+	if (vertexBuffer == NULL || !CreateTextures(device, textures, textureCount))
+	{
+		if (vertexBuffer != NULL)
+		{
+			vertexBuffer->Release();
+		}
+		Report("DescriptorPush couldn't create its vertex buffer and textures.");
+		return SCENARIO_ERROR;
+	}
+
+	device->SetRenderState(D3DRS_LIGHTING, FALSE);
+	device->SetRenderState(D3DRS_CULLMODE, D3DCULL_NONE);
+
+	//Stages 1 to 3 keep the last few textures for the whole run.
+	for (int stage = 1; stage < stageCount; stage++)
+	{
+		device->SetTexture(stage, textures[textureCount - stage]);
+	}
+
+	DeviceStatistics warm = {};
+	DeviceStatistics measured = {};
+	int result = SCENARIO_PASSED;
+
+	for (int frame = 0; frame < warmUpFrames + measuredFrames && result == SCENARIO_PASSED; frame++)
+	{
+		if (frame == warmUpFrames && !GetStatistics(device, warm))
+		{
+			result = SCENARIO_ERROR;
+			break;
+		}
+
+		PumpMessages();
+
+		device->Clear(0, NULL, D3DCLEAR_TARGET | D3DCLEAR_ZBUFFER, D3DCOLOR_XRGB(0, 0, 0), 1.0f, 0);
+		device->BeginScene();
+
+		for (int draw = 0; draw < drawsPerFrame; draw++)
+		{
+			device->SetTexture(0, textures[draw % (textureCount - stageCount + 1)]);
+
+			if (FAILED(device->DrawPrimitive(D3DPT_TRIANGLESTRIP, 0, 2)))
+			{
+				result = SCENARIO_ERROR;
+			}
+		}
+
+		device->EndScene();
+		if (FAILED(device->Present(NULL, NULL, NULL, NULL)))
+		{
+			result = SCENARIO_ERROR;
+		}
+	}
+
+	if (result == SCENARIO_PASSED && !GetStatistics(device, measured))
+	{
+		result = SCENARIO_ERROR;
+	}
+
+	for (int stage = 0; stage < stageCount; stage++)
+	{
+		device->SetTexture(stage, NULL);
+	}
+	ReleaseTextures(textures, textureCount);
+	vertexBuffer->Release();
+
+	if (result != SCENARIO_PASSED)
+	{
+		Report("DescriptorPush failed to render.");
+		return result;
+	}
+
+	unsigned long long executed = measured.DrawsExecuted - warm.DrawsExecuted;
+	long long cost = (executed != 0) ? (measured.DrawExecuteTime - warm.DrawExecuteTime) / (long long)executed : 0;
+	unsigned long long pushes = measured.PushDescriptorCount - warm.PushDescriptorCount;
+	unsigned long long pushWrites = measured.PushDescriptorWrites - warm.PushDescriptorWrites;
+	unsigned long long sets = (measured.DescriptorSetHits - warm.DescriptorSetHits) + (measured.DescriptorSetMisses - warm.DescriptorSetMisses);
+	unsigned long long allocations = measured.DescriptorSetAllocations - warm.DescriptorSetAllocations;
+
+	Report("DescriptorPush %llu draws: %lldns per draw, %llu descriptors in %llu pushes, %llu set lookups and %llu set allocations.", executed, cost, pushWrites, pushes, sets, allocations);
+
+	if (sets != 0)
+	{
+		if (pushes != 0)
+		{
+			Report("DescriptorPush failed: draws used descriptor sets and pushes together.");
+			return SCENARIO_FAILED;
+		}
+
+		Report("DescriptorPush passed using pooled descriptor sets.");
+		return SCENARIO_PASSED;
+	}
+
+	if (allocations != 0)
+	{
+		Report("DescriptorPush failed: pushed draws still allocated descriptor sets.");
+		return SCENARIO_FAILED;
+	}
+
+	if (pushes != 0 && pushWrites >= pushes * stageCount)
+	{
+		Report("DescriptorPush failed: each push sent %llu descriptors when only the stage 0 texture changed.", pushWrites / pushes);
+		return SCENARIO_FAILED;
+	}
+
+	Report("DescriptorPush passed using push descriptors.");
+	return SCENARIO_PASSED;
+}
+
+/*
+Draws every combination of a handful of pipeline state once, a few hundred draws per frame, so the device has to build thousands of pipelines while it renders.
+Reports the longest time a draw waited for its pipeline on the API thread (MaximumPipelineStall).
+Arguments: [draws per frame] [stall budget in microseconds]
+Without a budget the scenario only reports. With one it fails when the longest stall is over the budget.
+*/
+int PipelineStress(IDirect3DDevice9* device, const char* arguments)
+{
+	const DWORD colorWrites = 16;
+	const DWORD cullModes[] = { D3DCULL_NONE, D3DCULL_CW, D3DCULL_CCW };
+	const DWORD zFunctions[] = { D3DCMP_NEVER, D3DCMP_LESS, D3DCMP_EQUAL, D3DCMP_LESSEQUAL, D3DCMP_GREATER, D3DCMP_NOTEQUAL, D3DCMP_GREATEREQUAL, D3DCMP_ALWAYS };
+	const DWORD sourceBlends[] = { 0, D3DBLEND_ONE, D3DBLEND_SRCCOLOR, D3DBLEND_SRCALPHA, D3DBLEND_INVSRCALPHA }; //0 means blending off.
+	const int combinations = colorWrites * 3 * 8 * 5 * 2;
+
+	int drawsPerFrame = 256;
+	long long stallBudget = -1;
+	sscanf(arguments, "%d %lld", &drawsPerFrame, &stallBudget);
+	if (drawsPerFrame < 1)
+	{
+		drawsPerFrame = 1;
+	}
+
+	IDirect3DVertexBuffer9* vertexBuffer = CreateQuad(device);
+	if (vertexBuffer == NULL)
+	{
+		Report("PipelineStress couldn't create its vertex buffer.");
+		return SCENARIO_ERROR;
+	}
+
+	device->SetRenderState(D3DRS_LIGHTING, FALSE);
+	device->SetRenderState(D3DRS_DESTBLEND, D3DBLEND_INVSRCALPHA);
+
+	DeviceStatistics statistics = {};
+	int result = SCENARIO_PASSED;
+	int combination = 0;
+
+	while (combination < combinations && result == SCENARIO_PASSED)
+	{
+		PumpMessages();
+
+		device->Clear(0, NULL, D3DCLEAR_TARGET | D3DCLEAR_ZBUFFER, D3DCOLOR_XRGB(0, 0, 0), 1.0f, 0);
+		device->BeginScene();
+
+		for (int draw = 0; draw < drawsPerFrame && combination < combinations; draw++, combination++)
+		{
+			int index = combination;
+			DWORD colorWrite = index % colorWrites; index /= colorWrites;
+			DWORD cullMode = cullModes[index % 3]; index /= 3;
+			DWORD zFunction = zFunctions[index % 8]; index /= 8;
+			DWORD sourceBlend = sourceBlends[index % 5]; index /= 5;
+			DWORD zWrite = index % 2;
+
+			device->SetRenderState(D3DRS_COLORWRITEENABLE, colorWrite);
+			device->SetRenderState(D3DRS_CULLMODE, cullMode);
+			device->SetRenderState(D3DRS_ZFUNC, zFunction);
+			device->SetRenderState(D3DRS_ALPHABLENDENABLE, (sourceBlend != 0) ? TRUE : FALSE);
+			if (sourceBlend != 0)
+			{
+				device->SetRenderState(D3DRS_SRCBLEND, sourceBlend);
+			}
+			device->SetRenderState(D3DRS_ZWRITEENABLE, zWrite);
+			SetWorld(device, draw);
+
+			if (FAILED(device->DrawPrimitive(D3DPT_TRIANGLESTRIP, 0, 2)))
+			{
+				result = SCENARIO_ERROR;
+			}
+		}
+
+		device->EndScene();
+		if (FAILED(device->Present(NULL, NULL, NULL, NULL)))
+		{
+			result = SCENARIO_ERROR;
+		}
+	}
+
+	if (result == SCENARIO_PASSED && !GetStatistics(device, statistics))
+	{
+		result = SCENARIO_ERROR;
+	}
+
+	vertexBuffer->Release();
+
+	if (result != SCENARIO_PASSED)
+	{
+		Report("PipelineStress failed to render.");
+		return result;
+	}
+
+	Report("PipelineStress drew %d state combinations in %llu frames and created %llu pipelines.", combinations, statistics.Frames, statistics.PipelineCount);
+	Report("PipelineStress worst main thread stall: %lldus.", statistics.MaximumPipelineStall);
+
+	if (stallBudget >= 0 && statistics.MaximumPipelineStall > stallBudget)
+	{
+		Report("PipelineStress failed: the worst stall is over the %lldus budget.", stallBudget);
+		return SCENARIO_FAILED;
+	}
+
+	Report("PipelineStress passed.");
+	return SCENARIO_PASSED;
+}
+
+//Sets texture stage state that fixed function pipelines are compiled with. Every index below 13125 is a different combination.
+void SetStageCombination(IDirect3DDevice9* device, int index)
+{
+	const DWORD arguments[] = { D3DTA_DIFFUSE, D3DTA_CURRENT, D3DTA_TEXTURE, D3DTA_TFACTOR, D3DTA_SPECULAR, D3DTA_TEMP, D3DTA_CONSTANT };
+
+	device->SetTextureStageState(0, D3DTSS_COLOROP, D3DTOP_SELECTARG1 + index % 25); index /= 25;
+	device->SetTextureStageState(0, D3DTSS_ALPHAOP, D3DTOP_SELECTARG1 + index % 25); index /= 25;
+	device->SetTextureStageState(0, D3DTSS_COLORARG1, arguments[index % 7]); index /= 7;
+	device->SetTextureStageState(0, D3DTSS_ALPHAARG1, arguments[index % 3]);
+}
+
+/*
+Grows the pipeline cache to 10, 100, 1000 and then 10,000 pipelines and times the same draws at each size.
+The draws switch between eight pipelines that are always cached so every one of them looks its pipeline up and none of them compiles.
+Set PipelineCacheMaxEntries above the largest size or the cache evicts and the scenario can't measure it.
+Arguments: [largest pipeline count] [draws per measurement] [allowed growth]
+Fails when a measured draw missed the cache or when the cost per draw at the largest size is more than the allowed growth times the cost at 10 pipelines.
+*/
+int PipelineLookup(IDirect3DDevice9* device, const char* arguments)
+{
+	const int combinations = 25 * 25 * 7 * 3;
+	const int measuredCombinations = 8;
+	const int drawsPerFrame = 500;
+
+	int largestCount = 10000;
+	int measuredDraws = 20000;
+	double allowedGrowth = 4.0;
+	sscanf(arguments, "%d %d %lf", &largestCount, &measuredDraws, &allowedGrowth);
+	largestCount = min(largestCount, combinations);
+
+	IDirect3DVertexBuffer9* vertexBuffer = CreateQuad(device);
+	if (vertexBuffer == NULL)
+	{
+		Report("PipelineLookup couldn't create its vertex buffer.");
+		return SCENARIO_ERROR;
+	}
+
+	device->SetRenderState(D3DRS_LIGHTING, FALSE);
+	device->SetRenderState(D3DRS_CULLMODE, D3DCULL_NONE);
+
+	DeviceStatistics before = {};
+	DeviceStatistics after = {};
+	int result = SCENARIO_PASSED;
+	int built = 0;
+	long long firstCost = 0;
+	long long cost = 0;
+
+	for (int count = 10; result == SCENARIO_PASSED; count *= 10)
+	{
+		count = min(count, largestCount);
+
+		//Draw every new combination once so the cache holds count pipelines.
+		while (built < count && result == SCENARIO_PASSED)
+		{
+			PumpMessages();
+
+			device->Clear(0, NULL, D3DCLEAR_TARGET | D3DCLEAR_ZBUFFER, D3DCOLOR_XRGB(0, 0, 0), 1.0f, 0);
+			device->BeginScene();
+
+			for (int draw = 0; draw < drawsPerFrame && built < count; draw++, built++)
+			{
+				SetStageCombination(device, built);
+				SetWorld(device, draw);
+
+				if (FAILED(device->DrawPrimitive(D3DPT_TRIANGLESTRIP, 0, 2)))
+				{
+					result = SCENARIO_ERROR;
+				}
+			}
+
+			device->EndScene();
+			if (FAILED(device->Present(NULL, NULL, NULL, NULL)))
+			{
+				result = SCENARIO_ERROR;
+			}
+		}
+
+		if (result != SCENARIO_PASSED || !GetStatistics(device, before))
+		{
+			result = SCENARIO_ERROR;
+			break;
+		}
+
+		int draws = 0;
+		while (draws < measuredDraws && result == SCENARIO_PASSED)
+		{
+			PumpMessages();
+
+			device->Clear(0, NULL, D3DCLEAR_TARGET | D3DCLEAR_ZBUFFER, D3DCOLOR_XRGB(0, 0, 0), 1.0f, 0);
+			device->BeginScene();
+
+			for (int draw = 0; draw < drawsPerFrame && draws < measuredDraws; draw++, draws++)
+			{
+				SetStageCombination(device, draw % measuredCombinations);
+				SetWorld(device, draw);
+
+				if (FAILED(device->DrawPrimitive(D3DPT_TRIANGLESTRIP, 0, 2)))
+				{
+					result = SCENARIO_ERROR;
+				}
+			}
+
+			device->EndScene();
+			if (FAILED(device->Present(NULL, NULL, NULL, NULL)))
+			{
+				result = SCENARIO_ERROR;
+			}
+		}
+
+		if (result != SCENARIO_PASSED || !GetStatistics(device, after))
+		{
+			result = SCENARIO_ERROR;
+			break;
+		}
+
+		unsigned long long executed = after.DrawsExecuted - before.DrawsExecuted;
+		cost = (executed != 0) ? (after.DrawExecuteTime - before.DrawExecuteTime) / (long long)executed : 0;
+		if (count == 10)
+		{
+			firstCost = cost;
+		}
+
+		Report("PipelineLookup %d pipelines (%llu created): %lldns per draw, %llu hits and %llu misses.", count, after.PipelineCount, cost, after.PipelineCacheHits - before.PipelineCacheHits, after.PipelineCacheMisses - before.PipelineCacheMisses);
+
+		if (after.PipelineCacheEvictions != 0)
+		{
+			Report("PipelineLookup the cache evicted pipelines. Raise PipelineCacheMaxEntries above %d.", largestCount);
+			result = SCENARIO_ERROR;
+			break;
+		}
+
+		if (after.PipelineCacheMisses != before.PipelineCacheMisses)
+		{
+			Report("PipelineLookup failed: the measured draws missed the cache.");
+			result = SCENARIO_FAILED;
+			break;
+		}
+
+		if (count == largestCount)
+		{
+			break;
+		}
+	}
+
+	vertexBuffer->Release();
+
+	if (result != SCENARIO_PASSED)
+	{
+		if (result == SCENARIO_ERROR)
+		{
+			Report("PipelineLookup failed to render.");
+		}
+		return result;
+	}
+
+	if (firstCost > 0 && (double)cost > allowedGrowth * (double)firstCost)
+	{
+		Report("PipelineLookup failed: draws cost %lldns with %d pipelines and %lldns with 10.", cost, largestCount, firstCost);
+		return SCENARIO_FAILED;
+	}
+
+	Report("PipelineLookup passed.");
+	return SCENARIO_PASSED;
+}
+
+/*
+Moves eight lights between every lit draw. The light uploads have to stay inside the frame's render pass.
+Fails when any frame began more than one render pass.
+Arguments: [frames] [draws per frame]
+*/
+int LightHeavy(IDirect3DDevice9* device, const char* arguments)
+{
+	const DWORD lightCount = 8;
+
+	int frames = 120;
+	int drawsPerFrame = 64;
+	sscanf(arguments, "%d %d", &frames, &drawsPerFrame);
+
+	IDirect3DVertexBuffer9* vertexBuffer = CreateQuad(device);
+	if (vertexBuffer == NULL)
+	{
+		Report("LightHeavy couldn't create its vertex buffer.");
+		return SCENARIO_ERROR;
+	}
+
+	D3DMATERIAL9 material = {};
+	material.Diffuse.r = material.Diffuse.g = material.Diffuse.b = material.Diffuse.a = 1.0f;
+	material.Ambient = material.Diffuse;
+
+	device->SetRenderState(D3DRS_LIGHTING, TRUE);
+	device->SetRenderState(D3DRS_CULLMODE, D3DCULL_NONE);
+	device->SetRenderState(D3DRS_AMBIENT, D3DCOLOR_XRGB(32, 32, 32));
+	device->SetMaterial(&material);
+
+	for (DWORD i = 0; i < lightCount; i++)
+	{
+		device->LightEnable(i, TRUE);
+	}
+
+	DeviceStatistics start = {};
+	DeviceStatistics end = {};
+	int result = SCENARIO_PASSED;
+
+	if (!GetStatistics(device, start))
+	{
+		result = SCENARIO_ERROR;
+	}
+
+	for (int frame = 0; frame < frames && result == SCENARIO_PASSED; frame++)
+	{
+		PumpMessages();
+
+		device->Clear(0, NULL, D3DCLEAR_TARGET | D3DCLEAR_ZBUFFER, D3DCOLOR_XRGB(0, 0, 0), 1.0f, 0);
+		device->BeginScene();
+
+		for (int draw = 0; draw < drawsPerFrame; draw++)
+		{
+			for (DWORD i = 0; i < lightCount; i++)
+			{
+				D3DLIGHT9 light = {};
+				light.Type = D3DLIGHT_POINT;
+				light.Diffuse.r = (float)((i + draw) % 3) / 2.0f;
+				light.Diffuse.g = (float)((i + frame) % 4) / 3.0f;
+				light.Diffuse.b = (float)(i % 2);
+				light.Diffuse.a = 1.0f;
+				light.Position.x = (float)(draw % 8) - 3.5f + (float)i * 0.25f;
+				light.Position.y = (float)(draw / 8 % 8) - 3.5f;
+				light.Position.z = 10.0f;
+				light.Range = 20.0f;
+				light.Attenuation0 = 1.0f;
+				device->SetLight(i, &light);
+			}
+			SetWorld(device, draw);
+
+			if (FAILED(device->DrawPrimitive(D3DPT_TRIANGLESTRIP, 0, 2)))
+			{
+				result = SCENARIO_ERROR;
+			}
+		}
+
+		device->EndScene();
+		if (FAILED(device->Present(NULL, NULL, NULL, NULL)))
+		{
+			result = SCENARIO_ERROR;
+		}
+	}
+
+	if (result == SCENARIO_PASSED && !GetStatistics(device, end))
+	{
+		result = SCENARIO_ERROR;
+	}
+
+	for (DWORD i = 0; i < lightCount; i++)
+	{
+		device->LightEnable(i, FALSE);
+	}
+	vertexBuffer->Release();
+
+	if (result != SCENARIO_PASSED)
+	{
+		Report("LightHeavy failed to render.");
+		return result;
+	}
+
+	Report("LightHeavy %d frames of %d lit draws: %llu render passes, at most %u in a frame.", frames, drawsPerFrame, end.RenderPassBegins - start.RenderPassBegins, end.MaximumFrameRenderPassBegins);
+	Report("LightHeavy fixed function uploads: %llu for %llu bytes.", end.FixedFunctionUploads - start.FixedFunctionUploads, end.FixedFunctionUploadBytes - start.FixedFunctionUploadBytes);
+
+	if (end.MaximumFrameRenderPassBegins > 1)
+	{
+		Report("LightHeavy failed: a frame began more than one render pass.");
+		return SCENARIO_FAILED;
+	}
+
+	Report("LightHeavy passed.");
+	return SCENARIO_PASSED;
+}
+
+/*
+Draws with a static camera and a new world matrix for every object, 100k draws by default.
+The view projection product should only be built once and every draw should cost one world product and one push.
+Arguments: [draws] [draws per frame]
+*/
+int TransformHeavy(IDirect3DDevice9* device, const char* arguments)
+{
+	int draws = 100000;
+	int drawsPerFrame = 1000;
+	sscanf(arguments, "%d %d", &draws, &drawsPerFrame);
+	if (drawsPerFrame < 1)
+	{
+		drawsPerFrame = 1;
+	}
+
+	IDirect3DVertexBuffer9* vertexBuffer = CreateQuad(device);
+	if (vertexBuffer == NULL)
+	{
+		Report("TransformHeavy couldn't create its vertex buffer.");
+		return SCENARIO_ERROR;
+	}
+
+	device->SetRenderState(D3DRS_LIGHTING, FALSE);
+	device->SetRenderState(D3DRS_CULLMODE, D3DCULL_NONE);
+
+	DeviceStatistics start = {};
+	DeviceStatistics end = {};
+	int result = SCENARIO_PASSED;
+
+	if (!GetStatistics(device, start))
+	{
+		result = SCENARIO_ERROR;
+	}
+
+	int draw = 0;
+	while (draw < draws && result == SCENARIO_PASSED)
+	{
+		PumpMessages();
+
+		device->Clear(0, NULL, D3DCLEAR_TARGET | D3DCLEAR_ZBUFFER, D3DCOLOR_XRGB(0, 0, 0), 1.0f, 0);
+		device->BeginScene();
+
+		for (int i = 0; i < drawsPerFrame && draw < draws; i++, draw++)
+		{
+			SetWorld(device, draw);
+
+			if (FAILED(device->DrawPrimitive(D3DPT_TRIANGLESTRIP, 0, 2)))
+			{
+				result = SCENARIO_ERROR;
+			}
+		}
+
+		device->EndScene();
+		if (FAILED(device->Present(NULL, NULL, NULL, NULL)))
+		{
+			result = SCENARIO_ERROR;
+		}
+	}
+
+	if (result == SCENARIO_PASSED && !GetStatistics(device, end))
+	{
+		result = SCENARIO_ERROR;
+	}
+
+	vertexBuffer->Release();
+
+	if (result != SCENARIO_PASSED)
+	{
+		Report("TransformHeavy failed to render.");
+		return result;
+	}
+
+	unsigned long long worldUpdates = end.WorldUpdates - start.WorldUpdates;
+	unsigned long long viewProjectionUpdates = end.ViewProjectionUpdates - start.ViewProjectionUpdates;
+	unsigned long long pushes = end.TransformationPushes - start.TransformationPushes;
+	unsigned long long executed = end.DrawsExecuted - start.DrawsExecuted;
+	long long executeTime = end.DrawExecuteTime - start.DrawExecuteTime;
+
+	Report("TransformHeavy %d draws: %llu world and %llu view projection rebuilds for %llu pushes.", draws, worldUpdates, viewProjectionUpdates, pushes);
+	Report("TransformHeavy draw calls took %lldns on average.", (executed != 0) ? executeTime / (long long)executed : 0);
+
+	if (viewProjectionUpdates > 1)
+	{
+		Report("TransformHeavy failed: the view projection product was rebuilt with a static camera.");
+		return SCENARIO_FAILED;
+	}
+
+	if (worldUpdates > (unsigned long long)draws || pushes > (unsigned long long)draws)
+	{
+		Report("TransformHeavy failed: draws rebuilt or pushed their transforms more than once.");
+		return SCENARIO_FAILED;
+	}
+
+	Report("TransformHeavy passed.");
+	return SCENARIO_PASSED;
+}
+
+//Constant n gets a colour that is unique for every register and exact in an 8 bit target.
+void GetConstantColor(int n, float* color)
+{
+	color[0] = (float)((n & 15) * 17) / 255.0f;
+	color[1] = (float)((n >> 4) * 17) / 255.0f;
+	color[2] = (float)((n * 37) % 256) / 255.0f;
+	color[3] = 1.0f;
+}
+
+IDirect3DVertexShader9* AssembleVertexShader(IDirect3DDevice9* device, const char* source)
+{
+	LPD3DXBUFFER code = NULL;
+	IDirect3DVertexShader9* shader = NULL;
+
+	if (FAILED(D3DXAssembleShader(source, (UINT)strlen(source), NULL, NULL, 0, &code, NULL)))
+	{
+		return NULL;
+	}
+	device->CreateVertexShader((DWORD*)code->GetBufferPointer(), &shader);
+	code->Release();
+
+	return shader;
+}
+
+IDirect3DPixelShader9* AssemblePixelShader(IDirect3DDevice9* device, const char* source)
+{
+	LPD3DXBUFFER code = NULL;
+	IDirect3DPixelShader9* shader = NULL;
+
+	if (FAILED(D3DXAssembleShader(source, (UINT)strlen(source), NULL, NULL, 0, &code, NULL)))
+	{
+		return NULL;
+	}
+	device->CreatePixelShader((DWORD*)code->GetBufferPointer(), &shader);
+	code->Release();
+
+	return shader;
+}
+
+/*
+Reads the back buffer and checks the centre of the first cellCount cells of a 16x16 grid against GetConstantColor.
+Returns the number of cells that don't match or -1 if the back buffer couldn't be read.
+*/
+int CountWrongCells(IDirect3DDevice9* device, const char* name, int cellCount)
+{
+	IDirect3DSurface9* renderTarget = NULL;
+	IDirect3DSurface9* surface = NULL;
+	D3DSURFACE_DESC description = {};
+	D3DLOCKED_RECT lockedRect = {};
+	int wrongCells = -1;
+
+	if (FAILED(device->GetRenderTarget(0, &renderTarget)))
+	{
+		return -1;
+	}
+
+	renderTarget->GetDesc(&description);
+	if (SUCCEEDED(device->CreateOffscreenPlainSurface(description.Width, description.Height, D3DFMT_X8R8G8B8, D3DPOOL_SYSTEMMEM, &surface, NULL)))
+	{
+		if (SUCCEEDED(device->GetRenderTargetData(renderTarget, surface)) && SUCCEEDED(surface->LockRect(&lockedRect, NULL, D3DLOCK_READONLY)))
+		{
+			wrongCells = 0;
+			for (int cell = 0; cell < cellCount; cell++)
+			{
+				UINT x = (UINT)(((float)(cell % 16) + 0.5f) * (float)description.Width / 16.0f);
+				UINT y = (UINT)(((float)(cell / 16) + 0.5f) * (float)description.Height / 16.0f);
+				const BYTE* pixel = (const BYTE*)lockedRect.pBits + y * lockedRect.Pitch + x * 4;
+
+				float color[4];
+				GetConstantColor(cell, color);
+				int expected[3] = { (int)(color[2] * 255.0f + 0.5f), (int)(color[1] * 255.0f + 0.5f), (int)(color[0] * 255.0f + 0.5f) }; //BGR in memory.
+
+				for (int channel = 0; channel < 3; channel++)
+				{
+					if (abs((int)pixel[channel] - expected[channel]) > 2)
+					{
+						Report("%s c%d read back as (%d, %d, %d) instead of (%d, %d, %d).", name, cell, pixel[2], pixel[1], pixel[0], expected[2], expected[1], expected[0]);
+						wrongCells++;
+						break;
+					}
+				}
+			}
+			surface->UnlockRect();
+		}
+		surface->Release();
+	}
+	renderTarget->Release();
+
+	return wrongCells;
+}
+
+/*
+Sets all 256 vertex shader and 224 pixel shader float constants and draws one cell of a 16x16 grid per register with a shader that outputs that register.
+The back buffer is read back and every cell has to have its register's colour.
+Arguments: none
+*/
+int ShaderConstants(IDirect3DDevice9* device, const char* arguments)
+{
+	const int vertexConstantCount = 256;
+	const int pixelConstantCount = 224;
+	const D3DVERTEXELEMENT9 elements[] =
+	{
+		{ 0, 0, D3DDECLTYPE_FLOAT4, D3DDECLMETHOD_DEFAULT, D3DDECLUSAGE_POSITION, 0 },
+		D3DDECL_END()
+	};
+
+	float vertexConstants[vertexConstantCount * 4];
+	float pixelConstants[pixelConstantCount * 4];
+	float vertices[vertexConstantCount * 6 * 4];
+	char source[256];
+
+	for (int n = 0; n < vertexConstantCount; n++)
+	{
+		GetConstantColor(n, &vertexConstants[n * 4]);
+		if (n < pixelConstantCount)
+		{
+			GetConstantColor(n, &pixelConstants[n * 4]);
+		}
+
+		//Two clip space triangles covering cell n, row 0 at the top.
+		float left = -1.0f + (float)(n % 16) / 8.0f;
+		float top = 1.0f - (float)(n / 16) / 8.0f;
+		float corners[6][2] = { { left, top }, { left + 0.125f, top }, { left, top - 0.125f }, { left + 0.125f, top }, { left + 0.125f, top - 0.125f }, { left, top - 0.125f } };
+		for (int i = 0; i < 6; i++)
+		{
+			float* vertex = &vertices[(n * 6 + i) * 4];
+			vertex[0] = corners[i][0];
+			vertex[1] = corners[i][1];
+			vertex[2] = 0.5f;
+			vertex[3] = 1.0f;
+		}
+	}
+
+	IDirect3DVertexDeclaration9* vertexDeclaration = NULL;
+	IDirect3DVertexBuffer9* vertexBuffer = NULL;
+	IDirect3DVertexShader9* positionShader = AssembleVertexShader(device, "vs_3_0\ndcl_position v0\ndcl_position o0\nmov o0, v0\n");
+	IDirect3DPixelShader9* colorShader = AssemblePixelShader(device, "ps_3_0\ndcl_color v0\nmov oC0, v0\n");
+	IDirect3DVertexShader9* vertexShaders[vertexConstantCount] = {};
+	IDirect3DPixelShader9* pixelShaders[pixelConstantCount] = {};
+	void* data = NULL;
+	int result = SCENARIO_PASSED;
+
+	if (positionShader == NULL || colorShader == NULL
+		|| FAILED(device->CreateVertexDeclaration(elements, &vertexDeclaration))
+		|| FAILED(device->CreateVertexBuffer(sizeof(vertices), D3DUSAGE_WRITEONLY, 0, D3DPOOL_DEFAULT, &vertexBuffer, NULL))
+		|| FAILED(vertexBuffer->Lock(0, sizeof(vertices), &data, 0)))
+	{
+		result = SCENARIO_ERROR;
+	}
+	else
+	{
+		memcpy(data, vertices, sizeof(vertices));
+		vertexBuffer->Unlock();
+	}
+
+	for (int n = 0; n < vertexConstantCount && result == SCENARIO_PASSED; n++)
+	{
+		sprintf(source, "vs_3_0\ndcl_position v0\ndcl_position o0\ndcl_color o1\nmov o0, v0\nmov o1, c%d\n", n);
+		vertexShaders[n] = AssembleVertexShader(device, source);
+		if (vertexShaders[n] == NULL)
+		{
+			result = SCENARIO_ERROR;
+		}
+
+		if (n < pixelConstantCount)
+		{
+			sprintf(source, "ps_3_0\nmov oC0, c%d\n", n);
+			pixelShaders[n] = AssemblePixelShader(device, source);
+			if (pixelShaders[n] == NULL)
+			{
+				result = SCENARIO_ERROR;
+			}
+		}
+	}
+
+	if (result == SCENARIO_PASSED)
+	{
+		device->SetRenderState(D3DRS_LIGHTING, FALSE);
+		device->SetRenderState(D3DRS_ZENABLE, D3DZB_FALSE);
+		device->SetRenderState(D3DRS_CULLMODE, D3DCULL_NONE);
+		device->SetRenderState(D3DRS_ALPHABLENDENABLE, FALSE);
+		device->SetRenderState(D3DRS_COLORWRITEENABLE, 0xF);
+		device->SetVertexDeclaration(vertexDeclaration);
+		device->SetStreamSource(0, vertexBuffer, 0, sizeof(float) * 4);
+		device->SetVertexShaderConstantF(0, vertexConstants, vertexConstantCount);
+		device->SetPixelShaderConstantF(0, pixelConstants, pixelConstantCount);
+	}
+
+	//The first pass reads vertex shader constants and the second pixel shader constants.
+	for (int pass = 0; pass < 2 && result == SCENARIO_PASSED; pass++)
+	{
+		const char* name = (pass == 0) ? "ShaderConstants vertex" : "ShaderConstants pixel";
+		int cellCount = (pass == 0) ? vertexConstantCount : pixelConstantCount;
+
+		PumpMessages();
+
+		device->Clear(0, NULL, D3DCLEAR_TARGET, D3DCOLOR_XRGB(0, 0, 0), 1.0f, 0);
+		device->BeginScene();
+
+		for (int n = 0; n < cellCount; n++)
+		{
+			device->SetVertexShader((pass == 0) ? vertexShaders[n] : positionShader);
+			device->SetPixelShader((pass == 0) ? colorShader : pixelShaders[n]);
+
+			if (FAILED(device->DrawPrimitive(D3DPT_TRIANGLELIST, n * 6, 2)))
+			{
+				result = SCENARIO_ERROR;
+			}
+		}
+
+		device->EndScene();
+
+		//The back buffer is read before Present hands it back to the swapchain.
+		int wrongCells = CountWrongCells(device, name, cellCount);
+		if (wrongCells < 0)
+		{
+			Report("%s couldn't read the back buffer.", name);
+			result = SCENARIO_ERROR;
+		}
+		else if (wrongCells > 0)
+		{
+			Report("%s failed: %d of %d registers read back wrong.", name, wrongCells, cellCount);
+			result = SCENARIO_FAILED;
+		}
+
+		if (FAILED(device->Present(NULL, NULL, NULL, NULL)))
+		{
+			result = SCENARIO_ERROR;
+		}
+	}
+
+	device->SetVertexShader(NULL);
+	device->SetPixelShader(NULL);
+	for (int n = 0; n < vertexConstantCount; n++)
+	{
+		if (vertexShaders[n] != NULL)
+		{
+			vertexShaders[n]->Release();
+		}
+		if (n < pixelConstantCount && pixelShaders[n] != NULL)
+		{
+			pixelShaders[n]->Release();
+		}
+	}
+	if (positionShader != NULL)
+	{
+		positionShader->Release();
+	}
+	if (colorShader != NULL)
+	{
+		colorShader->Release();
+	}
+	if (vertexBuffer != NULL)
+	{
+		vertexBuffer->Release();
+	}
+	if (vertexDeclaration != NULL)
+	{
+		vertexDeclaration->Release();
+	}
+
+	if (result == SCENARIO_ERROR)
+	{
+		Report("ShaderConstants failed to render.");
+	}
+	else if (result == SCENARIO_PASSED)
+	{
+		Report("ShaderConstants passed.");
+	}
+
+	return result;
+}
+
+struct Scenario
+{
+	const char* Name;
+	int(*Run)(IDirect3DDevice9* device, const char* arguments);
+};
+
+Scenario g_scenarios[] =
+{
+	{ "ContextAllocations", ContextAllocations },
+	{ "SamplerChurn", SamplerChurn },
+	{ "DescriptorChurn", DescriptorChurn },
+	{ "DescriptorPush", DescriptorPush },
+	{ "DescriptorWrites", DescriptorWrites },
+	{ "CommandStreamCost", CommandStreamCost },
+	{ "RenderStateAnimation", RenderStateAnimation },
+	{ "PipelineStress", PipelineStress },
+	{ "PipelineLookup", PipelineLookup },
+	{ "LightHeavy", LightHeavy },
+	{ "TransformHeavy", TransformHeavy },
+	{ "ShaderConstants", ShaderConstants }
+};
+
+int RunScenario(IDirect3DDevice9* device, const char* commandLine)
+{
+	if (device == NULL)
+	{
+		Report("No device was created so no scenario can run.");
+		return SCENARIO_ERROR;
+	}
+
+	size_t nameLength = strcspn(commandLine, " ");
+	const char* arguments = commandLine + nameLength;
+	while (*arguments == ' ')
+	{
+		arguments++;
+	}
+
+	for (size_t i = 0; i < sizeof(g_scenarios) / sizeof(g_scenarios[0]); i++)
+	{
+		if (strlen(g_scenarios[i].Name) == nameLength && strncmp(g_scenarios[i].Name, commandLine, nameLength) == 0)
+		{
+			return g_scenarios[i].Run(device, arguments);
+		}
+	}
+
+	Report("There is no scenario named %.*s.", (int)nameLength, commandLine);
+	return SCENARIO_ERROR;
+}
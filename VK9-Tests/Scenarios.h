@@ -0,0 +1,33 @@
+/*
+Copyright(c) 2016 Christopher Joseph Dean Schaefer
+
+This software is provided 'as-is', without any express or implied
+warranty.In no event will the authors be held liable for any damages
+arising from the use of this software.
+
+Permission is granted to anyone to use this software for any purpose,
+including commercial applications, and to alter it and redistribute it
+freely, subject to the following restrictions :
+
+1. The origin of this software must not be misrepresented; you must not
+claim that you wrote the original software.If you use this software
+in a product, an acknowledgement in the product documentation would be
+appreciated but is not required.
+2. Altered source versions must be plainly marked as such, and must not be
+misrepresented as being the original software.
+3. This notice may not be removed or altered from any source distribution.
+*/
+#pragma once
+
+#include <d3d9.h>
+
+/*
+Scenarios are picked by the first word of the command line, e.g. "VK9-Tests.exe ContextAllocations".
+The rest of the command line is passed to the scenario.
+Results are written to Scenarios.log in the working directory.
+*/
+#define SCENARIO_PASSED 0
+#define SCENARIO_FAILED 1
+#define SCENARIO_ERROR 2 //The scenario couldn't run, e.g. the d3d9.dll isn't VK9 or a call failed.
+
+int RunScenario(IDirect3DDevice9* device, const char* commandLine);